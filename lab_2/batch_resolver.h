@@ -0,0 +1,552 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+// Batch mode: names come one per line from a file or stdin, a pool of threads resolves them
+// and then looks every returned address up in reverse, each reverse lookup being a task of
+// its own, so the addresses of one name are looked up in parallel. Results are printed as
+// JSON lines in input order once everything is done.
+//
+// Lookups go through a cache shared by the pool. An entry is owned by the thread resolving
+// it, others asking for the same key wait for that answer instead of sending a duplicate
+// query. Entries expire after their TTL. With -S the tool talks DNS to that server itself
+// and takes the TTLs from the answer, the SOA minimum for negative answers. Through the
+// system resolver the TTL is not visible, so -T is used for positive answers.
+
+enum {
+    BATCH_MAX_ADDRESSES = 16,
+    BATCH_CACHE_BUCKETS = 4096,
+    BATCH_DEFAULT_THREADS = 32,
+    BATCH_DEFAULT_TTL = 30,
+    // Used for negative answers through the system resolver and without an SOA.
+    BATCH_NEGATIVE_TTL = 5,
+    BATCH_DNS_ANSWER_SIZE = 4096
+};
+
+typedef struct {
+    int family;
+    unsigned char raw[sizeof(struct in6_addr)];
+    char text[INET6_ADDRSTRLEN];
+} BatchAddress;
+
+typedef struct {
+    // 0 or an EAI_* code.
+    int error;
+    uint32_t ttl;
+    size_t address_count;
+    BatchAddress addresses[BATCH_MAX_ADDRESSES];
+    char hostname[NI_MAXHOST];
+} BatchLookup;
+
+typedef struct BatchCacheEntry {
+    struct BatchCacheEntry *next;
+    char key[NI_MAXHOST + 8];
+    int is_resolving;
+    double expires_at;
+    BatchLookup lookup;
+} BatchCacheEntry;
+
+typedef struct {
+    const char *name;
+    double started_at;
+    double resolved_at;
+    double finished_at;
+    int is_cached;
+    BatchLookup forward;
+    size_t pending_reverse;
+    char (*hostnames)[NI_MAXHOST];
+} BatchName;
+
+typedef struct {
+    size_t name_index;
+    // -1 for the forward lookup.
+    long address_index;
+} BatchTask;
+
+typedef struct {
+    int family;
+    int numeric_only;
+    uint32_t default_ttl;
+    int has_dns_server;
+    struct sockaddr_in dns_server;
+
+    BatchName *names;
+    size_t name_count;
+    size_t finished_count;
+    BatchTask *tasks;
+    size_t task_head;
+    size_t task_tail;
+    // Reverse lookups go first, so a name is finished before the next one is started.
+    BatchTask *reverse_tasks;
+    size_t reverse_task_count;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+
+    pthread_mutex_t cache_lock;
+    pthread_cond_t cache_resolved;
+    BatchCacheEntry *cache[BATCH_CACHE_BUCKETS];
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+} Batch;
+
+typedef struct {
+    Batch *batch;
+    pthread_t thread;
+    struct __res_state resolver;
+} BatchWorker;
+
+static double batch_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1e3 + (double)now.tv_nsec / 1e6;
+}
+
+static size_t batch_hash(const char *key) {
+    size_t hash = 5381;
+    for (; *key != '\0'; ++key) {
+        hash = hash * 33 + (unsigned char)*key;
+    }
+    return hash % BATCH_CACHE_BUCKETS;
+}
+
+static void batch_add_address(BatchLookup *lookup, int family, const void *raw) {
+    if (lookup->address_count == BATCH_MAX_ADDRESSES) {
+        return;
+    }
+    const size_t raw_size = family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+    for (size_t i = 0; i < lookup->address_count; ++i) {
+        if (lookup->addresses[i].family == family && memcmp(lookup->addresses[i].raw, raw, raw_size) == 0) {
+            return;
+        }
+    }
+    BatchAddress *address = &lookup->addresses[lookup->address_count++];
+    address->family = family;
+    memcpy(address->raw, raw, raw_size);
+    inet_ntop(family, raw, address->text, sizeof(address->text));
+}
+
+static void batch_forward_system(const Batch *batch, const char *name, BatchLookup *lookup) {
+    struct addrinfo hints = { .ai_family = batch->family, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    lookup->error = getaddrinfo(name, NULL, &hints, &res);
+    if (lookup->error != 0) {
+        lookup->ttl = lookup->error == EAI_AGAIN ? 0 : BATCH_NEGATIVE_TTL;
+        return;
+    }
+    lookup->ttl = batch->default_ttl;
+    for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+        if (p->ai_family == AF_INET) {
+            batch_add_address(lookup, AF_INET, &((struct sockaddr_in*)p->ai_addr)->sin_addr);
+        } else if (p->ai_family == AF_INET6) {
+            batch_add_address(lookup, AF_INET6, &((struct sockaddr_in6*)p->ai_addr)->sin6_addr);
+        }
+    }
+    freeaddrinfo(res);
+}
+
+static void batch_reverse_system(const Batch *batch, const BatchAddress *address, BatchLookup *lookup) {
+    struct sockaddr_storage storage = { .ss_family = (sa_family_t)address->family };
+    socklen_t length;
+    if (address->family == AF_INET) {
+        memcpy(&((struct sockaddr_in*)&storage)->sin_addr, address->raw, sizeof(struct in_addr));
+        length = sizeof(struct sockaddr_in);
+    } else {
+        memcpy(&((struct sockaddr_in6*)&storage)->sin6_addr, address->raw, sizeof(struct in6_addr));
+        length = sizeof(struct sockaddr_in6);
+    }
+    lookup->error = getnameinfo((struct sockaddr*)&storage, length, lookup->hostname, sizeof(lookup->hostname), NULL, 0, NI_NAMEREQD);
+    lookup->ttl = lookup->error == 0 ? batch->default_ttl : lookup->error == EAI_AGAIN ? 0 : BATCH_NEGATIVE_TTL;
+}
+
+// Returns the response code, or -1 if no usable answer came back.
+static int batch_dns_query(BatchWorker *worker, const char *name, int type, unsigned char *answer, ns_msg *message) {
+    unsigned char query[NS_PACKETSZ];
+    const int query_length = res_nmkquery(&worker->resolver, ns_o_query, name, ns_c_in, type, NULL, 0, NULL, query, sizeof(query));
+    if (query_length < 0) {
+        return -1;
+    }
+    const int length = res_nsend(&worker->resolver, query, query_length, answer, BATCH_DNS_ANSWER_SIZE);
+    if (length < 0 || ns_initparse(answer, length, message) < 0) {
+        return -1;
+    }
+    return ns_msg_getflag(*message, ns_f_rcode);
+}
+
+// RFC 2308: a negative answer lives for the smaller of the SOA record's TTL and its minimum.
+static uint32_t batch_dns_negative_ttl(ns_msg *message) {
+    for (int i = 0; i < ns_msg_count(*message, ns_s_ns); ++i) {
+        ns_rr rr;
+        if (ns_parserr(message, ns_s_ns, i, &rr) == 0 && ns_rr_type(rr) == ns_t_soa && ns_rr_rdlen(rr) >= 4) {
+            const uint32_t minimum = ns_get32(ns_rr_rdata(rr) + ns_rr_rdlen(rr) - 4);
+            return ns_rr_ttl(rr) < minimum ? ns_rr_ttl(rr) : minimum;
+        }
+    }
+    return BATCH_NEGATIVE_TTL;
+}
+
+// Sets error and the negative TTL for anything but NOERROR, returns whether to read the answers.
+static int batch_dns_check(int rcode, ns_msg *message, BatchLookup *lookup) {
+    if (rcode == ns_r_noerror) {
+        return 1;
+    }
+    if (rcode == ns_r_nxdomain) {
+        lookup->error = EAI_NONAME;
+        lookup->ttl = batch_dns_negative_ttl(message);
+    } else {
+        lookup->error = rcode < 0 ? EAI_AGAIN : EAI_FAIL;
+        lookup->ttl = 0;
+    }
+    return 0;
+}
+
+static void batch_forward_dns(const Batch *batch, BatchWorker *worker, const char *name, BatchLookup *lookup) {
+    unsigned char answer[BATCH_DNS_ANSWER_SIZE];
+    ns_msg message;
+    const int type = batch->family == AF_INET6 ? ns_t_aaaa : ns_t_a;
+    if (!batch_dns_check(batch_dns_query(worker, name, type, answer, &message), &message, lookup)) {
+        return;
+    }
+    lookup->ttl = UINT32_MAX;
+    for (int i = 0; i < ns_msg_count(message, ns_s_an); ++i) {
+        ns_rr rr;
+        if (ns_parserr(&message, ns_s_an, i, &rr) != 0) {
+            continue;
+        }
+        // The chain of CNAMEs counts too, the name is only as fresh as its shortest link.
+        lookup->ttl = ns_rr_ttl(rr) < lookup->ttl ? ns_rr_ttl(rr) : lookup->ttl;
+        if (ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == sizeof(struct in_addr)) {
+            batch_add_address(lookup, AF_INET, ns_rr_rdata(rr));
+        } else if (ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == sizeof(struct in6_addr)) {
+            batch_add_address(lookup, AF_INET6, ns_rr_rdata(rr));
+        }
+    }
+    if (lookup->address_count == 0) {
+        lookup->error = EAI_NODATA;
+        lookup->ttl = batch_dns_negative_ttl(&message);
+    }
+}
+
+static void batch_reverse_name(const BatchAddress *address, char *name, size_t size) {
+    if (address->family == AF_INET) {
+        snprintf(name, size, "%u.%u.%u.%u.in-addr.arpa", address->raw[3], address->raw[2], address->raw[1], address->raw[0]);
+        return;
+    }
+    size_t offset = 0;
+    for (int i = (int)sizeof(struct in6_addr) - 1; i >= 0; --i) {
+        offset += (size_t)snprintf(name + offset, size - offset, "%x.%x.", address->raw[i] & 0xf, address->raw[i] >> 4);
+    }
+    snprintf(name + offset, size - offset, "ip6.arpa");
+}
+
+static void batch_reverse_dns(BatchWorker *worker, const BatchAddress *address, BatchLookup *lookup) {
+    char name[NS_MAXDNAME];
+    batch_reverse_name(address, name, sizeof(name));
+    unsigned char answer[BATCH_DNS_ANSWER_SIZE];
+    ns_msg message;
+    if (!batch_dns_check(batch_dns_query(worker, name, ns_t_ptr, answer, &message), &message, lookup)) {
+        return;
+    }
+    for (int i = 0; i < ns_msg_count(message, ns_s_an); ++i) {
+        ns_rr rr;
+        if (ns_parserr(&message, ns_s_an, i, &rr) == 0 && ns_rr_type(rr) == ns_t_ptr
+            && ns_name_uncompress(ns_msg_base(message), ns_msg_end(message), ns_rr_rdata(rr), lookup->hostname, sizeof(lookup->hostname)) >= 0) {
+            lookup->ttl = ns_rr_ttl(rr);
+            return;
+        }
+    }
+    lookup->error = EAI_NONAME;
+    lookup->ttl = batch_dns_negative_ttl(&message);
+}
+
+// Returns 1 on a cache hit. The TTL of a hit is what is left of it.
+static int batch_lookup(BatchWorker *worker, const char *key, const char *name, const BatchAddress *address, BatchLookup *lookup) {
+    Batch *batch = worker->batch;
+    const size_t bucket = batch_hash(key);
+    pthread_mutex_lock(&batch->cache_lock);
+    BatchCacheEntry *entry = batch->cache[bucket];
+    while (entry != NULL && strcmp(entry->key, key) != 0) {
+        entry = entry->next;
+    }
+    while (entry != NULL && entry->is_resolving) {
+        pthread_cond_wait(&batch->cache_resolved, &batch->cache_lock);
+    }
+    const double now = batch_now_ms();
+    if (entry != NULL && entry->expires_at > now) {
+        *lookup = entry->lookup;
+        lookup->ttl = (uint32_t)((entry->expires_at - now + 999) / 1e3);
+        ++batch->cache_hits;
+        pthread_mutex_unlock(&batch->cache_lock);
+        return 1;
+    }
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(*entry));
+        snprintf(entry->key, sizeof(entry->key), "%s", key);
+        entry->next = batch->cache[bucket];
+        batch->cache[bucket] = entry;
+    }
+    entry->is_resolving = 1;
+    ++batch->cache_misses;
+    pthread_mutex_unlock(&batch->cache_lock);
+
+    memset(lookup, 0, sizeof(*lookup));
+    if (address == NULL) {
+        if (batch->has_dns_server) {
+            batch_forward_dns(batch, worker, name, lookup);
+        } else {
+            batch_forward_system(batch, name, lookup);
+        }
+    } else if (batch->has_dns_server) {
+        batch_reverse_dns(worker, address, lookup);
+    } else {
+        batch_reverse_system(batch, address, lookup);
+    }
+
+    pthread_mutex_lock(&batch->cache_lock);
+    entry->lookup = *lookup;
+    entry->expires_at = batch_now_ms() + (double)lookup->ttl * 1e3;
+    entry->is_resolving = 0;
+    pthread_cond_broadcast(&batch->cache_resolved);
+    pthread_mutex_unlock(&batch->cache_lock);
+    return 0;
+}
+
+// Called with batch->lock held.
+static void batch_finish_name(Batch *batch, BatchName *name) {
+    name->finished_at = batch_now_ms();
+    if (++batch->finished_count == batch->name_count) {
+        pthread_cond_broadcast(&batch->has_work);
+    }
+}
+
+static void batch_run_task(BatchWorker *worker, BatchTask task) {
+    Batch *batch = worker->batch;
+    BatchName *name = &batch->names[task.name_index];
+    char key[NI_MAXHOST + 8];
+    if (task.address_index < 0) {
+        name->started_at = batch_now_ms();
+        snprintf(key, sizeof(key), "%d:%s", batch->family, name->name);
+        name->is_cached = batch_lookup(worker, key, name->name, NULL, &name->forward);
+        name->resolved_at = batch_now_ms();
+        pthread_mutex_lock(&batch->lock);
+        if (name->forward.error != 0 || batch->numeric_only) {
+            batch_finish_name(batch, name);
+        } else {
+            name->hostnames = calloc(name->forward.address_count, sizeof(*name->hostnames));
+            name->pending_reverse = name->forward.address_count;
+            for (size_t i = 0; i < name->forward.address_count; ++i) {
+                batch->reverse_tasks[batch->reverse_task_count++] = (BatchTask){ .name_index = task.name_index, .address_index = (long)i };
+            }
+            pthread_cond_broadcast(&batch->has_work);
+        }
+        pthread_mutex_unlock(&batch->lock);
+        return;
+    }
+    const BatchAddress *address = &name->forward.addresses[task.address_index];
+    snprintf(key, sizeof(key), "ptr:%s", address->text);
+    BatchLookup reverse;
+    batch_lookup(worker, key, NULL, address, &reverse);
+    if (reverse.error == 0) {
+        snprintf(name->hostnames[task.address_index], NI_MAXHOST, "%s", reverse.hostname);
+    }
+    pthread_mutex_lock(&batch->lock);
+    if (--name->pending_reverse == 0) {
+        batch_finish_name(batch, name);
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void *batch_worker_main(void *arg) {
+    BatchWorker *worker = arg;
+    Batch *batch = worker->batch;
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        while (batch->reverse_task_count == 0 && batch->task_head == batch->task_tail && batch->finished_count < batch->name_count) {
+            pthread_cond_wait(&batch->has_work, &batch->lock);
+        }
+        if (batch->reverse_task_count == 0 && batch->task_head == batch->task_tail) {
+            break;
+        }
+        const BatchTask task = batch->reverse_task_count > 0
+            ? batch->reverse_tasks[--batch->reverse_task_count]
+            : batch->tasks[batch->task_head++];
+        pthread_mutex_unlock(&batch->lock);
+        batch_run_task(worker, task);
+        pthread_mutex_lock(&batch->lock);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+static int batch_read_names(FILE *input, Batch *batch) {
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, input) != -1) {
+        char *name = line + strspn(line, " \t");
+        name[strcspn(name, " \t\r\n#")] = '\0';
+        if (*name == '\0') {
+            continue;
+        }
+        if (batch->name_count == capacity) {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            batch->names = realloc(batch->names, capacity * sizeof(*batch->names));
+        }
+        memset(&batch->names[batch->name_count], 0, sizeof(*batch->names));
+        batch->names[batch->name_count++].name = strdup(name);
+    }
+    free(line);
+    return ferror(input) ? -1 : 0;
+}
+
+static void batch_print_json_string(const char *text) {
+    putchar('"');
+    for (; *text != '\0'; ++text) {
+        const unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void batch_print_name(const Batch *batch, const BatchName *name) {
+    printf("{\"name\":");
+    batch_print_json_string(name->name);
+    printf(",\"status\":\"%s\"", name->forward.error == 0 ? "ok" : "error");
+    if (name->forward.error != 0) {
+        printf(",\"error\":");
+        batch_print_json_string(gai_strerror(name->forward.error));
+    }
+    printf(",\"cached\":%s,\"ttl\":%u,\"resolve_ms\":%.3f,\"latency_ms\":%.3f",
+           name->is_cached ? "true" : "false", name->forward.ttl,
+           name->resolved_at - name->started_at, name->finished_at - name->started_at);
+    if (name->forward.error == 0) {
+        printf(",\"addresses\":[");
+        for (size_t i = 0; i < name->forward.address_count; ++i) {
+            printf("%s{\"address\":\"%s\",\"hostname\":", i == 0 ? "" : ",", name->forward.addresses[i].text);
+            if (batch->numeric_only || name->hostnames[i][0] == '\0') {
+                printf("null");
+            } else {
+                batch_print_json_string(name->hostnames[i]);
+            }
+            printf("}");
+        }
+        printf("]");
+    }
+    printf("}\n");
+}
+
+static int batch_compare_latency(const void *lhs, const void *rhs) {
+    const double left = *(const double*)lhs;
+    const double right = *(const double*)rhs;
+    return (left > right) - (left < right);
+}
+
+static void batch_print_summary(const Batch *batch, size_t thread_count, double wall_ms) {
+    size_t failed = 0;
+    double *latencies = calloc(batch->name_count + 1, sizeof(*latencies));
+    for (size_t i = 0; i < batch->name_count; ++i) {
+        failed += batch->names[i].forward.error != 0;
+        latencies[i] = batch->names[i].finished_at - batch->names[i].started_at;
+    }
+    qsort(latencies, batch->name_count, sizeof(*latencies), batch_compare_latency);
+    const size_t count = batch->name_count;
+    fprintf(stderr, "[Batch] [names: %zu] [failed: %zu] [threads: %zu] [cache hits: %lu] [cache misses: %lu] "
+                    "[wall: %.1f ms] [latency p50: %.3f ms] [latency p99: %.3f ms]\n",
+            count, failed, thread_count, batch->cache_hits, batch->cache_misses, wall_ms,
+            count == 0 ? 0 : latencies[(count - 1) / 2], count == 0 ? 0 : latencies[(count - 1) * 99 / 100]);
+    free(latencies);
+}
+
+// dns_server is <ipv4>[:port] or NULL for the system resolver.
+static int batch_parse_dns_server(const char *spec, struct sockaddr_in *server) {
+    char address[INET_ADDRSTRLEN];
+    const size_t length = strcspn(spec, ":");
+    if (length >= sizeof(address)) {
+        return -1;
+    }
+    memcpy(address, spec, length);
+    address[length] = '\0';
+    *server = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(NS_DEFAULTPORT) };
+    if (spec[length] == ':') {
+        const long port = strtol(spec + length + 1, NULL, 10);
+        if (port <= 0 || port > UINT16_MAX) {
+            return -1;
+        }
+        server->sin_port = htons((uint16_t)port);
+    }
+    return inet_pton(AF_INET, address, &server->sin_addr) == 1 ? 0 : -1;
+}
+
+static int batch_main(const char *path, int family, int numeric_only, size_t thread_count, const char *dns_server, uint32_t default_ttl) {
+    static Batch batch;
+    batch.family = family;
+    batch.numeric_only = numeric_only;
+    batch.default_ttl = default_ttl;
+    if (dns_server != NULL) {
+        if (batch_parse_dns_server(dns_server, &batch.dns_server) != 0) {
+            fprintf(stderr, "Bad DNS server: %s\n", dns_server);
+            return 1;
+        }
+        batch.has_dns_server = 1;
+    }
+    FILE *input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (input == NULL || batch_read_names(input, &batch) != 0) {
+        fprintf(stderr, "Failed to read names from %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (input != stdin) {
+        fclose(input);
+    }
+    batch.tasks = calloc(batch.name_count + 1, sizeof(*batch.tasks));
+    batch.reverse_tasks = calloc(batch.name_count * BATCH_MAX_ADDRESSES + 1, sizeof(*batch.reverse_tasks));
+    for (size_t i = 0; i < batch.name_count; ++i) {
+        batch.tasks[batch.task_tail++] = (BatchTask){ .name_index = i, .address_index = -1 };
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.has_work, NULL);
+    pthread_mutex_init(&batch.cache_lock, NULL);
+    pthread_cond_init(&batch.cache_resolved, NULL);
+
+    const double started_at = batch_now_ms();
+    BatchWorker *workers = calloc(thread_count, sizeof(*workers));
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers[i].batch = &batch;
+        if (batch.has_dns_server) {
+            res_ninit(&workers[i].resolver);
+            workers[i].resolver.nsaddr_list[0] = batch.dns_server;
+            workers[i].resolver.nscount = 1;
+        }
+        const int status = pthread_create(&workers[i].thread, NULL, batch_worker_main, &workers[i]);
+        if (status != 0) {
+            fprintf(stderr, "pthread_create error: %s\n", strerror(status));
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < thread_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        if (batch.has_dns_server) {
+            res_nclose(&workers[i].resolver);
+        }
+    }
+    const double wall_ms = batch_now_ms() - started_at;
+
+    for (size_t i = 0; i < batch.name_count; ++i) {
+        batch_print_name(&batch, &batch.names[i]);
+    }
+    batch_print_summary(&batch, thread_count, wall_ms);
+    return 0;
+}
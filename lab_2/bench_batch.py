@@ -0,0 +1,125 @@
+import subprocess
+import pathlib
+import os
+import json
+import time
+import struct
+import socket
+import tempfile
+import threading
+import collections
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+EXECUTABLE = SCRIPT_DIR / 'build' / 'main'
+DNS_ADDRESS = '127.0.0.1'
+DNS_PORT = 55058
+# Every answer takes this long, like a resolver a few hops away.
+QUERY_DELAY_SECONDS = 0.02
+HOSTS = 200
+MISSING = 20
+TTL = 300
+SHORT_TTL = 1
+SOA_TTL = 60
+SOA_MINIMUM = 30
+THREADS = ['1', '8', '32']
+
+# A stand-in DNS server for the zone "test": host<i>.test has 10.0.<i / 256>.<i % 256> and the
+# matching PTR, short.test lives for a second, anything else is NXDOMAIN with an SOA.
+def encode_name(name: str) -> bytes:
+    return b''.join(bytes([len(label)]) + label.encode() for label in name.rstrip('.').split('.')) + b'\0'
+
+def decode_question(packet: bytes) -> tuple[str, int, int]:
+    labels = []
+    offset = 12
+    while packet[offset] != 0:
+        labels.append(packet[offset + 1:offset + 1 + packet[offset]].decode())
+        offset += 1 + packet[offset]
+    (qtype,) = struct.unpack('>H', packet[offset + 1:offset + 3])
+    return '.'.join(labels).lower(), qtype, offset + 5
+
+def host_address(name: str) -> bytes | None:
+    if name == 'short.test':
+        return bytes([10, 1, 0, 1])
+    if name.startswith('host') and name.endswith('.test') and name[4:-5].isdigit():
+        index = int(name[4:-5])
+        return bytes([10, 0, index >> 8, index & 0xff])
+    return None
+
+def ptr_name(name: str) -> str | None:
+    parts = name.split('.')
+    if len(parts) != 6 or parts[4:] != ['in-addr', 'arpa'] or parts[3] != '10' or parts[2] != '0':
+        return None
+    return f'host{int(parts[1]) * 256 + int(parts[0])}.test'
+
+def answer(packet: bytes) -> bytes:
+    name, qtype, question_end = decode_question(packet)
+    question = packet[12:question_end]
+    records = []
+    rcode = 0
+    if qtype == 1 and (address := host_address(name)) is not None:
+        ttl = SHORT_TTL if name == 'short.test' else TTL
+        records.append(b'\xc0\x0c' + struct.pack('>HHIH', 1, 1, ttl, 4) + address)
+    elif qtype == 12 and (target := ptr_name(name)) is not None:
+        rdata = encode_name(target)
+        records.append(b'\xc0\x0c' + struct.pack('>HHIH', 12, 1, TTL, len(rdata)) + rdata)
+    authority = []
+    if not records:
+        rcode = 0 if host_address(name) is not None else 3
+        soa = encode_name('ns.test') + encode_name('admin.test') + struct.pack('>IIIII', 1, 3600, 600, 86400, SOA_MINIMUM)
+        authority.append(encode_name('test') + struct.pack('>HHIH', 6, 1, SOA_TTL, len(soa)) + soa)
+    header = packet[:2] + struct.pack('>HHHHH', 0x8180 | rcode, 1, len(records), len(authority), 0)
+    return header + question + b''.join(records) + b''.join(authority)
+
+def serve(sock: socket.socket, queries: collections.Counter[str]) -> None:
+    while True:
+        try:
+            packet, client = sock.recvfrom(4096)
+        except OSError:
+            return
+        queries[decode_question(packet)[0]] += 1
+        def reply(packet: bytes = packet, client: tuple[str, int] = client) -> None:
+            time.sleep(QUERY_DELAY_SECONDS)
+            sock.sendto(answer(packet), client)
+        threading.Thread(target=reply, daemon=True).start()
+
+def run(threads: str, names_path: pathlib.Path, names: list[str], queries: collections.Counter[str]) -> None:
+    queries.clear()
+    start = time.perf_counter()
+    result = subprocess.run([EXECUTABLE, '-b', names_path, '-j', threads, '-S', f'{DNS_ADDRESS}:{DNS_PORT}'],
+        capture_output=True, text=True, check=True)
+    wall = time.perf_counter() - start
+    lines = [json.loads(line) for line in result.stdout.splitlines()]
+    assert [line['name'] for line in lines] == names
+    for line in lines:
+        address = host_address(line['name'])
+        if address is None:
+            assert line['status'] == 'error' and line['ttl'] <= SOA_MINIMUM, line
+            continue
+        assert line['status'] == 'ok', line
+        assert line['addresses'][0]['address'] == socket.inet_ntoa(address), line
+        expected_hostname = None if line['name'] == 'short.test' else line['name']
+        assert line['addresses'][0]['hostname'] == expected_hostname, line
+    cached = sum(line['cached'] for line in lines)
+    latencies = sorted(line['latency_ms'] for line in lines)
+    duplicate_queries = sum(count - 1 for name, count in queries.items() if name != 'short.test')
+    print(f'{threads:>8} {wall * 1000:>9.0f} {latencies[len(latencies) // 2]:>9.1f} {latencies[len(latencies) * 99 // 100]:>9.1f} '
+          f'{sum(queries.values()):>8} {cached:>7} {duplicate_queries:>10} {queries["short.test"]:>6}')
+
+with tempfile.TemporaryDirectory() as tmp:
+    # Every name twice, the second time from the cache, and short.test at both ends, which outlives
+    # its TTL unless the batch finishes within a second.
+    hosts = [f'host{i}.test' for i in range(HOSTS)]
+    missing = [f'missing{i}.test' for i in range(MISSING)]
+    names = ['short.test'] + hosts + missing + hosts + missing + ['short.test']
+    names_path = pathlib.Path(tmp) / 'names'
+    names_path.write_text('# rollout hosts\n' + '\n'.join(names) + '\n')
+    queries: collections.Counter[str] = collections.Counter()
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((DNS_ADDRESS, DNS_PORT))
+    threading.Thread(target=serve, args=(sock, queries), daemon=True).start()
+
+    print(f'{len(names)} names, {len(set(names))} distinct, stand-in DNS server answering in {QUERY_DELAY_SECONDS * 1000:.0f} ms')
+    print(f'{"threads":>8} {"wall, ms":>9} {"p50, ms":>9} {"p99, ms":>9} {"queries":>8} {"cached":>7} {"duplicates":>10} {"short":>6}')
+    for threads in THREADS:
+        run(threads, names_path, names, queries)
+    sock.close()
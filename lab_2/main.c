@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,28 +8,43 @@
 #include <arpa/inet.h>
 #include <errno.h>
 
+#include "batch_resolver.h"
+
 void print_usage(const char* program_name) {
     printf("Usage: %s [options] <address> [port]\n"
+           "       %s [options] -b <names_file | -> [-j <threads>] [-S <dns_server>[:port]] [-T <ttl>]\n"
            "Options:\n"
            "  -4               Use IPv4 (default)\n"
            "  -6               Use IPv6\n"
            "  -n               Show numeric addresses only\n"
            "  -s               Show service names for ports\n"
-           "  -h               Show this help message\n", program_name);
+           "  -b               Resolve every name in the file concurrently, print JSON lines\n"
+           "  -j               Resolver threads in batch mode (default %d)\n"
+           "  -S               Query this DNS server directly in batch mode, honoring record TTLs\n"
+           "  -T               Cache TTL in seconds for system resolver answers (default %d)\n"
+           "  -h               Show this help message\n", program_name, program_name, BATCH_DEFAULT_THREADS, BATCH_DEFAULT_TTL);
 }
 
 int main(int argc, char* argv[]) {
     int use_ipv4 = 1;
     int numeric_only = 0;
     int show_service_names = 0;
+    const char* batch_path = NULL;
+    size_t batch_threads = BATCH_DEFAULT_THREADS;
+    const char* dns_server = NULL;
+    uint32_t default_ttl = BATCH_DEFAULT_TTL;
     int opt;
 
-    while ((opt = getopt(argc, argv, "46nsh")) != -1) {
+    while ((opt = getopt(argc, argv, "46nshb:j:S:T:")) != -1) {
         switch (opt) {
             case '4': use_ipv4 = 1; break;
             case '6': use_ipv4 = 0; break;
             case 'n': numeric_only = 1; break;
             case 's': show_service_names = 1; break;
+            case 'b': batch_path = optarg; break;
+            case 'j': batch_threads = strtoul(optarg, NULL, 10); break;
+            case 'S': dns_server = optarg; break;
+            case 'T': default_ttl = (uint32_t)strtoul(optarg, NULL, 10); break;
             case 'h':
                 print_usage(argv[0]);
                 return 0;
@@ -39,6 +55,14 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (batch_path != NULL) {
+        if (batch_threads == 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return batch_main(batch_path, use_ipv4 ? AF_INET : AF_INET6, numeric_only, batch_threads, dns_server, default_ttl);
+    }
+
     struct addrinfo *res;
     {
         const char* address = argv[optind];
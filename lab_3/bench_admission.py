@@ -0,0 +1,79 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import socket
+import struct
+import threading
+import statistics
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'parallel_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = 55044
+MAX_CHILDREN = '8'
+BACKLOG = '64'
+PROTOCOL_VERSION = 18
+FILENAME_BUFFER_SIZE = 255
+FILE_SIZE = 1 << 20
+BURST = 400
+CLIENT_TIMEOUT_SECONDS = 10
+# -a 0 behaves like the old loop: at capacity the server stops accepting and the burst piles
+# up in the kernel backlog.
+QUEUE_LENGTHS = ['0', '1024']
+
+def recv_exact(sock: socket.socket, count: int) -> bytes:
+    data = bytearray()
+    while len(data) < count:
+        chunk = sock.recv(min(count - len(data), 1 << 20))
+        assert chunk
+        data += chunk
+    return bytes(data)
+
+def get(barrier: threading.Barrier, latencies: list[float]) -> None:
+    barrier.wait()
+    start = time.perf_counter()
+    try:
+        with socket.create_connection((ADDRESS, PORT), timeout=CLIENT_TIMEOUT_SECONDS) as sock:
+            sock.sendall(bytes([PROTOCOL_VERSION]))
+            assert recv_exact(sock, 1) == b'\x01'
+            sock.sendall(bytes([0]) + b'file.bin'.ljust(FILENAME_BUFFER_SIZE, b'\0'))
+            assert recv_exact(sock, 1) == b'\x01'
+            (size,) = struct.unpack('>Q', recv_exact(sock, 8))
+            sock.sendall(b'\x01')
+            recv_exact(sock, size)
+    except OSError:
+        return
+    latencies.append(time.perf_counter() - start)
+
+def run(queue_length: str, files_dir: pathlib.Path, log_path: pathlib.Path) -> None:
+    log = open(log_path, 'w')
+    server = subprocess.Popen([SERVER_EXECUTABLE, '-a', queue_length, '-b', BACKLOG, ADDRESS, str(PORT), files_dir, MAX_CHILDREN], stdout=log)
+    time.sleep(1)
+    barrier = threading.Barrier(BURST)
+    latencies: list[float] = []
+    threads = [threading.Thread(target=get, args=(barrier, latencies)) for _ in range(BURST)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    server.send_signal(2)
+    server.wait()
+    log.close()
+    quantiles = statistics.quantiles(latencies, n=100)
+    stalled = sum(latency > 0.9 for latency in latencies)
+    print(f'{queue_length:>6} {len(latencies):>6} {BURST - len(latencies):>7} {quantiles[49] * 1000:>9.0f} {quantiles[98] * 1000:>9.0f} {max(latencies) * 1000:>9.0f} {stalled:>8}')
+    for line in log_path.read_text().splitlines():
+        if line.startswith('[Admission'):
+            print(f'{"":>6} {line}')
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    (files_dir / 'file.bin').write_bytes(os.urandom(FILE_SIZE))
+    print(f'{BURST} simultaneous GETs of {FILE_SIZE >> 10} KiB, {MAX_CHILDREN} children, backlog {BACKLOG}')
+    print(f'{"queue":>6} {"done":>6} {"failed":>7} {"p50, ms":>9} {"p99, ms":>9} {"max, ms":>9} {">0.9 s":>8}')
+    for queue_length in QUEUE_LENGTHS:
+        run(queue_length, files_dir, pathlib.Path(tmp) / 'server.log')
@@ -0,0 +1,76 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import socket
+import struct
+import statistics
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = 55046
+PROTOCOL_VERSION = 18
+FILENAME_BUFFER_SIZE = 255
+FILE_SIZE = 4 << 10
+REQUESTS = 2000
+# A small pause between requests lets the server go idle, which is where the spin budget
+# decides between catching the next connection and a wakeup from poll.
+THINK_SECONDS = 0.0002
+BUDGETS_US = ['0', '50', '200', '1000']
+CLOCK_TICKS = os.sysconf('SC_CLK_TCK')
+
+# The server answers in several small writes, a delayed ACK from us would hold the second one
+# back by Nagle's 40 ms and hide everything else, so every read re-arms TCP_QUICKACK.
+def recv_exact(sock: socket.socket, count: int) -> bytes:
+    data = bytearray()
+    while len(data) < count:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_QUICKACK, 1)
+        chunk = sock.recv(count - len(data))
+        assert chunk
+        data += chunk
+    return bytes(data)
+
+def get() -> float:
+    start = time.perf_counter()
+    with socket.create_connection((ADDRESS, PORT)) as sock:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        sock.sendall(bytes([PROTOCOL_VERSION]))
+        assert recv_exact(sock, 1) == b'\x01'
+        sock.sendall(bytes([0]) + b'file.bin'.ljust(FILENAME_BUFFER_SIZE, b'\0'))
+        assert recv_exact(sock, 1) == b'\x01'
+        (size,) = struct.unpack('>Q', recv_exact(sock, 8))
+        sock.sendall(b'\x01')
+        recv_exact(sock, size)
+    return time.perf_counter() - start
+
+def cpu_seconds(pid: int) -> float:
+    fields = pathlib.Path(f'/proc/{pid}/stat').read_text().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / CLOCK_TICKS
+
+def run(budget_us: str, files_dir: pathlib.Path) -> None:
+    server = subprocess.Popen([SERVER_EXECUTABLE, '-p', budget_us, ADDRESS, str(PORT), files_dir], stdout=subprocess.DEVNULL)
+    time.sleep(1)
+    cpu_before = cpu_seconds(server.pid)
+    start = time.perf_counter()
+    latencies = []
+    for _ in range(REQUESTS):
+        latencies.append(get())
+        time.sleep(THINK_SECONDS)
+    wall = time.perf_counter() - start
+    cpu = cpu_seconds(server.pid) - cpu_before
+    server.send_signal(2)
+    server.wait()
+    quantiles = statistics.quantiles(latencies, n=100)
+    print(f'{budget_us:>10} {quantiles[49] * 1e6:>8.0f} {quantiles[98] * 1e6:>8.0f} {100 * cpu / wall:>10.0f}')
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    (files_dir / 'file.bin').write_bytes(os.urandom(FILE_SIZE))
+    print(f'{REQUESTS} sequential GETs of {FILE_SIZE >> 10} KiB, {THINK_SECONDS * 1e6:.0f} us apart, {os.cpu_count()} CPUs')
+    print(f'{"budget, us":>10} {"p50, us":>8} {"p99, us":>8} {"server cpu":>10}')
+    for budget_us in BUDGETS_US:
+        run(budget_us, files_dir)
@@ -0,0 +1,111 @@
+import subprocess
+import pathlib
+import os
+import sys
+import time
+import struct
+import random
+import socket
+import tempfile
+import threading
+import statistics
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'parallel_server.o'
+ADDRESS = '127.0.0.1'
+PORT = 55065
+PROTOCOL_VERSION = 18
+FILENAME_BUFFER_SIZE = 255
+READ_CHUNK_SIZE = 1 << 20
+HOT_FILES = 256
+HOT_FILE_SIZE = 1 << 20
+# Larger than memory, so a plain stream cycles the whole page cache. It is sparse, reading the
+# holes still fills the cache with zero pages. Pass a size in GiB to override.
+HUGE_FILE_SIZE = int(float(sys.argv[1]) * (1 << 30)) if len(sys.argv) > 1 else (os.sysconf('SC_PHYS_PAGES') * os.sysconf('SC_PAGE_SIZE') * 3 // 2)
+COLD_BYTES = str(1 << 30)
+MODES = [
+    ('off', []),
+    ('drop behind', ['-c', COLD_BYTES]),
+    ('O_DIRECT', ['-c', COLD_BYTES, '-O']),
+]
+
+def resident_bytes(paths: list[pathlib.Path]) -> int:
+    result = subprocess.run(['fincore', '-b', '-n', '-o', 'RES', *map(str, paths)], capture_output=True, text=True, check=True)
+    return sum(int(line) for line in result.stdout.split())
+
+def evict(paths: list[pathlib.Path]) -> None:
+    for path in paths:
+        fd = os.open(path, os.O_RDONLY)
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        os.close(fd)
+
+def recv_exact(sock: socket.socket, count: int) -> bytes:
+    data = b''
+    while len(data) < count:
+        chunk = sock.recv(count - len(data))
+        assert chunk, 'connection closed early'
+        data += chunk
+    return data
+
+# A GET that throws the body away, so the client side adds nothing to the page cache. Returns
+# the milliseconds from connecting to the last byte.
+def fetch(name: str) -> float:
+    start = time.perf_counter()
+    with socket.create_connection((ADDRESS, PORT)) as sock:
+        sock.sendall(bytes([PROTOCOL_VERSION]))
+        assert recv_exact(sock, 1) == b'\x01'
+        sock.sendall(bytes([0]) + name.encode().ljust(FILENAME_BUFFER_SIZE, b'\0'))
+        assert recv_exact(sock, 1) == b'\x01'
+        (size,) = struct.unpack('>Q', recv_exact(sock, 8))
+        sock.sendall(b'\x01')
+        received = 0
+        while received < size:
+            chunk = sock.recv(min(READ_CHUNK_SIZE, size - received))
+            assert chunk, 'connection closed early'
+            received += len(chunk)
+    return (time.perf_counter() - start) * 1000
+
+def percentiles(latencies: list[float]) -> str:
+    latencies = sorted(latencies)
+    return f'{statistics.median(latencies):>8.1f} {latencies[len(latencies) * 99 // 100]:>8.1f}'
+
+with tempfile.TemporaryDirectory(dir=SCRIPT_DIR) as tmp:
+    files_dir = pathlib.Path(tmp)
+    hot_names = [f'hot{i}.bin' for i in range(HOT_FILES)]
+    hot_paths = [files_dir / name for name in hot_names]
+    for path in hot_paths:
+        path.write_bytes(os.urandom(HOT_FILE_SIZE))
+    huge_path = files_dir / 'huge.bin'
+    with open(huge_path, 'wb') as file:
+        file.truncate(HUGE_FILE_SIZE)
+
+    print(f'{HOT_FILES} hot files of {HOT_FILE_SIZE >> 20} MiB, {HUGE_FILE_SIZE / (1 << 30):.1f} GiB streamed once')
+    print(f'{"":>12} {"hot resident, MiB":>28} {"hot latency during, ms":>22} {"hot latency after, ms":>22} {"stream, s":>10}')
+    print(f'{"":>12} {"before":>9} {"during":>9} {"after":>8} {"p50":>8} {"p99":>8} {"":>4} {"p50":>8} {"p99":>8} {"":>4}')
+    for label, options in MODES:
+        server = subprocess.Popen([SERVER_EXECUTABLE, *options, ADDRESS, str(PORT), files_dir, '8'], stdout=subprocess.DEVNULL)
+        time.sleep(0.5)
+        evict(hot_paths + [huge_path])
+        # Requested twice, so the hot set sits on the active list like any real working set.
+        for _ in range(2):
+            for name in hot_names:
+                fetch(name)
+        before = resident_bytes(hot_paths)
+        stream_start = time.perf_counter()
+        huge = threading.Thread(target=fetch, args=('huge.bin',))
+        huge.start()
+        during = []
+        lowest_resident = before
+        while huge.is_alive():
+            during.append(fetch(random.choice(hot_names)))
+            if len(during) % 16 == 0:
+                lowest_resident = min(lowest_resident, resident_bytes(hot_paths))
+        huge.join()
+        stream_seconds = time.perf_counter() - stream_start
+        after_resident = resident_bytes(hot_paths)
+        after = [fetch(name) for name in hot_names]
+        print(f'{label:>12} {before >> 20:>9} {lowest_resident >> 20:>9} {after_resident >> 20:>8} {percentiles(during)} {"":>4} '
+              f'{percentiles(after)} {"":>4} {stream_seconds:>6.1f}')
+        server.send_signal(2)
+        server.wait()
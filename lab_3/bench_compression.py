@@ -0,0 +1,78 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import socket
+import threading
+import random
+import json
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+SERVER_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = '55007'
+LINK_PORT = '55008'
+MAX_FILE_SIZE = str(1 << 33)
+LINK_BYTES_PER_SECOND = 100e6 / 8
+LINK_CHUNK_SIZE = 1 << 14
+
+def make_log(path: pathlib.Path, lines: int) -> None:
+    with open(path, 'w') as f:
+        for i in range(lines):
+            f.write(json.dumps({'id': i, 'level': random.choice(['INFO', 'WARN', 'ERROR']), 'msg': 'request handled', 'latency_ms': random.random() * 100}) + '\n')
+
+def pipe(source: socket.socket, destination: socket.socket, throttled: bool) -> None:
+    start = time.perf_counter()
+    sent = 0
+    while data := source.recv(LINK_CHUNK_SIZE):
+        destination.sendall(data)
+        sent += len(data)
+        if throttled:
+            delay = start + sent / LINK_BYTES_PER_SECOND - time.perf_counter()
+            if delay > 0:
+                time.sleep(delay)
+    destination.shutdown(socket.SHUT_WR)
+
+# A user-space relay that paces the server-to-client direction like a slow WAN link.
+def throttled_link() -> None:
+    listener = socket.create_server((ADDRESS, int(LINK_PORT)))
+    while True:
+        client, _ = listener.accept()
+        server = socket.create_connection((ADDRESS, int(PORT)))
+        threading.Thread(target=pipe, args=(client, server, False), daemon=True).start()
+        threading.Thread(target=pipe, args=(server, client, True), daemon=True).start()
+
+def run_client(args: list[str], cwd: pathlib.Path) -> float:
+    start = time.perf_counter()
+    subprocess.run([CLIENT_EXECUTABLE, *args], cwd=cwd, stdout=subprocess.DEVNULL, check=True)
+    return time.perf_counter() - start
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    out_dir = pathlib.Path(tmp) / 'out'
+    files_dir.mkdir()
+    out_dir.mkdir()
+    make_log(files_dir / 'log.json', 200000)
+    (files_dir / 'random.bin').write_bytes(os.urandom(8 << 20))
+
+    server = subprocess.Popen([SERVER_EXECUTABLE, ADDRESS, PORT, files_dir], stdout=subprocess.DEVNULL)
+    threading.Thread(target=throttled_link, daemon=True).start()
+    time.sleep(1)
+
+    print(f'link: {LINK_BYTES_PER_SECOND * 8 / 1e6:.0f} Mbit/s')
+    print(f'{"file":>12} {"size":>10} {"raw, MB/s":>10} {"cold, MB/s":>11} {"cached, MB/s":>13}')
+    for name in ['log.json', 'random.bin']:
+        size = (files_dir / name).stat().st_size
+        times = []
+        for args in [[], ['-Z'], ['-Z']]:
+            times.append(run_client([*args, ADDRESS, LINK_PORT, name, MAX_FILE_SIZE], out_dir))
+            assert (out_dir / name).read_bytes() == (files_dir / name).read_bytes()
+            (out_dir / name).unlink()
+        raw, cold, cached = (size / t / 1e6 for t in times)
+        print(f'{name:>12} {size:>10} {raw:>10.1f} {cold:>11.1f} {cached:>13.1f}')
+
+    server.send_signal(2)
+    server.wait()
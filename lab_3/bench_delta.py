@@ -0,0 +1,62 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import shutil
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+SERVER_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = '55006'
+MAX_FILE_SIZE = str(1 << 33)
+LINK_BYTES_PER_SECOND = 1e9 / 8
+
+FILE_SIZES = [16 << 20, 256 << 20, 1 << 30]
+CHANGED_BLOCKS = 16
+BLOCK = os.urandom(1 << 20)
+
+def make_file(path: pathlib.Path, size: int) -> None:
+    with open(path, 'wb') as f:
+        for i in range(size // len(BLOCK)):
+            f.write(i.to_bytes(8, 'little') + BLOCK[8:])
+
+def change_blocks(path: pathlib.Path, size: int) -> None:
+    with open(path, 'r+b') as f:
+        for i in range(CHANGED_BLOCKS):
+            f.seek(size // CHANGED_BLOCKS * i + 12345)
+            f.write(os.urandom(100))
+
+def run_client(args: list[str], cwd: pathlib.Path) -> float:
+    start = time.perf_counter()
+    subprocess.run([CLIENT_EXECUTABLE, *args], cwd=cwd, stdout=subprocess.DEVNULL, check=True)
+    return time.perf_counter() - start
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    out_dir = pathlib.Path(tmp) / 'out'
+    files_dir.mkdir()
+    out_dir.mkdir()
+    for size in FILE_SIZES:
+        name = f'{size}.bin'
+        make_file(files_dir / name, size)
+        shutil.copyfile(files_dir / name, out_dir / name)
+        change_blocks(files_dir / name, size)
+
+    server = subprocess.Popen([SERVER_EXECUTABLE, ADDRESS, PORT, files_dir], stdout=subprocess.DEVNULL)
+    time.sleep(1)
+
+    print(f'{"size":>12} {"delta, s":>10} {"full, s":>10} {"1 Gbps, s":>10}')
+    for size in FILE_SIZES:
+        name = f'{size}.bin'
+        delta = run_client(['-D', ADDRESS, PORT, name, MAX_FILE_SIZE], out_dir)
+        assert (out_dir / name).read_bytes() == (files_dir / name).read_bytes()
+        (out_dir / name).unlink()
+        full = run_client([ADDRESS, PORT, name, MAX_FILE_SIZE], out_dir)
+        (out_dir / name).unlink()
+        print(f'{size:>12} {delta:>10.4f} {full:>10.4f} {size / LINK_BYTES_PER_SECOND:>10.4f}')
+
+    server.send_signal(2)
+    server.wait()
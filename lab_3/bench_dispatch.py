@@ -0,0 +1,107 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import socket
+import struct
+import threading
+import statistics
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'dispatch_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = 55041
+WORKERS = '4'
+PROTOCOL_VERSION = 18
+FILENAME_BUFFER_SIZE = 255
+POLICIES = ['round-robin', 'connections', 'bytes']
+# Every fourth client downloads a big file and all of them read at the same pace. With four
+# workers round robin hands every big file to the same worker.
+CLIENTS = 80
+ARRIVAL_SECONDS = 0.05
+BIG_EVERY = 4
+BIG_SIZE = 24 << 20
+SMALL_SIZE = 256 << 10
+CLIENT_BYTES_PER_SECOND = 8 << 20
+READ_CHUNK_SIZE = 1 << 16
+SAMPLE_SECONDS = 0.1
+
+def recv_exact(sock: socket.socket, count: int) -> bytes:
+    data = b''
+    while len(data) < count:
+        chunk = sock.recv(count - len(data))
+        assert chunk
+        data += chunk
+    return data
+
+# A GET that reads the body slowly, the server's sendfile stalls on the full socket buffer.
+def slow_get(filename: str) -> None:
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, READ_CHUNK_SIZE)
+    sock.connect((ADDRESS, PORT))
+    sock.sendall(bytes([PROTOCOL_VERSION]))
+    assert recv_exact(sock, 1) == b'\x01'
+    sock.sendall(bytes([0]) + filename.encode().ljust(FILENAME_BUFFER_SIZE, b'\0'))
+    assert recv_exact(sock, 1) == b'\x01'
+    (size,) = struct.unpack('>Q', recv_exact(sock, 8))
+    sock.sendall(b'\x01')
+    start = time.perf_counter()
+    received = 0
+    while received < size:
+        received += len(recv_exact(sock, min(READ_CHUNK_SIZE, size - received)))
+        delay = start + received / CLIENT_BYTES_PER_SECOND - time.perf_counter()
+        if delay > 0:
+            time.sleep(delay)
+    sock.close()
+
+def read_loads(path: pathlib.Path) -> tuple[list[int], list[int]] | None:
+    try:
+        lines = path.read_text().splitlines()
+    except FileNotFoundError:
+        return None
+    rows = [line.split() for line in lines[4:]]
+    return [int(row[6]) for row in rows], [int(row[7]) for row in rows]
+
+def coefficient_of_variation(values: list[int]) -> float | None:
+    mean = statistics.fmean(values)
+    return statistics.pstdev(values) / mean if mean > 0 else None
+
+def run(policy: str, files_dir: pathlib.Path, status_path: pathlib.Path) -> tuple[float, float]:
+    server = subprocess.Popen([SERVER_EXECUTABLE, '-P', policy, '-S', status_path, ADDRESS, str(PORT), files_dir, WORKERS], stdout=subprocess.DEVNULL)
+    time.sleep(1)
+    threads = []
+    for i in range(CLIENTS):
+        name = 'big.bin' if i % BIG_EVERY == 0 else 'small.bin'
+        threads.append(threading.Thread(target=slow_get, args=(name,)))
+        threads[-1].start()
+        time.sleep(ARRIVAL_SECONDS)
+    connection_cvs = []
+    bytes_cvs = []
+    while any(thread.is_alive() for thread in threads):
+        loads = read_loads(status_path)
+        if loads is not None:
+            for values, cvs in zip(loads, [connection_cvs, bytes_cvs]):
+                cv = coefficient_of_variation(values)
+                if cv is not None:
+                    cvs.append(cv)
+        time.sleep(SAMPLE_SECONDS)
+    for thread in threads:
+        thread.join()
+    server.send_signal(2)
+    server.wait()
+    return statistics.fmean(connection_cvs), statistics.fmean(bytes_cvs)
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    (files_dir / 'big.bin').write_bytes(os.urandom(BIG_SIZE))
+    (files_dir / 'small.bin').write_bytes(os.urandom(SMALL_SIZE))
+    status_path = pathlib.Path(tmp) / 'status'
+
+    print(f'{WORKERS} workers, {CLIENTS} clients, per-worker load variation (stddev / mean, lower is better)')
+    print(f'{"policy":>12} {"connections":>12} {"bytes pending":>14}')
+    for policy in POLICIES:
+        connections_cv, bytes_cv = run(policy, files_dir, status_path)
+        print(f'{policy:>12} {connections_cv:>12.2f} {bytes_cv:>14.2f}')
@@ -0,0 +1,73 @@
+import subprocess
+import pathlib
+import os
+import re
+import sys
+import time
+import tempfile
+import threading
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+ADDRESS = '127.0.0.1'
+PORT = 55064
+# The source is sparse so the server side costs nothing, the download lands on a real disk next
+# to this script. Pass a size in GiB to try something smaller than the 10 GiB default.
+FILE_SIZE = int(float(sys.argv[1]) * (1 << 30)) if len(sys.argv) > 1 else 10 << 30
+WRITE_BEHIND_MIB = '16'
+CONFIGS = [
+    ('kernel write-back', []),
+    ('fdatasync + rename', ['-F', '-N']),
+    ('write-behind', ['-W', WRITE_BEHIND_MIB]),
+    ('all', ['-A', '-W', WRITE_BEHIND_MIB, '-F', '-N']),
+]
+SETTLED = re.compile(r'\[Output settled\] \[after_last_byte_ms: ([\d.]+)\]')
+
+def dirty_kib() -> int:
+    total = 0
+    with open('/proc/meminfo') as meminfo:
+        for line in meminfo:
+            if line.startswith(('Dirty:', 'Writeback:')):
+                total += int(line.split()[1])
+    return total
+
+def download(arguments: list[str], downloads_dir: pathlib.Path) -> tuple[bool, float, float, float]:
+    peak = [0]
+    done = threading.Event()
+    def sample() -> None:
+        while not done.wait(0.05):
+            peak[0] = max(peak[0], dirty_kib())
+    sampler = threading.Thread(target=sample)
+    sampler.start()
+    start = time.perf_counter()
+    result = subprocess.run([CLIENT_EXECUTABLE, *arguments, ADDRESS, str(PORT), 'file.bin', str(FILE_SIZE)],
+        cwd=downloads_dir, capture_output=True, text=True)
+    elapsed = time.perf_counter() - start
+    done.set()
+    sampler.join()
+    path = downloads_dir / 'file.bin'
+    is_ok = path.exists() and path.stat().st_size == FILE_SIZE and not (downloads_dir / 'file.bin.part').exists()
+    path.unlink(missing_ok=True)
+    match = SETTLED.search(result.stdout)
+    return is_ok, elapsed, peak[0] / 1024, float(match.group(1)) if match else float('nan')
+
+with tempfile.TemporaryDirectory(dir=SCRIPT_DIR) as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    with open(files_dir / 'file.bin', 'wb') as file:
+        file.truncate(FILE_SIZE)
+    downloads_dir = pathlib.Path(tmp) / 'downloads'
+    downloads_dir.mkdir()
+    server = subprocess.Popen([SERVER_EXECUTABLE, ADDRESS, str(PORT), files_dir], stdout=subprocess.DEVNULL)
+    time.sleep(0.5)
+
+    print(f'{FILE_SIZE / (1 << 30):.1f} GiB download, dirty is Dirty + Writeback from /proc/meminfo')
+    print(f'{"":>20} {"ok":>3} {"total, s":>9} {"peak dirty, MiB":>16} {"settle, ms":>11}')
+    for label, arguments in CONFIGS:
+        subprocess.run(['sync'])
+        is_ok, elapsed, peak_dirty, settle = download(arguments, downloads_dir)
+        print(f'{label:>20} {"ok" if is_ok else "no":>3} {elapsed:>9.1f} {peak_dirty:>16.0f} {settle:>11.0f}')
+    server.send_signal(2)
+    server.wait()
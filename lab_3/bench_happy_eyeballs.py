@@ -0,0 +1,97 @@
+import subprocess
+import pathlib
+import os
+import re
+import sys
+import time
+import socket
+import tempfile
+import statistics
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+# Resolves to ::1 first and 127.0.0.1 second through a hosts file fixture. The script re-runs
+# itself in a private mount namespace with the fixture mounted over /etc/hosts, so it needs root.
+HOSTNAME = 'dual.test'
+HOSTS_FIXTURE = f'::1 {HOSTNAME}\n127.0.0.1 {HOSTNAME}\n'
+DUAL_STACK_PORT = 55060
+BROKEN_PORT = 55061
+REFUSED_PORT = 55062
+FILE_SIZE = 64 << 10
+RUNS = 10
+TIMEOUT_MS = '3000'
+CONNECTED = re.compile(r'\[Connected to (\S+)\] \[after_ms: (\d+)\]')
+
+if os.environ.get('BENCH_HOSTS_FIXTURE') is None:
+    with tempfile.NamedTemporaryFile('w', suffix='.hosts') as hosts:
+        hosts.write(HOSTS_FIXTURE)
+        hosts.flush()
+        os.environ['BENCH_HOSTS_FIXTURE'] = hosts.name
+        sys.exit(subprocess.run(['unshare', '-m', 'sh', '-c', f'mount --bind {hosts.name} /etc/hosts && exec "$0" "$@"',
+            sys.executable, *sys.argv]).returncode)
+
+# Returns whether the file arrived, the whole run's time, the winning address and the time the
+# race took, a single address is connected to without racing.
+def fetch(host: str, port: int, downloads_dir: pathlib.Path, attempt_delay_ms: str) -> tuple[bool, float, str, float | None]:
+    start = time.perf_counter()
+    result = subprocess.run([CLIENT_EXECUTABLE, '-e', attempt_delay_ms, '-t', TIMEOUT_MS, host, str(port), 'file.bin', str(FILE_SIZE)],
+        cwd=downloads_dir, capture_output=True, text=True)
+    elapsed = time.perf_counter() - start
+    path = downloads_dir / 'file.bin'
+    is_ok = path.exists() and path.stat().st_size == FILE_SIZE
+    path.unlink(missing_ok=True)
+    match = CONNECTED.search(result.stdout)
+    if match is None:
+        return is_ok, elapsed, 'single address' if is_ok else 'connect failed', None
+    return is_ok, elapsed, match.group(1), float(match.group(2))
+
+def race(label: str, port: int, downloads_dir: pathlib.Path, attempt_delay_ms: str) -> None:
+    results = [fetch(HOSTNAME, port, downloads_dir, attempt_delay_ms) for _ in range(RUNS)]
+    succeeded = sum(is_ok for is_ok, _, _, _ in results)
+    connects = [connect_ms for _, _, _, connect_ms in results if connect_ms is not None]
+    connect = f'{statistics.median(connects):.0f}' if connects else '-'
+    p50 = statistics.median(elapsed for _, elapsed, _, _ in results) * 1000
+    print(f'{label:>30} {attempt_delay_ms:>8} {succeeded:>4}/{RUNS} {connect:>12} {p50:>9.0f}  {results[-1][2]}')
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    (files_dir / 'file.bin').write_bytes(os.urandom(FILE_SIZE))
+    downloads_dir = pathlib.Path(tmp) / 'downloads'
+    downloads_dir.mkdir()
+
+    # One listener on :: takes both families.
+    server = subprocess.Popen([SERVER_EXECUTABLE, '::', str(DUAL_STACK_PORT), files_dir], stdout=subprocess.DEVNULL)
+    time.sleep(0.5)
+    print(f'dual-stack server on [::]:{DUAL_STACK_PORT}')
+    for host in ['127.0.0.1', '::1', HOSTNAME]:
+        is_ok, elapsed, peer, _ = fetch(host, DUAL_STACK_PORT, downloads_dir, '50')
+        print(f'{host:>30} {"ok" if is_ok else "FAILED":>8} {elapsed * 1000:>6.0f} ms  {peer}')
+    server.send_signal(2)
+    server.wait()
+
+    # The IPv4 servers work. On ::1 one port has a listener whose accept queue is full, so SYNs
+    # are dropped like on a black-holed IPv6 path, the other has nothing and refuses at once.
+    servers = [
+        subprocess.Popen([SERVER_EXECUTABLE, '127.0.0.1', str(port), files_dir], stdout=subprocess.DEVNULL)
+        for port in (BROKEN_PORT, REFUSED_PORT)
+    ]
+    black_hole = socket.socket(socket.AF_INET6, socket.SOCK_STREAM)
+    black_hole.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_V6ONLY, 1)
+    black_hole.bind(('::1', BROKEN_PORT))
+    black_hole.listen(0)
+    queued = socket.create_connection(('::1', BROKEN_PORT))
+    time.sleep(0.5)
+    print(f'\n{HOSTNAME} with IPv6 broken, {TIMEOUT_MS} ms connect timeout')
+    print(f'{"":>30} {"delay":>8} {"ok":>7} {"connect, ms":>12} {"run, ms":>9}  connected to')
+    # A delay past the timeout never starts the second attempt, like a plain blocking connect.
+    race('SYNs dropped, sequential', BROKEN_PORT, downloads_dir, '60000')
+    race('SYNs dropped, raced', BROKEN_PORT, downloads_dir, '50')
+    race('refused, raced', REFUSED_PORT, downloads_dir, '50')
+    queued.close()
+    black_hole.close()
+    for server in servers:
+        server.send_signal(2)
+        server.wait()
@@ -0,0 +1,119 @@
+import subprocess
+import pathlib
+import os
+import re
+import time
+import random
+import socket
+import tempfile
+import threading
+import statistics
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'parallel_server.o'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+ADDRESS = '127.0.0.1'
+HEALTHY_PORT = 55055
+DELAYED_BACKEND_PORT = 55056
+DELAYED_PORT = 55057
+MAX_CHILDREN = '8'
+REQUESTS = 300
+FILE_SIZE = 64 << 10
+# The delayed server answers the handshake at once and then sits on one response in ten.
+STALL_PROBABILITY = 0.1
+STALL_SECONDS = 1.0
+# A delay no response reaches is the unhedged baseline with the same socket options.
+HEDGE_SPECS = ['60000', '20', 'p90']
+HEADER_TIME = re.compile(r'time_to_header_ms: ([\d.]+)')
+HEDGE_RATE = re.compile(r'\[Hedge rate: (\d+)/(\d+)\] \[hedges won: (\d+)\]')
+
+def pump(source: socket.socket, destination: socket.socket, stall_after_first: bool) -> None:
+    forwarded = 0
+    try:
+        while chunk := source.recv(1 << 16):
+            if stall_after_first and forwarded > 0:
+                time.sleep(STALL_SECONDS)
+                stall_after_first = False
+            destination.sendall(chunk)
+            forwarded += len(chunk)
+    except OSError:
+        pass
+    for sock in (source, destination):
+        try:
+            sock.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+
+def relay(client: socket.socket, rng: random.Random) -> None:
+    upstream = socket.create_connection((ADDRESS, DELAYED_BACKEND_PORT))
+    for sock in (client, upstream):
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    is_stalled = rng.random() < STALL_PROBABILITY
+    threads = [
+        threading.Thread(target=pump, args=(client, upstream, False)),
+        threading.Thread(target=pump, args=(upstream, client, is_stalled)),
+    ]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    client.close()
+    upstream.close()
+
+def delay_proxy(listener: socket.socket) -> None:
+    rng = random.Random(1)
+    while True:
+        try:
+            client, _ = listener.accept()
+        except OSError:
+            return
+        threading.Thread(target=relay, args=(client, rng), daemon=True).start()
+
+def run(hedge: str, downloads_dir: pathlib.Path, health_path: pathlib.Path) -> None:
+    for path in (health_path, pathlib.Path(f'{health_path}.hedge')):
+        path.unlink(missing_ok=True)
+    servers = f'{ADDRESS}:{DELAYED_PORT},{ADDRESS}:{HEALTHY_PORT}'
+    latencies = []
+    header_times: list[float] = []
+    rate = None
+    for i in range(REQUESTS):
+        name = f'file_{i % 50}.bin'
+        start = time.perf_counter()
+        result = subprocess.run([CLIENT_EXECUTABLE, '-s', servers, '-H', health_path, '-h', hedge, name, str(FILE_SIZE)],
+            cwd=downloads_dir, capture_output=True, text=True)
+        latencies.append(time.perf_counter() - start)
+        assert (downloads_dir / name).stat().st_size == FILE_SIZE, result.stdout
+        (downloads_dir / name).unlink()
+        if (match := HEADER_TIME.search(result.stdout)) is not None:
+            header_times.append(float(match.group(1)))
+        rate = HEDGE_RATE.search(result.stdout) or rate
+    quantiles = statistics.quantiles(latencies, n=100)
+    assert rate is not None
+    hedged, won = rate.group(1), rate.group(3)
+    header_p99 = statistics.quantiles(header_times, n=100)[98]
+    print(f'{hedge:>6} {quantiles[49] * 1000:>8.1f} {quantiles[89] * 1000:>8.1f} {quantiles[98] * 1000:>8.1f} {max(latencies) * 1000:>8.1f} {header_p99:>11.1f} {hedged:>7} {won:>5}')
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    for i in range(50):
+        (files_dir / f'file_{i}.bin').write_bytes(os.urandom(FILE_SIZE))
+    downloads_dir = pathlib.Path(tmp) / 'downloads'
+    downloads_dir.mkdir()
+    servers = [
+        subprocess.Popen([SERVER_EXECUTABLE, ADDRESS, str(port), files_dir, MAX_CHILDREN], stdout=subprocess.DEVNULL)
+        for port in (HEALTHY_PORT, DELAYED_BACKEND_PORT)
+    ]
+    listener = socket.create_server((ADDRESS, DELAYED_PORT))
+    threading.Thread(target=delay_proxy, args=(listener,), daemon=True).start()
+    time.sleep(1)
+
+    print(f'{REQUESTS} GETs over two servers, one stalls {STALL_SECONDS:.0f} s on {STALL_PROBABILITY:.0%} of its responses')
+    print(f'{"hedge":>6} {"p50, ms":>8} {"p90, ms":>8} {"p99, ms":>8} {"max, ms":>8} {"header p99":>11} {"hedged":>7} {"won":>5}')
+    for hedge in HEDGE_SPECS:
+        run(hedge, downloads_dir, pathlib.Path(tmp) / 'health')
+    listener.close()
+    for server in servers:
+        server.send_signal(2)
+        server.wait()
@@ -0,0 +1,50 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+SERVER_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = '55003'
+MAX_FILE_SIZE = str(1 << 33)
+
+FILE_SIZES = [1 << 20, 16 << 20, 256 << 20, 1 << 30, 4 << 30]
+BLOCK = os.urandom(1 << 20)
+
+def make_file(path: pathlib.Path, size: int) -> None:
+    with open(path, 'wb') as f:
+        for _ in range(size // len(BLOCK)):
+            f.write(BLOCK)
+
+def run_client(args: list[str], cwd: pathlib.Path) -> float:
+    start = time.perf_counter()
+    subprocess.run([CLIENT_EXECUTABLE, *args], cwd=cwd, stdout=subprocess.DEVNULL, check=True)
+    return time.perf_counter() - start
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    out_dir = pathlib.Path(tmp) / 'out'
+    files_dir.mkdir()
+    out_dir.mkdir()
+    unix_path = str(pathlib.Path(tmp) / 'server.sock')
+    for size in FILE_SIZES:
+        make_file(files_dir / f'{size}.bin', size)
+
+    server = subprocess.Popen([SERVER_EXECUTABLE, '-u', unix_path, ADDRESS, PORT, files_dir], stdout=subprocess.DEVNULL)
+    time.sleep(1)
+
+    print(f'{"size":>12} {"tcp, s":>10} {"unix, s":>10} {"tcp, MB/s":>12} {"unix, MB/s":>12}')
+    for size in FILE_SIZES:
+        name = f'{size}.bin'
+        tcp = run_client([ADDRESS, PORT, name, MAX_FILE_SIZE], out_dir)
+        (out_dir / name).unlink()
+        local = run_client(['-u', unix_path, name, MAX_FILE_SIZE], out_dir)
+        (out_dir / name).unlink()
+        print(f'{size:>12} {tcp:>10.4f} {local:>10.4f} {size / tcp / 1e6:>12.1f} {size / local / 1e6:>12.1f}')
+
+    server.send_signal(2)
+    server.wait()
@@ -0,0 +1,62 @@
+import subprocess
+import pathlib
+import hashlib
+import os
+import re
+import time
+import tempfile
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'parallel_server.o'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+# Loopback multicast works once the group is joined on 127.0.0.1, which the client does by
+# joining on the interface its control connection uses.
+GROUP = '239.255.0.1:55068'
+PORT = 55069
+RATE_MBIT = '400'
+FILE_SIZE = 64 << 20
+CLIENTS = 16
+LOSS_PERCENTS = [0, 1, 5]
+FINISHED = re.compile(r'\[Multicast finished\] \[datagrams: (\d+)\] \[dropped: (\d+)\] \[blocks: \d+/\d+\] \[recovered by FEC: (\d+)\] '
+    r'\[repaired over TCP: (\d+) blocks in (\d+) ranges\] \[multicast_ms: [\d.]+\] \[total_ms: ([\d.]+)\] \[complete: 1\]')
+SENT = re.compile(r'\[Multicast \d+\] \[Sent \d+ groups of \d+\] \[bytes: (\d+)\]')
+
+def run_session(files_dir: pathlib.Path, downloads_dir: pathlib.Path, digest: str, loss_percent: int) -> None:
+    server_log = downloads_dir / 'server.log'
+    with open(server_log, 'w') as log:
+        server = subprocess.Popen([SERVER_EXECUTABLE, '-g', GROUP, '-r', RATE_MBIT, '127.0.0.1', str(PORT), files_dir, '64'], stdout=log)
+        time.sleep(0.5)
+        client_dirs = [downloads_dir / f'{loss_percent}-{i}' for i in range(CLIENTS)]
+        clients = []
+        for client_dir in client_dirs:
+            client_dir.mkdir()
+            clients.append(subprocess.Popen([CLIENT_EXECUTABLE, '-M', '-l', str(loss_percent), '127.0.0.1', str(PORT), 'file.bin', str(FILE_SIZE)],
+                cwd=client_dir, stdout=subprocess.PIPE, text=True))
+        outputs = [client.communicate()[0] for client in clients]
+        time.sleep(0.5)
+        server.send_signal(2)
+        server.wait()
+    intact = sum(hashlib.sha256((client_dir / 'file.bin').read_bytes()).hexdigest() == digest for client_dir in client_dirs)
+    stats = [[float(value) for value in match.groups()] for match in map(FINISHED.search, outputs) if match is not None]
+    sent = SENT.search(server_log.read_text())
+    udp_bytes = int(sent.group(1)) if sent is not None else 0
+    repaired_bytes = sum(s[3] for s in stats) * 1400
+    total_ms = max(s[5] for s in stats) if stats else 0
+    on_wire = (udp_bytes + repaired_bytes) / (CLIENTS * FILE_SIZE)
+    print(f'{loss_percent:>6}% {intact:>4}/{CLIENTS} {sum(s[1] for s in stats) / max(len(stats), 1):>9.0f} '
+        f'{sum(s[2] for s in stats) / max(len(stats), 1):>9.0f} {sum(s[3] for s in stats) / max(len(stats), 1):>9.0f} '
+        f'{repaired_bytes / (1 << 20):>10.1f} {udp_bytes / (1 << 20):>9.1f} {on_wire:>10.3f} {total_ms:>9.0f}')
+
+with tempfile.TemporaryDirectory(dir='/dev/shm') as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    data = os.urandom(FILE_SIZE)
+    (files_dir / 'file.bin').write_bytes(data)
+    digest = hashlib.sha256(data).hexdigest()
+    downloads_dir = pathlib.Path(tmp) / 'downloads'
+    downloads_dir.mkdir()
+    print(f'{CLIENTS} clients, {FILE_SIZE >> 20} MiB, {RATE_MBIT} Mbit/s, bytes on the wire against {CLIENTS} unicast downloads')
+    print(f'{"loss":>7} {"ok":>9} {"dropped":>9} {"FEC":>9} {"TCP blks":>9} {"TCP MiB":>10} {"UDP MiB":>9} {"of unicast":>10} {"ms":>9}')
+    for loss_percent in LOSS_PERCENTS:
+        run_session(files_dir, downloads_dir, digest, loss_percent)
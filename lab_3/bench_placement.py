@@ -0,0 +1,112 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import socket
+import struct
+import threading
+import ctypes
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'dispatch_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = 55045
+WORKERS = str(os.cpu_count())
+PROTOCOL_VERSION = 18
+FILENAME_BUFFER_SIZE = 255
+FILE_SIZE = 8 << 20
+CLIENTS = 16
+DURATION_SECONDS = 10
+PLACEMENTS = [('floating', []), ('pinned', ['-A', 'physical'])]
+
+# perf_event_open(2) through ctypes. Hardware counters are often missing in a VM and the
+# scheduler counters fire in kernel context, which needs perf_event_paranoid below 2 or root,
+# an unavailable counter shows as n/a. Connection threads are counted through inherit, their
+# counts reach the worker's counter when they exit.
+SYS_PERF_EVENT_OPEN = 298
+PERF_TYPE_HARDWARE = 0
+PERF_TYPE_SOFTWARE = 1
+PERF_COUNT_HW_CACHE_MISSES = 3
+PERF_COUNT_SW_CONTEXT_SWITCHES = 3
+PERF_COUNT_SW_CPU_MIGRATIONS = 4
+PERF_ATTR_INHERIT = 1 << 1
+PERF_ATTR_EXCLUDE_HV = 1 << 6
+COUNTERS = [
+    ('LLC misses', PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+    ('migrations', PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS),
+    ('switches', PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES),
+]
+libc = ctypes.CDLL(None, use_errno=True)
+
+def perf_open(pid: int, event_type: int, config: int) -> int:
+    flags = PERF_ATTR_INHERIT | PERF_ATTR_EXCLUDE_HV
+    attr = ctypes.create_string_buffer(struct.pack('IIQQQQQIIQ', event_type, 64, config, 0, 0, 0, flags, 0, 0, 0))
+    return libc.syscall(SYS_PERF_EVENT_OPEN, attr, pid, -1, -1, 0)
+
+def recv_exact(sock: socket.socket, count: int) -> bytes:
+    data = bytearray()
+    while len(data) < count:
+        chunk = sock.recv(min(count - len(data), 1 << 20))
+        assert chunk
+        data += chunk
+    return bytes(data)
+
+def download_loop(deadline: float, received: list[int]) -> None:
+    while time.perf_counter() < deadline:
+        with socket.create_connection((ADDRESS, PORT)) as sock:
+            sock.sendall(bytes([PROTOCOL_VERSION]))
+            assert recv_exact(sock, 1) == b'\x01'
+            sock.sendall(bytes([0]) + b'file.bin'.ljust(FILENAME_BUFFER_SIZE, b'\0'))
+            assert recv_exact(sock, 1) == b'\x01'
+            (size,) = struct.unpack('>Q', recv_exact(sock, 8))
+            sock.sendall(b'\x01')
+            recv_exact(sock, size)
+            received.append(size)
+
+# The acceptor refreshes the status file between connections, an empty one gets it going.
+def worker_pids(status_path: pathlib.Path) -> list[int]:
+    while True:
+        socket.create_connection((ADDRESS, PORT)).close()
+        time.sleep(0.5)
+        try:
+            lines = status_path.read_text().splitlines()
+            return [int(line.split()[1]) for line in lines[4:]]
+        except FileNotFoundError:
+            pass
+
+def run(name: str, flags: list[str], files_dir: pathlib.Path, status_path: pathlib.Path) -> None:
+    server = subprocess.Popen([SERVER_EXECUTABLE, *flags, '-S', status_path, ADDRESS, str(PORT), files_dir, WORKERS], stdout=subprocess.DEVNULL)
+    time.sleep(1)
+    pids = worker_pids(status_path)
+    counter_fds = {label: [perf_open(pid, event_type, config) for pid in pids] for label, event_type, config in COUNTERS}
+    received: list[int] = []
+    deadline = time.perf_counter() + DURATION_SECONDS
+    threads = [threading.Thread(target=download_loop, args=(deadline, received)) for _ in range(CLIENTS)]
+    start = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.perf_counter() - start
+    totals = {}
+    for label, fds in counter_fds.items():
+        if any(fd < 0 for fd in fds):
+            totals[label] = 'n/a'
+            continue
+        totals[label] = str(sum(struct.unpack('Q', os.read(fd, 8))[0] for fd in fds))
+        for fd in fds:
+            os.close(fd)
+    server.send_signal(2)
+    server.wait()
+    print(f'{name:>9} {sum(received) / elapsed / (1 << 20):>8.0f} ' + ' '.join(f'{totals[label]:>12}' for label, _, _ in COUNTERS))
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    (files_dir / 'file.bin').write_bytes(os.urandom(FILE_SIZE))
+    print(f'{WORKERS} dispatch workers, {CLIENTS} clients downloading {FILE_SIZE >> 20} MiB for {DURATION_SECONDS} s')
+    print(f'{"placement":>9} {"MiB/s":>8} ' + ' '.join(f'{label:>12}' for label, _, _ in COUNTERS))
+    for name, flags in PLACEMENTS:
+        run(name, flags, files_dir, pathlib.Path(tmp) / 'status')
@@ -0,0 +1,56 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import socket
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'pool_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = '55040'
+MAX_CHILDREN = '64'
+MIN_SPARE = '2'
+MAX_SPARE = '6'
+PROTOCOL_VERSION = 18
+# Connections that send the version byte and then stall keep a worker busy until they close.
+LOAD_STEPS = [0, 8, 32, 32, 4, 0, 0, 0, 0, 0]
+STEP_SECONDS = 4
+SAMPLE_SECONDS = 0.5
+
+def read_status(path: pathlib.Path) -> dict[str, int]:
+    counts = {'idle': 0, 'busy': 0, 'starting': 0, 'retiring': 0}
+    try:
+        lines = path.read_text().splitlines()
+    except FileNotFoundError:
+        return counts
+    for line in lines[6:]:
+        state = line.split()[2]
+        counts[state] = counts.get(state, 0) + 1
+    return counts
+
+with tempfile.TemporaryDirectory() as tmp:
+    status_path = pathlib.Path(tmp) / 'status'
+    server = subprocess.Popen([SERVER_EXECUTABLE, '-m', MIN_SPARE, '-M', MAX_SPARE, '-S', status_path, ADDRESS, PORT, tmp, MAX_CHILDREN], stdout=subprocess.DEVNULL)
+    time.sleep(1)
+
+    held: list[socket.socket] = []
+    start = time.perf_counter()
+    print(f'spare workers {MIN_SPARE}..{MAX_SPARE}, at most {MAX_CHILDREN}')
+    print(f'{"time, s":>8} {"load":>5} {"idle":>5} {"busy":>5} {"retiring":>9}')
+    for load in LOAD_STEPS:
+        while len(held) > load:
+            held.pop().close()
+        while len(held) < load:
+            sock = socket.create_connection((ADDRESS, int(PORT)))
+            sock.sendall(bytes([PROTOCOL_VERSION]))
+            held.append(sock)
+        step_end = time.perf_counter() + STEP_SECONDS
+        while time.perf_counter() < step_end:
+            counts = read_status(status_path)
+            print(f'{time.perf_counter() - start:>8.1f} {load:>5} {counts["idle"] + counts["starting"]:>5} {counts["busy"]:>5} {counts["retiring"]:>9}')
+            time.sleep(SAMPLE_SECONDS)
+
+    server.send_signal(2)
+    server.wait()
@@ -0,0 +1,89 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import socket
+import struct
+import threading
+import hashlib
+import statistics
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+ORIGIN_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+PROXY_EXECUTABLE = BUILD_DIR / 'dispatch_server.o'
+ADDRESS  = '127.0.0.1'
+ORIGIN_PORT = 55047
+PROXY_PORT = 55048
+PROXY_WORKERS = '4'
+PROTOCOL_VERSION = 18
+FILENAME_BUFFER_SIZE = 255
+FILE_SIZE = 32 << 20
+FILE_COUNT = 4
+CONCURRENT = 16
+# Room for three of the four files, so the last fill evicts the least recently used one.
+CACHE_BYTES = 3 * FILE_SIZE
+
+def recv_exact(sock: socket.socket, count: int) -> bytes:
+    data = bytearray()
+    while len(data) < count:
+        chunk = sock.recv(min(count - len(data), 1 << 20))
+        assert chunk
+        data += chunk
+    return bytes(data)
+
+def get(name: str, results: list[tuple[float, str]]) -> None:
+    start = time.perf_counter()
+    with socket.create_connection((ADDRESS, PROXY_PORT)) as sock:
+        sock.sendall(bytes([PROTOCOL_VERSION]))
+        assert recv_exact(sock, 1) == b'\x01'
+        sock.sendall(bytes([0]) + name.encode().ljust(FILENAME_BUFFER_SIZE, b'\0'))
+        assert recv_exact(sock, 1) == b'\x01'
+        (size,) = struct.unpack('>Q', recv_exact(sock, 8))
+        sock.sendall(b'\x01')
+        digest = hashlib.md5(recv_exact(sock, size)).hexdigest()
+    results.append((time.perf_counter() - start, digest))
+
+def upstream_requests(origin_log: pathlib.Path) -> int:
+    return origin_log.read_text().count('[Start handling client]')
+
+def burst(label: str, name: str, expected: str, origin_log: pathlib.Path) -> None:
+    before = upstream_requests(origin_log)
+    results: list[tuple[float, str]] = []
+    threads = [threading.Thread(target=get, args=(name, results)) for _ in range(CONCURRENT)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    latencies = [latency for latency, _ in results]
+    correct = sum(digest == expected for _, digest in results)
+    print(f'{label:>14} {name:>8} {correct:>4}/{CONCURRENT:<3} {upstream_requests(origin_log) - before:>9} {statistics.median(latencies) * 1000:>8.0f} {max(latencies) * 1000:>8.0f}')
+
+with tempfile.TemporaryDirectory() as tmp:
+    origin_dir = pathlib.Path(tmp) / 'origin'
+    cache_dir = pathlib.Path(tmp) / 'cache'
+    origin_dir.mkdir()
+    cache_dir.mkdir()
+    digests = {}
+    for i in range(FILE_COUNT):
+        data = os.urandom(FILE_SIZE)
+        (origin_dir / f'{i}.bin').write_bytes(data)
+        digests[f'{i}.bin'] = hashlib.md5(data).hexdigest()
+    origin_log = pathlib.Path(tmp) / 'origin.log'
+    with open(origin_log, 'w') as origin_out, open(pathlib.Path(tmp) / 'proxy.log', 'w') as proxy_out:
+        origin = subprocess.Popen(['stdbuf', '-oL', ORIGIN_EXECUTABLE, ADDRESS, str(ORIGIN_PORT), origin_dir], stdout=origin_out)
+        proxy = subprocess.Popen([PROXY_EXECUTABLE, '-U', f'{ADDRESS}:{ORIGIN_PORT}', '-L', str(CACHE_BYTES), ADDRESS, str(PROXY_PORT), cache_dir, PROXY_WORKERS], stdout=proxy_out)
+        time.sleep(1)
+        print(f'{CONCURRENT} concurrent GETs of {FILE_SIZE >> 20} MiB through the proxy, cache limit {CACHE_BYTES >> 20} MiB')
+        print(f'{"":>14} {"file":>8} {"correct":>8} {"upstream":>9} {"p50, ms":>8} {"max, ms":>8}')
+        burst('cold miss', '0.bin', digests['0.bin'], origin_log)
+        burst('hit', '0.bin', digests['0.bin'], origin_log)
+        for name in ['1.bin', '2.bin', '3.bin']:
+            burst('cold miss', name, digests[name], origin_log)
+        burst('evicted', '0.bin', digests['0.bin'], origin_log)
+        print(f'cached: {sorted(path.name for path in cache_dir.iterdir() if not path.name.startswith("."))}')
+        proxy.send_signal(2)
+        origin.send_signal(2)
+        proxy.wait()
+        origin.wait()
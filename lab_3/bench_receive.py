@@ -0,0 +1,61 @@
+import subprocess
+import pathlib
+import os
+import re
+import time
+import hashlib
+import tempfile
+import statistics
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+ADDRESS = '127.0.0.1'
+PORT = 55063
+# Both copies live in tmpfs, so the disk does not cap what is measured.
+TMP_DIR = '/dev/shm' if os.path.isdir('/dev/shm') else None
+FILE_SIZE = 512 << 20
+RUNS = 5
+ENGINES = ['splice', 'mmap', 'zerocopy', 'uring', 'auto']
+FINISHED = re.compile(r'\[engine: (\w+)\] \[seconds: [\d.]+\] \[GB/s: ([\d.]+)\] \[cpu_s_per_GB: ([\d.]+)\]')
+
+def fetch(engine: str, downloads_dir: pathlib.Path) -> tuple[str, float, float] | None:
+    result = subprocess.run([CLIENT_EXECUTABLE, '-E', engine, ADDRESS, str(PORT), 'file.bin', str(FILE_SIZE)],
+        cwd=downloads_dir, capture_output=True, text=True)
+    match = FINISHED.search(result.stdout)
+    if match is None:
+        return None
+    return match.group(1), float(match.group(2)), float(match.group(3))
+
+with tempfile.TemporaryDirectory(dir=TMP_DIR) as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    with open(files_dir / 'file.bin', 'wb') as file:
+        for _ in range(FILE_SIZE >> 20):
+            file.write(os.urandom(1 << 20))
+    expected_digest = hashlib.sha256((files_dir / 'file.bin').read_bytes()).hexdigest()
+    downloads_dir = pathlib.Path(tmp) / 'downloads'
+    downloads_dir.mkdir()
+    server = subprocess.Popen([SERVER_EXECUTABLE, ADDRESS, str(PORT), files_dir], stdout=subprocess.DEVNULL)
+    time.sleep(0.5)
+
+    print(f'{FILE_SIZE >> 20} MiB over loopback, median of {RUNS} runs')
+    print(f'{"engine":>9} {"used":>9} {"GB/s":>7} {"CPU s/GB":>9}  file')
+    for engine in ENGINES:
+        results = []
+        is_intact = True
+        for _ in range(RUNS):
+            results.append(fetch(engine, downloads_dir))
+            path = downloads_dir / 'file.bin'
+            is_intact = is_intact and path.exists() and hashlib.sha256(path.read_bytes()).hexdigest() == expected_digest
+            path.unlink(missing_ok=True)
+        finished = [result for result in results if result is not None]
+        if not finished:
+            print(f'{engine:>9} {"-":>9} {"-":>7} {"-":>9}  unsupported')
+            continue
+        throughput = statistics.median(result[1] for result in finished)
+        cpu = statistics.median(result[2] for result in finished)
+        print(f'{engine:>9} {finished[-1][0]:>9} {throughput:>7.2f} {cpu:>9.3f}  {"intact" if is_intact else "CORRUPT"}')
+    server.send_signal(2)
+    server.wait()
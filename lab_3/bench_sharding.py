@@ -0,0 +1,74 @@
+import subprocess
+import pathlib
+import os
+import re
+import signal
+import time
+import tempfile
+import collections
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+ADDRESS = '127.0.0.1'
+PORTS = [55052, 55053, 55054]
+FILES = 60
+FILE_SIZE = 16 << 10
+HANDSHAKE_TIMEOUT_MS = '300'
+SERVED_BY = re.compile(r'\[Served by [\d.]+:(\d+)\]')
+
+def fetch_all(downloads_dir: pathlib.Path, health_path: pathlib.Path) -> tuple[collections.Counter[int], int, int, float]:
+    servers = ','.join(f'{ADDRESS}:{port}' for port in PORTS)
+    served_by: collections.Counter[int] = collections.Counter()
+    failed = 0
+    failovers = 0
+    start = time.perf_counter()
+    for i in range(FILES):
+        result = subprocess.run(
+            [CLIENT_EXECUTABLE, '-s', servers, '-H', health_path, '-t', HANDSHAKE_TIMEOUT_MS, f'file_{i}.bin', str(FILE_SIZE)],
+            cwd=downloads_dir, capture_output=True, text=True)
+        match = SERVED_BY.search(result.stdout)
+        if match is None or (downloads_dir / f'file_{i}.bin').stat().st_size != FILE_SIZE:
+            failed += 1
+            continue
+        served_by[int(match.group(1))] += 1
+        failovers += result.stdout.count('[Failing over')
+        (downloads_dir / f'file_{i}.bin').unlink()
+    return served_by, failed, failovers, (time.perf_counter() - start) / FILES
+
+def report(label: str, result: tuple[collections.Counter[int], int, int, float]) -> None:
+    served_by, failed, failovers, seconds_per_file = result
+    shares = ' '.join(f'{served_by[port]:>6}' for port in PORTS)
+    print(f'{label:>16} {shares} {failed:>7} {failovers:>10} {seconds_per_file * 1000:>8.1f}')
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    for i in range(FILES):
+        (files_dir / f'file_{i}.bin').write_bytes(os.urandom(FILE_SIZE))
+    downloads_dir = pathlib.Path(tmp) / 'downloads'
+    downloads_dir.mkdir()
+    health_path = pathlib.Path(tmp) / 'health'
+    servers = [
+        subprocess.Popen([SERVER_EXECUTABLE, ADDRESS, str(port), files_dir], stdout=subprocess.DEVNULL)
+        for port in PORTS
+    ]
+    time.sleep(1)
+
+    print(f'{FILES} GETs sharded over {len(PORTS)} iterative servers, handshake timeout {HANDSHAKE_TIMEOUT_MS} ms')
+    print(f'{"":>16} ' + ' '.join(f'{port:>6}' for port in PORTS) + f' {"failed":>7} {"failovers":>10} {"ms/file":>8}')
+    report('all up', fetch_all(downloads_dir, health_path))
+    servers[0].kill()
+    servers[0].wait()
+    report(f'{PORTS[0]} killed', fetch_all(downloads_dir, health_path))
+    # A stopped server still completes the TCP handshake from the backlog but never answers the
+    # protocol version, only the handshake timeout gets the client past it.
+    servers[1].send_signal(signal.SIGSTOP)
+    report(f'{PORTS[1]} stopped', fetch_all(downloads_dir, health_path))
+    report('again', fetch_all(downloads_dir, health_path))
+    print(health_path.read_text(), end='')
+    servers[1].send_signal(signal.SIGCONT)
+    for server in servers[1:]:
+        server.send_signal(signal.SIGINT)
+        server.wait()
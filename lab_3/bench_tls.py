@@ -0,0 +1,60 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+SERVER_EXECUTABLE = BUILD_DIR / 'iterative_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = '55009'
+TLS_PORT = '55010'
+MAX_FILE_SIZE = str(1 << 33)
+
+FILE_SIZES = [16 << 20, 256 << 20, 1 << 30]
+BLOCK = os.urandom(1 << 20)
+
+def make_file(path: pathlib.Path, size: int) -> None:
+    with open(path, 'wb') as f:
+        for _ in range(size // len(BLOCK)):
+            f.write(BLOCK)
+
+def run_client(args: list[str], cwd: pathlib.Path) -> tuple[float, str]:
+    start = time.perf_counter()
+    result = subprocess.run([CLIENT_EXECUTABLE, *args], cwd=cwd, stdout=subprocess.PIPE, text=True, check=True)
+    elapsed = time.perf_counter() - start
+    mode = next((line for line in result.stdout.splitlines() if line.startswith('[TLS: ')), 'plaintext')
+    return elapsed, mode
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    out_dir = pathlib.Path(tmp) / 'out'
+    files_dir.mkdir()
+    out_dir.mkdir()
+    cert = pathlib.Path(tmp) / 'cert.pem'
+    key = pathlib.Path(tmp) / 'key.pem'
+    subprocess.run(['openssl', 'req', '-x509', '-newkey', 'rsa:2048', '-nodes', '-days', '1',
+                    '-keyout', key, '-out', cert, '-subj', f'/CN={ADDRESS}', '-addext', f'subjectAltName=IP:{ADDRESS}'],
+                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, check=True)
+    for size in FILE_SIZES:
+        make_file(files_dir / f'{size}.bin', size)
+
+    plain_server = subprocess.Popen([SERVER_EXECUTABLE, ADDRESS, PORT, files_dir], stdout=subprocess.DEVNULL)
+    tls_server = subprocess.Popen([SERVER_EXECUTABLE, '-C', cert, '-K', key, ADDRESS, TLS_PORT, files_dir], stdout=subprocess.DEVNULL)
+    time.sleep(1)
+
+    print(f'{"size":>12} {"plain, MB/s":>12} {"tls, MB/s":>10}  tls path')
+    for size in FILE_SIZES:
+        name = f'{size}.bin'
+        plain, _ = run_client([ADDRESS, PORT, name, MAX_FILE_SIZE], out_dir)
+        (out_dir / name).unlink()
+        encrypted, mode = run_client(['-T', str(cert), ADDRESS, TLS_PORT, name, MAX_FILE_SIZE], out_dir)
+        assert (out_dir / name).stat().st_size == size
+        (out_dir / name).unlink()
+        print(f'{size:>12} {size / plain / 1e6:>12.1f} {size / encrypted / 1e6:>10.1f}  {mode}')
+
+    for server in [plain_server, tls_server]:
+        server.send_signal(2)
+        server.wait()
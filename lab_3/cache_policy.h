@@ -0,0 +1,142 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "client_utils.h"
+#include "scoreboard.h"
+
+// Keeps one-shot transfers of huge files from flushing the page cache. Without it a single
+// pull of a file larger than memory evicts the small files everyone keeps asking for, and
+// they come from disk again until the cache has refilled.
+//
+// A file of at least cold_bytes is cold unless it was requested CACHE_POLICY_POPULAR_HITS
+// times within the last CACHE_POLICY_WINDOW_S seconds. Cold files are streamed either with
+// POSIX_FADV_DONTNEED a few MiB behind the send cursor, the pages closer to it may still be
+// referenced by the socket's send queue, or with -O through O_DIRECT reads that never enter
+// the page cache at all. Request counts live in a lossy table in a shared anonymous mapping
+// created before the first fork, so forked workers see each other's requests.
+
+enum {
+    CACHE_POLICY_SLOTS = 4096,
+    CACHE_POLICY_POPULAR_HITS = 3,
+    CACHE_POLICY_WINDOW_S = 600,
+    CACHE_POLICY_DROP_LAG = 4 << 20,
+    CACHE_POLICY_DROP_WINDOW = 16 << 20,
+    CACHE_POLICY_DIRECT_CHUNK_SIZE = 1 << 20,
+    CACHE_POLICY_DIRECT_ALIGNMENT = 4096
+};
+
+typedef enum {
+    CacheClass_HOT,
+    CacheClass_COLD,
+    CacheClass_COLD_DIRECT,
+} CacheClass;
+
+typedef struct {
+    atomic_uint_fast64_t key;
+    atomic_uint hits;
+    atomic_int_fast64_t window_start;
+} CachePolicySlot;
+
+typedef struct {
+    uint64_t cold_bytes;
+    bool is_direct;
+    CachePolicySlot *slots;
+} CachePolicyConfig;
+
+static void cache_policy_create_table(CachePolicyConfig *const config) {
+    void *const memory = mmap(NULL, CACHE_POLICY_SLOTS * sizeof(CachePolicySlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(memory != MAP_FAILED);
+    config->slots = memory;
+}
+
+// Counts the request and says how to stream the file. Two files sharing a slot just restart
+// each other's count, which errs towards cold.
+static CacheClass cache_policy_classify(const CachePolicyConfig *const config, const struct stat *const st) {
+    if(config->cold_bytes == 0 or (uint64_t)st->st_size < config->cold_bytes) {
+        return CacheClass_HOT;
+    }
+    uint64_t key = ((uint64_t)st->st_dev << 48 ^ (uint64_t)st->st_ino) * 0x9e3779b97f4a7c15ULL;
+    key = key == 0 ? 1 : key;
+    CachePolicySlot *const slot = &config->slots[key % CACHE_POLICY_SLOTS];
+    const int64_t now = scoreboard_now();
+    unsigned hits;
+    if(atomic_exchange_explicit(&slot->key, key, memory_order_relaxed) != key
+        or now - atomic_load_explicit(&slot->window_start, memory_order_relaxed) > CACHE_POLICY_WINDOW_S) {
+        atomic_store_explicit(&slot->window_start, now, memory_order_relaxed);
+        atomic_store_explicit(&slot->hits, 1, memory_order_relaxed);
+        hits = 1;
+    } else {
+        hits = atomic_fetch_add_explicit(&slot->hits, 1, memory_order_relaxed) + 1;
+    }
+    if(hits >= CACHE_POLICY_POPULAR_HITS) {
+        return CacheClass_HOT;
+    }
+    return config->is_direct ? CacheClass_COLD_DIRECT : CacheClass_COLD;
+}
+
+// Drops what was sent in whole CACHE_POLICY_DROP_WINDOW steps. Page cache folios are aligned
+// to their size and DONTNEED skips any folio the range only partly covers, so unaligned 1 MiB
+// steps behind readahead's large folios drop next to nothing. Once done the whole file goes,
+// short of the tail still queued on the socket.
+static void cache_policy_drop_behind(const int fd, const off_t offset, const bool is_done, off_t *const dropped) {
+    if(is_done) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        *dropped = offset;
+        return;
+    }
+    const off_t until = (offset - CACHE_POLICY_DROP_LAG) / CACHE_POLICY_DROP_WINDOW * CACHE_POLICY_DROP_WINDOW;
+    if(until > *dropped) {
+        posix_fadvise(fd, *dropped, until - *dropped, POSIX_FADV_DONTNEED);
+        *dropped = until;
+    }
+}
+
+// Sends size bytes read with O_DIRECT, returns the count sent or -1 when the file system does
+// not do O_DIRECT, in which case nothing was sent.
+static off_t cache_policy_send_direct(const int client_sock, const int fd, const off_t size) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    const int direct_fd = open(path, O_RDONLY | O_DIRECT);
+    if(direct_fd == -1) {
+        printf("[Client_sock: %d] [O_DIRECT not available] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return -1;
+    }
+    void *buffer;
+    if(posix_memalign(&buffer, CACHE_POLICY_DIRECT_ALIGNMENT, CACHE_POLICY_DIRECT_CHUNK_SIZE) != 0) {
+        checked_close(direct_fd);
+        return -1;
+    }
+    off_t offset = 0;
+    while(offset < size) {
+        // The length stays aligned, the last read simply comes back short at the end of file.
+        const ssize_t nread = pread(direct_fd, buffer, CACHE_POLICY_DIRECT_CHUNK_SIZE, offset);
+        if(nread == -1 and offset == 0 and errno == EINVAL) {
+            printf("[Client_sock: %d] [O_DIRECT not available] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            offset = -1;
+            break;
+        }
+        if(nread <= 0) {
+            printf("[Client_sock: %d] [Failed to read direct] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            break;
+        }
+        const size_t count = (size_t)(nread < size - offset ? nread : size - offset);
+        if(not checked_write(client_sock, buffer, count, NULL)) {
+            printf("[Client_sock: %d] [Failed to send direct] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            break;
+        }
+        scoreboard_add_bytes_sent(count);
+        offset += (off_t)count;
+    }
+    free(buffer);
+    checked_close(direct_fd);
+    return offset;
+}
@@ -9,126 +9,915 @@
 #include <sys/stat.h> 
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <limits.h>
 #include "client_utils.h"
+#include "digest_cache.h"
+#include "delta.h"
+#include "compression.h"
+#include "tls.h"
+#include "shard.h"
+#include "hedge.h"
+#include "happy_eyeballs.h"
+#include "receive_engine.h"
+#include "multicast.h"
+#include <poll.h>
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
 typedef struct {
     const char *address;
     uint16_t port;
+    const char *unix_path;
     const char *filename;
     size_t max_file_size;
+    RequestOperation operation;
+    uint64_t range_offset;
+    uint64_t range_length;
+    const char *tls_ca;
+    ShardServers *shard;
+    const char *health_path;
+    uint32_t handshake_timeout_ms;
+    HedgeConfig hedge;
+    uint32_t attempt_delay_ms;
+    ReceiveEngine receive_engine;
+    bool is_preallocated;
+    size_t write_behind_window;
+    bool is_synced;
+    bool is_renamed;
+    uint32_t loss_percent;
 } ClientConfig;
 
+enum { DEFAULT_SHARD_HANDSHAKE_TIMEOUT_MS = 2000 };
+
 static void print_config(const ClientConfig *config) {
     printf("Client Configuration:\n");
-    printf("\tAddress: %s\n", config->address);
-    printf("\tPort: %d\n", config->port);
+    if(config->unix_path != NULL) {
+        printf("\tUnix Socket Path: %s\n", config->unix_path);
+    } else if(config->shard != NULL) {
+        printf("\tServers:");
+        for(size_t i = 0; i < config->shard->count; ++i) {
+            printf(" %s:%u", config->shard->servers[i].address, config->shard->servers[i].port);
+        }
+        printf("\n");
+        if(config->health_path != NULL) {
+            printf("\tHealth file: %s\n", config->health_path);
+        }
+        printf("\tHandshake timeout: %u ms\n", config->handshake_timeout_ms);
+        if(config->hedge.is_enabled and config->hedge.percentile != 0) {
+            printf("\tHedge after: p%u of recent response times\n", config->hedge.percentile);
+        } else if(config->hedge.is_enabled) {
+            printf("\tHedge after: %.1f ms\n", config->hedge.delay_ms);
+        }
+    } else {
+        printf("\tAddress: %s\n", config->address);
+        printf("\tPort: %d\n", config->port);
+        printf("\tConnection attempt delay: %u ms\n", config->attempt_delay_ms);
+        if(config->handshake_timeout_ms != 0) {
+            printf("\tHandshake timeout: %u ms\n", config->handshake_timeout_ms);
+        }
+        if(config->tls_ca != NULL) {
+            printf("\tTLS CA file: %s\n", config->tls_ca);
+        }
+    }
+    printf("\tReceive engine: %s\n", RECEIVE_ENGINE_NAMES[config->receive_engine]);
+    printf("\tOutput: %s%s%s", config->is_preallocated ? "preallocated, " : "", config->is_synced ? "fdatasync, " : "", config->is_renamed ? "atomic rename, " : "");
+    if(config->write_behind_window != 0) {
+        printf("write-behind every %zu MiB\n", config->write_behind_window >> 20);
+    } else {
+        printf("write-back left to the kernel\n");
+    }
     printf("\tFilename: %s\n", config->filename);
     printf("\tMaximum file size: %ld\n", config->max_file_size);
+    if(config->operation == RequestOperation_PUT) {
+        printf("\tOperation: upload\n");
+    } else if(config->operation == RequestOperation_GET_DIGEST) {
+        printf("\tOperation: verified download\n");
+    } else if(config->operation == RequestOperation_DIGEST_RANGE) {
+        printf("\tOperation: check range %lu:%lu\n", config->range_offset, config->range_length);
+    } else if(config->operation == RequestOperation_GET_DELTA) {
+        printf("\tOperation: delta update\n");
+    } else if(config->operation == RequestOperation_GET_COMPRESSED) {
+        printf("\tOperation: compressed download\n");
+    } else if(config->operation == RequestOperation_GET_MULTICAST) {
+        printf("\tOperation: multicast download, dropping %u%% of datagrams\n", config->loss_percent);
+    } else {
+        printf("\tOperation: download\n");
+    }
+}
+
+static void print_usage(const char *const program_name) {
+    fprintf(stderr,
+        "Usage: %s [-P | -V | -D | -Z | -M [-l <loss_percent>] | -R <offset>:<length>] [-E <engine>] [-A] [-W <MiB>] [-F] [-N] [-T <ca_file>] [-e <attempt_delay_ms>] [-t <handshake_timeout_ms>] <server_host> <server_port> <filename> <max_file_size>\n"
+        "       %s [-P | -V | -D | -Z | -M [-l <loss_percent>] | -R <offset>:<length>] [-E <engine>] [-A] [-W <MiB>] [-F] [-N] -u <unix_socket_path> <filename> <max_file_size>\n"
+        "       %s [-P | -V | -D | -Z | -M [-l <loss_percent>] | -R <offset>:<length>] [-E <engine>] [-A] [-W <MiB>] [-F] [-N] [-T <ca_file>] -s <ip:port>[,<ip:port>...] [-H <health_file>] [-t <handshake_timeout_ms>] [-h <delay_ms> | -h p<percentile>] <filename> <max_file_size>\n"
+        "  -P  upload <filename> from the current directory instead of downloading it\n"
+        "  -V  verify the downloaded file against the server's CRC32C digest\n"
+        "  -D  update the local <filename> in place, transferring only the blocks that changed\n"
+        "  -Z  let the server compress the file body, it is inflated while being received\n"
+        "  -E  how a plain download is received: auto, splice, mmap, zerocopy or uring, default auto\n"
+        "  -A  preallocate the downloaded file with fallocate before receiving it\n"
+        "  -W  start writeback of every <MiB> received and wait for the one before, bounding dirty memory\n"
+        "  -F  fdatasync the downloaded file before reporting it finished\n"
+        "  -N  download into <filename>.part and rename it over <filename> once complete\n"
+        "  -M  join the server's multicast session for <filename>, what is lost is fetched over TCP\n"
+        "  -l  drop this share of the multicast datagrams on arrival, for testing\n"
+        "  -T  connect over TLS, the server certificate must be signed by <ca_file> and match <server_host>\n"
+        "  -R  compare the digest of a byte range of the local <filename> with the server's copy\n"
+        "  -s  pick the server for <filename> by rendezvous hashing, failing over down the ranking\n"
+        "  -H  keep per-server latency and failures in <health_file>, slow or failing servers get fewer names\n"
+        "  -e  <server_host> may resolve to several IPv4 and IPv6 addresses, connects to them are raced\n"
+        "      with the next one starting this long after the previous, default 50\n"
+        "  -t  give up on a server that has not completed the handshake after this long, default 2000 with -s\n"
+        "  -h  send a download to the next server too if the first has not answered after this long,\n"
+        "      p<percentile> takes the delay from recent response times kept next to <health_file>\n",
+        program_name, program_name, program_name);
 }
 
 static ClientConfig handle_cmd_args(const int argc, char **argv) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <server_address> <server_port> <filename> <max_file_size>\n", argv[0]);
+    ClientConfig config = {
+        .address = NULL, .port = 0, .unix_path = NULL, .operation = RequestOperation_GET, .tls_ca = NULL,
+        .shard = NULL, .health_path = NULL, .handshake_timeout_ms = 0, .hedge = { .is_enabled = false },
+        .attempt_delay_ms = HAPPY_EYEBALLS_DEFAULT_ATTEMPT_DELAY_MS, .receive_engine = ReceiveEngine_AUTO,
+        .is_preallocated = false, .write_behind_window = 0, .is_synced = false, .is_renamed = false,
+        .loss_percent = 0
+    };
+    static ShardServers shard;
+    int opt;
+    while((opt = getopt(argc, argv, "u:PVDZMl:R:T:s:H:t:h:e:E:AW:FN")) != -1) {
+        switch(opt) {
+            case 'u': config.unix_path = optarg; break;
+            case 's': {
+                if(not shard_parse_servers(optarg, &shard)) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                config.shard = &shard;
+                config.handshake_timeout_ms = config.handshake_timeout_ms != 0 ? config.handshake_timeout_ms : DEFAULT_SHARD_HANDSHAKE_TIMEOUT_MS;
+                break;
+            }
+            case 'H': config.health_path = optarg; break;
+            case 'E': {
+                if(not receive_engine_parse(optarg, &config.receive_engine)) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            case 'e': {
+                config.attempt_delay_ms = (uint32_t)strtoul(optarg, NULL, 10);
+                if(config.attempt_delay_ms < HAPPY_EYEBALLS_MIN_ATTEMPT_DELAY_MS) {
+                    config.attempt_delay_ms = HAPPY_EYEBALLS_MIN_ATTEMPT_DELAY_MS;
+                }
+                break;
+            }
+            case 'h': {
+                if(not hedge_parse(optarg, &config.hedge)) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            case 'A': config.is_preallocated = true; break;
+            case 'W': config.write_behind_window = (size_t)strtoul(optarg, NULL, 10) << 20; break;
+            case 'F': config.is_synced = true; break;
+            case 'N': config.is_renamed = true; break;
+            case 't': config.handshake_timeout_ms = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'P': config.operation = RequestOperation_PUT; break;
+            case 'V': config.operation = RequestOperation_GET_DIGEST; break;
+            case 'D': config.operation = RequestOperation_GET_DELTA; break;
+            case 'Z': config.operation = RequestOperation_GET_COMPRESSED; break;
+            case 'M': config.operation = RequestOperation_GET_MULTICAST; break;
+            case 'l': config.loss_percent = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'T': config.tls_ca = optarg; break;
+            case 'R': {
+                config.operation = RequestOperation_DIGEST_RANGE;
+                if(sscanf(optarg, "%lu:%lu", &config.range_offset, &config.range_length) != 2) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            default: print_usage(argv[0]); exit(1);
+        }
+    }
+    const int expected_args = config.unix_path != NULL or config.shard != NULL ? 2 : 4;
+    if (argc - optind != expected_args or (config.unix_path != NULL and config.shard != NULL)) {
+        print_usage(argv[0]);
         exit(1);
     }
-    const ClientConfig config = {
-        .address = argv[1],
-        .port = (uint16_t)atoi(argv[2]),
-        .filename = argv[3],
-        .max_file_size = (uint64_t)atoi(argv[4])
-    };
+    // Only plain downloads are hedged: they are idempotent and the loser can be dropped before
+    // it sends the body, which is not true for uploads, deltas or a TLS relay.
+    const bool is_hedgeable = config.operation == RequestOperation_GET
+        or config.operation == RequestOperation_GET_DIGEST
+        or config.operation == RequestOperation_GET_COMPRESSED;
+    if(config.hedge.is_enabled and (config.shard == NULL or config.tls_ca != NULL or not is_hedgeable)) {
+        printf("[Hedging needs -s, no -T and a download]\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+    if(config.operation == RequestOperation_GET_MULTICAST and (config.tls_ca != NULL or config.unix_path != NULL)) {
+        printf("[Multicast needs a plain TCP server]\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+    if(config.unix_path == NULL and config.shard == NULL) {
+        config.address = argv[optind++];
+        config.port = (uint16_t)atoi(argv[optind++]);
+    }
+    config.filename = argv[optind];
+    config.max_file_size = strtoull(argv[optind + 1], NULL, 10);
     print_config(&config);
     return config;
 }
 
-static void receive_file(
+static double elapsed_ms(const struct timespec *const start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e3 + (double)(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static double cpu_seconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Every engine leaves the socket untouched when it turns out to be unsupported, so auto moves on
+// to the next one on the same connection.
+static bool receive_file(const ReceiveEngine engine, const int sock, const size_t file_size, const int file_fd, WriteBehind *const write_behind) {
+    printf("[Started receiving file file]\n");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const double cpu_start = cpu_seconds();
+    ReceiveResult result = ReceiveResult_UNSUPPORTED;
+    ReceiveEngine used = engine;
+    if(engine == ReceiveEngine_AUTO) {
+        const size_t engine_count = ARRAY_SIZE(RECEIVE_ENGINE_AUTO_ORDER);
+        for(size_t i = 0; i < engine_count and result == ReceiveResult_UNSUPPORTED; ++i) {
+            used = RECEIVE_ENGINE_AUTO_ORDER[i];
+            result = receive_with(used, sock, file_size, file_fd, write_behind);
+        }
+    } else {
+        result = receive_with(engine, sock, file_size, file_fd, write_behind);
+    }
+    if(result == ReceiveResult_UNSUPPORTED) {
+        printf("[Receive engine %s is not supported here]\n", RECEIVE_ENGINE_NAMES[used]);
+        return false;
+    }
+    if(result != ReceiveResult_DONE) {
+        return false;
+    }
+    const double seconds = elapsed_ms(&start) / 1e3;
+    const double gigabytes = (double)file_size / 1e9;
+    printf("[Finished receiving file file] [engine: %s] [seconds: %.3f] [GB/s: %.2f] [cpu_s_per_GB: %.3f]\n",
+        RECEIVE_ENGINE_NAMES[used], seconds, seconds > 0 ? gigabytes / seconds : 0, gigabytes > 0 ? (cpu_seconds() - cpu_start) / gigabytes : 0);
+    return true;
+}
+
+static bool report_digest(const uint32_t expected_digest, const uint32_t digest) {
+    if(digest == expected_digest) {
+        printf("[Digest verified: %08x]\n", digest);
+        return true;
+    }
+    printf("[Digest mismatch] [expected: %08x] [actual: %08x]\n", expected_digest, digest);
+    return false;
+}
+
+// Verified downloads go through user space so every block is hashed as it arrives,
+// instead of re-reading the file after the transfer.
+static bool receive_file_verified(
     const int sock,
     const size_t file_size,
-    const int pipe_in,
-    const int pipe_out,
-    const int file_fd
+    const int file_fd,
+    const uint32_t expected_digest,
+    WriteBehind *const write_behind
 ) {
-    printf("[Started receiving file file]\n");
+    printf("[Started receiving verified file]\n");
+    enum { RECEIVE_BUFFER_SIZE = 1 << 17 };
+    uint8_t *const buffer = malloc(RECEIVE_BUFFER_SIZE);
+    uint32_t digest = 0;
     size_t nread = 0;
-    off_t write_offset = 0;
-    while((size_t)write_offset < file_size) {
-        {
-            const ssize_t local_read = splice(sock, NULL, pipe_out, NULL, file_size - nread, 0);
-            if(local_read < 0) {
-                printf("[Failed to read splice] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    while(nread < file_size) {
+        const ssize_t local_read = recv(sock, buffer, MIN(file_size - nread, RECEIVE_BUFFER_SIZE), 0);
+        if(local_read < 0 and errno == EINTR) {
+            continue;
+        } else if(local_read <= 0) {
+            break;
+        }
+        digest = crc32c_update(digest, buffer, (size_t)local_read);
+        if(not checked_write(file_fd, buffer, (size_t)local_read, NULL)) {
+            printf("[Failed to write file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            break;
+        }
+        nread += (size_t)local_read;
+        write_behind_advance(write_behind, (off_t)nread);
+    }
+    free(buffer);
+    if(nread != file_size) {
+        printf("[Incomplete file] [received: %lu] [expected: %lu]\n", nread, file_size);
+        return false;
+    }
+    return report_digest(expected_digest, digest);
+}
+
+// Inflates the body as it arrives, the uncompressed file never has to fit in memory.
+static bool receive_file_inflated(
+    const int sock,
+    const uint64_t body_size,
+    const size_t file_size,
+    const int file_fd,
+    WriteBehind *const write_behind
+) {
+    printf("[Started receiving compressed file] [body size: %lu]\n", body_size);
+    z_stream stream = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+    if(inflateInit(&stream) != Z_OK) {
+        printf("[Failed to initialize inflate]\n");
+        return false;
+    }
+    uint8_t *const in = malloc(COMPRESSION_CHUNK_SIZE);
+    uint8_t *const out = malloc(COMPRESSION_CHUNK_SIZE);
+    uint64_t nread = 0;
+    size_t nwritten = 0;
+    int status = Z_OK;
+    while(nread < body_size and status == Z_OK) {
+        const ssize_t local_read = recv(sock, in, MIN(body_size - nread, COMPRESSION_CHUNK_SIZE), 0);
+        if(local_read < 0 and errno == EINTR) {
+            continue;
+        } else if(local_read <= 0) {
+            break;
+        }
+        nread += (uint64_t)local_read;
+        stream.next_in = in;
+        stream.avail_in = (uInt)local_read;
+        do {
+            stream.next_out = out;
+            stream.avail_out = COMPRESSION_CHUNK_SIZE;
+            status = inflate(&stream, Z_NO_FLUSH);
+            if(status != Z_OK and status != Z_STREAM_END and status != Z_BUF_ERROR) {
                 break;
             }
-            nread += (size_t)local_read;
-        }
-        {
-            const ssize_t local_write = splice(pipe_in, NULL, file_fd, &write_offset, file_size - (size_t)write_offset, 0);
-            if(local_write < 0) {
-                printf("[Failed to write splice] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            const size_t produced = COMPRESSION_CHUNK_SIZE - stream.avail_out;
+            if(not checked_write(file_fd, out, produced, NULL)) {
+                printf("[Failed to write file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+                status = Z_ERRNO;
                 break;
             }
+            nwritten += produced;
+            write_behind_advance(write_behind, (off_t)nwritten);
+        } while(stream.avail_out == 0 and status == Z_OK);
+        if(status == Z_BUF_ERROR) {
+            status = Z_OK;
         }
     }
-    printf("[Finished receiving file file]\n");
+    inflateEnd(&stream);
+    free(in);
+    free(out);
+    if(status != Z_STREAM_END or nwritten != file_size) {
+        printf("[Incomplete file] [status: %d] [received: %lu] [expected: %lu]\n", status, nwritten, file_size);
+        return false;
+    }
+    printf("[Finished receiving compressed file] [transferred: %lu] [file size: %lu]\n", body_size, file_size);
+    return true;
 }
 
-static void main_logic(const ClientConfig *const config, const int sock) {
-    {
-        struct sockaddr_in server_addr;
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(config->port);
-        if (inet_pton(AF_INET, config->address, &server_addr.sin_addr) <= 0) {
-            printf("[Failed inet_pton] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+// Co-located servers hand over their read-only descriptor instead of streaming the body,
+// copy_file_range lets the filesystem reflink or copy in-kernel.
+static bool receive_shared_file(
+    const int sock,
+    const size_t file_size,
+    const int file_fd
+) {
+    printf("[Started receiving shared file]\n");
+    int shared_fd;
+    if(not checked_receive_fd(sock, &shared_fd)) {
+        printf("[Failed to receive file descriptor] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return false;
+    }
+    off_t read_offset = 0;
+    while((size_t)read_offset < file_size) {
+        ssize_t ncopy = copy_file_range(shared_fd, &read_offset, file_fd, NULL, file_size - (size_t)read_offset, 0);
+        if(ncopy < 0 and (errno == EXDEV or errno == EINVAL or errno == EOPNOTSUPP or errno == ENOSYS)) {
+            ncopy = sendfile(file_fd, shared_fd, &read_offset, file_size - (size_t)read_offset);
         }
-        if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-            printf("[Connection failed] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+        if(ncopy < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            printf("[Failed to copy shared file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            break;
+        } else if(ncopy == 0) {
+            break;
         }
     }
-    const size_t file_size = ({
-        const uint8_t protocol_version = PROTOCOL_VERSION;
-        if(not checked_write(sock, &protocol_version, sizeof(protocol_version), NULL)) {
-            printf("[Failed to send protocol version] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+    if(not checked_close(shared_fd)) {
+        printf("[Failed to close shared file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    if((size_t)read_offset != file_size) {
+        printf("[Incomplete file] [received: %ld] [expected: %lu]\n", read_offset, file_size);
+        return false;
+    }
+    printf("[Finished receiving shared file]\n");
+    return true;
+}
+
+static void check_range_digest(const ClientConfig *const config, const int sock) {
+    const int file_fd = open(config->filename, O_RDONLY);
+    if(file_fd < 0) {
+        printf("[Failed to open file for reading] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if(fstat(file_fd, &st) == -1) {
+        printf("[Failed to stat local file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        checked_close(file_fd);
+        return;
+    }
+    if(config->range_offset > (uint64_t)st.st_size or config->range_length > (uint64_t)st.st_size - config->range_offset) {
+        printf("[Range beyond local file] [offset: %lu] [length: %lu] [file_size: %ld]\n", config->range_offset, config->range_length, st.st_size);
+        checked_close(file_fd);
+        return;
+    }
+    uint32_t local_digest;
+    const bool is_local_ok = mapped_range_digest(file_fd, (off_t)config->range_offset, (off_t)config->range_length, &local_digest);
+    checked_close(file_fd);
+    if(not is_local_ok) {
+        printf("[Failed to hash local range] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return;
+    }
+    const uint64_t range[2] = { htobe64(config->range_offset), htobe64(config->range_length) };
+    if(not checked_write(sock, range, sizeof(range), NULL)) {
+        printf("[Failed to send digest range] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return;
+    }
+    bool is_range_ok;
+    uint32_t network_digest;
+    if(not checked_read(sock, &is_range_ok, sizeof(is_range_ok), NULL) or not is_range_ok
+        or not checked_read(sock, &network_digest, sizeof(network_digest), NULL)) {
+        printf("[Server can not hash range]\n");
+        return;
+    }
+    report_digest(ntohl(network_digest), local_digest);
+}
+
+static void upload_file(const ClientConfig *const config, const int sock) {
+    const int file_fd = open(config->filename, O_RDONLY);
+    if(file_fd < 0) {
+        printf("[Failed to open file for reading] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if(fstat(file_fd, &st) == -1 or (size_t)st.st_size > config->max_file_size) {
+        printf("[Local file can not be uploaded] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        checked_close(file_fd);
+        return;
+    }
+    const uint64_t network_file_size = htobe64((uint64_t)st.st_size);
+    if(not checked_write(sock, &network_file_size, sizeof(network_file_size), NULL)) {
+        printf("[Failed to send upload size] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        checked_close(file_fd);
+        return;
+    }
+    bool is_upload_possible;
+    if(not checked_read(sock, &is_upload_possible, sizeof(is_upload_possible), NULL) or not is_upload_possible) {
+        printf("[Server refused upload]\n");
+        checked_close(file_fd);
+        return;
+    }
+    printf("[Started sending file] [file_size: %ld]\n", st.st_size);
+    off_t offset = 0;
+    while(offset < st.st_size) {
+        const ssize_t nsendfile = sendfile(sock, file_fd, &offset, (size_t)(st.st_size - offset));
+        if(nsendfile <= 0) {
+            printf("[Failed to sendfile] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            break;
         }
-        printf("[Written protocol version: %d]\n", PROTOCOL_VERSION);
-        {
-            bool is_protocol_version_ok;
-            if(not checked_read(sock, &is_protocol_version_ok, sizeof(is_protocol_version_ok), NULL)) {
-                printf("[Failed to receive protocol version ok] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-                return;
+    }
+    checked_close(file_fd);
+    bool is_committed = false;
+    if(offset == st.st_size and not checked_read(sock, &is_committed, sizeof(is_committed), NULL)) {
+        printf("[Failed to receive upload commit] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    printf("[Finished sending file] [committed: %d]\n", is_committed);
+}
+
+static bool pwrite_all(const int fd, const uint8_t *buffer, size_t count, off_t offset) {
+    while(count > 0) {
+        const ssize_t nwrite = pwrite(fd, buffer, count, offset);
+        if(nwrite < 0) {
+            if(errno == EINTR) {
+                continue;
             }
-            if(not is_protocol_version_ok) {
-                printf("[Protocol version mismatch]\n");
-                return;
+            return false;
+        }
+        buffer += nwrite;
+        count -= (size_t)nwrite;
+        offset += nwrite;
+    }
+    return true;
+}
+
+// Every full block of the local copy is described by its rolling and CRC32C checksums.
+static BlockSignature *compute_block_signatures(const int file_fd, const off_t file_size, const uint32_t block_size, uint64_t *const block_count) {
+    *block_count = (uint64_t)file_size / block_size;
+    BlockSignature *const signatures = malloc((*block_count + 1) * sizeof(*signatures));
+    if(*block_count == 0) {
+        return signatures;
+    }
+    const uint8_t *const data = mmap(NULL, (size_t)file_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+    if(data == MAP_FAILED) {
+        free(signatures);
+        return NULL;
+    }
+    madvise((void *)(uintptr_t)data, (size_t)file_size, MADV_SEQUENTIAL);
+    for(uint64_t i = 0; i < *block_count; ++i) {
+        const uint8_t *const block = data + i * block_size;
+        RollingChecksum rc;
+        RollingChecksum_init(&rc, block, block_size);
+        signatures[i].weak = htonl(RollingChecksum_digest(&rc));
+        signatures[i].strong = htonl(crc32c_update(0, block, block_size));
+    }
+    munmap((void *)(uintptr_t)data, (size_t)file_size);
+    return signatures;
+}
+
+// Applies the server's instructions on top of the local file. Copies never read behind
+// the output offset, so blocks that stayed in place are skipped and moved ones are copied forward.
+static bool apply_delta(const int sock, const int file_fd, const uint32_t block_size, const uint64_t block_count, uint64_t *const literal_bytes) {
+    uint8_t *const buffer = malloc(DELTA_MAX_LITERAL);
+    off_t output_offset = 0;
+    *literal_bytes = 0;
+    bool is_ok = false;
+    while(true) {
+        DeltaInstruction instruction;
+        if(not delta_read(sock, &instruction, sizeof(instruction))) {
+            printf("[Failed to receive delta instruction] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            break;
+        }
+        const uint32_t length = ntohl(instruction.length);
+        const uint64_t value = be64toh(instruction.value);
+        if(instruction.type == DeltaInstructionType_LITERAL) {
+            if(length > DELTA_MAX_LITERAL
+                or not delta_read(sock, buffer, length)
+                or not pwrite_all(file_fd, buffer, length, output_offset)) {
+                printf("[Failed to apply literal] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+                break;
+            }
+            *literal_bytes += length;
+            output_offset += length;
+        } else if(instruction.type == DeltaInstructionType_COPY) {
+            const off_t source_offset = (off_t)(value * block_size);
+            if(length % block_size != 0 or value + length / block_size > block_count or source_offset < output_offset) {
+                printf("[Invalid copy instruction] [block: %lu] [length: %u]\n", value, length);
+                break;
+            }
+            bool is_copied = true;
+            for(off_t done = 0; source_offset != output_offset and done < (off_t)length;) {
+                const size_t chunk = MIN((size_t)length - (size_t)done, DELTA_MAX_LITERAL);
+                if(pread(file_fd, buffer, chunk, source_offset + done) != (ssize_t)chunk
+                    or not pwrite_all(file_fd, buffer, chunk, output_offset + done)) {
+                    is_copied = false;
+                    break;
+                }
+                done += (off_t)chunk;
+            }
+            if(not is_copied) {
+                printf("[Failed to copy blocks] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+                break;
             }
-            printf("[Protocol version match]\n");
+            output_offset += length;
+        } else if(instruction.type == DeltaInstructionType_END) {
+            uint32_t digest = 0;
+            if(value != (uint64_t)output_offset or ftruncate(file_fd, output_offset) == -1
+                or not file_range_digest(file_fd, 0, output_offset, &digest)) {
+                printf("[Failed to finish delta] [expected size: %lu] [size: %ld] [errno: %d] [strerror: %s]\n", value, output_offset, errno, strerror(errno));
+                break;
+            }
+            report_digest(length, digest);
+            is_ok = digest == length;
+            break;
+        } else {
+            printf("[Unknown delta instruction: %d]\n", instruction.type);
+            break;
+        }
+    }
+    free(buffer);
+    return is_ok;
+}
+
+static void update_file_delta(const ClientConfig *const config, const int sock) {
+    const int file_fd = open(config->filename, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if(file_fd < 0 or fstat(file_fd, &st) == -1) {
+        printf("[Failed to open local file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return;
+    }
+    const uint32_t block_size = delta_block_size((uint64_t)st.st_size);
+    uint64_t block_count;
+    BlockSignature *const signatures = compute_block_signatures(file_fd, st.st_size, block_size, &block_count);
+    if(signatures == NULL) {
+        printf("[Failed to compute block signatures] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        checked_close(file_fd);
+        return;
+    }
+    const DeltaHeader header = { .block_size = htonl(block_size), .block_count = htobe64(block_count) };
+    bool is_delta_ok = false;
+    uint64_t network_file_size;
+    if(not checked_write(sock, &header, sizeof(header), NULL)
+        or not delta_read(sock, &is_delta_ok, sizeof(is_delta_ok)) or not is_delta_ok
+        or not delta_read(sock, &network_file_size, sizeof(network_file_size))) {
+        printf("[Server refused delta] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        free(signatures);
+        checked_close(file_fd);
+        return;
+    }
+    const uint64_t file_size = be64toh(network_file_size);
+    const bool is_client_ready = file_size <= config->max_file_size;
+    if(not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL) or not is_client_ready) {
+        printf("[File size is not ok] [file size: %lu]\n", file_size);
+        free(signatures);
+        checked_close(file_fd);
+        return;
+    }
+    printf("[Sending block signatures] [block size: %u] [block count: %lu]\n", block_size, block_count);
+    const bool is_sent = checked_write(sock, signatures, block_count * sizeof(*signatures), NULL);
+    free(signatures);
+    uint64_t literal_bytes = 0;
+    if(not is_sent) {
+        printf("[Failed to send block signatures] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    } else if(apply_delta(sock, file_fd, block_size, block_count, &literal_bytes)) {
+        printf("[Finished delta update] [file size: %lu] [literal bytes: %lu] [bytes saved: %lu]\n",
+            file_size, literal_bytes, file_size - literal_bytes);
+    }
+    checked_close(file_fd);
+}
+
+static bool exchange_protocol_version(const int sock) {
+    const uint8_t protocol_version = PROTOCOL_VERSION;
+    if(not checked_write(sock, &protocol_version, sizeof(protocol_version), NULL)) {
+        printf("[Failed to send protocol version] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return false;
+    }
+    printf("[Written protocol version: %d]\n", PROTOCOL_VERSION);
+    bool is_protocol_version_ok;
+    if(not checked_read(sock, &is_protocol_version_ok, sizeof(is_protocol_version_ok), NULL)) {
+        printf("[Failed to receive protocol version ok] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return false;
+    }
+    if(not is_protocol_version_ok) {
+        printf("[Protocol version mismatch]\n");
+        return false;
+    }
+    printf("[Protocol version match]\n");
+    return true;
+}
+
+// Runs once the protocol version was agreed on.
+static bool send_request(const ClientConfig *const config, const int sock) {
+    const uint8_t operation = (uint8_t)config->operation;
+    if(not checked_write(sock, &operation, sizeof(operation), NULL)) {
+        printf("[Failed to send operation] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return false;
+    }
+    filename_buff_t filename_buffer;
+    strncpy(filename_buffer, config->filename, ARRAY_SIZE(filename_buffer));
+    if(not checked_write(sock, filename_buffer, ARRAY_SIZE(filename_buffer), NULL)) {
+        printf("[Failed to send filename buffer] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return false;
+    }
+    if(config->operation == RequestOperation_GET_COMPRESSED) {
+        const uint8_t codec_mask = COMPRESSION_CODEC_MASK_DEFLATE;
+        if(not checked_write(sock, &codec_mask, sizeof(codec_mask), NULL)) {
+            printf("[Failed to send codec mask] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+// The rename is only durable once the directory entry is, so -F syncs the directory as well.
+static bool sync_parent_directory(const char *const path) {
+    char directory[PATH_MAX];
+    const char *const slash = strrchr(path, '/');
+    if(slash == NULL) {
+        strcpy(directory, ".");
+    } else {
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path) + (slash == path), path);
+    }
+    const int directory_fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if(directory_fd < 0) {
+        return false;
+    }
+    const bool is_synced = fsync(directory_fd) == 0;
+    checked_close(directory_fd);
+    return is_synced;
+}
+
+// Reports how long the file took to settle after its last byte arrived, which is where a
+// writeback backlog shows up. A download that did not complete never replaces <filename>.
+static bool finish_download(const ClientConfig *const config, const int file_fd, bool is_received, const char *const part_path) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(is_received and config->is_synced and fdatasync(file_fd) == -1) {
+        printf("[Failed to fdatasync file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        is_received = false;
+    }
+    if(not checked_close(file_fd)) {
+        printf("[Failed to close file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        is_received = false;
+    }
+    if(config->is_renamed) {
+        if(not is_received) {
+            unlink(part_path);
+        } else if(rename(part_path, config->filename) == -1) {
+            printf("[Failed to rename %s] [errno: %d] [strerror: %s]\n", part_path, errno, strerror(errno));
+            unlink(part_path);
+            is_received = false;
+        } else if(config->is_synced and not sync_parent_directory(config->filename)) {
+            printf("[Failed to sync directory] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        }
+    }
+    if(is_received) {
+        printf("[Output settled] [after_last_byte_ms: %.1f] [synced: %d] [renamed: %d]\n",
+            elapsed_ms(&start), config->is_synced, config->is_renamed);
+    }
+    return is_received;
+}
+
+static int connect_server(const ClientConfig *const config);
+
+// Opens the connection the lost blocks are fetched over, one GET_RANGE request carries them all.
+static int open_range_request(const ClientConfig *const config) {
+    const int sock = connect_server(config);
+    if(sock == -1) {
+        return -1;
+    }
+    const uint8_t operation = RequestOperation_GET_RANGE;
+    filename_buff_t filename_buffer;
+    strncpy(filename_buffer, config->filename, ARRAY_SIZE(filename_buffer));
+    if(not exchange_protocol_version(sock)
+        or not checked_write(sock, &operation, sizeof(operation), NULL)
+        or not checked_write(sock, filename_buffer, ARRAY_SIZE(filename_buffer), NULL)) {
+        printf("[Failed to request ranges] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        checked_close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Fetches one byte range, a zero length tells the server there are no more.
+static bool fetch_range(const int sock, const int file_fd, const uint64_t offset, const uint64_t length) {
+    const uint64_t range[2] = { htobe64(offset), htobe64(length) };
+    bool is_range_ok = false;
+    if(not checked_write(sock, range, sizeof(range), NULL) or length == 0) {
+        return length == 0;
+    }
+    if(not checked_read(sock, &is_range_ok, sizeof(is_range_ok), NULL) or not is_range_ok) {
+        printf("[Failed to fetch range] [offset: %lu] [length: %lu] [errno: %d] [strerror: %s]\n", offset, length, errno, strerror(errno));
+        return false;
+    }
+    uint8_t buffer[1 << 16];
+    uint64_t received = 0;
+    while(received < length) {
+        const ssize_t local_read = recv(sock, buffer, MIN(length - received, sizeof(buffer)), 0);
+        if(local_read <= 0 or not pwrite_all(file_fd, buffer, (size_t)local_read, (off_t)(offset + received))) {
+            printf("[Failed to receive range] [offset: %lu] [length: %lu] [errno: %d] [strerror: %s]\n", offset, length, errno, strerror(errno));
+            return false;
+        }
+        received += (uint64_t)local_read;
+    }
+    return true;
+}
+
+// Receives the announced session, then fills in whatever FEC could not repair with one range
+// request per run of missing blocks.
+static void receive_multicast(const ClientConfig *const config, const int sock) {
+    bool is_file_size_ok;
+    if(not checked_read(sock, &is_file_size_ok, sizeof(is_file_size_ok), NULL) or not is_file_size_ok) {
+        printf("[Server offers no multicast session] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return;
+    }
+    uint64_t file_size;
+    MulticastAnnouncement announcement;
+    if(not checked_read(sock, &file_size, sizeof(file_size), NULL) or not checked_read(sock, &announcement, sizeof(announcement), NULL)) {
+        printf("[Failed to receive multicast announcement] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return;
+    }
+    file_size = be64toh(file_size);
+    char group[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &announcement.group_address, group, sizeof(group));
+    printf("[File size: %lu] [Multicast session %u on %s:%u] [starts in: %u ms]\n",
+        file_size, ntohl(announcement.session_id), group, ntohs(announcement.port), ntohl(announcement.start_in_ms));
+    char part_path[PATH_MAX];
+    const char *const output_path = config->is_renamed ? part_path : config->filename;
+    snprintf(part_path, sizeof(part_path), "%s.part", config->filename);
+    const bool is_block_size_ok = ntohs(announcement.block_size) == MULTICAST_BLOCK_SIZE and announcement.fec_group <= MULTICAST_FEC_GROUP;
+    const int udp_sock = file_size <= config->max_file_size and is_block_size_ok ? multicast_open_receiver(&announcement, sock) : -1;
+    if(udp_sock == -1) {
+        printf("[Can not join multicast session] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    const int file_fd = udp_sock != -1 ? open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+    const bool is_client_ready = file_fd != -1 and ftruncate(file_fd, (off_t)file_size) != -1;
+    if(not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL) or not is_client_ready) {
+        printf("[Failed to get ready for multicast] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        if(udp_sock != -1) {
+            checked_close(udp_sock);
+        }
+        if(file_fd != -1) {
+            finish_download(config, file_fd, false, part_path);
+        }
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const uint64_t block_count = multicast_block_count(file_size, MULTICAST_BLOCK_SIZE);
+    uint8_t *const have = calloc(block_count + 1, 1);
+    MulticastReceiveStats stats = { 0 };
+    multicast_receive(udp_sock, &announcement, file_size, file_fd, config->loss_percent, have, &stats);
+    checked_close(udp_sock);
+    const double multicast_ms = elapsed_ms(&start);
+    uint64_t repaired_blocks = 0;
+    uint64_t repaired_ranges = 0;
+    int range_sock = -2;
+    bool is_complete = true;
+    for(uint64_t block = 0; block < block_count and is_complete;) {
+        if(have[block]) {
+            ++block;
+            continue;
         }
-        filename_buff_t filename_buffer;
-        strncpy(filename_buffer, config->filename, ARRAY_SIZE(filename_buffer));
-        if(not checked_write(sock, filename_buffer, ARRAY_SIZE(filename_buffer), NULL)) {
-            printf("[Failed to send filename buffer] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+        uint64_t end = block;
+        while(end < block_count and not have[end]) {
+            ++end;
         }
+        const uint64_t offset = block * MULTICAST_BLOCK_SIZE;
+        const uint64_t length = MIN(end * MULTICAST_BLOCK_SIZE, file_size) - offset;
+        range_sock = range_sock == -2 ? open_range_request(config) : range_sock;
+        is_complete = range_sock != -1 and fetch_range(range_sock, file_fd, offset, length);
+        repaired_blocks += end - block;
+        ++repaired_ranges;
+        block = end;
+    }
+    if(range_sock >= 0) {
+        is_complete = fetch_range(range_sock, file_fd, 0, 0) and is_complete;
+        checked_close(range_sock);
+    }
+    free(have);
+    printf("[Multicast finished] [datagrams: %lu] [dropped: %lu] [blocks: %lu/%lu] [recovered by FEC: %lu] [repaired over TCP: %lu blocks in %lu ranges] "
+        "[multicast_ms: %.1f] [total_ms: %.1f] [complete: %d]\n",
+        stats.datagrams, stats.dropped, stats.blocks, block_count, stats.recovered, repaired_blocks, repaired_ranges, multicast_ms, elapsed_ms(&start), is_complete);
+    finish_download(config, file_fd, is_complete, part_path);
+}
+
+// Receives the answer to a plain, digest or compressed download, false unless the file was
+// received and settled in place.
+static bool receive_download(const ClientConfig *const config, const int sock) {
+    const size_t file_size = ({
         {
             bool is_file_size_ok;
             if(not checked_read(sock, &is_file_size_ok, sizeof(is_file_size_ok), NULL)) {
                 printf("[Failed to receive is_file_size_ok] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-                return;
+                return false;
             }
             if(not is_file_size_ok) {
                 printf("[File size is not ok]\n");
-                return;
+                return false;
             }
         }
         size_t file_size;
         if(not checked_read(sock, &file_size, sizeof(file_size), NULL)) {
             printf("[Failed to receive file size] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+            return false;
         }
         be64toh(file_size);
     });
     printf("[File size: %ld]\n", file_size);    
+    uint8_t codec = CompressionCodec_NONE;
+    uint64_t body_size = file_size;
+    if(config->operation == RequestOperation_GET_COMPRESSED) {
+        if(not checked_read(sock, &codec, sizeof(codec), NULL)
+            or not checked_read(sock, &body_size, sizeof(body_size), NULL)) {
+            printf("[Failed to receive codec] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            return false;
+        }
+        body_size = be64toh(body_size);
+        printf("[Codec: %d] [Body size: %lu]\n", codec, body_size);
+        if(codec != CompressionCodec_NONE and codec != CompressionCodec_DEFLATE) {
+            printf("[Unsupported codec: %d]\n", codec);
+            return false;
+        }
+    }
+    uint32_t expected_digest = 0;
+    if(config->operation == RequestOperation_GET_DIGEST) {
+        if(not checked_read(sock, &expected_digest, sizeof(expected_digest), NULL)) {
+            printf("[Failed to receive digest] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            return false;
+        }
+        expected_digest = ntohl(expected_digest);
+    }
     {
         const bool is_client_ready = file_size <= config->max_file_size;
         if(not is_client_ready) {
@@ -136,52 +925,374 @@ static void main_logic(const ClientConfig *const config, const int sock) {
             if(not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
                 printf("[Failed to send is_client_ready: %d] [errno: %d] [strerror: %s]\n", is_client_ready, errno, strerror(errno));
             }
-            return;
+            return false;
         }
     }
-    int pipefd[2];
-    if(pipe(pipefd) < 0) {
-        printf("[Can not create pipe] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    char part_path[PATH_MAX];
+    const char *const output_path = config->is_renamed ? part_path : config->filename;
+    snprintf(part_path, sizeof(part_path), "%s.part", config->filename);
+    const int file_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(file_fd < 0) {
         const bool is_client_ready = false;
+        printf("[Failed to open file for writing] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
         if(not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
             printf("[Failed to send is_client_ready: %d] [errno: %d] [strerror: %s]\n", is_client_ready, errno, strerror(errno));
         }
+        return false;
+    }
+    // Reserving the blocks up front fails early on a full disk and keeps the file contiguous.
+    if(config->is_preallocated and file_size > 0 and fallocate(file_fd, 0, 0, (off_t)file_size) == -1) {
+        printf("[Failed to preallocate file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    WriteBehind write_behind = write_behind_create(file_fd, config->write_behind_window);
+    bool is_received = false;
+    const bool is_client_ready = true;
+    if(not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
+        printf("[Failed to send is_client_ready: %d] [errno: %d] [strerror: %s]\n", is_client_ready, errno, strerror(errno));
     } else {
-        const int file_fd = open(config->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if(file_fd < 0) {
-            const bool is_client_ready = false;
-            printf("[Failed to open file for writing] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            if(not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
-                printf("[Failed to send is_client_ready: %d] [errno: %d] [strerror: %s]\n", is_client_ready, errno, strerror(errno));
+        if(codec == CompressionCodec_DEFLATE) {
+            is_received = receive_file_inflated(sock, body_size, file_size, file_fd, &write_behind);
+        } else if(config->unix_path != NULL) {
+            is_received = receive_shared_file(sock, file_size, file_fd);
+            if(is_received and config->operation == RequestOperation_GET_DIGEST) {
+                uint32_t digest;
+                is_received = file_range_digest(file_fd, 0, (off_t)file_size, &digest) and report_digest(expected_digest, digest);
             }
+        } else if(config->operation == RequestOperation_GET_DIGEST) {
+            is_received = receive_file_verified(sock, file_size, file_fd, expected_digest, &write_behind);
         } else {
-            const bool is_client_ready = true;
-            if(not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
-                printf("[Failed to send is_client_ready: %d] [errno: %d] [strerror: %s]\n", is_client_ready, errno, strerror(errno));
-            } else {
-                receive_file(sock, file_size, pipefd[0], pipefd[1], file_fd);
+            is_received = receive_file(config->receive_engine, sock, file_size, file_fd, &write_behind);
+        }
+    }
+    return finish_download(config, file_fd, is_received, part_path);
+}
+
+static void receive_response(const ClientConfig *const config, const int sock) {
+    if(config->operation == RequestOperation_PUT) {
+        upload_file(config, sock);
+    } else if(config->operation == RequestOperation_DIGEST_RANGE) {
+        check_range_digest(config, sock);
+    } else if(config->operation == RequestOperation_GET_DELTA) {
+        update_file_delta(config, sock);
+    } else if(config->operation == RequestOperation_GET_MULTICAST) {
+        receive_multicast(config, sock);
+    } else {
+        receive_download(config, sock);
+    }
+}
+
+static void run_request(const ClientConfig *const config, const int sock) {
+    if(send_request(config, sock)) {
+        receive_response(config, sock);
+    }
+}
+
+static void set_socket_timeout(const int sock, const uint32_t timeout_ms) {
+    const struct timeval timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+        or setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+        printf("[Failed to set socket timeout] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+}
+
+static int connect_unix(const char *const unix_path) {
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    struct sockaddr_un server_addr = { .sun_family = AF_UNIX };
+    strncpy(server_addr.sun_path, unix_path, ARRAY_SIZE(server_addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        printf("[Connection failed] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        checked_close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// With a cached cookie connect returns at once and the first write goes out in the SYN.
+// That would make every raced attempt look connected, so only a lone address uses it.
+static int connect_single(const struct sockaddr_storage *const address, const socklen_t length, const uint32_t timeout_ms) {
+    const int sock = socket(address->ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if(sock == -1) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    set_socket_timeout(sock, timeout_ms);
+    const int is_fastopen = 1;
+    if(setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &is_fastopen, sizeof(is_fastopen)) == -1) {
+        printf("[Failed to set TCP_FASTOPEN_CONNECT] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    if (connect(sock, (const struct sockaddr *)address, length) < 0) {
+        printf("[Connection failed] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        checked_close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Returns a connected socket with the handshake timeout applied, or -1.
+static int connect_server(const ClientConfig *const config) {
+    if(config->unix_path != NULL) {
+        const int sock = connect_unix(config->unix_path);
+        if(sock != -1) {
+            set_socket_timeout(sock, config->handshake_timeout_ms);
+        }
+        return sock;
+    }
+    HappyEyeballsTargets targets;
+    if(not happy_eyeballs_resolve(config->address, config->port, &targets)) {
+        return -1;
+    }
+    if(targets.count == 1) {
+        return connect_single(&targets.addresses[0], targets.lengths[0], config->handshake_timeout_ms);
+    }
+    const int sock = happy_eyeballs_connect(&targets, config->attempt_delay_ms, config->handshake_timeout_ms);
+    if(sock != -1) {
+        set_socket_timeout(sock, config->handshake_timeout_ms);
+    }
+    return sock;
+}
+
+// Returns false if the server could not be reached or did not agree on the protocol, the
+// request then never started and another server can be tried. handshake_ms is the time
+// until the protocol version was agreed on. The timeout bounds connect and handshake only.
+static bool run_connected(const ClientConfig *const config, const int sock, const struct timespec *const start, double *const handshake_ms) {
+    if(config->tls_ca == NULL or config->unix_path != NULL) {
+        if(not exchange_protocol_version(sock)) {
+            return false;
+        }
+        *handshake_ms = elapsed_ms(start);
+        if(config->handshake_timeout_ms != 0) {
+            set_socket_timeout(sock, 0);
+        }
+        run_request(config, sock);
+        return true;
+    }
+    SSL_CTX *const ctx = tls_client_context_create(config->tls_ca);
+    TlsSession session;
+    if(ctx == NULL or not tls_session_start(&session, ctx, sock, config->address)) {
+        printf("[TLS setup failed]\n");
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    const bool is_protocol_agreed = exchange_protocol_version(session.app_fd);
+    if(is_protocol_agreed) {
+        *handshake_ms = elapsed_ms(start);
+        if(config->handshake_timeout_ms != 0) {
+            set_socket_timeout(sock, 0);
+        }
+        run_request(config, session.app_fd);
+    }
+    tls_session_finish(&session);
+    SSL_CTX_free(ctx);
+    return is_protocol_agreed;
+}
+
+static bool main_logic(const ClientConfig *const config, double *const handshake_ms) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const int sock = connect_server(config);
+    if(sock == -1) {
+        return false;
+    }
+    const bool is_reached = run_connected(config, sock, &start, handshake_ms);
+    checked_close(sock);
+    return is_reached;
+}
+
+static bool run_sharded(const ClientConfig *const config) {
+    ShardServers *const shard = config->shard;
+    if(config->health_path != NULL) {
+        shard_health_load(shard, config->health_path);
+    }
+    size_t order[SHARD_MAX_SERVERS];
+    shard_rank(shard, config->filename, order);
+    for(size_t i = 0; i < shard->count; ++i) {
+        ShardServer *const server = &shard->servers[order[i]];
+        printf("[Trying server %zu/%zu: %s:%u] [latency_ewma_ms: %.2f] [consecutive_failures: %u]\n",
+            i + 1, shard->count, server->address, server->port, server->latency_ewma_ms, server->consecutive_failures);
+        ClientConfig attempt = *config;
+        attempt.address = server->address;
+        attempt.port = server->port;
+        double handshake_ms = 0;
+        const bool is_reached = main_logic(&attempt, &handshake_ms);
+        shard_record(server, is_reached, handshake_ms);
+        if(config->health_path != NULL) {
+            shard_health_store(config->health_path, shard, server);
+        }
+        if(is_reached) {
+            printf("[Served by %s:%u] [handshake_ms: %.2f]\n", server->address, server->port, handshake_ms);
+            return true;
+        }
+        printf("[Failing over from %s:%u]\n", server->address, server->port);
+    }
+    printf("[No server reachable]\n");
+    return false;
+}
+
+// Connects, agrees on the protocol and sends the request without waiting for the answer.
+// Returns the socket or -1, the health view is updated either way.
+static int open_replica(const ClientConfig *const config, ShardServer *const server) {
+    printf("[Trying server %s:%u] [latency_ewma_ms: %.2f] [consecutive_failures: %u]\n",
+        server->address, server->port, server->latency_ewma_ms, server->consecutive_failures);
+    ClientConfig attempt = *config;
+    attempt.address = server->address;
+    attempt.port = server->port;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const int sock = connect_server(&attempt);
+    const bool is_reached = sock != -1 and exchange_protocol_version(sock);
+    shard_record(server, is_reached, elapsed_ms(&start));
+    if(config->health_path != NULL) {
+        shard_health_store(config->health_path, config->shard, server);
+    }
+    if(not is_reached) {
+        printf("[Failing over from %s:%u]\n", server->address, server->port);
+        if(sock != -1) {
+            checked_close(sock);
+        }
+        return -1;
+    }
+    set_socket_timeout(sock, 0);
+    // The request is several small writes, with Nagle the later ones wait out the server's
+    // delayed ACK and every request would look stalled to the hedge timer.
+    const int is_nodelay = 1;
+    if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &is_nodelay, sizeof(is_nodelay)) == -1) {
+        printf("[Failed to set TCP_NODELAY] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    if(not send_request(config, sock)) {
+        checked_close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Resets instead of closing, so the losing server fails its next read or write at once instead
+// of waiting for an acknowledgement that will never come.
+static void cancel_replica(const int sock) {
+    const struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+    if(setsockopt(sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) == -1) {
+        printf("[Failed to set SO_LINGER] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    checked_close(sock);
+}
+
+// A replica has answered once there is a byte to read, even if it hung up after sending it:
+// a refusal is one byte followed by a close, and has to win like any other answer. A hang-up
+// or an error with nothing to read is a failure. POLLRDHUP is asked for as a plain close
+// otherwise only shows as readable, and the peek tells the two apart.
+static bool is_replica_answered(const struct pollfd *const replica) {
+    uint8_t byte;
+    return (replica->revents & POLLIN) != 0 and recv(replica->fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT) == sizeof(byte);
+}
+
+static bool run_hedged(const ClientConfig *const config) {
+    ShardServers *const shard = config->shard;
+    char history_path[PATH_MAX] = "";
+    HedgeHistory history;
+    memset(&history, 0, sizeof(history));
+    if(config->health_path != NULL) {
+        shard_health_load(shard, config->health_path);
+        snprintf(history_path, sizeof(history_path), "%s.hedge", config->health_path);
+        hedge_history_load(history_path, &history);
+    }
+    const double delay_ms = hedge_delay_ms(&config->hedge, &history);
+    size_t order[SHARD_MAX_SERVERS];
+    shard_rank(shard, config->filename, order);
+    size_t next = 0;
+    ShardServer *primary_server = NULL;
+    struct pollfd replicas[2] = { { .fd = -1, .events = POLLIN | POLLRDHUP }, { .fd = -1, .events = POLLIN | POLLRDHUP } };
+    while(replicas[0].fd == -1 and next < shard->count) {
+        primary_server = &shard->servers[order[next++]];
+        replicas[0].fd = open_replica(config, primary_server);
+    }
+    if(replicas[0].fd == -1) {
+        printf("[No server reachable]\n");
+        return false;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const double delay_ceil_ms = ceil(delay_ms);
+    int ready = poll(replicas, 1, (int)delay_ceil_ms);
+    ShardServer *hedge_server = NULL;
+    bool is_hedged = false;
+    // A primary that fails before answering is hedged at once rather than after the delay.
+    if(ready == 0 or (ready == 1 and not is_replica_answered(&replicas[0]))) {
+        if(ready == 1) {
+            printf("[Replica failed before answering: %s:%u]\n", primary_server->address, primary_server->port);
+            checked_close(replicas[0].fd);
+            replicas[0].fd = -1;
+        }
+        while(replicas[1].fd == -1 and next < shard->count) {
+            hedge_server = &shard->servers[order[next++]];
+            replicas[1].fd = open_replica(config, hedge_server);
+        }
+        is_hedged = replicas[1].fd != -1;
+        if(is_hedged) {
+            printf("[Hedging to %s:%u after %.1f ms]\n", hedge_server->address, hedge_server->port, elapsed_ms(&start));
+        }
+        ready = 0;
+    }
+    // The first replica to send a header wins, the primary on a tie. One that errors or hangs
+    // up first is dropped and the other one waited for.
+    int winner = ready == 1 ? 0 : -1;
+    while(winner == -1 and (replicas[0].fd != -1 or replicas[1].fd != -1)) {
+        if(poll(replicas, 2, -1) == -1) {
+            printf("[Failed to poll replicas] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            break;
+        }
+        for(int i = 0; i < 2; ++i) {
+            if(replicas[i].fd == -1 or replicas[i].revents == 0) {
+                continue;
             }
-            if(not checked_close(file_fd)) {
-                printf("[Failed to close file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            if(is_replica_answered(&replicas[i])) {
+                winner = winner == -1 ? i : winner;
+            } else {
+                const ShardServer *const failed = i == 0 ? primary_server : hedge_server;
+                printf("[Replica failed before answering: %s:%u]\n", failed->address, failed->port);
+                checked_close(replicas[i].fd);
+                replicas[i].fd = -1;
             }
         }
-        if(not checked_close(pipefd[0])) {
-            printf("[Failed to close pipe 0] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-        }
-        if(not checked_close(pipefd[1])) {
-            printf("[Failed to close pipe 1] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    if(winner == -1) {
+        for(int i = 0; i < 2; ++i) {
+            if(replicas[i].fd != -1) {
+                checked_close(replicas[i].fd);
+            }
         }
+        printf("[No replica answered]\n");
+        return false;
+    }
+    const double time_to_header_ms = elapsed_ms(&start);
+    const bool is_hedge_won = winner == 1;
+    if(replicas[1 - winner].fd != -1) {
+        cancel_replica(replicas[1 - winner].fd);
     }
+    const ShardServer *const winner_server = is_hedge_won ? hedge_server : primary_server;
+    printf("[Served by %s:%u] [time_to_header_ms: %.2f] [hedged: %d] [hedge_won: %d]\n",
+        winner_server->address, winner_server->port, time_to_header_ms, is_hedged, is_hedge_won);
+    const bool is_received = receive_download(config, replicas[winner].fd);
+    checked_close(replicas[winner].fd);
+    if(history_path[0] != '\0') {
+        hedge_history_record(history_path, time_to_header_ms, is_hedged, is_hedge_won, &history);
+        printf("[Hedge rate: %lu/%lu] [hedges won: %lu] [delay_ms: %.1f]\n", history.hedged, history.requests, history.hedges_won, delay_ms);
+    }
+    return is_received;
 }
 
 int main(const int argc, char *argv[]) {
     const ClientConfig config = handle_cmd_args(argc, argv);
-
-    const int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("Socket creation failed");
-    } else {
-        main_logic(&config, sock);
+    if(config.hedge.is_enabled) {
+        return run_hedged(&config) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
+    if(config.shard != NULL) {
+        return run_sharded(&config) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    double handshake_ms;
+    main_logic(&config, &handshake_ms);
     return EXIT_SUCCESS;
 }
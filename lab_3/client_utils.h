@@ -23,7 +23,7 @@
 #define UNIQUE_NAME_COUNTER(prefix) CONCAT(prefix, __COUNTER__)
 #define UNIQUE_NAME(prefix) UNIQUE_NAME_COUNTER(UNIQUE_NAME_LINE(prefix))
 
-#define ARRAY_SIZE(data) sizeof((data)) / sizeof(data[0])
+#define ARRAY_SIZE(data) (sizeof((data)) / sizeof(data[0]))
 
 #define ASSERT_POSIX(expression) assert((expression) != -1)
 
@@ -77,5 +77,110 @@ static bool checked_close(const int fd) {
     return true;
 }
 
-enum { PROTOCOL_VERSION = 17 };
+typedef union {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+} fd_control_buff_t;
+
+// Passes an open descriptor over an AF_UNIX socket as SCM_RIGHTS ancillary data
+// attached to a single marker byte.
+static bool checked_send_fd(const int sock, const int fd) {
+    uint8_t marker = 0;
+    struct iovec iov = { .iov_base = &marker, .iov_len = sizeof(marker) };
+    fd_control_buff_t control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+    struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    while(sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        if(errno == EINTR) {
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+static bool checked_receive_fd(const int sock, int *const fd) {
+    uint8_t marker;
+    struct iovec iov = { .iov_base = &marker, .iov_len = sizeof(marker) };
+    fd_control_buff_t control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+    while(true) {
+        const ssize_t nrecv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if(nrecv < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if(nrecv == 0) {
+            errno = ECONNRESET;
+            return false;
+        }
+        break;
+    }
+    const struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL or cmsg->cmsg_level != SOL_SOCKET or cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return false;
+    }
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+    return true;
+}
+
+// Moves exactly n bytes from the socket into file_fd starting at offset 0, through the pipe,
+// so the payload never enters user space.
+static bool checked_splice_to_file(const int sock, const int pipefd[2], const int file_fd, const size_t n) {
+    off_t write_offset = 0;
+    while((size_t)write_offset < n) {
+        const ssize_t nread = splice(sock, NULL, pipefd[1], NULL, n - (size_t)write_offset, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(nread < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if(nread == 0) {
+            errno = ECONNRESET;
+            return false;
+        }
+        size_t pending = (size_t)nread;
+        while(pending > 0) {
+            const ssize_t nwrite = splice(pipefd[0], NULL, file_fd, &write_offset, pending, SPLICE_F_MOVE);
+            if(nwrite < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            pending -= (size_t)nwrite;
+        }
+    }
+    return true;
+}
+
+enum { PROTOCOL_VERSION = 18 };
 typedef char filename_buff_t[255];
+
+typedef enum {
+    RequestOperation_GET = 0,
+    RequestOperation_PUT = 1,
+    RequestOperation_GET_DIGEST = 2,
+    RequestOperation_DIGEST_RANGE = 3,
+    RequestOperation_GET_DELTA = 4,
+    RequestOperation_GET_COMPRESSED = 5,
+    RequestOperation_GET_MULTICAST = 6,
+    RequestOperation_GET_RANGE = 7,
+} RequestOperation;
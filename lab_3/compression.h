@@ -0,0 +1,145 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "client_utils.h"
+
+// Negotiated body compression. The client advertises a mask of codecs it can decode, the
+// server answers with the codec it used. Compressed variants are written once into a sidecar
+// directory under a name derived from (device, inode, mtime, codec), so repeat requests are
+// plain sendfile calls on the variant. A stale variant is never looked up again because the
+// mtime in its name no longer matches.
+
+typedef enum {
+    CompressionCodec_NONE = 0,
+    CompressionCodec_DEFLATE = 1,
+} CompressionCodec;
+
+enum {
+    COMPRESSION_CODEC_MASK_DEFLATE = 1 << CompressionCodec_DEFLATE,
+    COMPRESSION_CHUNK_SIZE = 1 << 17,
+    COMPRESSION_SAMPLE_SIZE = 1 << 16,
+    COMPRESSION_MIN_FILE_SIZE = 1 << 10
+};
+
+static const char VARIANT_DIR_NAME[] = ".variants";
+
+static const char *const INCOMPRESSIBLE_EXTENSIONS[] = {
+    ".gz", ".tgz", ".zip", ".bz2", ".xz", ".zst", ".lz4", ".7z", ".rar",
+    ".jpg", ".jpeg", ".png", ".gif", ".webp", ".mp3", ".mp4", ".mkv", ".avi", ".mov", ".pdf",
+};
+
+static bool compression_is_skipped_name(const char *const filename) {
+    const char *const extension = strrchr(filename, '.');
+    if(extension == NULL) {
+        return false;
+    }
+    for(size_t i = 0; i < ARRAY_SIZE(INCOMPRESSIBLE_EXTENSIONS); ++i) {
+        if(strcasecmp(extension, INCOMPRESSIBLE_EXTENSIONS[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Deflates the head of the file at the fastest level, already-compressed
+// data does not shrink by the required 10% and is sent raw.
+static bool compression_is_compressible(const int fd, const off_t file_size) {
+    if(file_size < COMPRESSION_MIN_FILE_SIZE) {
+        return false;
+    }
+    uint8_t *const sample = malloc(COMPRESSION_SAMPLE_SIZE);
+    const ssize_t nread = pread(fd, sample, COMPRESSION_SAMPLE_SIZE, 0);
+    bool is_compressible = false;
+    if(nread > 0) {
+        uLongf compressed_size = compressBound((uLong)nread);
+        uint8_t *const compressed = malloc(compressed_size);
+        if(compress2(compressed, &compressed_size, sample, (uLong)nread, Z_BEST_SPEED) == Z_OK) {
+            is_compressible = compressed_size * 10 < (uLongf)nread * 9;
+        }
+        free(compressed);
+    }
+    free(sample);
+    return is_compressible;
+}
+
+static bool compression_deflate_file(const int in_fd, const int out_fd) {
+    z_stream stream = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+    if(deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return false;
+    }
+    uint8_t *const in = malloc(COMPRESSION_CHUNK_SIZE);
+    uint8_t *const out = malloc(COMPRESSION_CHUNK_SIZE);
+    bool is_ok = true;
+    off_t offset = 0;
+    int flush = Z_NO_FLUSH;
+    while(is_ok and flush != Z_FINISH) {
+        const ssize_t nread = pread(in_fd, in, COMPRESSION_CHUNK_SIZE, offset);
+        if(nread < 0) {
+            is_ok = errno == EINTR;
+            continue;
+        }
+        offset += nread;
+        flush = nread == 0 ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = in;
+        stream.avail_in = (uInt)nread;
+        do {
+            stream.next_out = out;
+            stream.avail_out = COMPRESSION_CHUNK_SIZE;
+            if(deflate(&stream, flush) == Z_STREAM_ERROR) {
+                is_ok = false;
+                break;
+            }
+            const size_t produced = COMPRESSION_CHUNK_SIZE - stream.avail_out;
+            if(not checked_write(out_fd, out, produced, NULL)) {
+                is_ok = false;
+                break;
+            }
+        } while(stream.avail_out == 0);
+    }
+    deflateEnd(&stream);
+    free(in);
+    free(out);
+    return is_ok;
+}
+
+// Returns a read-only descriptor of the variant of fd compressed with codec, building it on
+// first use. The variant is written to a temporary file and renamed into place, so concurrent
+// workers either see a complete variant or none and at worst build it twice.
+static int compression_open_variant(const int fd, const struct stat *const st, const char *const variant_dir, const CompressionCodec codec) {
+    char variant_path[PATH_MAX];
+    snprintf(variant_path, sizeof(variant_path), "%s/%lx-%lx-%ld.%09ld-%d",
+        variant_dir, st->st_dev, st->st_ino, st->st_mtim.tv_sec, st->st_mtim.tv_nsec, codec);
+    const int variant_fd = open(variant_path, O_RDONLY | O_CLOEXEC);
+    if(variant_fd != -1 or errno != ENOENT) {
+        return variant_fd;
+    }
+    if(mkdir(variant_dir, 0755) == -1 and errno != EEXIST) {
+        return -1;
+    }
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s/.tmp.XXXXXX", variant_dir);
+    const int temp_fd = mkostemp(temp_path, O_CLOEXEC);
+    if(temp_fd == -1) {
+        return -1;
+    }
+    struct stat after;
+    const bool is_built = compression_deflate_file(fd, temp_fd)
+        and fstat(fd, &after) != -1
+        and after.st_mtim.tv_sec == st->st_mtim.tv_sec
+        and after.st_mtim.tv_nsec == st->st_mtim.tv_nsec
+        and after.st_size == st->st_size
+        and fchmod(temp_fd, 0444) != -1
+        and rename(temp_path, variant_path) != -1;
+    if(not is_built) {
+        unlink(temp_path);
+        checked_close(temp_fd);
+        return -1;
+    }
+    return temp_fd;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+
+// CRC32C (Castagnoli), chainable like zlib's crc32: start from 0 and feed the result back in.
+// x86-64 hosts with SSE4.2 use the crc32 instruction eight bytes at a time,
+// everything else falls back to a table-driven implementation.
+
+enum { CRC32C_POLYNOMIAL = 0x82F63B78 };
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_update_sw(const uint32_t crc, const void *const data, size_t n) {
+    if(crc32c_table[1] == 0) {
+        for(uint32_t i = 0; i < 256; ++i) {
+            uint32_t entry = i;
+            for(uint32_t bit = 0; bit < 8; ++bit) {
+                entry = (entry & 1) ? (entry >> 1) ^ CRC32C_POLYNOMIAL : entry >> 1;
+            }
+            crc32c_table[i] = entry;
+        }
+    }
+    const uint8_t *p = data;
+    uint32_t c = ~crc;
+    while(n-- > 0) {
+        c = crc32c_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_hw(const uint32_t crc, const void *const data, size_t n) {
+    const uint8_t *p = data;
+    uint64_t c = ~crc;
+    while(n >= 4 * sizeof(uint64_t)) {
+        uint64_t words[4];
+        memcpy(words, p, sizeof(words));
+        c = __builtin_ia32_crc32di(c, words[0]);
+        c = __builtin_ia32_crc32di(c, words[1]);
+        c = __builtin_ia32_crc32di(c, words[2]);
+        c = __builtin_ia32_crc32di(c, words[3]);
+        p += sizeof(words);
+        n -= sizeof(words);
+    }
+    while(n >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = __builtin_ia32_crc32di(c, word);
+        p += sizeof(word);
+        n -= sizeof(word);
+    }
+    uint32_t c32 = (uint32_t)c;
+    while(n-- > 0) {
+        c32 = __builtin_ia32_crc32qi(c32, *p++);
+    }
+    return ~c32;
+}
+#endif
+
+static bool crc32c_has_hw(void) {
+#if defined(__x86_64__)
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+}
+
+static uint32_t crc32c_update(const uint32_t crc, const void *const data, const size_t n) {
+#if defined(__x86_64__)
+    static int has_hw = -1;
+    if(has_hw == -1) {
+        has_hw = crc32c_has_hw();
+    }
+    if(has_hw) {
+        return crc32c_update_hw(crc, data, n);
+    }
+#endif
+    return crc32c_update_sw(crc, data, n);
+}
@@ -0,0 +1,57 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "crc32c.h"
+
+// Hashing must never be the bottleneck of a verified download: the hardware path has to
+// stay at least twice as fast as the link it verifies.
+
+enum {
+    BENCH_BUFFER_SIZE = 64 << 20,
+    BENCH_ITERATIONS = 16,
+    BENCH_HEADROOM = 2
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double bench_gbps(uint32_t (*const update)(uint32_t, const void *, size_t), const uint8_t *const data, const int iterations) {
+    uint32_t digest = 0;
+    const double start = now_seconds();
+    for(int i = 0; i < iterations; ++i) {
+        digest = update(digest, data, BENCH_BUFFER_SIZE);
+    }
+    const double elapsed = now_seconds() - start;
+    printf("\t[digest: %08x]\n", digest);
+    return (double)BENCH_BUFFER_SIZE * iterations * 8 / elapsed / 1e9;
+}
+
+int main(const int argc, char *argv[]) {
+    const double nic_gbps = argc > 1 ? strtod(argv[1], NULL) : 10.0;
+    uint8_t *const data = malloc(BENCH_BUFFER_SIZE);
+    if(data == NULL) {
+        return EXIT_FAILURE;
+    }
+    srand(17);
+    for(size_t i = 0; i < BENCH_BUFFER_SIZE; ++i) {
+        data[i] = (uint8_t)rand();
+    }
+    printf("[software]\n");
+    const double sw_gbps = bench_gbps(crc32c_update_sw, data, 1);
+    printf("\t[%.2f Gbit/s]\n", sw_gbps);
+    printf("[dispatched, hardware: %d]\n", crc32c_has_hw());
+    const double gbps = bench_gbps(crc32c_update, data, BENCH_ITERATIONS);
+    printf("\t[%.2f Gbit/s] [NIC: %.2f Gbit/s]\n", gbps, nic_gbps);
+    free(data);
+    if(gbps < nic_gbps * BENCH_HEADROOM) {
+        printf("[FAILED: hashing is less than %dx faster than the NIC]\n", BENCH_HEADROOM);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
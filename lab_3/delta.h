@@ -0,0 +1,350 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "client_utils.h"
+#include "crc32c.h"
+
+// rsync-style delta transfer. The client describes the blocks of its copy with a rolling weak
+// checksum and a CRC32C, the server scans the new version with the rolling checksum and answers
+// with literal data and copy-block instructions. Copies only ever read from at or after the
+// current output offset, so the client can rebuild the file in place, unchanged blocks cost no I/O.
+// The price is that data shifted towards the end of the file by an insertion is sent as literal.
+
+enum {
+    DELTA_MIN_BLOCK_SIZE = 4096,
+    DELTA_MAX_BLOCKS = 1 << 20,
+    DELTA_MAX_LITERAL = 1 << 20,
+    DELTA_MAX_COPY = 1 << 30
+};
+
+typedef enum {
+    DeltaInstructionType_LITERAL = 0,
+    DeltaInstructionType_COPY = 1,
+    DeltaInstructionType_END = 2,
+} DeltaInstructionType;
+
+// All multi-byte fields are big-endian on the wire.
+typedef struct {
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t block_count;
+} DeltaHeader;
+
+typedef struct {
+    uint32_t weak;
+    uint32_t strong;
+} BlockSignature;
+
+// LITERAL: length bytes of data follow.
+// COPY: value is the index of the client's first block, length the size of the run of consecutive blocks.
+// END: value is the new file size, length its CRC32C.
+typedef struct {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t length;
+    uint64_t value;
+} DeltaInstruction;
+
+static uint32_t delta_block_size(const uint64_t file_size) {
+    uint32_t block_size = DELTA_MIN_BLOCK_SIZE;
+    while((uint64_t)block_size * DELTA_MAX_BLOCKS < file_size) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+typedef struct {
+    uint32_t a;
+    uint32_t b;
+    uint32_t length;
+} RollingChecksum;
+
+// Signatures of every block and every re-sync after a match go through here, so whole
+// 16-byte chunks are summed with SSE2: a chunk starting at i adds its byte sum S to a and
+// (length - i) * S - sum(j * x[i + j]) to b.
+static void RollingChecksum_init(RollingChecksum *const rc, const uint8_t *const data, const uint32_t length) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t i = 0;
+#if defined(__x86_64__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low_weights = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m128i high_weights = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+    for(; i + 16 <= length; i += 16) {
+        const void *const chunk = data + i;
+        const __m128i bytes = _mm_loadu_si128(chunk);
+        const __m128i sums = _mm_sad_epu8(bytes, zero);
+        const uint32_t sum = (uint32_t)_mm_cvtsi128_si32(sums) + (uint32_t)_mm_extract_epi16(sums, 4);
+        const __m128i weighted = _mm_add_epi32(
+            _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), low_weights),
+            _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), high_weights));
+        const __m128i pairs = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, 0x4E));
+        const __m128i total = _mm_add_epi32(pairs, _mm_shuffle_epi32(pairs, 0xB1));
+        a += sum;
+        b += (length - i) * sum - (uint32_t)_mm_cvtsi128_si32(total);
+    }
+#endif
+    for(; i < length; ++i) {
+        a += data[i];
+        b += (length - i) * data[i];
+    }
+    rc->a = a;
+    rc->b = b;
+    rc->length = length;
+}
+
+static uint32_t RollingChecksum_digest(const RollingChecksum *const rc) {
+    return (rc->a & 0xFFFF) | (rc->b << 16);
+}
+
+static void RollingChecksum_roll(RollingChecksum *const rc, const uint8_t out, const uint8_t in) {
+    rc->a = rc->a - out + in;
+    rc->b = rc->b - rc->length * out + rc->a;
+}
+
+// checked_read reports success on EOF, the delta stream must not be cut short.
+static bool delta_read(const int sock, void *const buffer, const size_t count) {
+    size_t nread;
+    return checked_read(sock, buffer, count, &nread) and nread == count;
+}
+
+static bool delta_send_instruction(const int sock, const DeltaInstructionType type, const uint32_t length, const uint64_t value) {
+    const DeltaInstruction instruction = {
+        .type = (uint8_t)type,
+        .length = htonl(length),
+        .value = htobe64(value)
+    };
+    return checked_write(sock, &instruction, sizeof(instruction), NULL);
+}
+
+// Literal data goes straight from the page cache to the socket.
+static bool delta_send_literal(const int sock, const int fd, off_t offset, const off_t end) {
+    while(offset < end) {
+        const off_t length = end - offset < DELTA_MAX_LITERAL ? end - offset : DELTA_MAX_LITERAL;
+        if(not delta_send_instruction(sock, DeltaInstructionType_LITERAL, (uint32_t)length, 0)) {
+            return false;
+        }
+        const off_t literal_end = offset + length;
+        while(offset < literal_end) {
+            if(sendfile(sock, fd, &offset, (size_t)(literal_end - offset)) <= 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The low bits of the weak checksum are just a byte sum and cluster badly, slots are
+// picked by a multiplicative hash. The bit filter is sparse enough that the scan almost
+// never has to leave its inner loop for positions without a candidate.
+// Unchanged regions arrive as long runs of consecutive blocks, one instruction per run
+// instead of one per block keeps the stream and the syscall count small.
+typedef struct {
+    uint64_t first_block;
+    uint32_t block_count;
+} DeltaCopyRun;
+
+static bool DeltaCopyRun_flush(DeltaCopyRun *const run, const int sock, const uint32_t block_size) {
+    if(run->block_count == 0) {
+        return true;
+    }
+    const uint32_t length = run->block_count * block_size;
+    run->block_count = 0;
+    return delta_send_instruction(sock, DeltaInstructionType_COPY, length, run->first_block);
+}
+
+static bool DeltaCopyRun_extend(DeltaCopyRun *const run, const int sock, const uint32_t block_size, const uint64_t block) {
+    if(run->block_count > 0
+        and block == run->first_block + run->block_count
+        and (uint64_t)(run->block_count + 1) * block_size <= DELTA_MAX_COPY) {
+        ++run->block_count;
+        return true;
+    }
+    const bool is_flushed = DeltaCopyRun_flush(run, sock, block_size);
+    run->first_block = block;
+    run->block_count = 1;
+    return is_flushed;
+}
+
+typedef struct {
+    int64_t *heads;
+    int64_t *next;
+    uint64_t *filter;
+    uint32_t head_shift;
+    uint32_t filter_shift;
+} SignatureIndex;
+
+static uint32_t SignatureIndex_slot(const uint32_t weak, const uint32_t shift) {
+    return (weak * 0x9E3779B1u) >> shift;
+}
+
+static bool SignatureIndex_may_contain(const SignatureIndex *const index, const uint32_t weak) {
+    const uint32_t bit = SignatureIndex_slot(weak, index->filter_shift);
+    return (index->filter[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void SignatureIndex_init(SignatureIndex *const index, const BlockSignature *const signatures, const uint64_t block_count) {
+    uint32_t head_bits = 4;
+    while(((uint64_t)1 << head_bits) < block_count * 2) {
+        ++head_bits;
+    }
+    const uint32_t filter_bits = head_bits + 4 > 16 ? head_bits + 4 : 16;
+    index->head_shift = 32 - head_bits;
+    index->filter_shift = 32 - filter_bits;
+    index->heads = malloc(((size_t)1 << head_bits) * sizeof(*index->heads));
+    index->next = malloc((block_count + 1) * sizeof(*index->next));
+    index->filter = calloc(((size_t)1 << filter_bits) / 64, sizeof(*index->filter));
+    memset(index->heads, 0xFF, ((size_t)1 << head_bits) * sizeof(*index->heads));
+    // Inserting backwards keeps every chain in ascending block order.
+    for(uint64_t i = block_count; i-- > 0;) {
+        const uint32_t slot = SignatureIndex_slot(signatures[i].weak, index->head_shift);
+        index->next[i] = index->heads[slot];
+        index->heads[slot] = (int64_t)i;
+        const uint32_t bit = SignatureIndex_slot(signatures[i].weak, index->filter_shift);
+        index->filter[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+static void SignatureIndex_destroy(const SignatureIndex *const index) {
+    free(index->heads);
+    free(index->next);
+    free(index->filter);
+}
+
+// Streams the instructions turning the client's blocks into the file behind fd,
+// literal_bytes receives how much data had to be sent verbatim.
+static bool delta_send(
+    const int sock,
+    const int fd,
+    const off_t file_size,
+    const uint32_t file_digest_value,
+    const uint32_t block_size,
+    const BlockSignature *const signatures,
+    const uint64_t block_count,
+    uint64_t *const literal_bytes
+) {
+    *literal_bytes = 0;
+    const uint8_t *data = NULL;
+    if(file_size >= (off_t)block_size and block_count > 0) {
+        data = mmap(NULL, (size_t)file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED) {
+            return false;
+        }
+        madvise((void *)(uintptr_t)data, (size_t)file_size, MADV_SEQUENTIAL);
+    }
+    SignatureIndex index;
+    SignatureIndex_init(&index, signatures, block_count);
+    // Instruction headers are tiny, corking packs them with the literal data instead of
+    // leaving each one to Nagle and delayed ACKs. Fails harmlessly on unix sockets.
+    int is_corked = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &is_corked, sizeof(is_corked));
+
+    bool is_ok = true;
+    DeltaCopyRun run = { .block_count = 0 };
+    off_t literal_start = 0;
+    off_t position = 0;
+    RollingChecksum rc;
+    bool is_rolling = false;
+    while(data != NULL and position + (off_t)block_size <= file_size) {
+        if(not is_rolling and run.block_count > 0) {
+            // Right after a match the next block is by far the likeliest candidate,
+            // checking it by CRC alone avoids re-seeding the rolling checksum.
+            const uint64_t expected = run.first_block + run.block_count;
+            if(expected < block_count
+                and (off_t)(expected * block_size) >= position
+                and signatures[expected].strong == crc32c_update(0, data + position, block_size)) {
+                is_ok = DeltaCopyRun_extend(&run, sock, block_size, expected);
+                if(not is_ok) {
+                    break;
+                }
+                position += (off_t)block_size;
+                literal_start = position;
+                continue;
+            }
+        }
+        if(not is_rolling) {
+            RollingChecksum_init(&rc, data + position, block_size);
+            is_rolling = true;
+        }
+        {
+            // Most positions have no candidate block at all, roll over them without any calls.
+            uint32_t a = rc.a;
+            uint32_t b = rc.b;
+            const uint8_t *window = data + position;
+            const uint8_t *const last_window = data + file_size - block_size;
+            while(window < last_window) {
+                const uint32_t bit = (((a & 0xFFFF) | (b << 16)) * 0x9E3779B1u) >> index.filter_shift;
+                if((index.filter[bit / 64] >> (bit % 64)) & 1) {
+                    break;
+                }
+                a = a - window[0] + window[block_size];
+                b = b - block_size * window[0] + a;
+                ++window;
+            }
+            rc.a = a;
+            rc.b = b;
+            position = window - data;
+        }
+        const uint32_t weak = RollingChecksum_digest(&rc);
+        int64_t match = -1;
+        bool has_strong = false;
+        uint32_t strong = 0;
+        const int64_t first = SignatureIndex_may_contain(&index, weak) ? index.heads[SignatureIndex_slot(weak, index.head_shift)] : -1;
+        for(int64_t i = first; i != -1; i = index.next[i]) {
+            if(signatures[i].weak != weak or (off_t)((uint64_t)i * block_size) < position) {
+                continue;
+            }
+            if(not has_strong) {
+                strong = crc32c_update(0, data + position, block_size);
+                has_strong = true;
+            }
+            if(signatures[i].strong == strong) {
+                match = i;
+                break;
+            }
+        }
+        if(match != -1) {
+            if(position > literal_start) {
+                is_ok = DeltaCopyRun_flush(&run, sock, block_size)
+                    and delta_send_literal(sock, fd, literal_start, position);
+            }
+            is_ok = is_ok and DeltaCopyRun_extend(&run, sock, block_size, (uint64_t)match);
+            if(not is_ok) {
+                break;
+            }
+            *literal_bytes += (uint64_t)(position - literal_start);
+            position += (off_t)block_size;
+            literal_start = position;
+            is_rolling = false;
+            continue;
+        }
+        if(position + (off_t)block_size == file_size) {
+            break;
+        }
+        RollingChecksum_roll(&rc, data[position], data[position + (off_t)block_size]);
+        ++position;
+    }
+    if(is_ok) {
+        is_ok = DeltaCopyRun_flush(&run, sock, block_size)
+            and delta_send_literal(sock, fd, literal_start, file_size)
+            and delta_send_instruction(sock, DeltaInstructionType_END, file_digest_value, (uint64_t)file_size);
+        *literal_bytes += (uint64_t)(file_size - literal_start);
+    }
+    is_corked = 0;
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &is_corked, sizeof(is_corked));
+    SignatureIndex_destroy(&index);
+    if(data != NULL) {
+        munmap((void *)(uintptr_t)data, (size_t)file_size);
+    }
+    return is_ok;
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "client_utils.h"
+#include "crc32c.h"
+
+// Whole-file digests keyed by (device, inode, mtime, size). The table lives in a shared
+// anonymous mapping created before the servers fork, so every worker sees every entry.
+// Each slot is a seqlock: odd sequence means a writer is inside, readers retry or miss.
+
+enum { DIGEST_CACHE_ENTRIES = 4096 };
+
+typedef struct {
+    atomic_uint sequence;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    uint32_t digest;
+} DigestCacheEntry;
+
+typedef struct {
+    DigestCacheEntry entries[DIGEST_CACHE_ENTRIES];
+} DigestCache;
+
+static DigestCache *digest_cache = NULL;
+
+static void digest_cache_init(void) {
+    void *const memory = mmap(NULL, sizeof(DigestCache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(memory != MAP_FAILED);
+    digest_cache = memory;
+}
+
+static DigestCacheEntry *digest_cache_slot(const struct stat *const st) {
+    const uint64_t key = ((uint64_t)st->st_dev * 0x9E3779B97F4A7C15ull) ^ (uint64_t)st->st_ino;
+    return &digest_cache->entries[(key ^ (key >> 29)) % DIGEST_CACHE_ENTRIES];
+}
+
+static bool digest_cache_entry_matches(const DigestCacheEntry *const entry, const struct stat *const st) {
+    return entry->dev == st->st_dev and entry->ino == st->st_ino and entry->size == st->st_size
+        and entry->mtime.tv_sec == st->st_mtim.tv_sec and entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static bool digest_cache_lookup(const struct stat *const st, uint32_t *const digest) {
+    if(digest_cache == NULL) {
+        return false;
+    }
+    DigestCacheEntry *const entry = digest_cache_slot(st);
+    const unsigned begin = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+    if(begin & 1) {
+        return false;
+    }
+    const bool is_match = digest_cache_entry_matches(entry, st);
+    const uint32_t cached = entry->digest;
+    atomic_thread_fence(memory_order_acquire);
+    if(atomic_load_explicit(&entry->sequence, memory_order_relaxed) != begin or not is_match) {
+        return false;
+    }
+    *digest = cached;
+    return true;
+}
+
+static void digest_cache_store(const struct stat *const st, const uint32_t digest) {
+    if(digest_cache == NULL) {
+        return;
+    }
+    DigestCacheEntry *const entry = digest_cache_slot(st);
+    unsigned sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+    if((sequence & 1) or not atomic_compare_exchange_strong_explicit(
+        &entry->sequence, &sequence, sequence + 1, memory_order_acquire, memory_order_relaxed
+    )) {
+        return;
+    }
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtim;
+    entry->size = st->st_size;
+    entry->digest = digest;
+    atomic_store_explicit(&entry->sequence, sequence + 2, memory_order_release);
+}
+
+// Hashes [offset, offset + length) straight from the page cache through a read-only mapping.
+// The range must lie within the file, touching the mapping past its end raises SIGBUS.
+static bool mapped_range_digest(const int fd, const off_t offset, const off_t length, uint32_t *const digest) {
+    *digest = 0;
+    if(length == 0) {
+        return true;
+    }
+    const off_t page_size = (off_t)sysconf(_SC_PAGESIZE);
+    const off_t map_offset = offset - offset % page_size;
+    const size_t map_length = (size_t)(offset - map_offset + length);
+    uint8_t *const data = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, map_offset);
+    if(data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, map_length, MADV_SEQUENTIAL);
+    *digest = crc32c_update(0, data + (offset - map_offset), (size_t)length);
+    ASSERT_POSIX(munmap(data, map_length));
+    return true;
+}
+
+// Same for a range the caller has not checked against the file, fails with EINVAL when it
+// reaches past the end.
+static bool file_range_digest(const int fd, const off_t offset, const off_t length, uint32_t *const digest) {
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        return false;
+    }
+    if(offset < 0 or length < 0 or offset > st.st_size or length > st.st_size - offset) {
+        errno = EINVAL;
+        return false;
+    }
+    return mapped_range_digest(fd, offset, length, digest);
+}
+
+static bool file_digest(const int fd, const struct stat *const st, uint32_t *const digest) {
+    if(digest_cache_lookup(st, digest)) {
+        return true;
+    }
+    if(not mapped_range_digest(fd, 0, st->st_size, digest)) {
+        return false;
+    }
+    digest_cache_store(st, *digest);
+    return true;
+}
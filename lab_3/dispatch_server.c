@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include "iterative_server_utils_two.h"
+#include "placement.h"
+
+// One acceptor, long-lived workers. The acceptor owns the listeners and hands every accepted
+// socket to a worker over that worker's AF_UNIX channel with SCM_RIGHTS. It picks the worker
+// from the scoreboard: the one that still owes its clients the fewest bytes, or the one with
+// the fewest open connections. Workers serve each connection on its own thread, so a worker
+// streaming a huge file keeps taking new clients and the scoreboard shows the real load.
+
+enum { STATUS_INTERVAL_MS = 250 };
+
+typedef enum {
+    DispatchPolicy_BYTES = 0,
+    DispatchPolicy_CONNECTIONS,
+    DispatchPolicy_ROUND_ROBIN,
+} DispatchPolicy;
+
+static const char *const DISPATCH_POLICY_NAMES[] = { "bytes", "connections", "round-robin" };
+
+typedef struct {
+    IterativeServerConfig config;
+    int32_t worker_count;
+    DispatchPolicy policy;
+    const char *status_path;
+    Placement placement;
+} DispatchServerConfig;
+
+typedef struct {
+    int channel_fd;
+    WorkerSlot *slot;
+} DispatchWorker;
+
+typedef struct {
+    int client_sock;
+    const IterativeServerConfig *config;
+} WorkerConnection;
+
+static void dispatch_server_print_config(const DispatchServerConfig *config) {
+    iterative_server_print_config(&config->config);
+    printf("\tWorkers: %d\n", config->worker_count);
+    printf("\tPolicy: %s\n", DISPATCH_POLICY_NAMES[config->policy]);
+    if(config->status_path != NULL) {
+        printf("\tStatus file: %s\n", config->status_path);
+    }
+    placement_print(&config->placement);
+}
+
+static bool parse_policy(const char *const name, DispatchPolicy *const policy) {
+    for(size_t i = 0; i < ARRAY_SIZE(DISPATCH_POLICY_NAMES); ++i) {
+        if(strcmp(name, DISPATCH_POLICY_NAMES[i]) == 0) {
+            *policy = (DispatchPolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static DispatchServerConfig handle_cmd_args(const int argc, char **argv) {
+    DispatchServerConfig config;
+    iterative_server_default_options(&config.config);
+    config.policy = DispatchPolicy_BYTES;
+    config.status_path = NULL;
+    config.placement = PLACEMENT_NONE;
+    bool is_options_ok = true;
+    int opt;
+    while(is_options_ok and (opt = getopt(argc, argv, ITERATIVE_SERVER_OPTIONS "P:S:A:")) != -1) {
+        switch(opt) {
+            case 'P': is_options_ok = parse_policy(optarg, &config.policy); break;
+            case 'S': config.status_path = optarg; break;
+            case 'A': is_options_ok = placement_parse(optarg, &config.placement); break;
+            default: is_options_ok = iterative_server_parse_option(&config.config, opt, optarg); break;
+        }
+    }
+    const int first_arg = optind;
+    if (not is_options_ok or not iterative_server_finish_options(&config.config) or argc - first_arg != 4) {
+        printf("Usage: %s [-u <unix_socket_path>] [-q <max_upload_size>] [-z <variant_cache_dir>] [-C <tls_cert> -K <tls_key>] [-b <backlog>] [-p <busy_poll_us>] [-U <upstream_ip:port> [-L <cache_bytes>]] [-c <cold_file_bytes> [-O]] [-g <group_ip:port> [-r <rate_mbit>]] [-T <trace_file> [-n <trace_records>]] [-P bytes|connections|round-robin] [-S <status_file>] [-A <cpu_list>|physical[:<interface>]] <server_address> <server_port> <directory_path> <workers>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    config.config.address = argv[first_arg];
+    config.config.port = (uint16_t)atoi(argv[first_arg + 1]);
+    config.config.dir_path = argv[first_arg + 2];
+    config.worker_count = atoi(argv[first_arg + 3]);
+    assert(config.worker_count > 0);
+    dispatch_server_print_config(&config);
+    return config;
+}
+
+static void *worker_connection_main(void *const arg) {
+    WorkerConnection *const connection = arg;
+    handle_client(connection->client_sock, connection->config);
+    if(not checked_close(connection->client_sock)) {
+        printf("[Failed to close client connection: %d]\n", connection->client_sock);
+    }
+    atomic_fetch_add_explicit(&scoreboard_self->requests, 1, memory_order_relaxed);
+    if(atomic_fetch_sub_explicit(&scoreboard_self->connections, 1, memory_order_acq_rel) == 1) {
+        scoreboard_set_state(scoreboard_self, WorkerState_IDLE);
+    }
+    free(connection);
+    return NULL;
+}
+
+// Runs until the acceptor closes the channel, then lets the connections in flight finish.
+static void worker_main_loop(const int channel_fd, const IterativeServerConfig *const config) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    scoreboard_set_state(scoreboard_self, WorkerState_IDLE);
+    while(true) {
+        int client_sock;
+        if(not checked_receive_fd(channel_fd, &client_sock)) {
+            if(errno != ECONNRESET) {
+                printf("[Failed to receive connection] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            }
+            break;
+        }
+        // The acceptor already counted the connection, so its next pick sees it immediately.
+        scoreboard_set_state(scoreboard_self, WorkerState_BUSY);
+        WorkerConnection *const connection = malloc(sizeof(*connection));
+        connection->client_sock = client_sock;
+        connection->config = config;
+        pthread_t thread;
+        const int error = pthread_create(&thread, &attr, worker_connection_main, connection);
+        if(error != 0) {
+            printf("[Failed to start connection thread] [errno: %d] [strerror: %s]\n", error, strerror(error));
+            free(connection);
+            checked_close(client_sock);
+            atomic_fetch_sub_explicit(&scoreboard_self->connections, 1, memory_order_acq_rel);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    scoreboard_set_state(scoreboard_self, WorkerState_RETIRING);
+    while(atomic_load_explicit(&scoreboard_self->connections, memory_order_acquire) > 0) {
+        usleep(10000);
+    }
+}
+
+static void dispatch_spawn_workers(
+    DispatchWorker *const workers,
+    Scoreboard *const scoreboard,
+    const ServerListeners *const listeners,
+    const DispatchServerConfig *const config
+) {
+    for(size_t i = 0; i < (size_t)config->worker_count; ++i) {
+        int channel[2];
+        ASSERT_POSIX(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel));
+        WorkerSlot *const slot = &scoreboard->slots[i];
+        atomic_store_explicit(&slot->cpu, -1, memory_order_relaxed);
+        scoreboard_set_state(slot, WorkerState_STARTING);
+        fflush(stdout);
+        const pid_t pid = fork();
+        ASSERT_POSIX(pid);
+        if(pid == 0) {
+            assert(checked_close(listeners->tcp_fd));
+            if(listeners->unix_fd != -1) {
+                assert(checked_close(listeners->unix_fd));
+            }
+            for(size_t j = 0; j < i; ++j) {
+                assert(checked_close(workers[j].channel_fd));
+            }
+            assert(checked_close(channel[0]));
+            slot->pid = getpid();
+            scoreboard_self = slot;
+            // Connection threads inherit the mask, so a worker and all its connections share a core.
+            atomic_store_explicit(&slot->cpu, placement_apply(&config->placement, i), memory_order_relaxed);
+            worker_main_loop(channel[1], &config->config);
+            exit(EXIT_SUCCESS);
+        }
+        assert(checked_close(channel[1]));
+        slot->pid = pid;
+        workers[i].channel_fd = channel[0];
+        workers[i].slot = slot;
+        printf("[Spawned worker %jd]\n", (intmax_t)pid);
+    }
+}
+
+// Returns the index of the least loaded live worker or -1 when none is left.
+static ssize_t dispatch_pick_worker(const DispatchWorker *const workers, const size_t worker_count, const DispatchPolicy policy) {
+    static size_t next_worker = 0;
+    ssize_t best = -1;
+    int64_t best_bytes = 0;
+    int best_connections = 0;
+    for(size_t attempt = 0; attempt < worker_count; ++attempt) {
+        const size_t i = (next_worker + attempt) % worker_count;
+        if(workers[i].channel_fd == -1) {
+            continue;
+        }
+        const int64_t bytes = atomic_load_explicit(&workers[i].slot->bytes_pending, memory_order_relaxed);
+        const int connections = atomic_load_explicit(&workers[i].slot->connections, memory_order_relaxed);
+        const bool is_better = best == -1
+            or (policy == DispatchPolicy_BYTES and (bytes < best_bytes or (bytes == best_bytes and connections < best_connections)))
+            or (policy == DispatchPolicy_CONNECTIONS and (connections < best_connections or (connections == best_connections and bytes < best_bytes)));
+        if(is_better) {
+            best = (ssize_t)i;
+            best_bytes = bytes;
+            best_connections = connections;
+        }
+    }
+    // Ties go to the worker after the last pick, which is plain round robin for that policy.
+    if(best != -1) {
+        next_worker = (size_t)best + 1;
+    }
+    return best;
+}
+
+static void dispatch_connection(DispatchWorker *const workers, const size_t worker_count, const DispatchPolicy policy, const int client_sock) {
+    while(true) {
+        const ssize_t i = dispatch_pick_worker(workers, worker_count, policy);
+        if(i == -1) {
+            printf("[No workers left, dropping connection: %d]\n", client_sock);
+            return;
+        }
+        WorkerSlot *const slot = workers[i].slot;
+        atomic_fetch_add_explicit(&slot->connections, 1, memory_order_acq_rel);
+        if(checked_send_fd(workers[i].channel_fd, client_sock)) {
+            return;
+        }
+        printf("[Worker %jd is gone] [errno: %d] [strerror: %s]\n", (intmax_t)slot->pid, errno, strerror(errno));
+        atomic_fetch_sub_explicit(&slot->connections, 1, memory_order_acq_rel);
+        assert(checked_close(workers[i].channel_fd));
+        workers[i].channel_fd = -1;
+    }
+}
+
+static void dispatch_load_stats(const Scoreboard *const scoreboard, const bool is_bytes, double *const mean, double *const stddev) {
+    double sum = 0;
+    double sum_squares = 0;
+    for(size_t i = 0; i < scoreboard->slot_count; ++i) {
+        const double load = is_bytes
+            ? (double)atomic_load_explicit(&scoreboard->slots[i].bytes_pending, memory_order_relaxed)
+            : (double)atomic_load_explicit(&scoreboard->slots[i].connections, memory_order_relaxed);
+        sum += load;
+        sum_squares += load * load;
+    }
+    *mean = sum / (double)scoreboard->slot_count;
+    *stddev = sqrt(fmax(sum_squares / (double)scoreboard->slot_count - *mean * *mean, 0));
+}
+
+// Written to a temporary file and renamed, so a reader never sees a half-written view.
+static void dispatch_write_status(const Scoreboard *const scoreboard, const DispatchServerConfig *const config) {
+    if(config->status_path == NULL) {
+        return;
+    }
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", config->status_path);
+    FILE *const out = fopen(temp_path, "w");
+    if(out == NULL) {
+        printf("[Failed to write status: %s] [errno: %d] [strerror: %s]\n", temp_path, errno, strerror(errno));
+        return;
+    }
+    double mean;
+    double stddev;
+    fprintf(out, "policy: %s\n", DISPATCH_POLICY_NAMES[config->policy]);
+    dispatch_load_stats(scoreboard, false, &mean, &stddev);
+    fprintf(out, "connections per worker: mean %.2f stddev %.2f\n", mean, stddev);
+    dispatch_load_stats(scoreboard, true, &mean, &stddev);
+    fprintf(out, "bytes pending per worker: mean %.0f stddev %.0f\n", mean, stddev);
+    scoreboard_print(scoreboard, out);
+    if(fclose(out) != 0 or rename(temp_path, config->status_path) == -1) {
+        printf("[Failed to write status: %s] [errno: %d] [strerror: %s]\n", config->status_path, errno, strerror(errno));
+    }
+}
+
+static void dispatch_main_loop(
+    const ServerListeners *const listeners,
+    DispatchWorker *const workers,
+    const Scoreboard *const scoreboard,
+    const DispatchServerConfig *const config
+) {
+    struct timespec status_written_at = { 0 };
+    while (keep_running) {
+        const int connection_fd = server_listeners_accept(listeners);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if((now.tv_sec - status_written_at.tv_sec) * 1000 + (now.tv_nsec - status_written_at.tv_nsec) / 1000000 >= STATUS_INTERVAL_MS) {
+            dispatch_write_status(scoreboard, config);
+            status_written_at = now;
+        }
+        if (connection_fd < 0) {
+            continue;
+        }
+        dispatch_connection(workers, (size_t)config->worker_count, config->policy, connection_fd);
+        if(not checked_close(connection_fd)) {
+            printf("[Failed to close client connection: %d]\n", connection_fd);
+        }
+    }
+}
+
+static void socketfd_valid(const DispatchServerConfig *config, const int socketfd) {
+    server_listen_tcp(socketfd, config->config.backlog);
+    printf("[Server listening on %s:%d]\n", config->config.address, config->config.port);
+    ServerListeners listeners;
+    server_listeners_init(&listeners, socketfd, &config->config);
+
+    Scoreboard *const scoreboard = scoreboard_create((size_t)config->worker_count);
+    DispatchWorker *const workers = calloc((size_t)config->worker_count, sizeof(*workers));
+    dispatch_spawn_workers(workers, scoreboard, &listeners, config);
+    dispatch_main_loop(&listeners, workers, scoreboard, config);
+    busy_poll_print_stats(listeners.busy_poll_us);
+
+    for(size_t i = 0; i < (size_t)config->worker_count; ++i) {
+        if(workers[i].channel_fd != -1) {
+            assert(checked_close(workers[i].channel_fd));
+        }
+    }
+    while(true) {
+        const pid_t pid = waitpid(-1, NULL, 0);
+        if(pid == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        printf("[Process %jd exited]\n", (intmax_t)pid);
+    }
+    free(workers);
+    server_listeners_destroy(&listeners, config->config.unix_path);
+    if(config->status_path != NULL) {
+        unlink(config->status_path);
+    }
+}
+
+int main(const int argc, char *argv[]) {
+    {
+        struct sigaction sa;
+        ASSERT_POSIX(sigemptyset(&sa.sa_mask));
+        sa.sa_flags = 0;
+        sa.sa_handler = handle_sigint;
+        ASSERT_POSIX(sigaction(SIGINT, &sa, NULL));
+
+        // One client hanging up mid-transfer must not take a worker's other connections with it.
+        sa.sa_handler = SIG_IGN;
+        ASSERT_POSIX(sigaction(SIGPIPE, &sa, NULL));
+    }
+    const DispatchServerConfig config = handle_cmd_args(argc, argv);
+    digest_cache_init();
+    const int listenfd = server_socket_create(config.config.address, config.config.port);
+    socketfd_valid(&config, listenfd);
+    assert(checked_close(listenfd));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,176 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "client_utils.h"
+
+// Connection racing after RFC 8305. A hostname resolves to every A and AAAA record, sorted by
+// getaddrinfo's RFC 6724 rules and then interleaved so the families alternate, the preferred
+// one first. Attempts start one attempt delay apart, or at once when the previous one failed,
+// and the first to complete wins, the rest are closed. A family that is broken in a way that
+// swallows SYNs then costs one attempt delay instead of the kernel's full connect timeout.
+//
+// The RFC recommends 250 ms between attempts with 10 ms as the floor. The servers are usually
+// a LAN or loopback away, so the default is lower.
+
+enum {
+    HAPPY_EYEBALLS_MAX_ADDRESSES = 16,
+    HAPPY_EYEBALLS_DEFAULT_ATTEMPT_DELAY_MS = 50,
+    HAPPY_EYEBALLS_MIN_ATTEMPT_DELAY_MS = 10
+};
+
+typedef struct {
+    size_t count;
+    struct sockaddr_storage addresses[HAPPY_EYEBALLS_MAX_ADDRESSES];
+    socklen_t lengths[HAPPY_EYEBALLS_MAX_ADDRESSES];
+} HappyEyeballsTargets;
+
+static void happy_eyeballs_format(const struct sockaddr_storage *const address, char *const buffer, const size_t size) {
+    char host[INET6_ADDRSTRLEN] = "?";
+    if(address->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *const in6 = (const struct sockaddr_in6 *)address;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        snprintf(buffer, size, "[%s]:%u", host, ntohs(in6->sin6_port));
+    } else {
+        const struct sockaddr_in *const in = (const struct sockaddr_in *)address;
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        snprintf(buffer, size, "%s:%u", host, ntohs(in->sin_port));
+    }
+}
+
+static bool happy_eyeballs_resolve(const char *const host, const uint16_t port, HappyEyeballsTargets *const targets) {
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+    const struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_protocol = IPPROTO_TCP };
+    struct addrinfo *result;
+    const int status = getaddrinfo(host, service, &hints, &result);
+    if(status != 0) {
+        printf("[Failed to resolve %s] [gai_strerror: %s]\n", host, gai_strerror(status));
+        return false;
+    }
+    // getaddrinfo already put the preferred family first, interleave the rest behind it.
+    const struct addrinfo *by_family[2][HAPPY_EYEBALLS_MAX_ADDRESSES];
+    size_t family_counts[2] = { 0, 0 };
+    const int preferred_family = result->ai_family;
+    for(const struct addrinfo *entry = result; entry != NULL; entry = entry->ai_next) {
+        const size_t family = entry->ai_family == preferred_family ? 0 : 1;
+        if(family_counts[family] < HAPPY_EYEBALLS_MAX_ADDRESSES) {
+            by_family[family][family_counts[family]++] = entry;
+        }
+    }
+    targets->count = 0;
+    for(size_t i = 0; targets->count < HAPPY_EYEBALLS_MAX_ADDRESSES and (i < family_counts[0] or i < family_counts[1]); ++i) {
+        for(size_t family = 0; family < 2 and targets->count < HAPPY_EYEBALLS_MAX_ADDRESSES; ++family) {
+            if(i < family_counts[family]) {
+                memcpy(&targets->addresses[targets->count], by_family[family][i]->ai_addr, by_family[family][i]->ai_addrlen);
+                targets->lengths[targets->count] = by_family[family][i]->ai_addrlen;
+                ++targets->count;
+            }
+        }
+    }
+    freeaddrinfo(result);
+    return targets->count > 0;
+}
+
+static int64_t happy_eyeballs_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Returns a connected blocking socket or -1. timeout_ms bounds the whole race, 0 waits for the
+// kernel to give up on every attempt.
+static int happy_eyeballs_connect(const HappyEyeballsTargets *const targets, const uint32_t attempt_delay_ms, const uint32_t timeout_ms) {
+    struct pollfd attempts[HAPPY_EYEBALLS_MAX_ADDRESSES];
+    size_t attempt_targets[HAPPY_EYEBALLS_MAX_ADDRESSES];
+    size_t active_count = 0;
+    size_t next_target = 0;
+    const int64_t started_at = happy_eyeballs_now_ms();
+    const int64_t deadline = timeout_ms != 0 ? started_at + timeout_ms : INT64_MAX;
+    int64_t next_attempt_at = started_at;
+    int winner = -1;
+    while(winner == -1) {
+        const int64_t now = happy_eyeballs_now_ms();
+        if(now >= deadline) {
+            printf("[Connect timed out after %u ms]\n", timeout_ms);
+            break;
+        }
+        if(next_target < targets->count and (now >= next_attempt_at or active_count == 0)) {
+            char name[INET6_ADDRSTRLEN + 8];
+            happy_eyeballs_format(&targets->addresses[next_target], name, sizeof(name));
+            const int sock = socket(targets->addresses[next_target].ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+            if(sock == -1 or (connect(sock, (const struct sockaddr *)&targets->addresses[next_target], targets->lengths[next_target]) == -1 and errno != EINPROGRESS)) {
+                printf("[Connect to %s failed] [errno: %d] [strerror: %s]\n", name, errno, strerror(errno));
+                if(sock != -1) {
+                    checked_close(sock);
+                }
+                ++next_target;
+                next_attempt_at = now;
+                continue;
+            }
+            printf("[Connecting to %s] [attempt: %zu/%zu] [after_ms: %ld]\n", name, next_target + 1, targets->count, now - started_at);
+            attempts[active_count] = (struct pollfd){ .fd = sock, .events = POLLOUT };
+            attempt_targets[active_count] = next_target++;
+            ++active_count;
+            next_attempt_at = now + attempt_delay_ms;
+        }
+        if(active_count == 0) {
+            printf("[Every address refused the connection]\n");
+            break;
+        }
+        int64_t wait_until = deadline;
+        if(next_target < targets->count and next_attempt_at < wait_until) {
+            wait_until = next_attempt_at;
+        }
+        const int wait_ms = wait_until == INT64_MAX ? -1 : wait_until > now ? (int)(wait_until - now) : 0;
+        if(poll(attempts, active_count, wait_ms) == -1) {
+            printf("[Failed to poll connect attempts] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            break;
+        }
+        for(size_t i = 0; i < active_count and winner == -1;) {
+            if(attempts[i].revents == 0) {
+                ++i;
+                continue;
+            }
+            int error = 0;
+            socklen_t error_length = sizeof(error);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+            char name[INET6_ADDRSTRLEN + 8];
+            happy_eyeballs_format(&targets->addresses[attempt_targets[i]], name, sizeof(name));
+            if(error == 0) {
+                printf("[Connected to %s] [after_ms: %ld]\n", name, happy_eyeballs_now_ms() - started_at);
+                winner = attempts[i].fd;
+                attempts[i] = attempts[--active_count];
+                attempt_targets[i] = attempt_targets[active_count];
+                break;
+            }
+            printf("[Connect to %s failed] [errno: %d] [strerror: %s]\n", name, error, strerror(error));
+            checked_close(attempts[i].fd);
+            attempts[i] = attempts[--active_count];
+            attempt_targets[i] = attempt_targets[active_count];
+            next_attempt_at = happy_eyeballs_now_ms();
+        }
+    }
+    for(size_t i = 0; i < active_count; ++i) {
+        checked_close(attempts[i].fd);
+    }
+    if(winner != -1) {
+        const int flags = fcntl(winner, F_GETFL);
+        if(flags == -1 or fcntl(winner, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+            printf("[Failed to make the connection blocking] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            checked_close(winner);
+            return -1;
+        }
+    }
+    return winner;
+}
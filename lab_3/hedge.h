@@ -0,0 +1,140 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "client_utils.h"
+
+// Hedged GETs. When no response header arrived within the hedge delay the same request goes to
+// the next replica in the shard ranking, the first header wins and the other connection is reset
+// before the client acknowledges the size, so the loser never sends a body byte.
+//
+// The delay is either fixed or a percentile of the recent time to first response byte. Clients
+// are one-shot processes, so the samples and the hedge counters live next to the health file:
+//   <requests> <hedged> <hedges_won>
+//   <time_to_header_ms>
+//   ...
+
+enum {
+    HEDGE_HISTORY_SIZE = 256,
+    // Below this many samples a percentile is noise and the default delay is used instead.
+    HEDGE_MIN_SAMPLES = 16
+};
+
+static const double HEDGE_DEFAULT_DELAY_MS = 50;
+static const double HEDGE_MIN_DELAY_MS = 1;
+
+typedef struct {
+    bool is_enabled;
+    // 0 means delay_ms is fixed.
+    unsigned percentile;
+    double delay_ms;
+} HedgeConfig;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t hedged;
+    uint64_t hedges_won;
+    size_t count;
+    double samples[HEDGE_HISTORY_SIZE];
+} HedgeHistory;
+
+// <delay_ms> or p<percentile>.
+static bool hedge_parse(const char *const spec, HedgeConfig *const hedge) {
+    char *end;
+    if(spec[0] == 'p') {
+        const unsigned long percentile = strtoul(spec + 1, &end, 10);
+        if(end == spec + 1 or *end != '\0' or percentile == 0 or percentile >= 100) {
+            return false;
+        }
+        *hedge = (HedgeConfig){ .is_enabled = true, .percentile = (unsigned)percentile, .delay_ms = HEDGE_DEFAULT_DELAY_MS };
+        return true;
+    }
+    const double delay_ms = strtod(spec, &end);
+    if(end == spec or *end != '\0' or delay_ms < 0) {
+        return false;
+    }
+    *hedge = (HedgeConfig){ .is_enabled = true, .percentile = 0, .delay_ms = delay_ms };
+    return true;
+}
+
+static void hedge_history_parse(HedgeHistory *const history, FILE *const file) {
+    memset(history, 0, sizeof(*history));
+    if(fscanf(file, "%lu %lu %lu\n", &history->requests, &history->hedged, &history->hedges_won) != 3) {
+        memset(history, 0, sizeof(*history));
+        return;
+    }
+    while(history->count < HEDGE_HISTORY_SIZE and fscanf(file, "%lf\n", &history->samples[history->count]) == 1) {
+        ++history->count;
+    }
+}
+
+static void hedge_history_load(const char *const path, HedgeHistory *const history) {
+    memset(history, 0, sizeof(*history));
+    FILE *const file = fopen(path, "r");
+    if(file == NULL) {
+        return;
+    }
+    flock(fileno(file), LOCK_SH);
+    hedge_history_parse(history, file);
+    fclose(file);
+}
+
+static int hedge_compare_samples(const void *const lhs, const void *const rhs) {
+    const double left = *(const double *)lhs;
+    const double right = *(const double *)rhs;
+    return (left > right) - (left < right);
+}
+
+static double hedge_delay_ms(const HedgeConfig *const hedge, const HedgeHistory *const history) {
+    if(hedge->percentile == 0 or history->count < HEDGE_MIN_SAMPLES) {
+        return hedge->delay_ms;
+    }
+    double sorted[HEDGE_HISTORY_SIZE];
+    memcpy(sorted, history->samples, history->count * sizeof(sorted[0]));
+    qsort(sorted, history->count, sizeof(sorted[0]), hedge_compare_samples);
+    const double delay_ms = sorted[(history->count - 1) * hedge->percentile / 100];
+    return delay_ms < HEDGE_MIN_DELAY_MS ? HEDGE_MIN_DELAY_MS : delay_ms;
+}
+
+// Read, append and rewrite under an exclusive lock, the oldest sample falls out once the
+// window is full. history is left with the updated counters.
+static void hedge_history_record(
+    const char *const path,
+    const double time_to_header_ms,
+    const bool is_hedged,
+    const bool is_hedge_won,
+    HedgeHistory *const history
+) {
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        printf("[Failed to open hedge history: %s] [errno: %d] [strerror: %s]\n", path, errno, strerror(errno));
+        return;
+    }
+    flock(fd, LOCK_EX);
+    FILE *const file = fdopen(fd, "r+");
+    hedge_history_parse(history, file);
+    ++history->requests;
+    history->hedged += is_hedged;
+    history->hedges_won += is_hedge_won;
+    if(history->count == HEDGE_HISTORY_SIZE) {
+        memmove(history->samples, history->samples + 1, (HEDGE_HISTORY_SIZE - 1) * sizeof(history->samples[0]));
+        --history->count;
+    }
+    history->samples[history->count++] = time_to_header_ms;
+    rewind(file);
+    fprintf(file, "%lu %lu %lu\n", history->requests, history->hedged, history->hedges_won);
+    for(size_t i = 0; i < history->count; ++i) {
+        fprintf(file, "%.3f\n", history->samples[i]);
+    }
+    fflush(file);
+    if(ftruncate(fd, ftell(file)) == -1) {
+        printf("[Failed to truncate hedge history: %s] [errno: %d] [strerror: %s]\n", path, errno, strerror(errno));
+    }
+    fclose(file);
+}
@@ -3,16 +3,16 @@
 #include <signal.h>
 
 static IterativeServerConfig handle_cmd_args(const int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <server_address> <server_port> <directory_path>\n", argv[0]);
+    IterativeServerConfig config;
+    const int first_arg = iterative_server_parse_options(argc, argv, &config);
+    if (first_arg == -1 or argc - first_arg != 3) {
+        fprintf(stderr, "Usage: %s [-u <unix_socket_path>] [-q <max_upload_size>] [-z <variant_cache_dir>] [-C <tls_cert> -K <tls_key>] [-b <backlog>] [-p <busy_poll_us>] [-U <upstream_ip:port> [-L <cache_bytes>]] [-c <cold_file_bytes> [-O]] [-g <group_ip:port> [-r <rate_mbit>]] [-T <trace_file> [-n <trace_records>]] <server_address> <server_port> <directory_path>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    const IterativeServerConfig config = {
-        .address = argv[1],
-        .port = (uint16_t)atoi(argv[2]),
-        .dir_path = argv[3],
-    };
+    config.address = argv[first_arg];
+    config.port = (uint16_t)atoi(argv[first_arg + 1]);
+    config.dir_path = argv[first_arg + 2];
 
     iterative_server_print_config(&config);
 
@@ -20,16 +20,13 @@ static IterativeServerConfig handle_cmd_args(const int argc, char **argv) {
 }
 
 static void inner_function(const int listenfd, const IterativeServerConfig *const config) {
-    struct sockaddr_in srv_sin4 = {
-        .sin_family  = AF_INET,
-        .sin_port = htons(config->port),
-        .sin_addr.s_addr = inet_addr(config->address)
-    };
-    ASSERT_POSIX(bind(listenfd, (struct sockaddr *)&srv_sin4, sizeof(srv_sin4)));
-    ASSERT_POSIX(listen(listenfd, MAX_BACKLOG));
+    server_listen_tcp(listenfd, config->backlog);
 
     printf("[Server listening on %s:%d]\n", config->address, config->port);
-    iterative_server_main_loop(listenfd, config->dir_path);
+    ServerListeners listeners;
+    server_listeners_init(&listeners, listenfd, config);
+    iterative_server_main_loop(&listeners, config);
+    server_listeners_destroy(&listeners, config->unix_path);
 }
 
 int main(const int argc, char *argv[]) {
@@ -42,8 +39,8 @@ int main(const int argc, char *argv[]) {
     }
 
     const IterativeServerConfig config = handle_cmd_args(argc, argv);
-    const int listenfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    ASSERT_POSIX(listenfd);
+    digest_cache_init();
+    const int listenfd = server_socket_create(config.address, config.port);
     inner_function(listenfd, &config);
     assert(checked_close(listenfd));
     return EXIT_SUCCESS;
@@ -1,4 +1,5 @@
 #pragma once
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,13 +17,43 @@
 #include <endian.h>
 #include <alloca.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/statvfs.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sched.h>
 
 #include "client_utils.h"
+#include "digest_cache.h"
+#include "delta.h"
+#include "compression.h"
+#include "tls.h"
+#include "scoreboard.h"
+#include "proxy_cache.h"
+#include "cache_policy.h"
+#include "multicast.h"
+#include "trace.h"
 
 typedef struct {
     const char *address;
     uint16_t port;
     const char *dir_path;
+    const char *unix_path;
+    uint64_t max_upload_size;
+    const char *variant_dir;
+    const char *tls_cert;
+    const char *tls_key;
+    SSL_CTX *tls_context;
+    int backlog;
+    uint32_t busy_poll_us;
+    ProxyConfig proxy;
+    CachePolicyConfig cache_policy;
+    MulticastConfig multicast;
+    const char *trace_path;
+    uint64_t trace_records;
+    TraceRing trace;
 } IterativeServerConfig;
 
 static void iterative_server_print_config(const IterativeServerConfig *config) {
@@ -30,6 +61,118 @@ static void iterative_server_print_config(const IterativeServerConfig *config) {
     printf("\tAddress: %s\n", config->address);
     printf("\tPort: %d\n", config->port);
     printf("\tDirectory Path: %s\n", config->dir_path);
+    if(config->unix_path != NULL) {
+        printf("\tUnix Socket Path: %s\n", config->unix_path);
+    }
+    printf("\tMaximum upload size: %lu\n", config->max_upload_size);
+    printf("\tListen backlog: %d\n", config->backlog);
+    if(config->busy_poll_us != 0) {
+        printf("\tBusy poll: %u us\n", config->busy_poll_us);
+    }
+    if(config->proxy.is_enabled) {
+        char upstream[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &config->proxy.upstream.sin_addr, upstream, sizeof(upstream));
+        printf("\tProxy upstream: %s:%d\n", upstream, ntohs(config->proxy.upstream.sin_port));
+        printf("\tProxy cache bytes: %lu\n", config->proxy.cache_bytes);
+    }
+    if(config->cache_policy.cold_bytes != 0) {
+        printf("\tCold files from: %lu bytes, streamed %s\n", config->cache_policy.cold_bytes,
+            config->cache_policy.is_direct ? "with O_DIRECT" : "dropping pages behind");
+    }
+    if(config->multicast.is_enabled) {
+        char group[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &config->multicast.group.sin_addr, group, sizeof(group));
+        printf("\tMulticast group: %s:%d at %u Mbit/s\n", group, ntohs(config->multicast.group.sin_port), config->multicast.rate_mbit);
+    }
+    if(config->trace.header != NULL) {
+        printf("\tTrace ring: %s, %lu records\n", config->trace_path, config->trace.header->capacity);
+    }
+    if(config->variant_dir != NULL) {
+        printf("\tCompressed variant directory: %s\n", config->variant_dir);
+    }
+    if(config->tls_context != NULL) {
+        printf("\tTLS certificate: %s\n", config->tls_cert);
+    }
+}
+
+// Options shared by all servers, a server with options of its own appends them to this string
+// and hands everything it does not know to iterative_server_parse_option.
+#define ITERATIVE_SERVER_OPTIONS "u:q:z:C:K:b:p:U:L:c:Og:r:T:n:"
+
+static void iterative_server_default_options(IterativeServerConfig *const config) {
+    config->unix_path = NULL;
+    config->max_upload_size = 0;
+    config->variant_dir = NULL;
+    config->tls_cert = NULL;
+    config->tls_key = NULL;
+    config->tls_context = NULL;
+    config->backlog = SOMAXCONN;
+    config->busy_poll_us = 0;
+    config->proxy.is_enabled = false;
+    config->proxy.cache_bytes = 0;
+    config->cache_policy = (CachePolicyConfig){ .cold_bytes = 0, .is_direct = false, .slots = NULL };
+    config->multicast = (MulticastConfig){ .is_enabled = false, .rate_mbit = MULTICAST_DEFAULT_RATE_MBIT, .sessions = NULL };
+    config->trace_path = NULL;
+    config->trace_records = TRACE_DEFAULT_RECORDS;
+    config->trace = (TraceRing){ .header = NULL, .slots = NULL };
+}
+
+static bool iterative_server_parse_option(IterativeServerConfig *const config, const int opt, const char *const arg) {
+    switch(opt) {
+        case 'u': config->unix_path = arg; return true;
+        case 'q': config->max_upload_size = strtoull(arg, NULL, 10); return true;
+        case 'z': config->variant_dir = arg; return true;
+        case 'C': config->tls_cert = arg; return true;
+        case 'K': config->tls_key = arg; return true;
+        case 'b': config->backlog = atoi(arg); return true;
+        case 'p': config->busy_poll_us = (uint32_t)strtoul(arg, NULL, 10); return true;
+        case 'U': return proxy_parse_upstream(arg, &config->proxy);
+        case 'L': config->proxy.cache_bytes = strtoull(arg, NULL, 10); return true;
+        case 'c': config->cache_policy.cold_bytes = strtoull(arg, NULL, 10); return true;
+        case 'O': config->cache_policy.is_direct = true; return true;
+        case 'g': return multicast_parse_group(arg, &config->multicast);
+        case 'r': config->multicast.rate_mbit = (uint32_t)strtoul(arg, NULL, 10); return true;
+        case 'T': config->trace_path = arg; return true;
+        case 'n': config->trace_records = strtoull(arg, NULL, 10); return true;
+        default: return false;
+    }
+}
+
+static bool iterative_server_finish_options(IterativeServerConfig *const config) {
+    if(config->backlog <= 0 or (config->tls_cert == NULL) != (config->tls_key == NULL)
+        or (config->cache_policy.is_direct and config->cache_policy.cold_bytes == 0) or config->multicast.rate_mbit == 0
+        or config->trace_records == 0) {
+        return false;
+    }
+    if(config->trace_path != NULL
+        and not trace_ring_create(&config->trace, config->trace_path, config->trace_records, TRACE_PHASE_NAMES, TracePhase_COUNT)) {
+        return false;
+    }
+    if(config->multicast.is_enabled) {
+        multicast_create_sessions(&config->multicast);
+    }
+    if(config->cache_policy.cold_bytes != 0) {
+        cache_policy_create_table(&config->cache_policy);
+    }
+    if(config->tls_cert != NULL) {
+        config->tls_context = tls_server_context_create(config->tls_cert, config->tls_key);
+        if(config->tls_context == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses the options shared by all servers and returns the index of the first positional argument.
+static int iterative_server_parse_options(const int argc, char *const *const argv, IterativeServerConfig *const config) {
+    iterative_server_default_options(config);
+    int opt;
+    while((opt = getopt(argc, argv, ITERATIVE_SERVER_OPTIONS)) != -1) {
+        if(not iterative_server_parse_option(config, opt, optarg)) {
+            return -1;
+        }
+    }
+    return iterative_server_finish_options(config) ? optind : -1;
 }
 
 static volatile sig_atomic_t keep_running = true;
@@ -38,16 +181,285 @@ static void handle_sigint(const int val __attribute__((unused))) {
 }
 
 enum {
-    MAX_BACKLOG = 10
+    DEFER_ACCEPT_SECONDS = 5,
+    FASTOPEN_QUEUE_LENGTH = 256,
+    ACCEPT_POLL_TIMEOUT_MS = 1000,
+    ACCEPT_BACKOFF_MS = 100,
+    // A blocking sendfile only returns once it sent everything it was asked for, bounding
+    // each call keeps the scoreboard's bytes pending moving during long transfers.
+    SENDFILE_CHUNK_SIZE = 1 << 20
 };
 
+typedef struct {
+    int tcp_fd;
+    int unix_fd;
+    uint32_t busy_poll_us;
+} ServerListeners;
+
+// Low-latency mode. An idle server keeps retrying accept for busy_poll_us before it goes to
+// sleep in poll, so a request arriving within the budget skips the wakeup, and accepted
+// sockets get SO_BUSY_POLL so their blocking reads poll the NIC queue before sleeping. The
+// spin yields between attempts, on a shared core the client still gets to run. Both burn the
+// CPU they save latency on, the counts below and the process CPU time say how much.
+typedef struct {
+    uint64_t spin_hits;
+    uint64_t sleeps;
+    struct timespec started_at;
+} BusyPollStats;
+
+static BusyPollStats busy_poll_stats;
+
+static int64_t busy_poll_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void busy_poll_set_socket(const int sock, const uint32_t busy_poll_us) {
+    static bool is_failure_logged = false;
+    const int value = (int)busy_poll_us;
+    if(setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) == -1 and not is_failure_logged) {
+        printf("[Failed to set SO_BUSY_POLL] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        is_failure_logged = true;
+    }
+}
+
+static void busy_poll_print_stats(const uint32_t busy_poll_us) {
+    if(busy_poll_us == 0) {
+        return;
+    }
+    struct rusage usage;
+    ASSERT_POSIX(getrusage(RUSAGE_SELF, &usage));
+    const double cpu_seconds = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double wall_seconds = (double)(now.tv_sec - busy_poll_stats.started_at.tv_sec)
+        + (double)(now.tv_nsec - busy_poll_stats.started_at.tv_nsec) / 1e9;
+    printf("[Busy poll] [budget_us: %u] [spin_hits: %lu] [sleeps: %lu] [cpu_seconds: %.2f] [wall_seconds: %.2f] [cpu: %.0f%%]\n",
+        busy_poll_us, busy_poll_stats.spin_hits, busy_poll_stats.sleeps, cpu_seconds, wall_seconds, 100 * cpu_seconds / wall_seconds);
+}
+
+// SO_REUSEADDR lets a restarted server bind again while the previous run's connections sit in TIME_WAIT.
+// An IPv6 address gets a dual-stack socket, bound to :: it also takes IPv4 clients as mapped
+// addresses, so one listener serves clients racing both families.
+static int server_socket_create(const char *const address, const uint16_t port) {
+    struct sockaddr_storage srv_addr = { 0 };
+    socklen_t srv_addr_len;
+    struct sockaddr_in6 *const srv_sin6 = (struct sockaddr_in6 *)&srv_addr;
+    struct sockaddr_in *const srv_sin4 = (struct sockaddr_in *)&srv_addr;
+    if(inet_pton(AF_INET6, address, &srv_sin6->sin6_addr) == 1) {
+        srv_sin6->sin6_family = AF_INET6;
+        srv_sin6->sin6_port = htons(port);
+        srv_addr_len = sizeof(*srv_sin6);
+    } else {
+        assert(inet_pton(AF_INET, address, &srv_sin4->sin_addr) == 1);
+        srv_sin4->sin_family = AF_INET;
+        srv_sin4->sin_port = htons(port);
+        srv_addr_len = sizeof(*srv_sin4);
+    }
+    const int tcp_fd = socket(srv_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    ASSERT_POSIX(tcp_fd);
+    const int is_reuse_address = 1;
+    ASSERT_POSIX(setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &is_reuse_address, sizeof(is_reuse_address)));
+    if(srv_addr.ss_family == AF_INET6) {
+        const int is_v6_only = 0;
+        ASSERT_POSIX(setsockopt(tcp_fd, IPPROTO_IPV6, IPV6_V6ONLY, &is_v6_only, sizeof(is_v6_only)));
+    }
+    ASSERT_POSIX(bind(tcp_fd, (const struct sockaddr *)&srv_addr, srv_addr_len));
+    return tcp_fd;
+}
+
+// With TCP_DEFER_ACCEPT a connection is only queued once its first bytes arrived, so
+// handle_client never blocks on a client that connected and went quiet. TCP_FASTOPEN lets
+// a returning client put the request into its SYN. Both are optional, a kernel without
+// them still gets a working listener.
+static void server_listen_tcp(const int tcp_fd, const int backlog) {
+    ASSERT_POSIX(listen(tcp_fd, backlog));
+    const int defer_accept_seconds = DEFER_ACCEPT_SECONDS;
+    if(setsockopt(tcp_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept_seconds, sizeof(defer_accept_seconds)) == -1) {
+        printf("[Failed to set TCP_DEFER_ACCEPT] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    const int fastopen_queue_length = FASTOPEN_QUEUE_LENGTH;
+    if(setsockopt(tcp_fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue_length, sizeof(fastopen_queue_length)) == -1) {
+        printf("[Failed to set TCP_FASTOPEN] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+}
+
+static int server_listeners_create_unix(const char *const unix_path, const int backlog) {
+    struct sockaddr_un srv_sun = { .sun_family = AF_UNIX };
+    assert(strlen(unix_path) < ARRAY_SIZE(srv_sun.sun_path));
+    strcpy(srv_sun.sun_path, unix_path);
+    const int unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_POSIX(unix_fd);
+    if(unlink(unix_path) == -1) {
+        assert(errno == ENOENT);
+    }
+    ASSERT_POSIX(bind(unix_fd, (struct sockaddr *)&srv_sun, sizeof(srv_sun)));
+    ASSERT_POSIX(listen(unix_fd, backlog));
+    printf("[Server listening on unix:%s]\n", unix_path);
+    return unix_fd;
+}
+
+// Both listeners are non-blocking, so workers sharing them can race on the same wakeup
+// and the losers just go back to polling.
+static void server_listeners_init(ServerListeners *const listeners, const int tcp_fd, const IterativeServerConfig *const config) {
+    listeners->tcp_fd = tcp_fd;
+    listeners->unix_fd = config->unix_path != NULL ? server_listeners_create_unix(config->unix_path, config->backlog) : -1;
+    listeners->busy_poll_us = config->busy_poll_us;
+    clock_gettime(CLOCK_MONOTONIC, &busy_poll_stats.started_at);
+    ASSERT_POSIX(fcntl(listeners->tcp_fd, F_SETFL, O_NONBLOCK));
+    if(listeners->unix_fd != -1) {
+        ASSERT_POSIX(fcntl(listeners->unix_fd, F_SETFL, O_NONBLOCK));
+    }
+}
+
+static void server_listeners_destroy(const ServerListeners *const listeners, const char *const unix_path) {
+    if(listeners->unix_fd != -1) {
+        assert(checked_close(listeners->unix_fd));
+        unlink(unix_path);
+    }
+}
+
+// An accept that failed for lack of descriptors or memory leaves the connection queued and the
+// listener readable, polling again would spin at full CPU until something is freed. Returns
+// true after backing off for such an error.
+static bool server_accept_backoff(const int error) {
+    if(error != EMFILE and error != ENFILE and error != ENOBUFS and error != ENOMEM) {
+        return false;
+    }
+    printf("[Failed to accept, backing off %d ms] [errno: %d] [strerror: %s]\n", ACCEPT_BACKOFF_MS, error, strerror(error));
+    usleep(ACCEPT_BACKOFF_MS * 1000);
+    return true;
+}
+
+// Drains whatever is already queued before going back to poll, during a connection storm
+// every call is a single accept4 instead of poll plus accept. Accepted sockets stay blocking,
+// the request handlers read whole messages. The poll timeout bounds how long a stop request
+// that lands just before poll goes unnoticed.
+static int server_listeners_accept(const ServerListeners *const listeners) {
+    static size_t next_listener = 0;
+    const int fds[] = { listeners->tcp_fd, listeners->unix_fd };
+    const size_t listener_count = ARRAY_SIZE(fds);
+    int64_t spin_deadline_ns = 0;
+    while(keep_running) {
+        for(size_t attempt = 0; attempt < listener_count; ++attempt) {
+            const size_t i = (next_listener + attempt) % listener_count;
+            if(fds[i] == -1) {
+                continue;
+            }
+            struct sockaddr_storage client_addr;
+            socklen_t addrlen = sizeof(client_addr);
+            const int connection_fd = accept4(fds[i], (struct sockaddr *)&client_addr, &addrlen, SOCK_CLOEXEC);
+            if(connection_fd < 0) {
+                if(server_accept_backoff(errno)) {
+                    return -1;
+                }
+                continue;
+            }
+            next_listener = i + 1;
+            if(listeners->busy_poll_us != 0) {
+                busy_poll_stats.spin_hits += spin_deadline_ns != 0;
+                busy_poll_set_socket(connection_fd, listeners->busy_poll_us);
+            }
+            if(client_addr.ss_family == AF_INET) {
+                const struct sockaddr_in *const client_in = (const struct sockaddr_in *)&client_addr;
+                printf("[New connection from %s:%d]\n", inet_ntoa(client_in->sin_addr), ntohs(client_in->sin_port));
+            } else if(client_addr.ss_family == AF_INET6) {
+                const struct sockaddr_in6 *const client_in6 = (const struct sockaddr_in6 *)&client_addr;
+                char client_host[INET6_ADDRSTRLEN];
+                inet_ntop(AF_INET6, &client_in6->sin6_addr, client_host, sizeof(client_host));
+                printf("[New connection from [%s]:%d]\n", client_host, ntohs(client_in6->sin6_port));
+            } else {
+                printf("[New local connection] [connection_fd: %d]\n", connection_fd);
+            }
+            return connection_fd;
+        }
+        if(listeners->busy_poll_us != 0) {
+            const int64_t now_ns = busy_poll_now_ns();
+            if(spin_deadline_ns == 0) {
+                spin_deadline_ns = now_ns + (int64_t)listeners->busy_poll_us * 1000;
+            }
+            if(now_ns < spin_deadline_ns) {
+                sched_yield();
+                continue;
+            }
+            ++busy_poll_stats.sleeps;
+        }
+        struct pollfd pfds[] = {
+            { .fd = listeners->tcp_fd, .events = POLLIN },
+            { .fd = listeners->unix_fd, .events = POLLIN },
+        };
+        if(poll(pfds, ARRAY_SIZE(pfds), ACCEPT_POLL_TIMEOUT_MS) == -1) {
+            return -1;
+        }
+        spin_deadline_ns = 0;
+    }
+    return -1;
+}
+
+// Only connections accepted on the unix listener count, the TLS relay's socketpair is unnamed.
+static bool is_unix_socket(const int sock) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = sizeof(addr);
+    return getsockname(sock, (struct sockaddr *)&addr, &addr_len) != -1
+        and addr.sun_family == AF_UNIX
+        and addr_len > sizeof(addr.sun_family);
+}
+
+typedef struct {
+    CompressionCodec codec;
+    int fd;
+    off_t size;
+} CompressedBody;
+
+// Picks the codec for a compressed request, body->fd stays -1 when the file goes out raw.
+static void select_compressed_body(
+    const int fd,
+    const int client_sock,
+    const IterativeServerConfig *const config,
+    const char *const filename,
+    const uint8_t codec_mask,
+    CompressedBody *const body
+) {
+    body->codec = CompressionCodec_NONE;
+    body->fd = -1;
+    body->size = 0;
+    struct stat st;
+    if(not (codec_mask & COMPRESSION_CODEC_MASK_DEFLATE)
+        or is_unix_socket(client_sock)
+        or compression_is_skipped_name(filename)
+        or fstat(fd, &st) == -1
+        or not compression_is_compressible(fd, st.st_size)) {
+        return;
+    }
+    char default_variant_dir[PATH_MAX];
+    snprintf(default_variant_dir, sizeof(default_variant_dir), "%s/%s", config->dir_path, VARIANT_DIR_NAME);
+    const int variant_fd = compression_open_variant(fd, &st, config->variant_dir != NULL ? config->variant_dir : default_variant_dir, CompressionCodec_DEFLATE);
+    struct stat variant_st;
+    if(variant_fd == -1 or fstat(variant_fd, &variant_st) == -1 or variant_st.st_size >= st.st_size) {
+        printf("[Client_sock: %d] [Sending uncompressed: %s] [errno: %d] [strerror: %s]\n", client_sock, filename, errno, strerror(errno));
+        if(variant_fd != -1) {
+            checked_close(variant_fd);
+        }
+        return;
+    }
+    body->codec = CompressionCodec_DEFLATE;
+    body->fd = variant_fd;
+    body->size = variant_st.st_size;
+}
+
 static void with_file_open(
     const int fd,
     const int client_sock,
-    const char *const buffer 
+    const char *const buffer,
+    const bool with_digest,
+    const CompressedBody *const compressed,
+    const CachePolicyConfig *const cache_policy
 ) {
     struct stat st;
-    if(fstat(fd, &st) == -1) {
+    uint32_t digest = 0;
+    if(fstat(fd, &st) == -1 or (with_digest and not file_digest(fd, &st, &digest))) {
         printf("[Client_sock: %d] [Error stat: %s] [errno: %d] [strerror: %s]\n", client_sock, buffer, errno, strerror(errno));
         const bool is_file_size_ok = false;
         if(not checked_write(client_sock, &is_file_size_ok, sizeof(is_file_size_ok), NULL)) {
@@ -69,6 +481,25 @@ static void with_file_open(
             return;
         }
     }
+    if(with_digest) {
+        const uint32_t network_digest = htonl(digest);
+        if(not checked_write(client_sock, &network_digest, sizeof(network_digest), NULL)) {
+            printf("[Client_sock: %d] [Failed to send digest] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            return;
+        }
+        printf("[Client_sock: %d] [Sent digest: %08x]\n", client_sock, digest);
+    }
+    if(compressed != NULL) {
+        const uint8_t codec = (uint8_t)compressed->codec;
+        const uint64_t network_body_size = htobe64((uint64_t)(compressed->fd != -1 ? compressed->size : st.st_size));
+        if(not checked_write(client_sock, &codec, sizeof(codec), NULL)
+            or not checked_write(client_sock, &network_body_size, sizeof(network_body_size), NULL)) {
+            printf("[Client_sock: %d] [Failed to send codec] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            return;
+        }
+        printf("[Client_sock: %d] [Sent codec: %d]\n", client_sock, codec);
+    }
+    trace_phase(TracePhase_HEADER_SENT);
     bool is_client_ready;
     if(not checked_read(client_sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
         printf("[Client_sock: %d] [Failed to receive clients file approval] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
@@ -78,27 +509,332 @@ static void with_file_open(
         printf("[Client_sock: %d] [Client rejected file receiving]\n", client_sock);
         return;
     }
-    
+    trace_phase(TracePhase_CLIENT_READY);
+
+    const bool is_compressed = compressed != NULL and compressed->fd != -1;
+    if(is_unix_socket(client_sock) and not is_compressed) {
+        if(not checked_send_fd(client_sock, fd)) {
+            printf("[Client_sock: %d] [Failed to pass file descriptor] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            return;
+        }
+        printf("[Client_sock: %d] [Passed file descriptor]\n", client_sock);
+        return;
+    }
     printf("[Client_sock: %d] [Ready to send file]\n", client_sock);
     {
+        const int body_fd = is_compressed ? compressed->fd : fd;
+        const off_t body_size = is_compressed ? compressed->size : st.st_size;
         off_t offset = 0;
-        while(offset < st.st_size) {
-            const ssize_t nsendfile = sendfile(client_sock, fd, &offset, (size_t)(st.st_size - offset));
+        scoreboard_begin_send((uint64_t)body_size);
+        // Compressed variants are small by construction, only whole files are classified.
+        const CacheClass cache_class = is_compressed ? CacheClass_HOT : cache_policy_classify(cache_policy, &st);
+        if(cache_class != CacheClass_HOT) {
+            printf("[Client_sock: %d] [Streaming cold file %s]\n", client_sock, cache_class == CacheClass_COLD_DIRECT ? "with O_DIRECT" : "dropping pages behind");
+        }
+        if(cache_class == CacheClass_COLD_DIRECT) {
+            offset = cache_policy_send_direct(client_sock, body_fd, body_size);
+            if(offset != -1) {
+                trace_bytes((uint64_t)offset, 0);
+                trace_phase(TracePhase_BODY_DONE);
+                scoreboard_end_send((uint64_t)(body_size - offset));
+                if(offset == body_size) {
+                    printf("[Client_sock: %d] [Finished sending file]\n", client_sock);
+                }
+                return;
+            }
+            offset = 0;
+        }
+        off_t dropped = 0;
+        while(offset < body_size) {
+            const off_t chunk = body_size - offset < SENDFILE_CHUNK_SIZE ? body_size - offset : SENDFILE_CHUNK_SIZE;
+            const ssize_t nsendfile = sendfile(client_sock, body_fd, &offset, (size_t)chunk);
+            trace_sendfile(nsendfile);
+            if(nsendfile > 0) {
+                scoreboard_add_bytes_sent((uint64_t)nsendfile);
+            }
+            if(cache_class != CacheClass_HOT) {
+                cache_policy_drop_behind(body_fd, offset, false, &dropped);
+            }
             if(nsendfile < 0) {
                 printf("[Client_sock: %d] [Failed to sendfile] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+                scoreboard_end_send((uint64_t)(body_size - offset));
                 return;
             } else if(nsendfile == 0) {
                 break;
             }
         }
+        if(cache_class != CacheClass_HOT) {
+            cache_policy_drop_behind(body_fd, offset, true, &dropped);
+        }
+        scoreboard_end_send((uint64_t)(body_size - offset));
+        trace_phase(TracePhase_BODY_DONE);
     }
     printf("[Client_sock: %d] [Finished sending file]\n", client_sock);
 }
 
-static void handle_client(
+// Lets clients check a segment of a resumed or split download without transferring it again.
+static void handle_digest_range(
+    const int fd,
+    const int client_sock
+) {
+    uint64_t range[2];
+    if(not checked_read(client_sock, range, sizeof(range), NULL)) {
+        printf("[Client_sock: %d] [Failed to receive digest range] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    const uint64_t offset = be64toh(range[0]);
+    const uint64_t length = be64toh(range[1]);
+    struct stat st;
+    uint32_t digest = 0;
+    bool is_range_ok = fstat(fd, &st) != -1 and offset <= (uint64_t)st.st_size and length <= (uint64_t)st.st_size - offset;
+    if(is_range_ok) {
+        is_range_ok = (offset == 0 and length == (uint64_t)st.st_size)
+            ? file_digest(fd, &st, &digest)
+            : mapped_range_digest(fd, (off_t)offset, (off_t)length, &digest);
+    }
+    if(not checked_write(client_sock, &is_range_ok, sizeof(is_range_ok), NULL)) {
+        printf("[Client_sock: %d] [Failed to send digest range ok] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    if(not is_range_ok) {
+        printf("[Client_sock: %d] [Invalid digest range] [offset: %lu] [length: %lu]\n", client_sock, offset, length);
+        return;
+    }
+    const uint32_t network_digest = htonl(digest);
+    if(not checked_write(client_sock, &network_digest, sizeof(network_digest), NULL)) {
+        printf("[Client_sock: %d] [Failed to send digest] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    printf("[Client_sock: %d] [Sent range digest] [offset: %lu] [length: %lu] [digest: %08x]\n", client_sock, offset, length, digest);
+}
+
+// Serves byte ranges of the file until the client sends an empty one, clients of a multicast
+// session fetch what they lost this way over one connection.
+static void handle_get_range(
+    const int fd,
+    const int client_sock
+) {
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        printf("[Client_sock: %d] [Failed to fstat] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    uint64_t ranges_sent = 0;
+    uint64_t bytes_sent = 0;
+    for(;;) {
+        uint64_t range[2];
+        if(not checked_read(client_sock, range, sizeof(range), NULL)) {
+            printf("[Client_sock: %d] [Failed to receive range] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            return;
+        }
+        const uint64_t offset = be64toh(range[0]);
+        const uint64_t length = be64toh(range[1]);
+        if(length == 0) {
+            break;
+        }
+        const bool is_range_ok = offset <= (uint64_t)st.st_size and length <= (uint64_t)st.st_size - offset;
+        // Corked, the reply byte goes out with the range instead of waiting on a delayed ACK,
+        // which would cost every range of a repair tens of milliseconds.
+        int is_corked = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_CORK, &is_corked, sizeof(is_corked));
+        if(not checked_write(client_sock, &is_range_ok, sizeof(is_range_ok), NULL)) {
+            printf("[Client_sock: %d] [Failed to send range ok] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            return;
+        }
+        if(not is_range_ok) {
+            printf("[Client_sock: %d] [Invalid range] [offset: %lu] [length: %lu]\n", client_sock, offset, length);
+            return;
+        }
+        off_t position = (off_t)offset;
+        const off_t end = (off_t)(offset + length);
+        while(position < end) {
+            const off_t chunk = end - position < SENDFILE_CHUNK_SIZE ? end - position : SENDFILE_CHUNK_SIZE;
+            const ssize_t nsendfile = sendfile(client_sock, fd, &position, (size_t)chunk);
+            trace_sendfile(nsendfile);
+            if(nsendfile <= 0) {
+                printf("[Client_sock: %d] [Failed to sendfile range] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+                return;
+            }
+            scoreboard_add_bytes_sent((uint64_t)nsendfile);
+        }
+        is_corked = 0;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_CORK, &is_corked, sizeof(is_corked));
+        ++ranges_sent;
+        bytes_sent += length;
+    }
+    trace_phase(TracePhase_BODY_DONE);
+    printf("[Client_sock: %d] [Sent ranges] [count: %lu] [bytes: %lu]\n", client_sock, ranges_sent, bytes_sent);
+}
+
+// Sends only what changed relative to the client's copy, described by its block signatures.
+static void handle_delta(
+    const int fd,
+    const int client_sock
+) {
+    DeltaHeader header;
+    if(not delta_read(client_sock, &header, sizeof(header))) {
+        printf("[Client_sock: %d] [Failed to receive delta header] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    const uint32_t block_size = ntohl(header.block_size);
+    const uint64_t block_count = be64toh(header.block_count);
+    struct stat st;
+    uint32_t digest = 0;
+    const bool is_delta_ok = block_size >= DELTA_MIN_BLOCK_SIZE
+        and block_count <= DELTA_MAX_BLOCKS
+        and fstat(fd, &st) != -1
+        and file_digest(fd, &st, &digest);
+    if(not checked_write(client_sock, &is_delta_ok, sizeof(is_delta_ok), NULL)) {
+        printf("[Client_sock: %d] [Failed to send delta ok] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    if(not is_delta_ok) {
+        printf("[Client_sock: %d] [Invalid delta request] [block size: %u] [block count: %lu]\n", client_sock, block_size, block_count);
+        return;
+    }
+    {
+        const uint64_t network_file_size = htobe64((uint64_t)st.st_size);
+        if(not checked_write(client_sock, &network_file_size, sizeof(network_file_size), NULL)) {
+            printf("[Client_sock: %d] [Failed to send file size] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            return;
+        }
+    }
+    bool is_client_ready;
+    if(not delta_read(client_sock, &is_client_ready, sizeof(is_client_ready))) {
+        printf("[Client_sock: %d] [Failed to receive clients file approval] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    if(not is_client_ready) {
+        printf("[Client_sock: %d] [Client rejected file receiving]\n", client_sock);
+        return;
+    }
+    BlockSignature *const signatures = malloc((block_count + 1) * sizeof(*signatures));
+    if(not delta_read(client_sock, signatures, block_count * sizeof(*signatures))) {
+        printf("[Client_sock: %d] [Failed to receive block signatures] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        free(signatures);
+        return;
+    }
+    for(uint64_t i = 0; i < block_count; ++i) {
+        signatures[i].weak = ntohl(signatures[i].weak);
+        signatures[i].strong = ntohl(signatures[i].strong);
+    }
+    printf("[Client_sock: %d] [Received block signatures] [block size: %u] [block count: %lu]\n", client_sock, block_size, block_count);
+    uint64_t literal_bytes;
+    if(not delta_send(client_sock, fd, st.st_size, digest, block_size, signatures, block_count, &literal_bytes)) {
+        printf("[Client_sock: %d] [Failed to send delta] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+    } else {
+        printf("[Client_sock: %d] [Finished sending delta] [file size: %ld] [literal bytes: %lu]\n", client_sock, st.st_size, literal_bytes);
+    }
+    free(signatures);
+}
+
+static const char UPLOAD_TEMP_PREFIX[] = ".upload.";
+
+static bool is_upload_temp_name(const char *const filename) {
+    return strncmp(filename, UPLOAD_TEMP_PREFIX, strlen(UPLOAD_TEMP_PREFIX)) == 0;
+}
+
+// Enforces the quota and reserves the space before any payload moves, returns -1 if the upload is refused.
+static int upload_open_temp(
+    const int client_sock,
+    const IterativeServerConfig *const config,
+    const char *const filename,
+    const uint64_t file_size,
+    char *const temp_path
+) {
+    if(filename[0] == '\0' or strchr(filename, '/') != NULL or is_upload_temp_name(filename)) {
+        printf("[Client_sock: %d] [Upload filename not allowed: %s]\n", client_sock, filename);
+        return -1;
+    }
+    if(file_size > config->max_upload_size) {
+        printf("[Client_sock: %d] [Upload exceeds quota] [file_size: %lu] [max_upload_size: %lu]\n", client_sock, file_size, config->max_upload_size);
+        return -1;
+    }
+    struct statvfs stv;
+    if(statvfs(config->dir_path, &stv) == -1 or (uint64_t)stv.f_bavail * stv.f_frsize < file_size) {
+        printf("[Client_sock: %d] [Not enough space for upload] [file_size: %lu]\n", client_sock, file_size);
+        return -1;
+    }
+    snprintf(temp_path, PATH_MAX, "%s/%sXXXXXX", config->dir_path, UPLOAD_TEMP_PREFIX);
+    const int temp_fd = mkostemp(temp_path, O_CLOEXEC);
+    if(temp_fd == -1) {
+        printf("[Client_sock: %d] [Failed to create upload file] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return -1;
+    }
+    if(fchmod(temp_fd, 0644) == -1 or (file_size > 0 and fallocate(temp_fd, 0, 0, (off_t)file_size) == -1 and errno != EOPNOTSUPP)) {
+        printf("[Client_sock: %d] [Failed to preallocate upload file] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        checked_close(temp_fd);
+        unlink(temp_path);
+        return -1;
+    }
+    return temp_fd;
+}
+
+// The body lands in a hidden temp file that is renamed over the target only once complete,
+// so concurrent readers see either the old or the new version.
+static void handle_upload(
     const int client_sock,
-    const char* const dir_path
+    const IterativeServerConfig *const config,
+    const char *const filename
 ) {
+    uint64_t file_size;
+    if(not checked_read(client_sock, &file_size, sizeof(file_size), NULL)) {
+        printf("[Client_sock: %d] [Failed to receive upload size] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    file_size = be64toh(file_size);
+    printf("[Client_sock: %d] [Upload request: %s] [file_size: %lu]\n", client_sock, filename, file_size);
+
+    char temp_path[PATH_MAX];
+    const int temp_fd = upload_open_temp(client_sock, config, filename, file_size, temp_path);
+    {
+        const bool is_upload_possible = temp_fd != -1;
+        if(not checked_write(client_sock, &is_upload_possible, sizeof(is_upload_possible), NULL)) {
+            printf("[Client_sock: %d] [Failed to send upload possibility] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        }
+        if(not is_upload_possible) {
+            return;
+        }
+    }
+    trace_phase(TracePhase_CLIENT_READY);
+    bool is_committed = false;
+    int pipefd[2];
+    if(pipe(pipefd) < 0) {
+        printf("[Client_sock: %d] [Can not create pipe] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+    } else {
+        if(not checked_splice_to_file(client_sock, pipefd, temp_fd, file_size)) {
+            printf("[Client_sock: %d] [Failed to receive upload] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        } else {
+            trace_bytes(0, file_size);
+            trace_phase(TracePhase_BODY_DONE);
+            char final_path[PATH_MAX];
+            snprintf(final_path, ARRAY_SIZE(final_path), "%s/%s", config->dir_path, filename);
+            is_committed = rename(temp_path, final_path) != -1;
+            if(not is_committed) {
+                printf("[Client_sock: %d] [Failed to publish upload] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            }
+        }
+        checked_close(pipefd[0]);
+        checked_close(pipefd[1]);
+    }
+    if(not is_committed) {
+        unlink(temp_path);
+    }
+    if(not checked_close(temp_fd)) {
+        printf("[Client_sock: %d] [Failed to close upload file] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+    }
+    if(not checked_write(client_sock, &is_committed, sizeof(is_committed), NULL)) {
+        printf("[Client_sock: %d] [Failed to send upload commit] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    printf("[Client_sock: %d] [Finished receiving upload: %d]\n", client_sock, is_committed);
+}
+
+static void handle_client_request(
+    const int client_sock,
+    const IterativeServerConfig *const config
+) {
+    const char *const dir_path = config->dir_path;
     {
         printf("[Client_sock: %d] [Start handling client]\n", client_sock);
         uint8_t client_protocol_version;
@@ -107,6 +843,7 @@ static void handle_client(
             return;
         }
         printf("[Client_sock: %d] [Client protocol version: %d]\n", client_sock, client_protocol_version);
+        trace_phase(TracePhase_VERSION_RECEIVED);
         {
             const bool is_protocol_match = client_protocol_version == PROTOCOL_VERSION;
             if(not checked_write(client_sock, &is_protocol_match, sizeof(is_protocol_match), NULL)) {
@@ -119,6 +856,11 @@ static void handle_client(
             }
         }
     }
+    uint8_t operation;
+    if(not checked_read(client_sock, &operation, sizeof(operation), NULL)) {
+        printf("[Client_sock: %d] [Failed to receive operation] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
     char *buffer;
     {
         filename_buff_t filename_buffer;
@@ -127,7 +869,11 @@ static void handle_client(
             return;
         }
 
-        if(memchr(filename_buffer, '\0', ARRAY_SIZE(filename_buffer)) == NULL) {
+        if(memchr(filename_buffer, '\0', ARRAY_SIZE(filename_buffer)) == NULL
+            or operation > RequestOperation_GET_RANGE
+            or is_upload_temp_name(filename_buffer)
+            or is_proxy_temp_name(filename_buffer)
+            or strncmp(filename_buffer, VARIANT_DIR_NAME, strlen(VARIANT_DIR_NAME)) == 0) {
             printf("[Client_sock: %d] [Error filename not valid]\n", client_sock);
             const bool is_file_size_ok = false;
             if(not checked_write(client_sock, &is_file_size_ok, sizeof(is_file_size_ok), NULL)) {
@@ -135,13 +881,31 @@ static void handle_client(
             }
             return;
         }
+        trace_request(operation, filename_buffer);
+        if(operation == RequestOperation_PUT) {
+            handle_upload(client_sock, config, filename_buffer);
+            return;
+        }
         const size_t dir_path_strlen = strlen(dir_path);
         const size_t filename_strlen = strlen(filename_buffer);
         const size_t buffer_byte_count = dir_path_strlen + 1 + filename_strlen + 1;
         buffer = malloc(buffer_byte_count);
         snprintf(buffer, buffer_byte_count, "%s/%s", dir_path, filename_buffer);
     }
-    const int fd = open(buffer, O_RDONLY);
+    int fd = open(buffer, O_RDONLY);
+    if(config->proxy.is_enabled) {
+        if(fd != -1) {
+            proxy_touch(fd);
+        } else if(errno == ENOENT) {
+            // A plain GET streams straight from the fetch, the other operations need the whole file.
+            const char *const filename = buffer + strlen(dir_path) + 1;
+            fd = proxy_open(&config->proxy, dir_path, filename, operation == RequestOperation_GET ? client_sock : -1);
+            if(fd == PROXY_ANSWERED) {
+                free(buffer);
+                return;
+            }
+        }
+    }
     if(fd == -1) {
         printf("[Client_sock: %d] [Error open file: %s] [errno: %d] [strerror: %s]\n", client_sock, buffer, errno, strerror(errno));
         const bool is_file_size_ok = false;
@@ -149,7 +913,30 @@ static void handle_client(
             printf("[Client_sock: %d] [Failed to inform failure file size not ok] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
         }
     } else {
-        with_file_open(fd, client_sock, buffer);
+        trace_phase(TracePhase_FILE_OPENED);
+        if(operation == RequestOperation_DIGEST_RANGE) {
+            handle_digest_range(fd, client_sock);
+        } else if(operation == RequestOperation_GET_DELTA) {
+            handle_delta(fd, client_sock);
+        } else if(operation == RequestOperation_GET_RANGE) {
+            handle_get_range(fd, client_sock);
+        } else if(operation == RequestOperation_GET_MULTICAST) {
+            multicast_handle_request(&config->multicast, config->address, fd, client_sock);
+        } else if(operation == RequestOperation_GET_COMPRESSED) {
+            uint8_t codec_mask;
+            if(not checked_read(client_sock, &codec_mask, sizeof(codec_mask), NULL)) {
+                printf("[Client_sock: %d] [Failed to receive codec mask] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            } else {
+                CompressedBody compressed;
+                select_compressed_body(fd, client_sock, config, buffer, codec_mask, &compressed);
+                with_file_open(fd, client_sock, buffer, false, &compressed, &config->cache_policy);
+                if(compressed.fd != -1 and not checked_close(compressed.fd)) {
+                    printf("[Client_sock: %d] [Failed to close compressed variant] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+                }
+            }
+        } else {
+            with_file_open(fd, client_sock, buffer, operation == RequestOperation_GET_DIGEST, NULL, &config->cache_policy);
+        }
         if(not checked_close(fd)) {
             printf("[Client_sock: %d] [Failed to close file] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
         }
@@ -157,4 +944,30 @@ static void handle_client(
     free(buffer);
 }
 
-
+// TCP clients of a TLS-enabled server talk through the session, unix socket clients stay local.
+// With tracing on the whole connection, handshake included, becomes one trace record.
+static void handle_client(
+    const int client_sock,
+    const IterativeServerConfig *const config
+) {
+    TraceRecord trace_record;
+    if(config->trace.header != NULL) {
+        trace_record_begin(&config->trace, &trace_record);
+        trace_self = &trace_record;
+    }
+    if(config->tls_context == NULL or is_unix_socket(client_sock)) {
+        handle_client_request(client_sock, config);
+    } else {
+        TlsSession session;
+        if(tls_session_start(&session, config->tls_context, client_sock, NULL)) {
+            handle_client_request(session.app_fd, config);
+            tls_session_finish(&session);
+        } else {
+            printf("[Client_sock: %d] [TLS handshake failed]\n", client_sock);
+        }
+    }
+    if(trace_self != NULL) {
+        trace_ring_write(&config->trace, trace_self);
+        trace_self = NULL;
+    }
+}
@@ -0,0 +1,443 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "client_utils.h"
+
+// One-to-many distribution for rollouts, where many clients want the same file at once.
+//
+// A GET_MULTICAST request is answered over TCP with the file size and an announcement: the
+// UDP group and port, a session id and when the transmission starts. Requests for the same
+// file inside the join window get the same session, the first one forks a sender that waits
+// for the window to close and then sends the file exactly once, however many clients joined.
+// A multicast group needs the clients to join it, any other address is sent to as broadcast.
+//
+// Every MULTICAST_FEC_GROUP data blocks are followed by their XOR parity, so a client repairs
+// one lost block per group by itself. Blocks a group lost more of are fetched afterwards with
+// GET_RANGE requests on the ordinary TCP port. A group goes out as one UDP GSO send of
+// equally sized segments, or one sendmmsg where the kernel lacks UDP_SEGMENT, paced to the
+// configured rate, as nothing else stops a sender from overrunning every receive buffer.
+
+enum {
+    MULTICAST_BLOCK_SIZE = 1400,
+    MULTICAST_FEC_GROUP = 8,
+    MULTICAST_JOIN_WINDOW_MS = 500,
+    // A session closer to its start than this is not offered to new clients, they might miss
+    // the first blocks while joining.
+    MULTICAST_JOIN_MARGIN_MS = 50,
+    MULTICAST_DEFAULT_RATE_MBIT = 200,
+    MULTICAST_SESSION_SLOTS = 64,
+    MULTICAST_END_REPEATS = 3,
+    MULTICAST_END_INTERVAL_MS = 10,
+    MULTICAST_RECEIVE_BATCH = 64,
+    MULTICAST_IDLE_TIMEOUT_MS = 1000,
+    MULTICAST_RECEIVE_BUFFER = 16 << 20,
+    MULTICAST_INDEX_END = 0xff
+};
+
+typedef struct {
+    uint32_t session_id;
+    uint32_t group;
+    uint16_t length;
+    // Below data_count a data block, equal to it the parity, MULTICAST_INDEX_END once done.
+    uint8_t index;
+    uint8_t data_count;
+} MulticastHeader;
+
+typedef struct {
+    uint32_t group_address;
+    uint16_t port;
+    uint16_t block_size;
+    uint32_t session_id;
+    uint32_t start_in_ms;
+    uint8_t fec_group;
+    uint8_t reserved[3];
+} MulticastAnnouncement;
+
+enum { MULTICAST_SEGMENT_SIZE = sizeof(MulticastHeader) + MULTICAST_BLOCK_SIZE };
+
+typedef struct {
+    uint64_t key;
+    uint32_t session_id;
+    int64_t start_at_ms;
+} MulticastSession;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t next_session_id;
+    MulticastSession sessions[MULTICAST_SESSION_SLOTS];
+} MulticastSessions;
+
+typedef struct {
+    bool is_enabled;
+    struct sockaddr_in group;
+    uint32_t rate_mbit;
+    MulticastSessions *sessions;
+} MulticastConfig;
+
+static int64_t multicast_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t multicast_block_count(const uint64_t file_size, const uint16_t block_size) {
+    return (file_size + block_size - 1) / block_size;
+}
+
+static bool multicast_parse_group(const char *const arg, MulticastConfig *const config) {
+    char address[INET_ADDRSTRLEN];
+    unsigned port;
+    if(sscanf(arg, "%15[0-9.]:%u", address, &port) != 2 or port == 0 or port > UINT16_MAX
+        or inet_pton(AF_INET, address, &config->group.sin_addr) != 1) {
+        return false;
+    }
+    config->group.sin_family = AF_INET;
+    config->group.sin_port = htons((uint16_t)port);
+    config->is_enabled = true;
+    return true;
+}
+
+// The session table is shared by forked workers, like the scoreboard it is mapped before the
+// first fork.
+static void multicast_create_sessions(MulticastConfig *const config) {
+    void *const memory = mmap(NULL, sizeof(MulticastSessions), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(memory != MAP_FAILED);
+    config->sessions = memory;
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&config->sessions->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+static void multicast_pace(const int64_t started_at_ns, const uint64_t bytes_sent, const uint32_t rate_mbit) {
+    const int64_t due_ns = started_at_ns + (int64_t)(bytes_sent * 8 * 1000 / rate_mbit);
+    const struct timespec due = { .tv_sec = due_ns / 1000000000, .tv_nsec = due_ns % 1000000000 };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+}
+
+static bool multicast_send_segments(const int sock, const struct sockaddr_in *const group, uint8_t *const segments, const size_t count, const bool is_gso) {
+    if(is_gso) {
+        struct iovec iov = { .iov_base = segments, .iov_len = count * MULTICAST_SEGMENT_SIZE };
+        const struct msghdr message = { .msg_name = (void *)(uintptr_t)group, .msg_namelen = sizeof(*group), .msg_iov = &iov, .msg_iovlen = 1 };
+        return sendmsg(sock, &message, 0) != -1;
+    }
+    struct mmsghdr messages[MULTICAST_FEC_GROUP + 1];
+    struct iovec iovs[MULTICAST_FEC_GROUP + 1];
+    for(size_t i = 0; i < count; ++i) {
+        iovs[i] = (struct iovec){ .iov_base = segments + i * MULTICAST_SEGMENT_SIZE, .iov_len = MULTICAST_SEGMENT_SIZE };
+        messages[i] = (struct mmsghdr){ .msg_hdr = { .msg_name = (void *)(uintptr_t)group, .msg_namelen = sizeof(*group), .msg_iov = &iovs[i], .msg_iovlen = 1 } };
+    }
+    for(size_t sent = 0; sent < count;) {
+        const int nsent = sendmmsg(sock, messages + sent, (unsigned)(count - sent), 0);
+        if(nsent <= 0) {
+            return false;
+        }
+        sent += (size_t)nsent;
+    }
+    return true;
+}
+
+// Runs in the forked sender. Short blocks are padded to a full segment, GSO needs every
+// segment but the last one the same size, the header carries the real length.
+static void multicast_send(const MulticastConfig *const config, const char *const server_address, const int fd, const uint64_t file_size,
+    const uint32_t session_id, const int64_t start_at_ms) {
+    const int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
+        printf("[Multicast %u] [Failed to create socket] [errno: %d] [strerror: %s]\n", session_id, errno, strerror(errno));
+        return;
+    }
+    if(IN_MULTICAST(ntohl(config->group.sin_addr.s_addr))) {
+        // Leave through the interface the server listens on, which for 127.0.0.1 is loopback.
+        struct in_addr interface;
+        if(inet_pton(AF_INET, server_address, &interface) == 1 and interface.s_addr != htonl(INADDR_ANY)) {
+            setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface));
+        }
+    } else {
+        const int is_broadcast = 1;
+        setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &is_broadcast, sizeof(is_broadcast));
+    }
+    const int segment_size = MULTICAST_SEGMENT_SIZE;
+    bool is_gso = setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) == 0;
+    uint8_t *const segments = calloc(MULTICAST_FEC_GROUP + 1, MULTICAST_SEGMENT_SIZE);
+    const uint64_t block_count = multicast_block_count(file_size, MULTICAST_BLOCK_SIZE);
+    const uint64_t group_count = (block_count + MULTICAST_FEC_GROUP - 1) / MULTICAST_FEC_GROUP;
+    const struct timespec start = { .tv_sec = start_at_ms / 1000, .tv_nsec = start_at_ms % 1000 * 1000000 };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &start, NULL);
+    struct timespec started_at;
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+    const int64_t started_at_ns = (int64_t)started_at.tv_sec * 1000000000 + started_at.tv_nsec;
+    uint64_t bytes_sent = 0;
+    uint64_t group = 0;
+    for(; group < group_count; ++group) {
+        const uint64_t first_block = group * MULTICAST_FEC_GROUP;
+        const size_t data_count = (size_t)(block_count - first_block < MULTICAST_FEC_GROUP ? block_count - first_block : MULTICAST_FEC_GROUP);
+        MulticastHeader *const parity_header = (MulticastHeader *)(void *)(segments + data_count * MULTICAST_SEGMENT_SIZE);
+        uint8_t *const parity = (uint8_t *)(parity_header + 1);
+        memset(parity, 0, MULTICAST_BLOCK_SIZE);
+        bool is_read_ok = true;
+        for(size_t i = 0; i < data_count and is_read_ok; ++i) {
+            MulticastHeader *const header = (MulticastHeader *)(void *)(segments + i * MULTICAST_SEGMENT_SIZE);
+            uint8_t *const payload = (uint8_t *)(header + 1);
+            const off_t offset = (off_t)((first_block + i) * MULTICAST_BLOCK_SIZE);
+            const size_t length = (size_t)((uint64_t)offset + MULTICAST_BLOCK_SIZE <= file_size ? MULTICAST_BLOCK_SIZE : file_size - (uint64_t)offset);
+            is_read_ok = pread(fd, payload, length, offset) == (ssize_t)length;
+            memset(payload + length, 0, MULTICAST_BLOCK_SIZE - length);
+            *header = (MulticastHeader){ .session_id = htonl(session_id), .group = htonl((uint32_t)group), .length = htons((uint16_t)length),
+                .index = (uint8_t)i, .data_count = (uint8_t)data_count };
+            for(size_t byte = 0; byte < MULTICAST_BLOCK_SIZE; ++byte) {
+                parity[byte] ^= payload[byte];
+            }
+        }
+        if(not is_read_ok) {
+            printf("[Multicast %u] [Failed to read file] [errno: %d] [strerror: %s]\n", session_id, errno, strerror(errno));
+            break;
+        }
+        *parity_header = (MulticastHeader){ .session_id = htonl(session_id), .group = htonl((uint32_t)group), .length = htons(MULTICAST_BLOCK_SIZE),
+            .index = (uint8_t)data_count, .data_count = (uint8_t)data_count };
+        bool is_sent = multicast_send_segments(sock, &config->group, segments, data_count + 1, is_gso);
+        if(not is_sent and is_gso and group == 0) {
+            // UDP_SEGMENT is accepted everywhere, a device without GSO support fails the send.
+            is_gso = false;
+            is_sent = multicast_send_segments(sock, &config->group, segments, data_count + 1, is_gso);
+        }
+        if(not is_sent) {
+            printf("[Multicast %u] [Failed to send] [errno: %d] [strerror: %s]\n", session_id, errno, strerror(errno));
+            break;
+        }
+        bytes_sent += (data_count + 1) * MULTICAST_SEGMENT_SIZE;
+        multicast_pace(started_at_ns, bytes_sent, config->rate_mbit);
+    }
+    const MulticastHeader end = { .session_id = htonl(session_id), .index = MULTICAST_INDEX_END };
+    for(size_t i = 0; i < MULTICAST_END_REPEATS; ++i) {
+        sendto(sock, &end, sizeof(end), 0, (const struct sockaddr *)&config->group, sizeof(config->group));
+        usleep(MULTICAST_END_INTERVAL_MS * 1000);
+    }
+    printf("[Multicast %u] [Sent %lu groups of %lu] [bytes: %lu] [gso: %d] [ms: %ld]\n",
+        session_id, group, group_count, bytes_sent, is_gso, multicast_now_ms() - start_at_ms);
+    free(segments);
+    checked_close(sock);
+}
+
+// The sender is double forked, so it outlives a worker that exits after this request and
+// nobody has to reap it. It keeps only stdio and the file, moved to the first slot after
+// stderr, so it holds no client sockets, listeners or cache locks of the worker.
+static void multicast_spawn_sender(const MulticastConfig *const config, const char *const server_address, const int fd, const int client_sock,
+    const uint64_t file_size, const uint32_t session_id, const int64_t start_at_ms) {
+    fflush(stdout);
+    const pid_t pid = fork();
+    if(pid == -1) {
+        printf("[Client_sock: %d] [Failed to fork multicast sender] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    if(pid == 0) {
+        if(fork() == 0) {
+            const int file_fd = STDERR_FILENO + 1;
+            if((fd != file_fd and dup2(fd, file_fd) == -1) or close_range((unsigned int)file_fd + 1, ~0U, 0) == -1) {
+                printf("[Multicast %u] [Failed to close inherited descriptors] [errno: %d] [strerror: %s]\n", session_id, errno, strerror(errno));
+                fflush(stdout);
+                _exit(0);
+            }
+            multicast_send(config, server_address, file_fd, file_size, session_id, start_at_ms);
+            fflush(stdout);
+        }
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+// Answers a GET_MULTICAST request with the session the client is to join.
+static void multicast_handle_request(const MulticastConfig *const config, const char *const server_address, const int fd, const int client_sock) {
+    struct stat st;
+    const bool is_file_size_ok = config->is_enabled and fstat(fd, &st) != -1;
+    if(not checked_write(client_sock, &is_file_size_ok, sizeof(is_file_size_ok), NULL) or not is_file_size_ok) {
+        printf("[Client_sock: %d] [Multicast not available] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    const uint64_t key = ((uint64_t)st.st_dev << 48 ^ (uint64_t)st.st_ino ^ (uint64_t)st.st_mtim.tv_nsec << 20 ^ (uint64_t)st.st_mtim.tv_sec)
+        * 0x9e3779b97f4a7c15ULL;
+    MulticastSession *const slot = &config->sessions->sessions[key % MULTICAST_SESSION_SLOTS];
+    const int64_t now = multicast_now_ms();
+    pthread_mutex_lock(&config->sessions->lock);
+    const bool is_new_session = slot->key != key or slot->start_at_ms - now < MULTICAST_JOIN_MARGIN_MS;
+    if(is_new_session) {
+        *slot = (MulticastSession){ .key = key, .session_id = ++config->sessions->next_session_id, .start_at_ms = now + MULTICAST_JOIN_WINDOW_MS };
+    }
+    const MulticastSession session = *slot;
+    pthread_mutex_unlock(&config->sessions->lock);
+    if(is_new_session) {
+        multicast_spawn_sender(config, server_address, fd, client_sock, (uint64_t)st.st_size, session.session_id, session.start_at_ms);
+    }
+    const uint64_t network_file_size = htobe64((uint64_t)st.st_size);
+    const MulticastAnnouncement announcement = {
+        .group_address = config->group.sin_addr.s_addr, .port = config->group.sin_port, .block_size = htons(MULTICAST_BLOCK_SIZE),
+        .session_id = htonl(session.session_id), .start_in_ms = htonl((uint32_t)(session.start_at_ms - now)), .fec_group = MULTICAST_FEC_GROUP
+    };
+    bool is_client_ready = false;
+    if(not checked_write(client_sock, &network_file_size, sizeof(network_file_size), NULL)
+        or not checked_write(client_sock, &announcement, sizeof(announcement), NULL)
+        or not checked_read(client_sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
+        printf("[Client_sock: %d] [Failed to announce multicast session] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+        return;
+    }
+    printf("[Client_sock: %d] [Multicast session %u] [new: %d] [starts in: %ld ms] [client ready: %d]\n",
+        client_sock, session.session_id, is_new_session, session.start_at_ms - now, is_client_ready);
+}
+
+typedef struct {
+    uint64_t datagrams;
+    uint64_t dropped;
+    uint64_t blocks;
+    uint64_t recovered;
+} MulticastReceiveStats;
+
+// Joins the announced group on the interface the control connection uses.
+static int multicast_open_receiver(const MulticastAnnouncement *const announcement, const int control_sock) {
+    const int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
+        return -1;
+    }
+    const int is_reuse_address = 1;
+    const int receive_buffer = MULTICAST_RECEIVE_BUFFER;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &is_reuse_address, sizeof(is_reuse_address));
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &receive_buffer, sizeof(receive_buffer)) == -1) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    }
+    const struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = announcement->port, .sin_addr = { .s_addr = announcement->group_address } };
+    struct sockaddr_in local;
+    socklen_t local_length = sizeof(local);
+    const bool is_multicast = IN_MULTICAST(ntohl(announcement->group_address));
+    if(bind(sock, (const struct sockaddr *)&address, sizeof(address)) == -1
+        or (is_multicast and getsockname(control_sock, (struct sockaddr *)&local, &local_length) == -1)) {
+        checked_close(sock);
+        return -1;
+    }
+    if(is_multicast) {
+        const struct ip_mreq membership = { .imr_multiaddr = address.sin_addr, .imr_interface = local.sin_family == AF_INET ? local.sin_addr : (struct in_addr){ htonl(INADDR_ANY) } };
+        if(setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == -1) {
+            checked_close(sock);
+            return -1;
+        }
+    }
+    return sock;
+}
+
+static void multicast_store_block(const int file_fd, const uint64_t file_size, const uint64_t block, const uint8_t *const payload,
+    uint8_t *const have, MulticastReceiveStats *const stats) {
+    const off_t offset = (off_t)(block * MULTICAST_BLOCK_SIZE);
+    const size_t length = (size_t)((uint64_t)offset + MULTICAST_BLOCK_SIZE <= file_size ? MULTICAST_BLOCK_SIZE : file_size - (uint64_t)offset);
+    if(pwrite(file_fd, payload, length, offset) == (ssize_t)length) {
+        have[block] = 1;
+        ++stats->blocks;
+    }
+}
+
+// XORs the parity with the group's other blocks, read back from the file, when exactly one
+// is missing. A group missing more is left for the TCP repair.
+static void multicast_recover(const int file_fd, const uint64_t file_size, const uint64_t first_block, const size_t data_count,
+    uint8_t *const parity, uint8_t *const have, MulticastReceiveStats *const stats) {
+    size_t missing_count = 0;
+    uint64_t missing = 0;
+    for(size_t i = 0; i < data_count; ++i) {
+        if(not have[first_block + i]) {
+            ++missing_count;
+            missing = first_block + i;
+        }
+    }
+    if(missing_count != 1) {
+        return;
+    }
+    uint8_t block[MULTICAST_BLOCK_SIZE];
+    for(size_t i = 0; i < data_count; ++i) {
+        if(first_block + i == missing) {
+            continue;
+        }
+        const off_t offset = (off_t)((first_block + i) * MULTICAST_BLOCK_SIZE);
+        memset(block, 0, sizeof(block));
+        if(pread(file_fd, block, MULTICAST_BLOCK_SIZE, offset) == -1) {
+            return;
+        }
+        for(size_t byte = 0; byte < MULTICAST_BLOCK_SIZE; ++byte) {
+            parity[byte] ^= block[byte];
+        }
+    }
+    const uint64_t blocks_before = stats->blocks;
+    multicast_store_block(file_fd, file_size, missing, parity, have, stats);
+    stats->recovered += stats->blocks - blocks_before;
+}
+
+// Receives the session into file_fd until every block is there, the sender says it is done,
+// or the group goes quiet. have[] tells the caller which blocks are still missing. loss_percent
+// throws away that share of the datagrams, for testing the repair paths.
+static void multicast_receive(const int sock, const MulticastAnnouncement *const announcement, const uint64_t file_size, const int file_fd,
+    const uint32_t loss_percent, uint8_t *const have, MulticastReceiveStats *const stats) {
+    const uint32_t session_id = ntohl(announcement->session_id);
+    const uint64_t block_count = multicast_block_count(file_size, MULTICAST_BLOCK_SIZE);
+    const uint8_t fec_group = announcement->fec_group;
+    uint8_t *const buffers = malloc((size_t)MULTICAST_RECEIVE_BATCH * MULTICAST_SEGMENT_SIZE);
+    struct mmsghdr messages[MULTICAST_RECEIVE_BATCH];
+    struct iovec iovs[MULTICAST_RECEIVE_BATCH];
+    unsigned seed = (unsigned)getpid() ^ (unsigned)multicast_now_ms();
+    int timeout_ms = (int)ntohl(announcement->start_in_ms) + MULTICAST_IDLE_TIMEOUT_MS;
+    bool is_ended = false;
+    while(stats->blocks < block_count and not is_ended) {
+        struct pollfd poll_fd = { .fd = sock, .events = POLLIN };
+        const int ready = poll(&poll_fd, 1, timeout_ms);
+        if(ready <= 0) {
+            if(ready == -1 and errno == EINTR) {
+                continue;
+            }
+            printf("[Multicast %u] [No datagrams for %d ms]\n", session_id, timeout_ms);
+            break;
+        }
+        timeout_ms = MULTICAST_IDLE_TIMEOUT_MS;
+        for(size_t i = 0; i < MULTICAST_RECEIVE_BATCH; ++i) {
+            iovs[i] = (struct iovec){ .iov_base = buffers + i * MULTICAST_SEGMENT_SIZE, .iov_len = MULTICAST_SEGMENT_SIZE };
+            messages[i] = (struct mmsghdr){ .msg_hdr = { .msg_iov = &iovs[i], .msg_iovlen = 1 } };
+        }
+        const int count = recvmmsg(sock, messages, MULTICAST_RECEIVE_BATCH, MSG_DONTWAIT, NULL);
+        for(int i = 0; i < count; ++i) {
+            const MulticastHeader *const header = (const MulticastHeader *)(void *)(buffers + (size_t)i * MULTICAST_SEGMENT_SIZE);
+            if(messages[i].msg_len < sizeof(*header) or ntohl(header->session_id) != session_id) {
+                continue;
+            }
+            ++stats->datagrams;
+            if(loss_percent != 0 and (uint32_t)rand_r(&seed) % 100 < loss_percent) {
+                ++stats->dropped;
+                continue;
+            }
+            if(header->index == MULTICAST_INDEX_END) {
+                is_ended = true;
+                continue;
+            }
+            const uint64_t first_block = (uint64_t)ntohl(header->group) * fec_group;
+            uint8_t *const payload = (uint8_t *)(uintptr_t)(header + 1);
+            if(header->data_count > fec_group or header->index > header->data_count or first_block + header->data_count > block_count) {
+                continue;
+            }
+            if(header->index == header->data_count) {
+                multicast_recover(file_fd, file_size, first_block, header->data_count, payload, have, stats);
+            } else if(not have[first_block + header->index]) {
+                multicast_store_block(file_fd, file_size, first_block + header->index, payload, have, stats);
+            }
+        }
+    }
+    free(buffers);
+}
@@ -1,116 +1,307 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <signal.h>
+#include <sched.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <time.h>
 #include <errno.h>
 #include <err.h>
 #include <stdatomic.h>
 #include "iterative_server_utils_one.h"
 
+enum { DEFAULT_ADMISSION_QUEUE_LENGTH = 1024 };
+
 typedef struct {
     IterativeServerConfig config;
     int32_t max_children;
+    int32_t admission_queue_length;
 } ParallelServerConfig;
 
 static void parallel_server_print_config(const ParallelServerConfig *config) {
     iterative_server_print_config(&config->config);
     printf("\tMaximum Children: %d\n", config->max_children);
+    printf("\tAdmission queue length: %d\n", config->admission_queue_length);
 }
 
-static ParallelServerConfig handle_cmd_args(const int argc, const char **argv) {
-    if (argc != 5) {
-        printf("Usage: %s <server_address> <server_port> <directory_path> <max_children>\n", argv[0]);
+static ParallelServerConfig handle_cmd_args(const int argc, char **argv) {
+    ParallelServerConfig config;
+    iterative_server_default_options(&config.config);
+    config.admission_queue_length = DEFAULT_ADMISSION_QUEUE_LENGTH;
+    bool is_options_ok = true;
+    int opt;
+    while(is_options_ok and (opt = getopt(argc, argv, ITERATIVE_SERVER_OPTIONS "a:")) != -1) {
+        switch(opt) {
+            case 'a': config.admission_queue_length = atoi(optarg); break;
+            default: is_options_ok = iterative_server_parse_option(&config.config, opt, optarg); break;
+        }
+    }
+    const int first_arg = optind;
+    if (not is_options_ok or not iterative_server_finish_options(&config.config) or argc - first_arg != 4
+        or config.admission_queue_length < 1) {
+        printf("Usage: %s [-u <unix_socket_path>] [-q <max_upload_size>] [-z <variant_cache_dir>] [-C <tls_cert> -K <tls_key>] [-b <backlog>] [-p <busy_poll_us>] [-U <upstream_ip:port> [-L <cache_bytes>]] [-c <cold_file_bytes> [-O]] [-g <group_ip:port> [-r <rate_mbit>]] [-T <trace_file> [-n <trace_records>]] [-a <admission_queue_length>] <server_address> <server_port> <directory_path> <max_children>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    const ParallelServerConfig config = {
-        .config.address = argv[1],
-        .config.port = (uint16_t)atoi(argv[2]),
-        .config.dir_path = argv[3],
-        .max_children = atoi(argv[4])
-    };
+    config.config.address = argv[first_arg];
+    config.config.port = (uint16_t)atoi(argv[first_arg + 1]);
+    config.config.dir_path = argv[first_arg + 2];
+    config.max_children = atoi(argv[first_arg + 3]);
     assert(config.max_children > 0);
     parallel_server_print_config(&config);
     return config;
 }
 
-static atomic_int active_children = 0;
+// Sockets accepted while every child is busy wait here instead of in the kernel backlog,
+// where a full queue means dropped SYNs and second-long retransmit stalls for the client.
+typedef struct {
+    int *fds;
+    struct timespec *enqueued_at;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} AdmissionQueue;
 
-static void wait_finish_child_processes(void) {
-    while (true) {
-        const pid_t pid = waitpid(-1, NULL, WNOHANG);
-        switch (pid) {
-            case -1: {
-                if (errno != ECHILD) {
-                    printf("[Failed waitpid]");
-                }
-                return;
-            }
-            case 0: {
-                return;
-            }
-            default: {
-                printf("[Process %jd exited]\n", (intmax_t)pid);
-                atomic_fetch_add(&active_children, -1);
-            }
-        }    
-    }
+enum { WAIT_HISTOGRAM_BUCKETS = 40 };
+
+// Queue wait of every connection that was forked, in microseconds. Bucket i counts waits
+// below 2^i us, so percentiles are exact to a factor of two.
+typedef struct {
+    uint64_t admitted;
+    uint64_t queued;
+    uint64_t wait_total_us;
+    uint64_t wait_max_us;
+    size_t peak_depth;
+    uint64_t histogram[WAIT_HISTOGRAM_BUCKETS];
+} AdmissionStats;
+
+static void admission_queue_push(AdmissionQueue *const queue, const int fd) {
+    const size_t tail = (queue->head + queue->count) % queue->capacity;
+    queue->fds[tail] = fd;
+    clock_gettime(CLOCK_MONOTONIC, &queue->enqueued_at[tail]);
+    ++queue->count;
 }
 
-static void handle_sigchld(const int value __attribute__((unused))) {
-    wait_finish_child_processes();
+static int admission_queue_pop(AdmissionQueue *const queue, struct timespec *const enqueued_at) {
+    const int fd = queue->fds[queue->head];
+    *enqueued_at = queue->enqueued_at[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
+    return fd;
 }
 
-static void socketfd_valid(const ParallelServerConfig *config, const int socketfd) {
-    {
-        const struct sockaddr_in srv_sin4 = {
-            .sin_family  = AF_INET,
-            .sin_port = htons(config->config.port),
-            .sin_addr.s_addr = inet_addr(config->config.address)
-        };
-        ASSERT_POSIX(bind(socketfd, (const struct sockaddr *)&srv_sin4, sizeof(srv_sin4)));
+static void admission_stats_record(AdmissionStats *const stats, const struct timespec *const enqueued_at) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t wait_ns = (now.tv_sec - enqueued_at->tv_sec) * 1000000000 + (now.tv_nsec - enqueued_at->tv_nsec);
+    const uint64_t wait_us = wait_ns > 0 ? (uint64_t)wait_ns / 1000 : 0;
+    size_t bucket = 0;
+    while(bucket + 1 < WAIT_HISTOGRAM_BUCKETS and wait_us >= (1ull << bucket)) {
+        ++bucket;
     }
-    ASSERT_POSIX(listen(socketfd, MAX_BACKLOG));
-    printf("[Server listening on %s:%d]\n", config->config.address, config->config.port);
+    ++stats->admitted;
+    ++stats->histogram[bucket];
+    stats->wait_total_us += wait_us;
+    if(wait_us > stats->wait_max_us) {
+        stats->wait_max_us = wait_us;
+    }
+}
 
-    sigset_t sigcld_unblock_mask;
-    sigprocmask(SIG_BLOCK, NULL, &sigcld_unblock_mask);
-    sigdelset(&sigcld_unblock_mask, SIGCLD);
+static uint64_t admission_stats_percentile(const AdmissionStats *const stats, const uint64_t percent) {
+    uint64_t seen = 0;
+    for(size_t bucket = 0; bucket < WAIT_HISTOGRAM_BUCKETS; ++bucket) {
+        seen += stats->histogram[bucket];
+        if(seen * 100 >= stats->admitted * percent) {
+            return 1ull << bucket;
+        }
+    }
+    return stats->wait_max_us;
+}
 
-    sigset_t sigcld_block_mask;    
-    sigprocmask(SIG_BLOCK, NULL, &sigcld_block_mask);
-    sigaddset(&sigcld_block_mask, SIGCHLD);
+static void admission_stats_print(const AdmissionStats *const stats) {
+    printf("[Admission: %lu connections, %lu queued, peak depth %zu]\n", stats->admitted, stats->queued, stats->peak_depth);
+    if(stats->admitted != 0) {
+        printf("[Admission wait: mean %lu us, p50 < %lu us, p99 < %lu us, max %lu us]\n",
+            stats->wait_total_us / stats->admitted, admission_stats_percentile(stats, 50),
+            admission_stats_percentile(stats, 99), stats->wait_max_us);
+    }
+}
+
+// Returns true in the child once it served the connection.
+static bool spawn_child(
+    const int connection_fd,
+    const ServerListeners *const listeners,
+    const int signal_fd,
+    AdmissionQueue *const queue,
+    const IterativeServerConfig *const config
+) {
+    fflush(stdout);
+    const pid_t pid = fork();
+    if(pid < 0) {
+        printf("[Failed to fork] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return false;
+    }
+    if(pid == 0) {
+        assert(checked_close(signal_fd));
+        if(listeners->unix_fd != -1) {
+            assert(checked_close(listeners->unix_fd));
+        }
+        while(queue->count != 0) {
+            struct timespec enqueued_at;
+            assert(checked_close(admission_queue_pop(queue, &enqueued_at)));
+        }
+        sigset_t mask;
+        ASSERT_POSIX(sigemptyset(&mask));
+        ASSERT_POSIX(sigprocmask(SIG_SETMASK, &mask, NULL));
+        handle_client(connection_fd, config);
+        return true;
+    }
+    printf("[Process %jd started] [connection_fd: %d]\n", (intmax_t)pid, connection_fd);
+    return false;
+}
 
-    sigprocmask(SIG_BLOCK, &sigcld_block_mask, NULL);
+static size_t reap_children(const int signal_fd) {
+    struct signalfd_siginfo info;
+    while(read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    size_t reaped = 0;
+    while (true) {
+        const pid_t pid = waitpid(-1, NULL, WNOHANG);
+        if(pid == -1) {
+            if (errno != ECHILD) {
+                printf("[Failed waitpid] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            }
+            return reaped;
+        }
+        if(pid == 0) {
+            return reaped;
+        }
+        printf("[Process %jd exited]\n", (intmax_t)pid);
+        ++reaped;
+    }
+}
 
+// Single-threaded event loop: poll on the listeners and a signalfd for SIGCHLD. Accepting
+// never waits for a child to exit, connections beyond max_children go to the admission
+// queue and are forked in arrival order as children exit. Only a full queue leaves new
+// connections in the kernel backlog.
+static bool parallel_server_main_loop(
+    const ServerListeners *const listeners,
+    const int signal_fd,
+    AdmissionQueue *const queue,
+    AdmissionStats *const stats,
+    const ParallelServerConfig *const config
+) {
+    size_t active_children = 0;
+    const size_t max_children = (size_t)config->max_children;
     while(keep_running) {
-        const int connection_fd = accept(socketfd, NULL, NULL);
-        if(connection_fd < 0) {
+        const bool is_accepting = queue->count < queue->capacity;
+        struct pollfd pfds[] = {
+            { .fd = signal_fd, .events = POLLIN },
+            { .fd = is_accepting ? listeners->tcp_fd : -1, .events = POLLIN },
+            { .fd = is_accepting ? listeners->unix_fd : -1, .events = POLLIN },
+        };
+        // With -p the loop spins on a zero-timeout poll for the budget before it sleeps, like
+        // server_listeners_accept does for the other servers.
+        int ready = 0;
+        if(listeners->busy_poll_us != 0) {
+            const int64_t spin_deadline_ns = busy_poll_now_ns() + (int64_t)listeners->busy_poll_us * 1000;
+            while(keep_running and (ready = poll(pfds, ARRAY_SIZE(pfds), 0)) == 0 and busy_poll_now_ns() < spin_deadline_ns) {
+                sched_yield();
+            }
+            busy_poll_stats.spin_hits += ready > 0;
+            busy_poll_stats.sleeps += ready == 0;
+        }
+        if(ready == 0) {
+            ready = poll(pfds, ARRAY_SIZE(pfds), -1);
+        }
+        if(ready == -1) {
+            if(errno != EINTR) {
+                printf("[Failed poll] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            }
             continue;
         }
-        const pid_t pid = fork();
-        if(pid < 0) {
-            perror("[Failed to fork]");
-        } else if (pid == 0) {
-            handle_client(connection_fd, config->config.dir_path);
-            return;
-        } else {
-            atomic_fetch_add(&active_children, 1);
-            while(atomic_fetch_add(&active_children, 0) == config->max_children) {
-                sigsuspend(&sigcld_unblock_mask);
+        if(pfds[0].revents != 0) {
+            const size_t reaped = reap_children(signal_fd);
+            active_children = reaped < active_children ? active_children - reaped : 0;
+        }
+        for(size_t i = 1; i < ARRAY_SIZE(pfds); ++i) {
+            while(pfds[i].revents != 0 and queue->count < queue->capacity) {
+                const int connection_fd = accept4(pfds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+                if(connection_fd < 0) {
+                    server_accept_backoff(errno);
+                    break;
+                }
+                if(listeners->busy_poll_us != 0) {
+                    busy_poll_set_socket(connection_fd, listeners->busy_poll_us);
+                }
+                admission_queue_push(queue, connection_fd);
+                if(active_children + queue->count > max_children) {
+                    const size_t depth = active_children + queue->count - max_children;
+                    ++stats->queued;
+                    stats->peak_depth = depth > stats->peak_depth ? depth : stats->peak_depth;
+                }
             }
         }
-        if(not close(connection_fd)) {
-            printf("[Failed to close connection_fd: %d]", connection_fd);
+        while(active_children < max_children and queue->count != 0) {
+            struct timespec enqueued_at;
+            const int connection_fd = admission_queue_pop(queue, &enqueued_at);
+            admission_stats_record(stats, &enqueued_at);
+            if(spawn_child(connection_fd, listeners, signal_fd, queue, &config->config)) {
+                return true;
+            }
+            ++active_children;
+            if(not checked_close(connection_fd)) {
+                printf("[Failed to close connection_fd: %d]\n", connection_fd);
+            }
         }
     }
-    wait_finish_child_processes();
+    return false;
 }
 
-int main(const int argc, const char *argv[]) {
+static void socketfd_valid(const ParallelServerConfig *config, const int socketfd) {
+    server_listen_tcp(socketfd, config->config.backlog);
+    printf("[Server listening on %s:%d]\n", config->config.address, config->config.port);
+    ServerListeners listeners;
+    server_listeners_init(&listeners, socketfd, &config->config);
+
+    sigset_t sigchld_mask;
+    ASSERT_POSIX(sigemptyset(&sigchld_mask));
+    ASSERT_POSIX(sigaddset(&sigchld_mask, SIGCHLD));
+    ASSERT_POSIX(sigprocmask(SIG_BLOCK, &sigchld_mask, NULL));
+    const int signal_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    ASSERT_POSIX(signal_fd);
+
+    // The usage check keeps at least one slot, the accepted socket needs somewhere to wait for its fork.
+    const size_t capacity = (size_t)config->admission_queue_length;
+    AdmissionQueue queue = {
+        .fds = calloc(capacity, sizeof(int)),
+        .enqueued_at = calloc(capacity, sizeof(struct timespec)),
+        .capacity = capacity,
+    };
+    AdmissionStats stats = { 0 };
+    if(parallel_server_main_loop(&listeners, signal_fd, &queue, &stats, config)) {
+        return;
+    }
+    admission_stats_print(&stats);
+    busy_poll_print_stats(listeners.busy_poll_us);
+    while(queue.count != 0) {
+        struct timespec enqueued_at;
+        assert(checked_close(admission_queue_pop(&queue, &enqueued_at)));
+    }
+    free(queue.fds);
+    free(queue.enqueued_at);
+    while(waitpid(-1, NULL, 0) > 0 or errno == EINTR) {
+    }
+    assert(checked_close(signal_fd));
+    server_listeners_destroy(&listeners, config->config.unix_path);
+}
+
+int main(const int argc, char *argv[]) {
     {
         struct sigaction sa;
         ASSERT_POSIX(sigemptyset(&sa.sa_mask));
@@ -118,13 +309,10 @@ int main(const int argc, const char *argv[]) {
         
         sa.sa_handler = handle_sigint;
         ASSERT_POSIX(sigaction(SIGINT, &sa, NULL));
-
-        sa.sa_handler = handle_sigchld;
-        ASSERT_POSIX(sigaction(SIGCLD, &sa, NULL));
     }
     const ParallelServerConfig config = handle_cmd_args(argc, argv);
-    const int listenfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    ASSERT_POSIX(listenfd);
+    digest_cache_init();
+    const int listenfd = server_socket_create(config.config.address, config.config.port);
     socketfd_valid(&config, listenfd);
     assert(checked_close(listenfd));
     return EXIT_SUCCESS;
@@ -0,0 +1,188 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "client_utils.h"
+
+// Where forked workers run. Without a policy they float and the scheduler moves them between
+// cores, and on a multi-socket host between nodes, so the socket buffers, the page cache
+// pages sendfile touches and the worker's own heap end up remote. A policy is an ordered CPU
+// list, worker i is pinned to cpus[i % cpu_count], so a recycled worker lands where its slot
+// ran before.
+//
+//   -A 0,2,4-7              exactly these CPUs
+//   -A physical             the first hardware thread of every physical core
+//   -A physical:<interface> the same, restricted to the NUMA node the NIC is attached to
+//
+// A pinned worker also switches to MPOL_LOCAL, so its heap, the per-connection state included,
+// is allocated on the node of the CPU it runs on instead of wherever the page happened to be
+// faulted in before the pin.
+
+typedef struct {
+    size_t cpu_count;
+    int cpus[CPU_SETSIZE];
+    int node;
+} Placement;
+
+static const Placement PLACEMENT_NONE = { .cpu_count = 0, .node = -1 };
+
+// Parses a kernel cpulist such as "0-3,8,10-11\n" into a set.
+static bool placement_parse_cpu_list(const char *list, cpu_set_t *const set) {
+    CPU_ZERO(set);
+    while(*list != '\0' and *list != '\n') {
+        char *end;
+        const unsigned long first = strtoul(list, &end, 10);
+        if(end == list) {
+            return false;
+        }
+        unsigned long last = first;
+        if(*end == '-') {
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            if(end == list) {
+                return false;
+            }
+        }
+        if(last < first or last >= CPU_SETSIZE) {
+            return false;
+        }
+        for(unsigned long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, set);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return true;
+}
+
+static bool placement_read_line(const char *const path, char *const buffer, const size_t size) {
+    FILE *const file = fopen(path, "r");
+    if(file == NULL) {
+        return false;
+    }
+    const bool is_read = fgets(buffer, (int)size, file) != NULL;
+    fclose(file);
+    return is_read;
+}
+
+static int placement_read_int(const char *const path) {
+    char buffer[32];
+    return placement_read_line(path, buffer, sizeof(buffer)) ? atoi(buffer) : -1;
+}
+
+// A virtual interface or a single-node host reports no node, the whole machine is then local.
+static int placement_interface_node(const char *const interface) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", interface);
+    return placement_read_int(path);
+}
+
+static bool placement_node_cpus(const int node, cpu_set_t *const set) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    char list[4096];
+    return placement_read_line(path, list, sizeof(list)) and placement_parse_cpu_list(list, set);
+}
+
+static void placement_add_physical_cores(Placement *const placement, const cpu_set_t *const allowed) {
+    int seen_package[CPU_SETSIZE];
+    int seen_core[CPU_SETSIZE];
+    size_t seen_count = 0;
+    for(size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if(not CPU_ISSET(cpu, allowed)) {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%zu/topology/physical_package_id", cpu);
+        const int package = placement_read_int(path);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%zu/topology/core_id", cpu);
+        const int core = placement_read_int(path);
+        bool is_sibling = false;
+        for(size_t i = 0; i < seen_count and not is_sibling; ++i) {
+            is_sibling = seen_package[i] == package and seen_core[i] == core;
+        }
+        if(is_sibling) {
+            continue;
+        }
+        seen_package[seen_count] = package;
+        seen_core[seen_count] = core;
+        ++seen_count;
+        placement->cpus[placement->cpu_count++] = (int)cpu;
+    }
+}
+
+static bool placement_parse(const char *const spec, Placement *const placement) {
+    *placement = PLACEMENT_NONE;
+    cpu_set_t allowed;
+    ASSERT_POSIX(sched_getaffinity(0, sizeof(allowed), &allowed));
+    if(strncmp(spec, "physical", strlen("physical")) == 0) {
+        const char *const suffix = spec + strlen("physical");
+        if(*suffix == ':') {
+            placement->node = placement_interface_node(suffix + 1);
+            cpu_set_t node_cpus;
+            if(placement->node >= 0 and placement_node_cpus(placement->node, &node_cpus)) {
+                CPU_AND(&allowed, &allowed, &node_cpus);
+            } else {
+                printf("[No NUMA node for interface %s, using every node]\n", suffix + 1);
+            }
+        } else if(*suffix != '\0') {
+            return false;
+        }
+        placement_add_physical_cores(placement, &allowed);
+    } else {
+        cpu_set_t requested;
+        if(not placement_parse_cpu_list(spec, &requested)) {
+            return false;
+        }
+        for(size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if(CPU_ISSET(cpu, &requested)) {
+                if(not CPU_ISSET(cpu, &allowed)) {
+                    printf("[CPU %zu is not available to this process]\n", cpu);
+                    return false;
+                }
+                placement->cpus[placement->cpu_count++] = (int)cpu;
+            }
+        }
+    }
+    return placement->cpu_count > 0;
+}
+
+static void placement_print(const Placement *const placement) {
+    if(placement->cpu_count == 0) {
+        printf("\tPlacement: none\n");
+        return;
+    }
+    printf("\tPlacement:");
+    for(size_t i = 0; i < placement->cpu_count; ++i) {
+        printf(" %d", placement->cpus[i]);
+    }
+    if(placement->node >= 0) {
+        printf(" (node %d)", placement->node);
+    }
+    printf("\n");
+}
+
+// Called in the worker right after fork. Returns the CPU the worker is pinned to, or -1.
+static int placement_apply(const Placement *const placement, const size_t worker_index) {
+    if(placement->cpu_count == 0) {
+        return -1;
+    }
+    const int cpu = placement->cpus[worker_index % placement->cpu_count];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((size_t)cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) == -1) {
+        printf("[Failed to pin worker to CPU %d] [errno: %d] [strerror: %s]\n", cpu, errno, strerror(errno));
+        return -1;
+    }
+    if(syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1) {
+        printf("[Failed to set local memory policy] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    return cpu;
+}
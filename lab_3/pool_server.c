@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -9,107 +10,324 @@
 #include <err.h>
 #include <stdatomic.h>
 #include "iterative_server_utils_two.h"
+#include "placement.h"
+
+// The parent is a supervisor that never serves. Once per tick, or sooner when a worker exits,
+// it reads the scoreboard and keeps the number of idle workers between min_spare and
+// max_spare: it forks 1, 2, 4, ... workers on consecutive short ticks and retires one idle
+// worker per tick when there are too many. Workers exit on their own after
+// max_requests_per_child requests, which bounds whatever memory a long-lived worker collects.
+
+enum {
+    SUPERVISOR_TICK_SECONDS = 1,
+    MAX_SPAWN_RATE = 32,
+    DEFAULT_MIN_SPARE = 2,
+    DEFAULT_MAX_SPARE = 8,
+    DEFAULT_MAX_REQUESTS_PER_CHILD = 1000
+};
 
 typedef struct {
     IterativeServerConfig config;
     int32_t max_children;
+    int32_t min_spare;
+    int32_t max_spare;
+    uint64_t max_requests_per_child;
+    const char *status_path;
+    Placement placement;
 } ParallelServerConfig;
 
+typedef struct {
+    Scoreboard *scoreboard;
+    uint32_t spawn_rate;
+    uint64_t spawned;
+    uint64_t retired;
+    uint64_t exited_requests;
+    uint64_t exited_bytes_sent;
+    int64_t started_at;
+    int64_t retired_at;
+} Supervisor;
+
 static void parallel_server_print_config(const ParallelServerConfig *config) {
     iterative_server_print_config(&config->config);
     printf("\tMaximum Children: %d\n", config->max_children);
+    printf("\tSpare workers: %d..%d\n", config->min_spare, config->max_spare);
+    printf("\tRequests per child: %lu\n", config->max_requests_per_child);
+    if(config->status_path != NULL) {
+        printf("\tStatus file: %s\n", config->status_path);
+    }
+    placement_print(&config->placement);
 }
 
-static ParallelServerConfig handle_cmd_args(const int argc, const char **argv) {
-    if (argc != 5) {
-        printf("Usage: %s <server_address> <server_port> <directory_path> <max_children>\n", argv[0]);
+static ParallelServerConfig handle_cmd_args(const int argc, char **argv) {
+    ParallelServerConfig config;
+    iterative_server_default_options(&config.config);
+    config.min_spare = DEFAULT_MIN_SPARE;
+    config.max_spare = DEFAULT_MAX_SPARE;
+    config.max_requests_per_child = DEFAULT_MAX_REQUESTS_PER_CHILD;
+    config.status_path = NULL;
+    config.placement = PLACEMENT_NONE;
+    bool is_options_ok = true;
+    int opt;
+    while(is_options_ok and (opt = getopt(argc, argv, ITERATIVE_SERVER_OPTIONS "m:M:R:S:A:")) != -1) {
+        switch(opt) {
+            case 'm': config.min_spare = atoi(optarg); break;
+            case 'M': config.max_spare = atoi(optarg); break;
+            case 'R': config.max_requests_per_child = strtoull(optarg, NULL, 10); break;
+            case 'S': config.status_path = optarg; break;
+            case 'A': is_options_ok = placement_parse(optarg, &config.placement); break;
+            default: is_options_ok = iterative_server_parse_option(&config.config, opt, optarg); break;
+        }
+    }
+    const int first_arg = optind;
+    if (not is_options_ok or not iterative_server_finish_options(&config.config) or argc - first_arg != 4
+        or config.min_spare < 1 or config.max_spare < config.min_spare) {
+        printf("Usage: %s [-u <unix_socket_path>] [-q <max_upload_size>] [-z <variant_cache_dir>] [-C <tls_cert> -K <tls_key>] [-b <backlog>] [-p <busy_poll_us>] [-U <upstream_ip:port> [-L <cache_bytes>]] [-c <cold_file_bytes> [-O]] [-g <group_ip:port> [-r <rate_mbit>]] [-T <trace_file> [-n <trace_records>]] [-m <min_spare>] [-M <max_spare>] [-R <max_requests_per_child>] [-S <status_file>] [-A <cpu_list>|physical[:<interface>]] <server_address> <server_port> <directory_path> <max_children>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    const ParallelServerConfig config = {
-        .config.address = argv[1],
-        .config.port = (uint16_t)atoi(argv[2]),
-        .config.dir_path = argv[3],
-        .max_children = atoi(argv[4])
-    };
+    config.config.address = argv[first_arg];
+    config.config.port = (uint16_t)atoi(argv[first_arg + 1]);
+    config.config.dir_path = argv[first_arg + 2];
+    config.max_children = atoi(argv[first_arg + 3]);
     assert(config.max_children > 0);
     parallel_server_print_config(&config);
     return config;
 }
 
-static void wait_finish_child_processes(void) {
+static void worker_main_loop(
+    const ServerListeners *const listeners,
+    const IterativeServerConfig *const config,
+    const uint64_t max_requests
+) {
+    WorkerSlot *const slot = scoreboard_self;
+    scoreboard_set_state(slot, WorkerState_IDLE);
+    while (keep_running) {
+        const int connection_fd = server_listeners_accept(listeners);
+        if (connection_fd < 0) {
+            continue;
+        }
+        scoreboard_set_state(slot, WorkerState_BUSY);
+        handle_client(connection_fd, config);
+        if(not checked_close(connection_fd)) {
+            printf("[Failed to close client connection: %d]\n", connection_fd);
+        }
+        const uint64_t requests = atomic_fetch_add_explicit(&slot->requests, 1, memory_order_relaxed) + 1;
+        if(max_requests != 0 and requests >= max_requests) {
+            printf("[Worker %jd recycled after %lu requests]\n", (intmax_t)getpid(), requests);
+            break;
+        }
+        scoreboard_set_state(slot, WorkerState_IDLE);
+    }
+    scoreboard_set_state(slot, WorkerState_RETIRING);
+    busy_poll_print_stats(listeners->busy_poll_us);
+}
+
+// The child never returns from here, it exits once it served its share of requests or was retired.
+static bool supervisor_spawn(Supervisor *const supervisor, const ServerListeners *const listeners, const ParallelServerConfig *const config) {
+    WorkerSlot *const slot = scoreboard_find_empty(supervisor->scoreboard);
+    if(slot == NULL) {
+        return false;
+    }
+    atomic_store_explicit(&slot->requests, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->bytes_sent, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->cpu, -1, memory_order_relaxed);
+    scoreboard_set_state(slot, WorkerState_STARTING);
+    fflush(stdout);
+    const pid_t pid = fork();
+    if(pid == -1) {
+        printf("[Failed to fork worker] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        scoreboard_set_state(slot, WorkerState_EMPTY);
+        return false;
+    }
+    if(pid == 0) {
+        sigset_t mask;
+        ASSERT_POSIX(sigemptyset(&mask));
+        ASSERT_POSIX(sigprocmask(SIG_SETMASK, &mask, NULL));
+        slot->pid = getpid();
+        scoreboard_self = slot;
+        // Each worker accepts on its own and reports its own spinning and CPU time.
+        busy_poll_stats = (BusyPollStats){ .spin_hits = 0, .sleeps = 0 };
+        clock_gettime(CLOCK_MONOTONIC, &busy_poll_stats.started_at);
+        const size_t slot_index = (size_t)(slot - supervisor->scoreboard->slots);
+        atomic_store_explicit(&slot->cpu, placement_apply(&config->placement, slot_index), memory_order_relaxed);
+        worker_main_loop(listeners, &config->config, config->max_requests_per_child);
+        exit(EXIT_SUCCESS);
+    }
+    slot->pid = pid;
+    ++supervisor->spawned;
+    printf("[Spawned worker %jd]\n", (intmax_t)pid);
+    return true;
+}
+
+static void supervisor_reap(Supervisor *const supervisor) {
     while (true) {
-        const pid_t pid = waitpid(-1, NULL, WNOHANG);
-        switch (pid) {
-            case -1: {
-                if (errno != ECHILD) {
-                    printf("[Failed waitpid]");
+        int status;
+        const pid_t pid = waitpid(-1, &status, WNOHANG);
+        if(pid == -1) {
+            if (errno != ECHILD) {
+                printf("[Failed waitpid] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            }
+            return;
+        }
+        if(pid == 0) {
+            return;
+        }
+        if(WIFSIGNALED(status)) {
+            printf("[Process %jd killed by signal %d]\n", (intmax_t)pid, WTERMSIG(status));
+        } else {
+            printf("[Process %jd exited]\n", (intmax_t)pid);
+        }
+        WorkerSlot *const slot = scoreboard_find_pid(supervisor->scoreboard, pid);
+        if(slot != NULL) {
+            supervisor->exited_requests += atomic_load_explicit(&slot->requests, memory_order_relaxed);
+            supervisor->exited_bytes_sent += atomic_load_explicit(&slot->bytes_sent, memory_order_relaxed);
+            scoreboard_set_state(slot, WorkerState_EMPTY);
+        }
+    }
+}
+
+static void supervisor_retire_one(Supervisor *const supervisor) {
+    Scoreboard *const scoreboard = supervisor->scoreboard;
+    for(size_t i = 0; i < scoreboard->slot_count; ++i) {
+        WorkerSlot *const slot = &scoreboard->slots[i];
+        int expected = WorkerState_IDLE;
+        if(atomic_compare_exchange_strong(&slot->state, &expected, WorkerState_RETIRING)) {
+            atomic_store_explicit(&slot->state_since, scoreboard_now(), memory_order_relaxed);
+            if(kill(slot->pid, SIGUSR1) == -1) {
+                printf("[Failed to retire worker %jd] [errno: %d] [strerror: %s]\n", (intmax_t)slot->pid, errno, strerror(errno));
+            }
+            ++supervisor->retired;
+            printf("[Retiring idle worker %jd]\n", (intmax_t)slot->pid);
+            return;
+        }
+    }
+}
+
+// Written to a temporary file and renamed, so a reader never sees a half-written view.
+static void supervisor_write_status(const Supervisor *const supervisor, const ParallelServerConfig *const config) {
+    if(config->status_path == NULL) {
+        return;
+    }
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", config->status_path);
+    FILE *const out = fopen(temp_path, "w");
+    if(out == NULL) {
+        printf("[Failed to write status: %s] [errno: %d] [strerror: %s]\n", temp_path, errno, strerror(errno));
+        return;
+    }
+    const Scoreboard *const scoreboard = supervisor->scoreboard;
+    uint64_t requests = supervisor->exited_requests;
+    uint64_t bytes_sent = supervisor->exited_bytes_sent;
+    for(size_t i = 0; i < scoreboard->slot_count; ++i) {
+        requests += atomic_load_explicit(&scoreboard->slots[i].requests, memory_order_relaxed);
+        bytes_sent += atomic_load_explicit(&scoreboard->slots[i].bytes_sent, memory_order_relaxed);
+    }
+    fprintf(out, "supervisor: %jd\n", (intmax_t)getpid());
+    fprintf(out, "uptime: %ld\n", scoreboard_now() - supervisor->started_at);
+    fprintf(out, "workers: %zu idle, %zu busy, %zu retiring, limits %d..%d spare, %d max\n",
+        scoreboard_count(scoreboard, WorkerState_IDLE), scoreboard_count(scoreboard, WorkerState_BUSY),
+        scoreboard_count(scoreboard, WorkerState_RETIRING), config->min_spare, config->max_spare, config->max_children);
+    fprintf(out, "spawned: %lu, retired: %lu\n", supervisor->spawned, supervisor->retired);
+    fprintf(out, "requests: %lu, bytes sent: %lu\n", requests, bytes_sent);
+    scoreboard_print(scoreboard, out);
+    if(fclose(out) != 0 or rename(temp_path, config->status_path) == -1) {
+        printf("[Failed to write status: %s] [errno: %d] [strerror: %s]\n", config->status_path, errno, strerror(errno));
+    }
+}
+
+static void supervisor_main_loop(Supervisor *const supervisor, const ServerListeners *const listeners, const ParallelServerConfig *const config) {
+    sigset_t sigchld_mask;
+    ASSERT_POSIX(sigemptyset(&sigchld_mask));
+    ASSERT_POSIX(sigaddset(&sigchld_mask, SIGCHLD));
+    while (keep_running) {
+        supervisor_reap(supervisor);
+        const size_t idle = scoreboard_count(supervisor->scoreboard, WorkerState_IDLE);
+        if(idle < (size_t)config->min_spare) {
+            for(size_t i = 0; i < supervisor->spawn_rate; ++i) {
+                if(not supervisor_spawn(supervisor, listeners, config)) {
+                    break;
                 }
-                return;
             }
-            case 0: {
-                return;
+            if(supervisor->spawn_rate < MAX_SPAWN_RATE) {
+                supervisor->spawn_rate *= 2;
             }
-            default: {
-                printf("[Process %jd exited]\n", (intmax_t)pid);
+        } else {
+            supervisor->spawn_rate = 1;
+            // Every retirement wakes the loop with a SIGCHLD, so pace them by the clock instead.
+            if(idle > (size_t)config->max_spare and scoreboard_now() - supervisor->retired_at >= SUPERVISOR_TICK_SECONDS) {
+                supervisor_retire_one(supervisor);
+                supervisor->retired_at = scoreboard_now();
             }
-        }    
+        }
+        supervisor_write_status(supervisor, config);
+        const struct timespec tick = { .tv_sec = SUPERVISOR_TICK_SECONDS };
+        if(sigtimedwait(&sigchld_mask, NULL, &tick) == -1 and errno != EAGAIN and errno != EINTR) {
+            printf("[Failed sigtimedwait] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        }
     }
 }
 
-static void handle_sigchld(const int value __attribute__((unused))) {
-    wait_finish_child_processes();
+static void supervisor_stop_workers(Supervisor *const supervisor) {
+    Scoreboard *const scoreboard = supervisor->scoreboard;
+    for(size_t i = 0; i < scoreboard->slot_count; ++i) {
+        WorkerSlot *const slot = &scoreboard->slots[i];
+        if(atomic_load_explicit(&slot->state, memory_order_acquire) != WorkerState_EMPTY) {
+            kill(slot->pid, SIGUSR1);
+        }
+    }
+    while(true) {
+        const pid_t pid = waitpid(-1, NULL, 0);
+        if(pid == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        printf("[Process %jd exited]\n", (intmax_t)pid);
+    }
 }
 
 static void socketfd_valid(const ParallelServerConfig *config, const int socketfd) {
-    {
-        const struct sockaddr_in srv_sin4 = {
-            .sin_family  = AF_INET,
-            .sin_port = htons(config->config.port),
-            .sin_addr.s_addr = inet_addr(config->config.address)
-        };
-        ASSERT_POSIX(bind(socketfd, (const struct sockaddr *)&srv_sin4, sizeof(srv_sin4)));
-    }
-    ASSERT_POSIX(listen(socketfd, MAX_BACKLOG));
+    server_listen_tcp(socketfd, config->config.backlog);
     printf("[Server listening on %s:%d]\n", config->config.address, config->config.port);
+    ServerListeners listeners;
+    server_listeners_init(&listeners, socketfd, &config->config);
 
-    sigset_t sigcld_unblock_mask;
-    sigprocmask(SIG_BLOCK, NULL, &sigcld_unblock_mask);
-    sigdelset(&sigcld_unblock_mask, SIGCLD);
+    // SIGCHLD stays blocked in the supervisor and is only taken by sigtimedwait.
+    sigset_t sigchld_block_mask;
+    ASSERT_POSIX(sigemptyset(&sigchld_block_mask));
+    ASSERT_POSIX(sigaddset(&sigchld_block_mask, SIGCHLD));
+    ASSERT_POSIX(sigprocmask(SIG_BLOCK, &sigchld_block_mask, NULL));
 
-    sigset_t sigcld_block_mask;    
-    sigprocmask(SIG_BLOCK, NULL, &sigcld_block_mask);
-    sigaddset(&sigcld_block_mask, SIGCHLD);
-
-    sigprocmask(SIG_BLOCK, &sigcld_block_mask, NULL);
-
-    for(uint32_t i = 0; i < (uint32_t)config->max_children; ++i) {
-        const pid_t pid = fork();
-        ASSERT_POSIX(pid);
-        if(pid == 0) {
-            iterative_server_main_loop(socketfd, config->config.dir_path);
-            return;
-        }
+    Supervisor supervisor = {
+        .scoreboard = scoreboard_create((size_t)config->max_children),
+        .spawn_rate = 1,
+        .started_at = scoreboard_now(),
+    };
+    supervisor_main_loop(&supervisor, &listeners, config);
+    supervisor_stop_workers(&supervisor);
+    server_listeners_destroy(&listeners, config->config.unix_path);
+    if(config->status_path != NULL) {
+        unlink(config->status_path);
     }
-    iterative_server_main_loop(socketfd, config->config.dir_path);
-    wait_finish_child_processes();
 }
 
-int main(const int argc, const char *argv[]) {
+int main(const int argc, char *argv[]) {
     {
         struct sigaction sa;
         ASSERT_POSIX(sigemptyset(&sa.sa_mask));
         sa.sa_flags = 0;
-        
+
         sa.sa_handler = handle_sigint;
         ASSERT_POSIX(sigaction(SIGINT, &sa, NULL));
 
-        sa.sa_handler = handle_sigchld;
-        ASSERT_POSIX(sigaction(SIGCLD, &sa, NULL));
+        // A worker asked to retire finishes the request it is serving, so reads restart.
+        sa.sa_flags = SA_RESTART;
+        ASSERT_POSIX(sigaction(SIGUSR1, &sa, NULL));
     }
     const ParallelServerConfig config = handle_cmd_args(argc, argv);
-    const int listenfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    ASSERT_POSIX(listenfd);
+    digest_cache_init();
+    const int listenfd = server_socket_create(config.config.address, config.config.port);
     socketfd_valid(&config, listenfd);
     assert(checked_close(listenfd));
     return EXIT_SUCCESS;
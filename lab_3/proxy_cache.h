@@ -0,0 +1,431 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "client_utils.h"
+#include "scoreboard.h"
+
+// Proxy mode: the served directory is a cache in front of an upstream server. A miss is
+// fetched with the ordinary GET protocol, and later requests are plain sendfile hits.
+//
+// Misses for the same name are collapsed across threads and processes through two hidden
+// files next to the cached one:
+//   .proxy.<name>.lock  created with O_EXCL, whoever creates it fetches and holds flock on
+//                       it until done; it carries the upstream size as a big-endian uint64
+//                       once known, or PROXY_SIZE_FAILED
+//   .proxy.<name>       the body as it arrives, renamed to <name> when complete
+// The fetch runs on its own thread, and every requester, the one that started it included,
+// follows the growing body with sendfile. A slow client never holds the fetch up. A lock
+// nobody holds flock on was left by a crashed fetcher and is removed by the next requester.
+//
+// With a byte limit the least recently used files are deleted after every fill. Hits bump
+// atime explicitly, so relatime or noatime mounts do not matter.
+
+enum {
+    PROXY_ATTEMPTS = 4,
+    PROXY_FOLLOW_POLL_US = 1000,
+    PROXY_SEND_CHUNK_SIZE = 1 << 20,
+    // Returned by proxy_open when it already answered the client itself.
+    PROXY_ANSWERED = -2
+};
+
+static const char PROXY_TEMP_PREFIX[] = ".proxy.";
+static const uint64_t PROXY_SIZE_FAILED = UINT64_MAX;
+
+typedef struct {
+    bool is_enabled;
+    struct sockaddr_in upstream;
+    uint64_t cache_bytes;
+} ProxyConfig;
+
+typedef struct {
+    const ProxyConfig *proxy;
+    const char *dir_path;
+    int lock_fd;
+    filename_buff_t filename;
+    char lock_path[PATH_MAX];
+    char data_path[PATH_MAX];
+    char final_path[PATH_MAX];
+} ProxyFill;
+
+typedef enum {
+    ProxyFollow_ANSWERED,
+    ProxyFollow_RETRY,
+} ProxyFollow;
+
+static bool is_proxy_temp_name(const char *const filename) {
+    return strncmp(filename, PROXY_TEMP_PREFIX, strlen(PROXY_TEMP_PREFIX)) == 0;
+}
+
+// Accepts <ipv4>:<port>.
+static bool proxy_parse_upstream(const char *const value, ProxyConfig *const proxy) {
+    const char *const colon = strrchr(value, ':');
+    if(colon == NULL or colon == value or (size_t)(colon - value) >= INET_ADDRSTRLEN) {
+        return false;
+    }
+    char address[INET_ADDRSTRLEN];
+    memcpy(address, value, (size_t)(colon - value));
+    address[colon - value] = '\0';
+    proxy->upstream.sin_family = AF_INET;
+    proxy->upstream.sin_port = htons((uint16_t)atoi(colon + 1));
+    proxy->is_enabled = inet_pton(AF_INET, address, &proxy->upstream.sin_addr) == 1 and proxy->upstream.sin_port != 0;
+    return proxy->is_enabled;
+}
+
+static void proxy_touch(const int fd) {
+    const struct timespec times[2] = { { .tv_sec = 0, .tv_nsec = UTIME_NOW }, { .tv_sec = 0, .tv_nsec = UTIME_OMIT } };
+    futimens(fd, times);
+}
+
+// Sends a GET upstream and reads the answer up to the size. Returns the socket positioned at
+// the body, or -1 if the upstream is unreachable or does not have the file.
+static int proxy_upstream_request(const ProxyConfig *const proxy, const char *const filename, uint64_t *const size) {
+    const int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if(sock == -1) {
+        return -1;
+    }
+    const uint8_t protocol_version = PROTOCOL_VERSION;
+    const uint8_t operation = RequestOperation_GET;
+    filename_buff_t filename_buffer = { 0 };
+    strncpy(filename_buffer, filename, ARRAY_SIZE(filename_buffer) - 1);
+    bool is_protocol_match = false;
+    bool is_file_size_ok = false;
+    const bool is_client_ready = true;
+    if(connect(sock, (const struct sockaddr *)&proxy->upstream, sizeof(proxy->upstream)) == -1
+        or not checked_write(sock, &protocol_version, sizeof(protocol_version), NULL)
+        or not checked_read(sock, &is_protocol_match, sizeof(is_protocol_match), NULL)
+        or not is_protocol_match
+        or not checked_write(sock, &operation, sizeof(operation), NULL)
+        or not checked_write(sock, filename_buffer, ARRAY_SIZE(filename_buffer), NULL)
+        or not checked_read(sock, &is_file_size_ok, sizeof(is_file_size_ok), NULL)
+        or not is_file_size_ok
+        or not checked_read(sock, size, sizeof(*size), NULL)
+        or not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
+        printf("[Upstream request failed: %s] [errno: %d] [strerror: %s]\n", filename, errno, strerror(errno));
+        checked_close(sock);
+        return -1;
+    }
+    *size = be64toh(*size);
+    return sock;
+}
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    off_t size;
+    struct timespec atime;
+} ProxyCacheEntry;
+
+static int proxy_compare_atime(const void *const a, const void *const b) {
+    const struct timespec *const left = &((const ProxyCacheEntry *)a)->atime;
+    const struct timespec *const right = &((const ProxyCacheEntry *)b)->atime;
+    if(left->tv_sec != right->tv_sec) {
+        return left->tv_sec < right->tv_sec ? -1 : 1;
+    }
+    return left->tv_nsec < right->tv_nsec ? -1 : left->tv_nsec > right->tv_nsec;
+}
+
+// Hidden files, the in-flight ones and the compressed variant directory included, are not
+// part of the cache.
+static void proxy_evict(const char *const dir_path, const uint64_t cache_bytes) {
+    DIR *const dir = opendir(dir_path);
+    if(dir == NULL) {
+        printf("[Failed to scan cache: %s] [errno: %d] [strerror: %s]\n", dir_path, errno, strerror(errno));
+        return;
+    }
+    ProxyCacheEntry *entries = NULL;
+    size_t entry_count = 0;
+    size_t entry_capacity = 0;
+    uint64_t total = 0;
+    const struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if(entry->d_name[0] == '.' or fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 or not S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if(entry_count == entry_capacity) {
+            entry_capacity = entry_capacity == 0 ? 64 : entry_capacity * 2;
+            entries = realloc(entries, entry_capacity * sizeof(*entries));
+            assert(entries != NULL);
+        }
+        ProxyCacheEntry *const cache_entry = &entries[entry_count++];
+        strcpy(cache_entry->name, entry->d_name);
+        cache_entry->size = st.st_size;
+        cache_entry->atime = st.st_atim;
+        total += (uint64_t)st.st_size;
+    }
+    if(total > cache_bytes) {
+        qsort(entries, entry_count, sizeof(*entries), proxy_compare_atime);
+        for(size_t i = 0; i < entry_count and total > cache_bytes; ++i) {
+            if(unlinkat(dirfd(dir), entries[i].name, 0) == -1) {
+                printf("[Failed to evict: %s] [errno: %d] [strerror: %s]\n", entries[i].name, errno, strerror(errno));
+                continue;
+            }
+            total -= (uint64_t)entries[i].size;
+            printf("[Evicted: %s] [size: %ld] [cache bytes: %lu]\n", entries[i].name, entries[i].size, total);
+        }
+    }
+    free(entries);
+    closedir(dir);
+}
+
+static void *proxy_fill_main(void *const arg) {
+    ProxyFill *const fill = arg;
+    uint64_t size = PROXY_SIZE_FAILED;
+    const int upstream_sock = proxy_upstream_request(fill->proxy, fill->filename, &size);
+    int data_fd = -1;
+    if(upstream_sock != -1) {
+        data_fd = open(fill->data_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(data_fd == -1) {
+            printf("[Failed to create cache file: %s] [errno: %d] [strerror: %s]\n", fill->data_path, errno, strerror(errno));
+            size = PROXY_SIZE_FAILED;
+        }
+    }
+    // Followers wait for this before they open the body.
+    const uint64_t network_size = htobe64(size);
+    if(pwrite(fill->lock_fd, &network_size, sizeof(network_size), 0) != sizeof(network_size)) {
+        printf("[Failed to publish upstream size] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    bool is_filled = false;
+    if(data_fd != -1) {
+        int pipefd[2];
+        if(pipe(pipefd) == -1) {
+            printf("[Can not create pipe] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        } else {
+            is_filled = checked_splice_to_file(upstream_sock, pipefd, data_fd, size)
+                and rename(fill->data_path, fill->final_path) != -1;
+            checked_close(pipefd[0]);
+            checked_close(pipefd[1]);
+        }
+        if(not is_filled) {
+            printf("[Failed to fill cache: %s] [errno: %d] [strerror: %s]\n", fill->filename, errno, strerror(errno));
+            unlink(fill->data_path);
+        }
+        checked_close(data_fd);
+    }
+    if(upstream_sock != -1) {
+        checked_close(upstream_sock);
+    }
+    // Unlinked before the flock goes away, a requester that sees the lock released either
+    // finds the cached file or can start a fetch of its own.
+    unlink(fill->lock_path);
+    checked_close(fill->lock_fd);
+    if(is_filled) {
+        printf("[Filled cache: %s] [size: %lu]\n", fill->filename, size);
+        if(fill->proxy->cache_bytes != 0) {
+            proxy_evict(fill->dir_path, fill->proxy->cache_bytes);
+        }
+    }
+    return NULL;
+}
+
+// The probe lock is dropped again right away, held it would keep a new fetcher that took
+// over the name out of its LOCK_EX.
+static bool proxy_is_fetcher_gone(const int lock_fd) {
+    if(flock(lock_fd, LOCK_SH | LOCK_NB) != 0) {
+        return false;
+    }
+    flock(lock_fd, LOCK_UN);
+    return true;
+}
+
+// Creates the lock already held. It is locked under a temporary name and then linked into
+// place, so no requester ever finds the name with an unlocked file behind it and takes the
+// fetcher for dead. Returns -1 with errno EEXIST when a fetch is in flight.
+static int proxy_create_lock(const char *const lock_path) {
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", lock_path);
+    const int lock_fd = mkostemp(temp_path, O_CLOEXEC);
+    if(lock_fd == -1) {
+        return -1;
+    }
+    const bool is_linked = fchmod(lock_fd, 0644) != -1 and flock(lock_fd, LOCK_EX) != -1 and link(temp_path, lock_path) != -1;
+    const int error = errno;
+    unlink(temp_path);
+    if(not is_linked) {
+        checked_close(lock_fd);
+        errno = error;
+        return -1;
+    }
+    return lock_fd;
+}
+
+// A lock whose fetcher died keeps later fetches out, it goes unless someone replaced it.
+static void proxy_remove_stale_lock(const int lock_fd, const char *const lock_path) {
+    struct stat held;
+    struct stat current;
+    if(fstat(lock_fd, &held) == 0 and stat(lock_path, &current) == 0 and held.st_ino == current.st_ino) {
+        printf("[Removing stale proxy lock: %s]\n", lock_path);
+        unlink(lock_path);
+    }
+}
+
+static void proxy_refuse(const int client_sock) {
+    const bool is_file_size_ok = false;
+    if(client_sock != -1 and not checked_write(client_sock, &is_file_size_ok, sizeof(is_file_size_ok), NULL)) {
+        printf("[Client_sock: %d] [Failed to inform file size not ok] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+    }
+}
+
+// Streams the body of an in-flight fetch to the client as it grows. Without a client it only
+// waits for the fetch to end, the caller then finds the cached file.
+static ProxyFollow proxy_follow(const int client_sock, const int lock_fd, const ProxyFill *const paths) {
+    uint64_t size;
+    while(pread(lock_fd, &size, sizeof(size), 0) != sizeof(size)) {
+        if(proxy_is_fetcher_gone(lock_fd)) {
+            proxy_remove_stale_lock(lock_fd, paths->lock_path);
+            return ProxyFollow_RETRY;
+        }
+        usleep(PROXY_FOLLOW_POLL_US);
+    }
+    size = be64toh(size);
+    if(size == PROXY_SIZE_FAILED) {
+        if(client_sock == -1) {
+            return ProxyFollow_ANSWERED;
+        }
+        printf("[Client_sock: %d] [Upstream does not have: %s]\n", client_sock, paths->filename);
+        proxy_refuse(client_sock);
+        return ProxyFollow_ANSWERED;
+    }
+    // Gone means the fetch already finished and renamed it, the next attempt is a hit.
+    const int data_fd = open(paths->data_path, O_RDONLY | O_CLOEXEC);
+    if(data_fd == -1) {
+        return ProxyFollow_RETRY;
+    }
+    if(client_sock == -1) {
+        while(not proxy_is_fetcher_gone(lock_fd)) {
+            usleep(PROXY_FOLLOW_POLL_US);
+        }
+        checked_close(data_fd);
+        return ProxyFollow_RETRY;
+    }
+    printf("[Client_sock: %d] [Following upstream fetch: %s] [size: %lu]\n", client_sock, paths->filename, size);
+    {
+        const bool is_file_size_ok = true;
+        const uint64_t network_size = htobe64(size);
+        bool is_client_ready = false;
+        if(not checked_write(client_sock, &is_file_size_ok, sizeof(is_file_size_ok), NULL)
+            or not checked_write(client_sock, &network_size, sizeof(network_size), NULL)
+            or not checked_read(client_sock, &is_client_ready, sizeof(is_client_ready), NULL)
+            or not is_client_ready) {
+            printf("[Client_sock: %d] [Client rejected file receiving] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+            checked_close(data_fd);
+            return ProxyFollow_ANSWERED;
+        }
+    }
+    off_t offset = 0;
+    bool is_fetch_done = false;
+    scoreboard_begin_send(size);
+    while((uint64_t)offset < size) {
+        struct stat st;
+        if(fstat(data_fd, &st) == -1) {
+            break;
+        }
+        if(offset < st.st_size) {
+            const off_t available = st.st_size - offset;
+            const ssize_t nsendfile = sendfile(client_sock, data_fd, &offset, (size_t)(available < PROXY_SEND_CHUNK_SIZE ? available : PROXY_SEND_CHUNK_SIZE));
+            if(nsendfile <= 0) {
+                printf("[Client_sock: %d] [Failed to sendfile] [errno: %d] [strerror: %s]\n", client_sock, errno, strerror(errno));
+                break;
+            }
+            scoreboard_add_bytes_sent((uint64_t)nsendfile);
+            continue;
+        }
+        // Caught up with a fetch that ended short, the upstream or the cache write failed.
+        if(is_fetch_done) {
+            printf("[Client_sock: %d] [Upstream fetch failed mid-body: %s] [sent: %ld]\n", client_sock, paths->filename, offset);
+            proxy_remove_stale_lock(lock_fd, paths->lock_path);
+            break;
+        }
+        is_fetch_done = proxy_is_fetcher_gone(lock_fd);
+        if(not is_fetch_done) {
+            usleep(PROXY_FOLLOW_POLL_US);
+        }
+    }
+    scoreboard_end_send(size - (uint64_t)offset);
+    checked_close(data_fd);
+    printf("[Client_sock: %d] [Finished sending followed file] [sent: %ld]\n", client_sock, offset);
+    return ProxyFollow_ANSWERED;
+}
+
+// Called on a local miss. Returns the open cached file once the name is present, or
+// PROXY_ANSWERED when the body was already streamed to client_sock or refused, or -1 when the
+// upstream does not have the file and client_sock was -1.
+static int proxy_open(const ProxyConfig *const proxy, const char *const dir_path, const char *const filename, const int client_sock) {
+    ProxyFill *const fill = malloc(sizeof(*fill));
+    assert(fill != NULL);
+    fill->proxy = proxy;
+    fill->dir_path = dir_path;
+    strncpy(fill->filename, filename, ARRAY_SIZE(fill->filename));
+    snprintf(fill->final_path, sizeof(fill->final_path), "%s/%s", dir_path, filename);
+    snprintf(fill->data_path, sizeof(fill->data_path), "%s/%s%s", dir_path, PROXY_TEMP_PREFIX, filename);
+    snprintf(fill->lock_path, sizeof(fill->lock_path), "%s/%s%s.lock", dir_path, PROXY_TEMP_PREFIX, filename);
+    int result = -1;
+    uint32_t attempt = 0;
+    for(; attempt < PROXY_ATTEMPTS; ++attempt) {
+        const int fd = open(fill->final_path, O_RDONLY | O_CLOEXEC);
+        if(fd != -1) {
+            proxy_touch(fd);
+            result = fd;
+            break;
+        }
+        pthread_t fill_thread;
+        bool is_filling = false;
+        int follow_fd = -1;
+        fill->lock_fd = proxy_create_lock(fill->lock_path);
+        if(fill->lock_fd != -1) {
+            follow_fd = open(fill->lock_path, O_RDONLY | O_CLOEXEC);
+            const int error = follow_fd == -1 ? errno : pthread_create(&fill_thread, NULL, proxy_fill_main, fill);
+            if(error != 0) {
+                printf("[Failed to start upstream fetch] [errno: %d] [strerror: %s]\n", error, strerror(error));
+                unlink(fill->lock_path);
+                checked_close(fill->lock_fd);
+                if(follow_fd != -1) {
+                    checked_close(follow_fd);
+                }
+                break;
+            }
+            is_filling = true;
+            printf("[Upstream fetch: %s]\n", filename);
+        } else if(errno == EEXIST) {
+            follow_fd = open(fill->lock_path, O_RDONLY | O_CLOEXEC);
+        } else {
+            printf("[Failed to create proxy lock: %s] [errno: %d] [strerror: %s]\n", fill->lock_path, errno, strerror(errno));
+            break;
+        }
+        ProxyFollow follow = ProxyFollow_RETRY;
+        if(follow_fd != -1) {
+            follow = proxy_follow(client_sock, follow_fd, fill);
+            checked_close(follow_fd);
+        }
+        // The thread uses fill, and the fetch it started has to finish even if this client left.
+        if(is_filling) {
+            pthread_join(fill_thread, NULL);
+        }
+        if(follow == ProxyFollow_ANSWERED) {
+            result = client_sock != -1 ? PROXY_ANSWERED : -1;
+            break;
+        }
+    }
+    if(attempt == PROXY_ATTEMPTS or (result == -1 and client_sock != -1)) {
+        printf("[Proxy gave up on: %s] [attempts: %u]\n", filename, attempt);
+        proxy_refuse(client_sock);
+        result = client_sock != -1 ? PROXY_ANSWERED : -1;
+    }
+    free(fill);
+    return result;
+}
@@ -0,0 +1,421 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+
+#include "client_utils.h"
+#include "write_behind.h"
+
+// Ways to move a download body from the socket into the output file. Every engine either
+// receives exactly file_size bytes, fails, or reports itself unsupported before consuming any
+// byte, so the caller can fall back to the next one on the same connection.
+//
+//   splice    socket -> pipe -> file, with the pipe grown to RECEIVE_PIPE_SIZE and drained
+//             after every read, the data never enters user space
+//   mmap      the file is preallocated and mapped, recv copies straight into the page cache
+//   zerocopy  TCP_ZEROCOPY_RECEIVE maps the received pages, one write copies them into the
+//             file. Needs page-aligned payloads, a loopback or jumbo frame MTU
+//   uring     recv and write submitted through io_uring, the write of one chunk overlaps the
+//             receive of the next and both go in with one io_uring_enter
+//
+// auto tries them in the order bench_receive.py found fastest on loopback, skipping whatever
+// the kernel lacks.
+
+typedef enum {
+    ReceiveEngine_AUTO,
+    ReceiveEngine_SPLICE,
+    ReceiveEngine_MMAP,
+    ReceiveEngine_ZEROCOPY,
+    ReceiveEngine_URING,
+} ReceiveEngine;
+
+static const char *const RECEIVE_ENGINE_NAMES[] = { "auto", "splice", "mmap", "zerocopy", "uring" };
+
+// 512 MiB over loopback: splice 1.8 GB/s at 0.50 CPU s/GB, zerocopy 1.5 at 0.64, uring 1.3 at
+// 0.67, mmap 1.1 at 0.78, the page faults of the fresh mapping cost more than the copies saved.
+static const ReceiveEngine RECEIVE_ENGINE_AUTO_ORDER[] = { ReceiveEngine_SPLICE, ReceiveEngine_ZEROCOPY, ReceiveEngine_URING, ReceiveEngine_MMAP };
+
+typedef enum {
+    ReceiveResult_DONE,
+    ReceiveResult_FAILED,
+    ReceiveResult_UNSUPPORTED,
+} ReceiveResult;
+
+enum {
+    RECEIVE_PIPE_SIZE = 1 << 20,
+    RECEIVE_CHUNK_SIZE = 1 << 20,
+    RECEIVE_URING_BUFFERS = 4,
+    RECEIVE_URING_ENTRIES = 8,
+};
+
+static bool receive_engine_parse(const char *const name, ReceiveEngine *const engine) {
+    const size_t engine_count = ARRAY_SIZE(RECEIVE_ENGINE_NAMES);
+    for(size_t i = 0; i < engine_count; ++i) {
+        if(strcmp(name, RECEIVE_ENGINE_NAMES[i]) == 0) {
+            *engine = (ReceiveEngine)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t receive_min(const size_t lhs, const size_t rhs) {
+    return lhs < rhs ? lhs : rhs;
+}
+
+static ReceiveResult receive_incomplete(const size_t received, const size_t file_size) {
+    printf("[Incomplete file] [received: %zu] [expected: %zu]\n", received, file_size);
+    return ReceiveResult_FAILED;
+}
+
+static ReceiveResult receive_splice(const int sock, const size_t file_size, const int file_fd, WriteBehind *const write_behind) {
+    int pipefd[2];
+    if(pipe2(pipefd, O_CLOEXEC) == -1) {
+        printf("[Can not create pipe] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return ReceiveResult_UNSUPPORTED;
+    }
+    // The default 64 KiB pipe caps every splice at 16 pages, pipe-max-size may cap this one lower.
+    int pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, RECEIVE_PIPE_SIZE);
+    if(pipe_size == -1) {
+        pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    }
+    off_t write_offset = 0;
+    ReceiveResult result = ReceiveResult_DONE;
+    while((size_t)write_offset < file_size) {
+        const size_t remaining = file_size - (size_t)write_offset;
+        const ssize_t in_pipe = splice(sock, NULL, pipefd[1], NULL, receive_min(remaining, (size_t)pipe_size), SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in_pipe < 0 and write_offset == 0 and errno == EINVAL) {
+            printf("[splice not available for this socket] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            result = ReceiveResult_UNSUPPORTED;
+            break;
+        }
+        if(in_pipe <= 0) {
+            if(in_pipe < 0) {
+                printf("[Failed to read splice] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            }
+            result = receive_incomplete((size_t)write_offset, file_size);
+            break;
+        }
+        // Drain what was just read, so the pipe is empty for the next read and the loop ends.
+        for(ssize_t drained = 0; drained < in_pipe and result == ReceiveResult_DONE;) {
+            const ssize_t out_pipe = splice(pipefd[0], NULL, file_fd, &write_offset, (size_t)(in_pipe - drained), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(out_pipe <= 0) {
+                printf("[Failed to write splice] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+                result = ReceiveResult_FAILED;
+            }
+            drained += out_pipe;
+        }
+        if(result != ReceiveResult_DONE) {
+            break;
+        }
+        write_behind_advance(write_behind, write_offset);
+    }
+    checked_close(pipefd[0]);
+    checked_close(pipefd[1]);
+    return result;
+}
+
+static ReceiveResult receive_mmap(const int sock, const size_t file_size, const int file_fd, WriteBehind *const write_behind) {
+    if(file_size == 0) {
+        return ReceiveResult_DONE;
+    }
+    const int error = posix_fallocate(file_fd, 0, (off_t)file_size);
+    if(error != 0) {
+        printf("[Failed to preallocate file] [errno: %d] [strerror: %s]\n", error, strerror(error));
+        return ReceiveResult_UNSUPPORTED;
+    }
+    uint8_t *const map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_fd, 0);
+    if(map == MAP_FAILED) {
+        printf("[Failed to map file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return ReceiveResult_UNSUPPORTED;
+    }
+    madvise(map, file_size, MADV_SEQUENTIAL);
+    size_t received = 0;
+    ReceiveResult result = ReceiveResult_DONE;
+    while(received < file_size) {
+        const ssize_t local_read = recv(sock, map + received, receive_min(file_size - received, (size_t)RECEIVE_CHUNK_SIZE), 0);
+        if(local_read <= 0) {
+            if(local_read < 0) {
+                printf("[Failed to recv] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            }
+            result = receive_incomplete(received, file_size);
+            break;
+        }
+        received += (size_t)local_read;
+        write_behind_advance(write_behind, (off_t)received);
+    }
+    munmap(map, file_size);
+    return result;
+}
+
+static bool receive_pwrite_all(const int file_fd, const uint8_t *buffer, size_t count, off_t offset) {
+    while(count > 0) {
+        const ssize_t written = pwrite(file_fd, buffer, count, offset);
+        if(written <= 0) {
+            printf("[Failed to write file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            return false;
+        }
+        buffer += written;
+        count -= (size_t)written;
+        offset += written;
+    }
+    return true;
+}
+
+static ReceiveResult receive_zerocopy(const int sock, const size_t file_size, const int file_fd, WriteBehind *const write_behind) {
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    uint8_t *const window = mmap(NULL, RECEIVE_CHUNK_SIZE, PROT_READ, MAP_SHARED, sock, 0);
+    if(window == MAP_FAILED) {
+        printf("[TCP_ZEROCOPY_RECEIVE not available] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return ReceiveResult_UNSUPPORTED;
+    }
+    uint8_t *const copy_buffer = malloc(RECEIVE_CHUNK_SIZE);
+    size_t received = 0;
+    ReceiveResult result = ReceiveResult_DONE;
+    while(received < file_size and result == ReceiveResult_DONE) {
+        const size_t remaining = file_size - received;
+        struct tcp_zerocopy_receive zerocopy = {
+            .address = (uint64_t)(uintptr_t)window,
+            .length = (uint32_t)(receive_min(remaining, (size_t)RECEIVE_CHUNK_SIZE) / page_size * page_size),
+        };
+        socklen_t zerocopy_length = sizeof(zerocopy);
+        if(zerocopy.length > 0 and getsockopt(sock, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zerocopy, &zerocopy_length) == -1) {
+            if(received == 0) {
+                printf("[TCP_ZEROCOPY_RECEIVE not available] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+                result = ReceiveResult_UNSUPPORTED;
+                break;
+            }
+            printf("[Failed TCP_ZEROCOPY_RECEIVE] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            result = ReceiveResult_FAILED;
+            break;
+        }
+        if(zerocopy.length > 0) {
+            if(not receive_pwrite_all(file_fd, window, zerocopy.length, (off_t)received)) {
+                result = ReceiveResult_FAILED;
+            }
+            received += zerocopy.length;
+            write_behind_advance(write_behind, (off_t)received);
+            madvise(window, zerocopy.length, MADV_DONTNEED);
+            continue;
+        }
+        // Bytes that do not fill a page, or nothing queued yet: an ordinary blocking recv.
+        const size_t copy_length = zerocopy.recv_skip_hint > 0 ? receive_min(zerocopy.recv_skip_hint, remaining) : receive_min(remaining, (size_t)RECEIVE_CHUNK_SIZE);
+        const ssize_t local_read = recv(sock, copy_buffer, copy_length, 0);
+        if(local_read <= 0) {
+            if(local_read < 0) {
+                printf("[Failed to recv] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            }
+            result = receive_incomplete(received, file_size);
+            break;
+        }
+        if(not receive_pwrite_all(file_fd, copy_buffer, (size_t)local_read, (off_t)received)) {
+            result = ReceiveResult_FAILED;
+        }
+        received += (size_t)local_read;
+        write_behind_advance(write_behind, (off_t)received);
+    }
+    free(copy_buffer);
+    munmap(window, RECEIVE_CHUNK_SIZE);
+    return result;
+}
+
+typedef struct {
+    int ring_fd;
+    uint8_t *sq_ring;
+    size_t sq_ring_size;
+    uint8_t *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    struct io_uring_params params;
+} ReceiveUring;
+
+static bool receive_uring_setup(ReceiveUring *const uring) {
+    memset(uring, 0, sizeof(*uring));
+    uring->ring_fd = (int)syscall(SYS_io_uring_setup, RECEIVE_URING_ENTRIES, &uring->params);
+    if(uring->ring_fd == -1) {
+        printf("[io_uring not available] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return false;
+    }
+    const struct io_uring_params *const params = &uring->params;
+    uring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(uint32_t);
+    uring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    const bool is_single_mmap = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(is_single_mmap) {
+        uring->sq_ring_size = uring->sq_ring_size > uring->cq_ring_size ? uring->sq_ring_size : uring->cq_ring_size;
+    }
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+    uring->cq_ring = is_single_mmap ? uring->sq_ring
+        : mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+    uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+    if(uring->sq_ring == MAP_FAILED or uring->cq_ring == MAP_FAILED or uring->sqes == MAP_FAILED) {
+        printf("[Failed to map io_uring] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void receive_uring_destroy(ReceiveUring *const uring) {
+    if(uring->sqes != NULL and uring->sqes != MAP_FAILED) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+    if(uring->cq_ring != NULL and uring->cq_ring != MAP_FAILED and uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    if(uring->sq_ring != NULL and uring->sq_ring != MAP_FAILED) {
+        munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+    if(uring->ring_fd > 0) {
+        checked_close(uring->ring_fd);
+    }
+}
+
+static uint32_t *receive_uring_field(uint8_t *const ring, const uint32_t offset) {
+    return (uint32_t *)(void *)(ring + offset);
+}
+
+// Only ever called with fewer outstanding entries than the ring holds.
+static void receive_uring_queue(ReceiveUring *const uring, const uint8_t opcode, const int fd, void *const buffer, const size_t length, const off_t offset, const uint64_t user_data) {
+    uint32_t *const tail = receive_uring_field(uring->sq_ring, uring->params.sq_off.tail);
+    const uint32_t mask = *receive_uring_field(uring->sq_ring, uring->params.sq_off.ring_mask);
+    const uint32_t index = *tail & mask;
+    struct io_uring_sqe *const sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = user_data;
+    receive_uring_field(uring->sq_ring, uring->params.sq_off.array)[index] = index;
+    __atomic_store_n(tail, *tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool receive_uring_reap(ReceiveUring *const uring, const uint32_t submit_count, struct io_uring_cqe *const cqe) {
+    uint32_t *const head = receive_uring_field(uring->cq_ring, uring->params.cq_off.head);
+    const uint32_t *const tail = receive_uring_field(uring->cq_ring, uring->params.cq_off.tail);
+    if(*head == __atomic_load_n(tail, __ATOMIC_ACQUIRE) or submit_count > 0) {
+        if(syscall(SYS_io_uring_enter, uring->ring_fd, submit_count, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+            printf("[Failed io_uring_enter] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            return false;
+        }
+    }
+    const uint32_t mask = *receive_uring_field(uring->cq_ring, uring->params.cq_off.ring_mask);
+    const struct io_uring_cqe *const cqes = (const struct io_uring_cqe *)(void *)(uring->cq_ring + uring->params.cq_off.cqes);
+    *cqe = cqes[*head & mask];
+    __atomic_store_n(head, *head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// One recv is in flight at a time, so the stream lands in order, while up to
+// RECEIVE_URING_BUFFERS - 1 earlier chunks are still being written out.
+static ReceiveResult receive_uring(const int sock, const size_t file_size, const int file_fd, WriteBehind *const write_behind) {
+    ReceiveUring uring;
+    if(not receive_uring_setup(&uring)) {
+        receive_uring_destroy(&uring);
+        return ReceiveResult_UNSUPPORTED;
+    }
+    uint8_t *const buffers = malloc((size_t)RECEIVE_URING_BUFFERS * RECEIVE_CHUNK_SIZE);
+    bool is_buffer_busy[RECEIVE_URING_BUFFERS] = { false };
+    size_t buffer_lengths[RECEIVE_URING_BUFFERS] = { 0 };
+    enum { RECV_TAG = 1 << 16 };
+    size_t received = 0;
+    size_t written = 0;
+    size_t recv_buffer = 0;
+    bool is_recv_pending = false;
+    uint32_t submit_count = 0;
+    ReceiveResult result = ReceiveResult_DONE;
+    while(written < file_size) {
+        if(not is_recv_pending and received < file_size and not is_buffer_busy[recv_buffer]) {
+            receive_uring_queue(&uring, IORING_OP_RECV, sock, buffers + recv_buffer * RECEIVE_CHUNK_SIZE,
+                receive_min(file_size - received, (size_t)RECEIVE_CHUNK_SIZE), 0, RECV_TAG | recv_buffer);
+            is_buffer_busy[recv_buffer] = true;
+            is_recv_pending = true;
+            ++submit_count;
+        }
+        struct io_uring_cqe cqe;
+        if(not receive_uring_reap(&uring, submit_count, &cqe)) {
+            result = ReceiveResult_FAILED;
+            break;
+        }
+        submit_count = 0;
+        const size_t buffer = cqe.user_data & (RECV_TAG - 1);
+        if((cqe.user_data & RECV_TAG) == 0) {
+            is_buffer_busy[buffer] = false;
+            // A short write to a regular file only happens when the disk is full.
+            if(cqe.res < 0 or (size_t)cqe.res != buffer_lengths[buffer]) {
+                printf("[Failed io_uring write] [errno: %d] [strerror: %s]\n", cqe.res < 0 ? -cqe.res : ENOSPC, strerror(cqe.res < 0 ? -cqe.res : ENOSPC));
+                result = ReceiveResult_FAILED;
+                break;
+            }
+            written += (size_t)cqe.res;
+            // Chunks are written in the order they were received and few are in flight, so the
+            // byte count stands in for the gap-free prefix.
+            write_behind_advance(write_behind, (off_t)written);
+            continue;
+        }
+        is_recv_pending = false;
+        if(cqe.res <= 0) {
+            is_buffer_busy[buffer] = false;
+            if(received == 0 and (cqe.res == -EINVAL or cqe.res == -EOPNOTSUPP)) {
+                printf("[io_uring recv not available] [errno: %d] [strerror: %s]\n", -cqe.res, strerror(-cqe.res));
+                result = ReceiveResult_UNSUPPORTED;
+            } else {
+                if(cqe.res < 0) {
+                    printf("[Failed io_uring recv] [errno: %d] [strerror: %s]\n", -cqe.res, strerror(-cqe.res));
+                }
+                result = receive_incomplete(received, file_size);
+            }
+            break;
+        }
+        receive_uring_queue(&uring, IORING_OP_WRITE, file_fd, buffers + buffer * RECEIVE_CHUNK_SIZE, (size_t)cqe.res, (off_t)received, buffer);
+        ++submit_count;
+        buffer_lengths[buffer] = (size_t)cqe.res;
+        received += (size_t)cqe.res;
+        recv_buffer = (recv_buffer + 1) % RECEIVE_URING_BUFFERS;
+    }
+    // Every busy buffer still has one request in flight. The kernel may write into it until
+    // that completes, so wait them out before freeing, a pending recv is ended by the shutdown.
+    if(is_recv_pending) {
+        shutdown(sock, SHUT_RD);
+    }
+    size_t in_flight = 0;
+    for(size_t i = 0; i < RECEIVE_URING_BUFFERS; ++i) {
+        in_flight += is_buffer_busy[i];
+    }
+    for(; in_flight > 0; --in_flight) {
+        struct io_uring_cqe cqe;
+        if(not receive_uring_reap(&uring, submit_count, &cqe)) {
+            break;
+        }
+        submit_count = 0;
+    }
+    free(buffers);
+    receive_uring_destroy(&uring);
+    return result;
+}
+
+static ReceiveResult receive_with(const ReceiveEngine engine, const int sock, const size_t file_size, const int file_fd, WriteBehind *const write_behind) {
+    if(engine == ReceiveEngine_SPLICE) {
+        return receive_splice(sock, file_size, file_fd, write_behind);
+    } else if(engine == ReceiveEngine_MMAP) {
+        return receive_mmap(sock, file_size, file_fd, write_behind);
+    } else if(engine == ReceiveEngine_ZEROCOPY) {
+        return receive_zerocopy(sock, file_size, file_fd, write_behind);
+    } else if(engine == ReceiveEngine_URING) {
+        return receive_uring(sock, file_size, file_fd, write_behind);
+    }
+    return ReceiveResult_UNSUPPORTED;
+}
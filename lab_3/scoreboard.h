@@ -0,0 +1,139 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "client_utils.h"
+
+// Per-worker state shared between the pool supervisor and its workers. The table lives in a
+// shared anonymous mapping created before the first fork. Each worker only writes its own
+// slot, the supervisor reads all of them to decide whether to fork or retire workers and
+// renders them as the status view.
+
+typedef enum {
+    WorkerState_EMPTY = 0,
+    WorkerState_STARTING,
+    WorkerState_IDLE,
+    WorkerState_BUSY,
+    WorkerState_RETIRING,
+} WorkerState;
+
+static const char *const WORKER_STATE_NAMES[] = { "empty", "starting", "idle", "busy", "retiring" };
+
+typedef struct {
+    atomic_int state;
+    pid_t pid;
+    atomic_uint_fast64_t requests;
+    atomic_uint_fast64_t bytes_sent;
+    atomic_int_fast64_t state_since;
+    atomic_int connections;
+    atomic_int_fast64_t bytes_pending;
+    atomic_int cpu;
+} WorkerSlot;
+
+typedef struct {
+    size_t slot_count;
+    WorkerSlot slots[];
+} Scoreboard;
+
+// Set in a worker to its own slot, NULL everywhere else so the hooks below do nothing.
+static WorkerSlot *scoreboard_self = NULL;
+
+static int64_t scoreboard_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static Scoreboard *scoreboard_create(const size_t slot_count) {
+    const size_t size = sizeof(Scoreboard) + slot_count * sizeof(WorkerSlot);
+    void *const memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(memory != MAP_FAILED);
+    Scoreboard *const scoreboard = memory;
+    scoreboard->slot_count = slot_count;
+    return scoreboard;
+}
+
+static void scoreboard_set_state(WorkerSlot *const slot, const WorkerState state) {
+    atomic_store_explicit(&slot->state_since, scoreboard_now(), memory_order_relaxed);
+    atomic_store_explicit(&slot->state, state, memory_order_release);
+}
+
+// A response body of count bytes is about to be sent. Bytes pending is what a worker still
+// owes its clients, the dispatcher balances on it.
+static void scoreboard_begin_send(const uint64_t count) {
+    if(scoreboard_self != NULL) {
+        atomic_fetch_add_explicit(&scoreboard_self->bytes_pending, (int_fast64_t)count, memory_order_relaxed);
+    }
+}
+
+static void scoreboard_add_bytes_sent(const uint64_t count) {
+    if(scoreboard_self != NULL) {
+        atomic_fetch_add_explicit(&scoreboard_self->bytes_sent, count, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&scoreboard_self->bytes_pending, (int_fast64_t)count, memory_order_relaxed);
+    }
+}
+
+// Drops whatever was announced by scoreboard_begin_send but never sent.
+static void scoreboard_end_send(const uint64_t unsent) {
+    if(scoreboard_self != NULL) {
+        atomic_fetch_sub_explicit(&scoreboard_self->bytes_pending, (int_fast64_t)unsent, memory_order_relaxed);
+    }
+}
+
+static WorkerSlot *scoreboard_find_empty(Scoreboard *const scoreboard) {
+    for(size_t i = 0; i < scoreboard->slot_count; ++i) {
+        if(atomic_load_explicit(&scoreboard->slots[i].state, memory_order_acquire) == WorkerState_EMPTY) {
+            return &scoreboard->slots[i];
+        }
+    }
+    return NULL;
+}
+
+static WorkerSlot *scoreboard_find_pid(Scoreboard *const scoreboard, const pid_t pid) {
+    for(size_t i = 0; i < scoreboard->slot_count; ++i) {
+        if(atomic_load_explicit(&scoreboard->slots[i].state, memory_order_acquire) != WorkerState_EMPTY
+            and scoreboard->slots[i].pid == pid) {
+            return &scoreboard->slots[i];
+        }
+    }
+    return NULL;
+}
+
+// Counts slots in the given state, starting workers count as idle because they are about to be.
+static size_t scoreboard_count(const Scoreboard *const scoreboard, const WorkerState state) {
+    size_t count = 0;
+    for(size_t i = 0; i < scoreboard->slot_count; ++i) {
+        WorkerState slot_state = (WorkerState)atomic_load_explicit(&scoreboard->slots[i].state, memory_order_acquire);
+        if(slot_state == WorkerState_STARTING) {
+            slot_state = WorkerState_IDLE;
+        }
+        if(slot_state == state) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+static void scoreboard_print(const Scoreboard *const scoreboard, FILE *const out) {
+    const int64_t now = scoreboard_now();
+    fprintf(out, "%5s %8s %9s %10s %14s %8s %11s %14s %4s\n", "slot", "pid", "state", "requests", "bytes_sent", "seconds", "connections", "bytes_pending", "cpu");
+    for(size_t i = 0; i < scoreboard->slot_count; ++i) {
+        const WorkerSlot *const slot = &scoreboard->slots[i];
+        const int state = atomic_load_explicit(&slot->state, memory_order_acquire);
+        if(state == WorkerState_EMPTY) {
+            continue;
+        }
+        fprintf(out, "%5zu %8d %9s %10lu %14lu %8ld %11d %14ld %4d\n", i, slot->pid, WORKER_STATE_NAMES[state],
+            atomic_load_explicit(&slot->requests, memory_order_relaxed),
+            atomic_load_explicit(&slot->bytes_sent, memory_order_relaxed),
+            now - atomic_load_explicit(&slot->state_since, memory_order_relaxed),
+            atomic_load_explicit(&slot->connections, memory_order_relaxed),
+            atomic_load_explicit(&slot->bytes_pending, memory_order_relaxed),
+            atomic_load_explicit(&slot->cpu, memory_order_relaxed));
+    }
+}
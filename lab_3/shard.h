@@ -0,0 +1,188 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/file.h>
+
+#include "client_utils.h"
+
+// Client-side sharding over a list of equivalent servers. Every filename ranks all servers
+// with weighted rendezvous hashing: server i scores -weight_i / ln(h(name, i)), h uniform in
+// (0, 1), and the request goes to the best score, failing over down the ranking. Adding or
+// removing a server only moves the names that rank it first, and a server's share of names
+// is proportional to its weight.
+//
+// The weight is the inverse of the server's smoothed connect plus handshake latency, cut to
+// a hundredth while a recent failure is cooling down, so slow or flapping servers get less
+// traffic without names moving around on every run. The client is a one-shot process, so
+// the view lives in an optional health file shared by every client that names it:
+//   <address>:<port> <latency_ewma_ms> <consecutive_failures> <last_failure_unix_seconds>
+
+enum {
+    SHARD_MAX_SERVERS = 64,
+    SHARD_FAILURE_COOLDOWN_SECONDS = 30
+};
+
+static const double SHARD_LATENCY_ALPHA = 0.3;
+static const double SHARD_LATENCY_FLOOR_MS = 1.0;
+static const double SHARD_FAILED_WEIGHT_FACTOR = 0.01;
+
+typedef struct {
+    char address[INET_ADDRSTRLEN];
+    uint16_t port;
+    double latency_ewma_ms;
+    uint32_t consecutive_failures;
+    int64_t last_failure;
+} ShardServer;
+
+typedef struct {
+    size_t count;
+    ShardServer servers[SHARD_MAX_SERVERS];
+} ShardServers;
+
+// Parses a comma separated list of <ipv4>:<port>.
+static bool shard_parse_servers(const char *list, ShardServers *const shard) {
+    shard->count = 0;
+    while(*list != '\0') {
+        const char *const end = list + strcspn(list, ",");
+        const char *const colon = memchr(list, ':', (size_t)(end - list));
+        if(colon == NULL or colon == list or (size_t)(colon - list) >= INET_ADDRSTRLEN or shard->count == SHARD_MAX_SERVERS) {
+            return false;
+        }
+        ShardServer *const server = &shard->servers[shard->count++];
+        memset(server, 0, sizeof(*server));
+        memcpy(server->address, list, (size_t)(colon - list));
+        struct in_addr unused;
+        const long port = strtol(colon + 1, NULL, 10);
+        if(inet_pton(AF_INET, server->address, &unused) != 1 or port <= 0 or port > UINT16_MAX) {
+            return false;
+        }
+        server->port = (uint16_t)port;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return shard->count > 0;
+}
+
+static ShardServer *shard_find(ShardServers *const shard, const char *const address, const uint16_t port) {
+    for(size_t i = 0; i < shard->count; ++i) {
+        if(shard->servers[i].port == port and strcmp(shard->servers[i].address, address) == 0) {
+            return &shard->servers[i];
+        }
+    }
+    return NULL;
+}
+
+// FNV-1a over the name and the server, finished with the splitmix64 mixer so that servers
+// differing in one port digit still rank independently.
+static uint64_t shard_hash(const char *const filename, const ShardServer *const server) {
+    uint64_t hash = 0xcbf29ce484222325;
+    char key[PATH_MAX];
+    const int key_length = snprintf(key, sizeof(key), "%s:%u/%s", server->address, server->port, filename);
+    for(int i = 0; i < key_length and (size_t)i < sizeof(key); ++i) {
+        hash = (hash ^ (uint8_t)key[i]) * 0x100000001b3;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+    return hash ^ (hash >> 31);
+}
+
+static double shard_weight(const ShardServer *const server, const int64_t now) {
+    const double weight = 1.0 / (server->latency_ewma_ms + SHARD_LATENCY_FLOOR_MS);
+    const bool is_cooling_down = server->consecutive_failures > 0 and now - server->last_failure < SHARD_FAILURE_COOLDOWN_SECONDS;
+    return is_cooling_down ? weight * SHARD_FAILED_WEIGHT_FACTOR : weight;
+}
+
+static double shard_score(const char *const filename, const ShardServer *const server, const int64_t now) {
+    const double unit = ((double)(shard_hash(filename, server) >> 11) + 0.5) / 9007199254740992.0;
+    return -shard_weight(server, now) / log(unit);
+}
+
+// Fills order with the server indices from the best to the worst candidate for filename.
+static void shard_rank(const ShardServers *const shard, const char *const filename, size_t *const order) {
+    const int64_t now = time(NULL);
+    double scores[SHARD_MAX_SERVERS];
+    for(size_t i = 0; i < shard->count; ++i) {
+        scores[i] = shard_score(filename, &shard->servers[i], now);
+        order[i] = i;
+    }
+    for(size_t i = 1; i < shard->count; ++i) {
+        const size_t current = order[i];
+        size_t j = i;
+        for(; j > 0 and scores[order[j - 1]] < scores[current]; --j) {
+            order[j] = order[j - 1];
+        }
+        order[j] = current;
+    }
+}
+
+static void shard_health_parse(ShardServers *const shard, FILE *const file) {
+    char address[INET_ADDRSTRLEN];
+    unsigned port;
+    double latency_ewma_ms;
+    uint32_t consecutive_failures;
+    int64_t last_failure;
+    while(fscanf(file, "%15[^:]:%u %lf %u %ld\n", address, &port, &latency_ewma_ms, &consecutive_failures, &last_failure) == 5) {
+        ShardServer *const server = shard_find(shard, address, (uint16_t)port);
+        if(server != NULL) {
+            server->latency_ewma_ms = latency_ewma_ms;
+            server->consecutive_failures = consecutive_failures;
+            server->last_failure = last_failure;
+        }
+    }
+}
+
+static void shard_health_load(ShardServers *const shard, const char *const path) {
+    FILE *const file = fopen(path, "r");
+    if(file == NULL) {
+        return;
+    }
+    flock(fileno(file), LOCK_SH);
+    shard_health_parse(shard, file);
+    fclose(file);
+}
+
+static void shard_record(ShardServer *const server, const bool is_ok, const double latency_ms) {
+    if(is_ok) {
+        server->latency_ewma_ms = server->latency_ewma_ms <= 0
+            ? latency_ms
+            : SHARD_LATENCY_ALPHA * latency_ms + (1 - SHARD_LATENCY_ALPHA) * server->latency_ewma_ms;
+        server->consecutive_failures = 0;
+    } else {
+        ++server->consecutive_failures;
+        server->last_failure = time(NULL);
+    }
+}
+
+// Read, update and rewrite under an exclusive lock on the health file itself, so concurrent
+// clients do not drop each other's observations. Only this run's server gets updated, the
+// others keep whatever the file says now.
+static void shard_health_store(const char *const path, const ShardServers *const shard, const ShardServer *const observed) {
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        printf("[Failed to open health file: %s] [errno: %d] [strerror: %s]\n", path, errno, strerror(errno));
+        return;
+    }
+    flock(fd, LOCK_EX);
+    ShardServers current = *shard;
+    FILE *const file = fdopen(fd, "r+");
+    shard_health_parse(&current, file);
+    *shard_find(&current, observed->address, observed->port) = *observed;
+    rewind(file);
+    for(size_t i = 0; i < current.count; ++i) {
+        const ShardServer *const server = &current.servers[i];
+        fprintf(file, "%s:%u %.3f %u %ld\n", server->address, server->port, server->latency_ewma_ms, server->consecutive_failures, server->last_failure);
+    }
+    fflush(file);
+    if(ftruncate(fd, ftell(file)) == -1) {
+        printf("[Failed to truncate health file: %s] [errno: %d] [strerror: %s]\n", path, errno, strerror(errno));
+    }
+    fclose(file);
+}
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "iterative_server_utils_one.h"
+#include "syscall_count.h"
+
+// System calls and time per small-file request of handle_client, which every server variant
+// here runs for each connection. The requests go over connected pairs, a client process on
+// one end and handle_client on the other, so only the request itself is measured and not
+// how a variant accepts or hands out connections. Server logging goes to a buffer big enough
+// for the whole run, what it costs depends on where stdout goes.
+//
+// Exits with failure when a request needs more system calls than its budget. A change that
+// saves some should lower the budget with it, so they cannot come back unnoticed.
+
+enum {
+    BENCH_REQUESTS = 50,
+    BENCH_FILE_SIZE = 4096,
+    BENCH_LOG_BUFFER_SIZE = 64 << 20
+};
+
+static const char BENCH_FILENAME[] = "small.bin";
+
+typedef enum {
+    BenchTransport_UNIX,
+    BenchTransport_TCP,
+} BenchTransport;
+
+typedef struct {
+    const char *name;
+    BenchTransport transport;
+    RequestOperation operation;
+    uint64_t budget;
+} BenchVariant;
+
+static const BenchVariant BENCH_VARIANTS[] = {
+    { .name = "get over unix socket", .transport = BenchTransport_UNIX, .operation = RequestOperation_GET, .budget = 13 },
+    { .name = "get over tcp", .transport = BenchTransport_TCP, .operation = RequestOperation_GET, .budget = 13 },
+    { .name = "get digest over tcp", .transport = BenchTransport_TCP, .operation = RequestOperation_GET_DIGEST, .budget = 17 },
+    { .name = "put over tcp", .transport = BenchTransport_TCP, .operation = RequestOperation_PUT, .budget = 20 },
+};
+
+typedef struct {
+    const IterativeServerConfig *config;
+    const int *socks;
+} BenchServer;
+
+static int64_t bench_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Connects to the listener and accepts, so the server end is what a server gets from accept.
+// A socketpair would not do for unix sockets, unnamed ones are treated as plain streams.
+static bool bench_pair(const int listen_fd, int pair[2]) {
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+    if(getsockname(listen_fd, (struct sockaddr *)&address, &address_len) == -1) {
+        return false;
+    }
+    pair[1] = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(pair[1] == -1 or connect(pair[1], (struct sockaddr *)&address, address_len) == -1) {
+        return false;
+    }
+    pair[0] = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    return pair[0] != -1;
+}
+
+static bool bench_pairs_create(const BenchTransport transport, const char *const unix_path, int server_socks[], int client_socks[]) {
+    int listen_fd;
+    if(transport == BenchTransport_TCP) {
+        const struct sockaddr_in loopback = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK), .sin_port = 0 };
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(listen_fd == -1 or bind(listen_fd, (const struct sockaddr *)&loopback, sizeof(loopback)) == -1) {
+            return false;
+        }
+    } else {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        strncpy(address.sun_path, unix_path, sizeof(address.sun_path) - 1);
+        unlink(unix_path);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(listen_fd == -1 or bind(listen_fd, (const struct sockaddr *)&address, sizeof(address)) == -1) {
+            return false;
+        }
+    }
+    if(listen(listen_fd, 1) == -1) {
+        return false;
+    }
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        int pair[2];
+        if(not bench_pair(listen_fd, pair)) {
+            return false;
+        }
+        server_socks[i] = pair[0];
+        client_socks[i] = pair[1];
+    }
+    checked_close(listen_fd);
+    return true;
+}
+
+// The client half of one request, the way client.c would make it.
+static bool bench_request(const int sock, const BenchVariant *const variant) {
+    const uint8_t header[2] = { PROTOCOL_VERSION, (uint8_t)variant->operation };
+    filename_buff_t filename_buffer = { 0 };
+    strcpy(filename_buffer, BENCH_FILENAME);
+    bool is_ok;
+    if(not checked_write(sock, &header[0], sizeof(header[0]), NULL) or not checked_read(sock, &is_ok, sizeof(is_ok), NULL) or not is_ok
+        or not checked_write(sock, &header[1], sizeof(header[1]), NULL)
+        or not checked_write(sock, filename_buffer, sizeof(filename_buffer), NULL)) {
+        return false;
+    }
+    uint8_t body[BENCH_FILE_SIZE];
+    if(variant->operation == RequestOperation_PUT) {
+        const uint64_t size = htobe64(BENCH_FILE_SIZE);
+        memset(body, 'x', sizeof(body));
+        return checked_write(sock, &size, sizeof(size), NULL) and checked_read(sock, &is_ok, sizeof(is_ok), NULL) and is_ok
+            and checked_write(sock, body, sizeof(body), NULL) and checked_read(sock, &is_ok, sizeof(is_ok), NULL) and is_ok;
+    }
+    uint64_t size;
+    uint32_t digest;
+    if(not checked_read(sock, &is_ok, sizeof(is_ok), NULL) or not is_ok or not checked_read(sock, &size, sizeof(size), NULL)
+        or (variant->operation == RequestOperation_GET_DIGEST and not checked_read(sock, &digest, sizeof(digest), NULL))) {
+        return false;
+    }
+    is_ok = true;
+    if(not checked_write(sock, &is_ok, sizeof(is_ok), NULL)) {
+        return false;
+    }
+    if(variant->transport == BenchTransport_UNIX) {
+        int fd;
+        return checked_receive_fd(sock, &fd) and checked_close(fd);
+    }
+    return checked_read(sock, body, be64toh(size), NULL);
+}
+
+static pid_t bench_client_spawn(const BenchVariant *const variant, const int server_socks[], const int client_socks[]) {
+    fflush(NULL);
+    const pid_t pid = fork();
+    if(pid != 0) {
+        return pid;
+    }
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        checked_close(server_socks[i]);
+    }
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        if(not bench_request(client_socks[i], variant)) {
+            _exit(EXIT_FAILURE);
+        }
+        checked_close(client_socks[i]);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+static void bench_serve(void *const arg) {
+    const BenchServer *const server = arg;
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        handle_client(server->socks[i], server->config);
+        checked_close(server->socks[i]);
+    }
+}
+
+// Serves BENCH_REQUESTS requests, counting system calls when count is given and timing them
+// otherwise. Returns the nanoseconds per request or -1.
+static int64_t bench_run(const BenchVariant *const variant, const IterativeServerConfig *const config, SyscallCount *const count) {
+    int server_socks[BENCH_REQUESTS];
+    int client_socks[BENCH_REQUESTS];
+    char unix_path[PATH_MAX];
+    snprintf(unix_path, sizeof(unix_path), "%s/bench.sock", config->dir_path);
+    if(not bench_pairs_create(variant->transport, unix_path, server_socks, client_socks)) {
+        return -1;
+    }
+    const pid_t client = bench_client_spawn(variant, server_socks, client_socks);
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        checked_close(client_socks[i]);
+    }
+    BenchServer server = { .config = config, .socks = server_socks };
+    const int64_t started_at = bench_now_ns();
+    bool is_ok = true;
+    if(count != NULL) {
+        is_ok = syscall_count_run(bench_serve, &server, count);
+        for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+            checked_close(server_socks[i]);
+        }
+    } else {
+        bench_serve(&server);
+    }
+    const int64_t elapsed = bench_now_ns() - started_at;
+    int status;
+    is_ok = waitpid(client, &status, 0) != -1 and WIFEXITED(status) and WEXITSTATUS(status) == 0 and is_ok;
+    return is_ok ? elapsed / BENCH_REQUESTS : -1;
+}
+
+int main(void) {
+    // The report keeps the real stdout, the servers' logging goes to /dev/null through a buffer
+    // that holds all of it.
+    FILE *const report = fdopen(dup(STDOUT_FILENO), "w");
+    static char log_buffer[BENCH_LOG_BUFFER_SIZE];
+    if(report == NULL or freopen("/dev/null", "w", stdout) == NULL or setvbuf(stdout, log_buffer, _IOFBF, sizeof(log_buffer)) != 0) {
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    char dir_path[] = "/tmp/syscall_bench.XXXXXX";
+    if(mkdtemp(dir_path) == NULL) {
+        fprintf(report, "[Failed to create directory] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    char file_path[PATH_MAX];
+    snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, BENCH_FILENAME);
+    const int file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint8_t data[BENCH_FILE_SIZE];
+    memset(data, 'x', sizeof(data));
+    if(file_fd == -1 or not checked_write(file_fd, data, sizeof(data), NULL) or not checked_close(file_fd)) {
+        fprintf(report, "[Failed to create %s] [errno: %d] [strerror: %s]\n", file_path, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    IterativeServerConfig config;
+    iterative_server_default_options(&config);
+    config.address = "127.0.0.1";
+    config.dir_path = dir_path;
+    config.max_upload_size = BENCH_FILE_SIZE;
+
+    bool is_within_budget = true;
+    for(size_t i = 0; i < ARRAY_SIZE(BENCH_VARIANTS); ++i) {
+        const BenchVariant *const variant = &BENCH_VARIANTS[i];
+        SyscallCount count;
+        // The timed run goes first and warms the page cache and the allocator for the counted one.
+        const int64_t ns = bench_run(variant, &config, NULL);
+        if(ns == -1 or bench_run(variant, &config, &count) == -1) {
+            fprintf(report, "[%s] [Failed to run] [errno: %d] [strerror: %s]\n", variant->name, errno, strerror(errno));
+            is_within_budget = false;
+            continue;
+        }
+        const double per_request = (double)count.total / BENCH_REQUESTS;
+        fprintf(report, "[%s] [syscalls per request: %.2f] [budget: %lu] [ns per request: %ld]\n\t", variant->name, per_request, variant->budget, ns);
+        syscall_count_print(report, &count, BENCH_REQUESTS);
+        if(per_request > (double)variant->budget) {
+            fprintf(report, "[FAILED: %s needs more system calls than its budget]\n", variant->name);
+            is_within_budget = false;
+        } else if(per_request + 1 <= (double)variant->budget) {
+            fprintf(report, "[Budget of %s can be lowered to %.0f]\n", variant->name, ceil(per_request));
+        }
+    }
+    unlink(file_path);
+    snprintf(file_path, sizeof(file_path), "%s/bench.sock", dir_path);
+    unlink(file_path);
+    rmdir(dir_path);
+    fclose(report);
+    return is_within_budget ? EXIT_SUCCESS : EXIT_FAILURE;
+}
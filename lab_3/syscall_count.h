@@ -0,0 +1,156 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "client_utils.h"
+
+// Counts the system calls a piece of code makes. The code runs in a forked child that stops
+// itself and is then stepped from one system call to the next with ptrace, so no strace or
+// perf has to be installed and nothing the child does escapes the count, not even the calls
+// made inside libc. The child's exit is left out.
+
+enum { SYSCALL_COUNT_MAX_NR = 512 };
+
+typedef struct {
+    uint64_t total;
+    uint32_t by_nr[SYSCALL_COUNT_MAX_NR];
+} SyscallCount;
+
+// Names of the calls the servers make, the others are printed by number. The first ones are
+// defined on every architecture, the rest only where the architecture has them: x86-64 keeps
+// select, poll, rename and unlink, 32-bit ones have the 64-bit or time64 variants instead.
+static const char *const SYSCALL_NAMES[SYSCALL_COUNT_MAX_NR] = {
+    [SYS_read] = "read", [SYS_write] = "write", [SYS_openat] = "openat", [SYS_close] = "close", [SYS_munmap] = "munmap",
+    [SYS_madvise] = "madvise", [SYS_brk] = "brk", [SYS_pread64] = "pread64", [SYS_pwrite64] = "pwrite64",
+    [SYS_splice] = "splice", [SYS_pipe2] = "pipe2", [SYS_socket] = "socket", [SYS_accept4] = "accept4",
+    [SYS_sendto] = "sendto", [SYS_recvfrom] = "recvfrom", [SYS_sendmsg] = "sendmsg", [SYS_recvmsg] = "recvmsg",
+    [SYS_getsockname] = "getsockname", [SYS_getsockopt] = "getsockopt", [SYS_setsockopt] = "setsockopt",
+    [SYS_fallocate] = "fallocate", [SYS_renameat2] = "renameat2", [SYS_unlinkat] = "unlinkat", [SYS_fchmod] = "fchmod",
+    [SYS_getpid] = "getpid", [SYS_getrandom] = "getrandom", [SYS_statx] = "statx", [SYS_fsync] = "fsync",
+    [SYS_fdatasync] = "fdatasync",
+#ifdef SYS_fstat
+    [SYS_fstat] = "fstat",
+#endif
+#ifdef SYS_newfstatat
+    [SYS_newfstatat] = "newfstatat",
+#endif
+#ifdef SYS_lseek
+    [SYS_lseek] = "lseek",
+#endif
+#ifdef SYS_mmap
+    [SYS_mmap] = "mmap",
+#endif
+#ifdef SYS_select
+    [SYS_select] = "select",
+#endif
+#ifdef SYS_pselect6
+    [SYS_pselect6] = "pselect6",
+#endif
+#ifdef SYS_poll
+    [SYS_poll] = "poll",
+#endif
+#ifdef SYS_ppoll
+    [SYS_ppoll] = "ppoll",
+#endif
+#ifdef SYS_sendfile
+    [SYS_sendfile] = "sendfile",
+#endif
+#ifdef SYS_fcntl
+    [SYS_fcntl] = "fcntl",
+#endif
+#ifdef SYS_fadvise64
+    [SYS_fadvise64] = "fadvise64",
+#endif
+#ifdef SYS_statfs
+    [SYS_statfs] = "statfs",
+#endif
+#ifdef SYS_fstatfs
+    [SYS_fstatfs] = "fstatfs",
+#endif
+#ifdef SYS_rename
+    [SYS_rename] = "rename",
+#endif
+#ifdef SYS_renameat
+    [SYS_renameat] = "renameat",
+#endif
+#ifdef SYS_unlink
+    [SYS_unlink] = "unlink",
+#endif
+#ifdef SYS_clock_gettime
+    [SYS_clock_gettime] = "clock_gettime",
+#endif
+};
+
+// Runs body(arg) in a traced child, false if it could not be traced or did not exit cleanly.
+static bool syscall_count_run(void (*const body)(void *), void *const arg, SyscallCount *const count) {
+    memset(count, 0, sizeof(*count));
+    fflush(NULL);
+    const pid_t pid = fork();
+    if(pid == -1) {
+        return false;
+    }
+    if(pid == 0) {
+        if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+        raise(SIGSTOP);
+        body(arg);
+        // Straight to the kernel, buffered output of the child is thrown away.
+        syscall(SYS_exit_group, 0);
+    }
+    int status;
+    if(waitpid(pid, &status, 0) == -1 or not WIFSTOPPED(status)
+        or ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) == -1) {
+        printf("[Failed to trace child] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    int pending_signal = 0;
+    while(ptrace(PTRACE_SYSCALL, pid, NULL, pending_signal) != -1 and waitpid(pid, &status, 0) != -1 and WIFSTOPPED(status)) {
+        pending_signal = 0;
+        if(WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+            pending_signal = WSTOPSIG(status);
+            continue;
+        }
+        struct __ptrace_syscall_info info;
+        if(ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 and info.op == PTRACE_SYSCALL_INFO_ENTRY
+            and info.entry.nr != SYS_exit_group) {
+            ++count->total;
+            if(info.entry.nr < SYSCALL_COUNT_MAX_NR) {
+                ++count->by_nr[info.entry.nr];
+            }
+        }
+    }
+    return WIFEXITED(status) and WEXITSTATUS(status) == 0;
+}
+
+// Prints the calls made per run of runs, the most frequent first.
+static void syscall_count_print(FILE *const out, const SyscallCount *const count, const uint64_t runs) {
+    bool is_printed[SYSCALL_COUNT_MAX_NR] = { false };
+    for(;;) {
+        size_t top = SYSCALL_COUNT_MAX_NR;
+        for(size_t nr = 0; nr < SYSCALL_COUNT_MAX_NR; ++nr) {
+            if(count->by_nr[nr] != 0 and not is_printed[nr] and (top == SYSCALL_COUNT_MAX_NR or count->by_nr[nr] > count->by_nr[top])) {
+                top = nr;
+            }
+        }
+        if(top == SYSCALL_COUNT_MAX_NR) {
+            break;
+        }
+        is_printed[top] = true;
+        if(SYSCALL_NAMES[top] != NULL) {
+            fprintf(out, " %s=%.2f", SYSCALL_NAMES[top], (double)count->by_nr[top] / (double)runs);
+        } else {
+            fprintf(out, " #%zu=%.2f", top, (double)count->by_nr[top] / (double)runs);
+        }
+    }
+    fprintf(out, "\n");
+}
@@ -0,0 +1,70 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import signal
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+CLIENT_EXECUTABLE = BUILD_DIR / 'client.o'
+SERVER_EXECUTABLE = BUILD_DIR / 'pool_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = '55005'
+MAX_FILE_SIZE = '100000000'
+MAX_CHILDREN = '16'
+MAX_UPLOAD_SIZE = '100000000'
+
+FILENAME = 'shared.bin'
+FILE_SIZE = 1 << 20
+ROUNDS = 10
+READERS = 8
+
+with tempfile.TemporaryDirectory() as tmp:
+    tmp_dir = pathlib.Path(tmp)
+    server_dir = tmp_dir / 'server'
+    server_dir.mkdir()
+    versions = [os.urandom(FILE_SIZE), os.urandom(FILE_SIZE)]
+    writer_dirs = []
+    for i, version in enumerate(versions):
+        writer_dir = tmp_dir / f'writer_{i}'
+        writer_dir.mkdir()
+        (writer_dir / FILENAME).write_bytes(version)
+        writer_dirs.append(writer_dir)
+    (server_dir / FILENAME).write_bytes(versions[0])
+
+    server = subprocess.Popen([SERVER_EXECUTABLE, '-q', MAX_UPLOAD_SIZE, ADDRESS, PORT, server_dir, MAX_CHILDREN], stdout=subprocess.DEVNULL, start_new_session=True)
+    time.sleep(1)
+
+    start = time.perf_counter()
+    subprocess.run([CLIENT_EXECUTABLE, '-P', ADDRESS, PORT, FILENAME, MAX_FILE_SIZE], cwd=writer_dirs[0], stdout=subprocess.DEVNULL, check=True)
+    upload_time = time.perf_counter() - start
+    reader_dir = tmp_dir / 'reader_throughput'
+    reader_dir.mkdir()
+    start = time.perf_counter()
+    subprocess.run([CLIENT_EXECUTABLE, ADDRESS, PORT, FILENAME, MAX_FILE_SIZE], cwd=reader_dir, stdout=subprocess.DEVNULL, check=True)
+    download_time = time.perf_counter() - start
+    print(f'[upload: {FILE_SIZE / upload_time / 1e6:.1f} MB/s] [download: {FILE_SIZE / download_time / 1e6:.1f} MB/s]')
+
+    torn_reads = 0
+    for round in range(ROUNDS):
+        writer = subprocess.Popen([CLIENT_EXECUTABLE, '-P', ADDRESS, PORT, FILENAME, MAX_FILE_SIZE], cwd=writer_dirs[round % 2], stdout=subprocess.DEVNULL)
+        readers: list[tuple[pathlib.Path, subprocess.Popen[bytes]]] = []
+        for i in range(READERS):
+            reader_dir = tmp_dir / f'reader_{round}_{i}'
+            reader_dir.mkdir()
+            readers.append((reader_dir, subprocess.Popen([CLIENT_EXECUTABLE, ADDRESS, PORT, FILENAME, MAX_FILE_SIZE], cwd=reader_dir, stdout=subprocess.DEVNULL)))
+        writer.wait()
+        for reader_dir, reader in readers:
+            reader.wait()
+            if (reader_dir / FILENAME).read_bytes() not in versions:
+                torn_reads += 1
+
+    os.killpg(server.pid, signal.SIGINT)
+    server.wait()
+
+    leftovers = [path.name for path in server_dir.iterdir() if path.name != FILENAME]
+    print(f'[torn reads: {torn_reads}] [leftover temp files: {leftovers}]')
+    assert torn_reads == 0
+    assert not leftovers
+    print('[CLIENTS FINISHED]')
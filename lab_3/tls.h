@@ -0,0 +1,202 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "client_utils.h"
+
+// TLS with the record layer in the kernel. OpenSSL runs the handshake and, with
+// SSL_OP_ENABLE_KTLS, installs the session keys as TLS_TX/TLS_RX on the socket. From then on
+// the socket carries plaintext for us: read, write, sendfile and splice all keep working and
+// the protocol code does not know TLS is there.
+//
+// When the kernel can not take the keys (no tls module, unsupported cipher) the session falls
+// back to a relay thread that moves data between SSL_read/SSL_write and one end of a
+// socketpair, the protocol code gets the other end. That costs a copy but nothing else changes.
+
+enum {
+    TLS_RELAY_BUFFER_SIZE = 1 << 16,
+    TLS_HANDSHAKE_TIMEOUT_SECONDS = 10
+};
+
+typedef struct {
+    SSL *ssl;
+    int app_fd;
+    int relay_fd;
+    pthread_t relay;
+} TlsSession;
+
+static void tls_print_errors(const char *const what) {
+    printf("[%s]", what);
+    unsigned long error;
+    while((error = ERR_get_error()) != 0) {
+        char message[256];
+        ERR_error_string_n(error, message, sizeof(message));
+        printf(" [%s]", message);
+    }
+    printf("\n");
+}
+
+static SSL_CTX *tls_server_context_create(const char *const cert_file, const char *const key_file) {
+    SSL_CTX *const ctx = SSL_CTX_new(TLS_server_method());
+    if(ctx == NULL) {
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    // A kTLS receiver can not take post-handshake messages, so no session tickets.
+    SSL_CTX_set_num_tickets(ctx, 0);
+    if(SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+        or SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1) {
+        tls_print_errors("Failed to load certificate");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static SSL_CTX *tls_client_context_create(const char *const ca_file) {
+    SSL_CTX *const ctx = SSL_CTX_new(TLS_client_method());
+    if(ctx == NULL) {
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    if(SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+        tls_print_errors("Failed to load CA file");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static bool tls_relay_write(SSL *const ssl, const int sock, const uint8_t *const buffer, const int count) {
+    int written = 0;
+    while(written < count) {
+        const int nwrite = SSL_write(ssl, buffer + written, count - written);
+        if(nwrite > 0) {
+            written += nwrite;
+            continue;
+        }
+        const int error = SSL_get_error(ssl, nwrite);
+        if(error != SSL_ERROR_WANT_WRITE and error != SSL_ERROR_WANT_READ) {
+            return false;
+        }
+        struct pollfd pfd = { .fd = sock, .events = error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN };
+        poll(&pfd, 1, -1);
+    }
+    return true;
+}
+
+// Runs until the protocol side closes its end, everything it wrote is flushed before close_notify.
+static void *tls_relay_main(void *const arg) {
+    TlsSession *const session = arg;
+    const int sock = SSL_get_fd(session->ssl);
+    uint8_t *const buffer = malloc(TLS_RELAY_BUFFER_SIZE);
+    bool is_peer_open = true;
+    while(true) {
+        struct pollfd pfds[] = {
+            { .fd = session->relay_fd, .events = POLLIN },
+            { .fd = is_peer_open ? sock : -1, .events = POLLIN },
+        };
+        if(not (is_peer_open and SSL_pending(session->ssl) > 0) and poll(pfds, ARRAY_SIZE(pfds), -1) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if(is_peer_open and (SSL_pending(session->ssl) > 0 or pfds[1].revents != 0)) {
+            const int nread = SSL_read(session->ssl, buffer, TLS_RELAY_BUFFER_SIZE);
+            if(nread > 0) {
+                if(not checked_write(session->relay_fd, buffer, (size_t)nread, NULL)) {
+                    break;
+                }
+            } else if(SSL_get_error(session->ssl, nread) != SSL_ERROR_WANT_READ) {
+                is_peer_open = false;
+                shutdown(session->relay_fd, SHUT_WR);
+            }
+        }
+        if(pfds[0].revents != 0) {
+            const ssize_t nread = read(session->relay_fd, buffer, TLS_RELAY_BUFFER_SIZE);
+            if(nread <= 0) {
+                break;
+            }
+            if(not tls_relay_write(session->ssl, sock, buffer, (int)nread)) {
+                break;
+            }
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Handshakes on a connected blocking socket. On success session->app_fd is the descriptor
+// the protocol code should use, peer_address additionally pins the server's IP on clients.
+static bool tls_session_start(TlsSession *const session, SSL_CTX *const ctx, const int sock, const char *const peer_address) {
+    session->ssl = SSL_new(ctx);
+    session->app_fd = -1;
+    session->relay_fd = -1;
+    if(session->ssl == NULL or SSL_set_fd(session->ssl, sock) != 1) {
+        tls_print_errors("Failed to create TLS session");
+        SSL_free(session->ssl);
+        return false;
+    }
+    if(peer_address != NULL) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(session->ssl), peer_address);
+    }
+    // A peer that never speaks TLS must not pin a single-threaded server forever.
+    struct timeval timeout = { .tv_sec = TLS_HANDSHAKE_TIMEOUT_SECONDS };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    const int status = peer_address != NULL ? SSL_connect(session->ssl) : SSL_accept(session->ssl);
+    timeout.tv_sec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if(status != 1) {
+        tls_print_errors("TLS handshake failed");
+        SSL_free(session->ssl);
+        return false;
+    }
+    if(BIO_get_ktls_send(SSL_get_wbio(session->ssl)) and BIO_get_ktls_recv(SSL_get_rbio(session->ssl))) {
+        printf("[TLS: kernel] [cipher: %s]\n", SSL_get_cipher_name(session->ssl));
+        session->app_fd = sock;
+        return true;
+    }
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        printf("[Failed to create TLS relay] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        SSL_free(session->ssl);
+        return false;
+    }
+    ASSERT_POSIX(fcntl(sock, F_SETFL, O_NONBLOCK));
+    session->app_fd = pair[0];
+    session->relay_fd = pair[1];
+    const int error = pthread_create(&session->relay, NULL, tls_relay_main, session);
+    if(error != 0) {
+        printf("[Failed to start TLS relay] [errno: %d] [strerror: %s]\n", error, strerror(error));
+        checked_close(pair[0]);
+        checked_close(pair[1]);
+        SSL_free(session->ssl);
+        return false;
+    }
+    printf("[TLS: user-space relay] [cipher: %s]\n", SSL_get_cipher_name(session->ssl));
+    return true;
+}
+
+// Closes app_fd, sends close_notify and frees the session. The TCP socket stays open for the caller.
+static void tls_session_finish(TlsSession *const session) {
+    if(session->relay_fd != -1) {
+        checked_close(session->app_fd);
+        pthread_join(session->relay, NULL);
+        checked_close(session->relay_fd);
+        const int sock = SSL_get_fd(session->ssl);
+        ASSERT_POSIX(fcntl(sock, F_SETFL, 0));
+    }
+    SSL_shutdown(session->ssl);
+    SSL_free(session->ssl);
+}
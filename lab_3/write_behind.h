@@ -0,0 +1,45 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "client_utils.h"
+
+// Rolling write-behind for a file written front to back. Every full window is handed to
+// writeback as soon as it is written, and the window before it is waited for, so at most two
+// windows are dirty or under writeback at once instead of whatever vm.dirty_ratio allows. The
+// kernel otherwise starts flushing late and the close or fsync at the end of a big download
+// stalls for seconds on the backlog.
+
+typedef struct {
+    int fd;
+    off_t window;
+    off_t started;
+    off_t waited;
+} WriteBehind;
+
+static WriteBehind write_behind_create(const int fd, const size_t window) {
+    return (WriteBehind){ .fd = fd, .window = (off_t)window, .started = 0, .waited = 0 };
+}
+
+// written is how far the file is written without gaps, a NULL or disabled write-behind does nothing.
+static void write_behind_advance(WriteBehind *const write_behind, const off_t written) {
+    if(write_behind == NULL or write_behind->window == 0) {
+        return;
+    }
+    while(written - write_behind->started >= write_behind->window) {
+        if(sync_file_range(write_behind->fd, write_behind->started, write_behind->window, SYNC_FILE_RANGE_WRITE) == -1) {
+            printf("[Write-behind disabled] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            write_behind->window = 0;
+            return;
+        }
+        write_behind->started += write_behind->window;
+        if(write_behind->started - write_behind->waited > write_behind->window) {
+            sync_file_range(write_behind->fd, write_behind->waited, write_behind->window,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            write_behind->waited += write_behind->window;
+        }
+    }
+}
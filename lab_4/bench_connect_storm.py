@@ -0,0 +1,75 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import socket
+import selectors
+import errno
+import resource
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'multiplex_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = 55030
+PROTOCOL_VERSION = 20
+CONNECTIONS = 10000
+MAX_CLIENTS = '1000'
+BACKLOGS = ['10', str(socket.SOMAXCONN)]
+DEADLINE_SECONDS = 30
+
+# Opens every connection at once and times each one until the server's protocol match, or
+# its BUSY answer once max_clients are connected, arrives. SYNs dropped by a full accept
+# queue show up as multi-second outliers, connections still waiting after the deadline count
+# as failed.
+def storm(port: int) -> tuple[list[float], int]:
+    selector = selectors.DefaultSelector()
+    started = {}
+    for _ in range(CONNECTIONS):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setblocking(False)
+        started[sock] = time.perf_counter()
+        if sock.connect_ex((ADDRESS, port)) not in (0, errno.EINPROGRESS):
+            raise RuntimeError('connect failed')
+        selector.register(sock, selectors.EVENT_WRITE)
+    latencies = []
+    failures = 0
+    deadline = time.perf_counter() + DEADLINE_SECONDS
+    while len(latencies) + failures < CONNECTIONS and time.perf_counter() < deadline:
+        for key, events in selector.select(timeout=1):
+            sock = key.fileobj
+            try:
+                if events & selectors.EVENT_WRITE:
+                    sock.send(bytes([PROTOCOL_VERSION]))
+                    selector.modify(sock, selectors.EVENT_READ)
+                    continue
+                assert sock.recv(1) in (b'\x01', b'\x02')
+                latencies.append(time.perf_counter() - started[sock])
+            except ConnectionError:
+                failures += 1
+            selector.unregister(sock)
+            sock.close()
+    for key in list(selector.get_map().values()):
+        key.fileobj.close()
+    return sorted(latencies), CONNECTIONS - len(latencies)
+
+soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, CONNECTIONS * 2), hard))
+
+with tempfile.TemporaryDirectory() as tmp:
+    print(f'{CONNECTIONS} simultaneous connects, max_clients {MAX_CLIENTS}')
+    print(f'{"backlog":>8} {"total, s":>9} {"p50, ms":>8} {"p99, ms":>8} {"max, ms":>8} {">1s":>5} {"failed":>7}')
+    for i, backlog in enumerate(BACKLOGS):
+        port = PORT + i
+        server = subprocess.Popen([SERVER_EXECUTABLE, '-b', backlog, ADDRESS, str(port), tmp, MAX_CLIENTS], stdout=subprocess.DEVNULL)
+        time.sleep(1)
+        start = time.perf_counter()
+        latencies, failures = storm(port)
+        total = time.perf_counter() - start
+        slow = sum(1 for latency in latencies if latency > 1)
+        p50 = latencies[len(latencies) // 2] * 1e3
+        p99 = latencies[len(latencies) * 99 // 100] * 1e3
+        print(f'{backlog:>8} {total:>9.2f} {p50:>8.1f} {p99:>8.1f} {latencies[-1] * 1e3:>8.1f} {slow:>5} {failures:>7}')
+        server.send_signal(2)
+        server.wait()
@@ -0,0 +1,97 @@
+import subprocess
+import pathlib
+import os
+import time
+import tempfile
+import socket
+import struct
+import threading
+import random
+import statistics
+import collections
+
+SCRIPT_DIR = pathlib.Path(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = SCRIPT_DIR / 'build'
+SERVER_EXECUTABLE = BUILD_DIR / 'multiplex_server.o'
+ADDRESS  = '127.0.0.1'
+PORT = 55050
+PROTOCOL_VERSION = 20
+FILENAME_BUFFER_SIZE = 255
+STATUS_BUSY = 2
+MAX_CLIENTS = '16'
+FILE_SIZE = 4 << 20
+BURST = 300
+MAX_RETRIES = 8
+CLIENT_TIMEOUT_SECONDS = 30
+# -N is the old behaviour: at max_clients the server stops accepting and the burst waits in
+# the accept queue without an answer. The default answers the excess BUSY with a retry hint.
+MODES = [('queue', ['-N']), ('shed', [])]
+
+def recv_exact(sock: socket.socket, count: int) -> bytes:
+    data = bytearray()
+    while len(data) < count:
+        chunk = sock.recv(min(count - len(data), 1 << 20))
+        assert chunk
+        data += chunk
+    return bytes(data)
+
+# Returns the seconds until the first answer of any kind, until the download is done, and
+# how many BUSY answers it took. Honours the hint the same way client.c does.
+def get(barrier: threading.Barrier, results: list[tuple[float, float, int]]) -> None:
+    barrier.wait()
+    start = time.perf_counter()
+    first_answer = None
+    for attempt in range(MAX_RETRIES + 1):
+        try:
+            with socket.create_connection((ADDRESS, PORT), timeout=CLIENT_TIMEOUT_SECONDS) as sock:
+                sock.sendall(bytes([PROTOCOL_VERSION]))
+                status = recv_exact(sock, 1)[0]
+                if first_answer is None:
+                    first_answer = time.perf_counter() - start
+                if status == STATUS_BUSY:
+                    (retry_after_ms,) = struct.unpack('>I', recv_exact(sock, 4))
+                    delay = retry_after_ms * (1 << attempt) / 1000
+                    time.sleep(delay / 2 + random.uniform(0, delay / 2))
+                    continue
+                sock.sendall(bytes([0]) + b'file.bin'.ljust(FILENAME_BUFFER_SIZE, b'\0'))
+                assert recv_exact(sock, 1) == b'\x01'
+                (size,) = struct.unpack('>Q', recv_exact(sock, 8))
+                sock.sendall(b'\x01')
+                recv_exact(sock, size)
+                sock.sendall(b'\x01')
+        except OSError:
+            return
+        results.append((first_answer, time.perf_counter() - start, attempt))
+        return
+
+def run(name: str, flags: list[str], files_dir: pathlib.Path, log_path: pathlib.Path) -> None:
+    log = open(log_path, 'w')
+    server = subprocess.Popen([SERVER_EXECUTABLE, *flags, ADDRESS, str(PORT), files_dir, MAX_CLIENTS], stdout=log)
+    time.sleep(1)
+    barrier = threading.Barrier(BURST)
+    results: list[tuple[float, float, int]] = []
+    threads = [threading.Thread(target=get, args=(barrier, results)) for _ in range(BURST)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    server.send_signal(2)
+    server.wait()
+    log.close()
+    answers = statistics.quantiles([result[0] for result in results], n=100)
+    completions = statistics.quantiles([result[1] for result in results], n=100)
+    busy = sum(result[2] for result in results)
+    print(f'{name:>6} {len(results):>5} {BURST - len(results):>7} {answers[49] * 1000:>9.0f} {answers[98] * 1000:>9.0f} {completions[49] * 1000:>9.0f} {completions[98] * 1000:>9.0f} {busy:>6}')
+    reasons = collections.Counter(line.split('[busy: ')[1].split(']')[0] for line in log_path.read_text().splitlines() if '[busy: ' in line)
+    for reason, count in reasons.items():
+        print(f'{"":>6} busy because of {reason}: {count}')
+
+with tempfile.TemporaryDirectory() as tmp:
+    files_dir = pathlib.Path(tmp) / 'files'
+    files_dir.mkdir()
+    (files_dir / 'file.bin').write_bytes(os.urandom(FILE_SIZE))
+    print(f'{BURST} simultaneous GETs of {FILE_SIZE >> 20} MiB, max_clients {MAX_CLIENTS}')
+    print(f'{"":>6} {"":>5} {"":>7} {"first answer":>19} {"completion":>19}')
+    print(f'{"mode":>6} {"done":>5} {"failed":>7} {"p50, ms":>9} {"p99, ms":>9} {"p50, ms":>9} {"p99, ms":>9} {"busy":>6}')
+    for name, flags in MODES:
+        run(name, flags, files_dir, pathlib.Path(tmp) / 'server.log')
@@ -9,6 +9,9 @@
 #include <sys/stat.h> 
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <time.h>
 #include "client_utils.h"
 
 typedef struct {
@@ -16,127 +19,279 @@ typedef struct {
     uint16_t port;
     const char *filename;
     size_t max_file_size;
+    RequestOperation operation;
+    uint32_t max_retries;
 } ClientConfig;
 
+enum {
+    DEFAULT_MAX_RETRIES = 5,
+    MAX_BACKOFF_SHIFT = 16,
+    MAX_BACKOFF_MS = 30000
+};
+
 static void print_config(const ClientConfig *config) {
     printf("Client Configuration:\n");
     printf("\tAddress: %s\n", config->address);
     printf("\tPort: %d\n", config->port);
     printf("\tFilename: %s\n", config->filename);
     printf("\tMaximum file size: %ld\n", config->max_file_size);
+    printf("\tMaximum retries: %u\n", config->max_retries);
+    printf("\tOperation: %s\n",
+        config->operation == RequestOperation_PUT ? "upload"
+        : config->operation == RequestOperation_GET_SPARSE ? "sparse download" : "download");
+}
+
+static void print_usage(const char *const program_name) {
+    fprintf(stderr,
+        "Usage: %s [-P | -S] [-r <max_retries>] <server_address> <server_port> <filename> <max_file_size>\n"
+        "  -P  upload <filename> from the current directory instead of downloading it\n"
+        "  -S  download only the data extents of <filename> and recreate its holes locally\n"
+        "  -r  reconnect at most this many times while the server answers BUSY, default 5\n",
+        program_name);
 }
 
 static ClientConfig handle_cmd_args(const int argc, char **argv) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <server_address> <server_port> <filename> <max_file_size>\n", argv[0]);
+    RequestOperation operation = RequestOperation_GET;
+    uint32_t max_retries = DEFAULT_MAX_RETRIES;
+    int opt;
+    while((opt = getopt(argc, argv, "PSr:")) != -1) {
+        switch(opt) {
+            case 'P': operation = RequestOperation_PUT; break;
+            case 'S': operation = RequestOperation_GET_SPARSE; break;
+            case 'r': max_retries = (uint32_t)strtoul(optarg, NULL, 10); break;
+            default: print_usage(argv[0]); exit(1);
+        }
+    }
+    if (argc - optind != 4) {
+        print_usage(argv[0]);
         exit(1);
     }
     const ClientConfig config = {
-        .address = argv[1],
-        .port = (uint16_t)atoi(argv[2]),
-        .filename = argv[3],
-        .max_file_size = (uint64_t)atoi(argv[4])
+        .address = argv[optind],
+        .port = (uint16_t)atoi(argv[optind + 1]),
+        .filename = argv[optind + 2],
+        .max_file_size = strtoull(argv[optind + 3], NULL, 10),
+        .operation = operation,
+        .max_retries = max_retries
     };
     print_config(&config);
     return config;
 }
 
-static void receive_file(
+static bool receive_range(
     const int sock,
-    const size_t file_size,
+    const off_t offset,
+    const size_t length,
     const int pipe_in,
     const int pipe_out,
     const int file_fd
 ) {
-    printf("[Started receiving file file]\n");
     size_t nread = 0;
-    off_t write_offset = 0;
-    while((size_t)write_offset < file_size) {
+    off_t write_offset = offset;
+    const off_t end_offset = offset + (off_t)length;
+    while(write_offset < end_offset) {
         {
-            const ssize_t local_read = splice(sock, NULL, pipe_out, NULL, file_size - nread, 0);
+            const ssize_t local_read = splice(sock, NULL, pipe_out, NULL, length - nread, 0);
             if(local_read < 0) {
                 printf("[Failed to read splice] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-                break;
+                return false;
+            } else if(local_read == 0) {
+                printf("[Connection closed before the end of file]\n");
+                return false;
             }
             nread += (size_t)local_read;
         }
         {
-            const ssize_t local_write = splice(pipe_in, NULL, file_fd, &write_offset, file_size - (size_t)write_offset, 0);
+            const ssize_t local_write = splice(pipe_in, NULL, file_fd, &write_offset, (size_t)(end_offset - write_offset), 0);
             if(local_write < 0) {
                 printf("[Failed to write splice] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-                break;
+                return false;
             }
         }
     }
+    return true;
+}
+
+static void receive_file(
+    const int sock,
+    const size_t file_size,
+    const int pipe_in,
+    const int pipe_out,
+    const int file_fd
+) {
+    printf("[Started receiving file file]\n");
+    receive_range(sock, 0, file_size, pipe_in, pipe_out, file_fd);
     printf("[Finished receiving file file]\n");
 }
 
-static void main_logic(const ClientConfig *const config, const int sock) {
+// Only data extents come over the wire, sizing the file up front leaves everything else as holes.
+static void receive_sparse_file(
+    const int sock,
+    const size_t file_size,
+    const int pipe_in,
+    const int pipe_out,
+    const int file_fd
+) {
+    printf("[Started receiving sparse file]\n");
+    if(ftruncate(file_fd, (off_t)file_size) == -1) {
+        printf("[Failed to truncate file] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return;
+    }
+    size_t data_size = 0;
+    while(true) {
+        ExtentHeader header;
+        if(not checked_read(sock, &header, sizeof(header), NULL)) {
+            printf("[Failed to receive extent header] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            return;
+        }
+        const uint64_t offset = be64toh(header.offset);
+        const uint64_t length = be64toh(header.length);
+        if(length == 0) {
+            break;
+        }
+        if(offset + length > file_size) {
+            printf("[Extent out of file bounds] [offset: %lu] [length: %lu]\n", offset, length);
+            return;
+        }
+        if(not receive_range(sock, (off_t)offset, length, pipe_in, pipe_out, file_fd)) {
+            return;
+        }
+        data_size += length;
+    }
+    printf("[Finished receiving sparse file] [data bytes: %lu] [apparent size: %lu]\n", data_size, file_size);
+}
+
+static void upload_file(const ClientConfig *const config, const int sock) {
+    const int file_fd = open(config->filename, O_RDONLY);
+    if(file_fd < 0) {
+        printf("[Failed to open file for reading] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if(fstat(file_fd, &st) == -1 or (size_t)st.st_size > config->max_file_size) {
+        printf("[Local file can not be uploaded] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        checked_close(file_fd);
+        return;
+    }
+    const uint64_t network_file_size = htobe64((uint64_t)st.st_size);
+    if(not checked_write(sock, &network_file_size, sizeof(network_file_size), NULL)) {
+        printf("[Failed to send upload size] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        checked_close(file_fd);
+        return;
+    }
+    bool is_upload_possible;
+    if(not checked_read(sock, &is_upload_possible, sizeof(is_upload_possible), NULL) or not is_upload_possible) {
+        printf("[Server refused upload]\n");
+        checked_close(file_fd);
+        return;
+    }
+    printf("[Started sending file] [file_size: %ld]\n", st.st_size);
+    off_t offset = 0;
+    while(offset < st.st_size) {
+        const ssize_t nsendfile = sendfile(sock, file_fd, &offset, (size_t)(st.st_size - offset));
+        if(nsendfile <= 0) {
+            printf("[Failed to sendfile] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            break;
+        }
+    }
+    checked_close(file_fd);
+    bool is_committed = false;
+    if(offset == st.st_size and not checked_read(sock, &is_committed, sizeof(is_committed), NULL)) {
+        printf("[Failed to receive upload commit] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+    }
+    printf("[Finished sending file] [committed: %d]\n", is_committed);
+}
+
+// Returns true if the server answered BUSY, *retry_after_ms then holds its hint.
+static bool main_logic(const ClientConfig *const config, const int sock, uint32_t *const retry_after_ms) {
     {
         struct sockaddr_in server_addr;
         server_addr.sin_family = AF_INET;
         server_addr.sin_port = htons(config->port);
         if (inet_pton(AF_INET, config->address, &server_addr.sin_addr) <= 0) {
             printf("[Failed inet_pton] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+            return false;
+        }
+        // With a cached cookie connect returns at once and the version byte goes out in the SYN.
+        const int is_fastopen = 1;
+        if(setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &is_fastopen, sizeof(is_fastopen)) == -1) {
+            printf("[Failed to set TCP_FASTOPEN_CONNECT] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
         }
         if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
             printf("[Connection failed] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+            return false;
         }
     }
         const uint8_t protocol_version = PROTOCOL_VERSION;
         if(not checked_write(sock, &protocol_version, sizeof(protocol_version), NULL)) {
             printf("[Failed to send protocol version] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+            return false;
         }
         printf("[Written protocol version: %d]\n", PROTOCOL_VERSION);
         {
-            bool is_protocol_version_ok;
-            if(not checked_read(sock, &is_protocol_version_ok, sizeof(is_protocol_version_ok), NULL)) {
+            uint8_t status;
+            if(not checked_read(sock, &status, sizeof(status), NULL)) {
                 printf("[Failed to receive protocol version ok] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-                return;
+                return false;
             }
-            if(not is_protocol_version_ok) {
+            if(status == ProtocolStatus_BUSY) {
+                if(not checked_read(sock, retry_after_ms, sizeof(*retry_after_ms), NULL)) {
+                    printf("[Failed to receive retry after] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+                    return false;
+                }
+                *retry_after_ms = ntohl(*retry_after_ms);
+                printf("[Server busy] [retry_after_ms: %u]\n", *retry_after_ms);
+                return true;
+            }
+            if(status != ProtocolStatus_OK) {
                 printf("[Protocol version mismatch]\n");
-                return;
+                return false;
             }
             printf("[Protocol version match]\n");
         }
+        const uint8_t operation = (uint8_t)config->operation;
+        if(not checked_write(sock, &operation, sizeof(operation), NULL)) {
+            printf("[Failed to send operation] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+            return false;
+        }
         char filename_buffer[NAME_MAX];
         strncpy(filename_buffer, config->filename, ARRAY_SIZE(filename_buffer));
         if(not checked_write(sock, filename_buffer, ARRAY_SIZE(filename_buffer), NULL)) {
             printf("[Failed to send filename buffer] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+            return false;
         }
         printf("[Send filename_buffer] [filename_buffer: %s]\n", filename_buffer);
+        if(config->operation == RequestOperation_PUT) {
+            upload_file(config, sock);
+            return false;
+        }
         {
             bool is_file_operation_possible;
             if(not checked_read(sock, &is_file_operation_possible, sizeof(is_file_operation_possible), NULL)) {
                 printf("[Failed to receive is_file_operation_possible] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-                return;
+                return false;
             }
             printf("[is_file_operation_possible: %d]\n", is_file_operation_possible);
             if(not is_file_operation_possible) {
-                return;
+                return false;
             }
         }
-        uint32_t file_size;
+        uint64_t file_size;
         if(not checked_read(sock, &file_size, sizeof(file_size), NULL)) {
             printf("[Failed to receive file size] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-            return;
+            return false;
         }
-        file_size = ntohl(file_size);
+        file_size = be64toh(file_size);
         
-    printf("[File size: %u]\n", file_size);
+    printf("[File size: %lu]\n", file_size);
     {
         const bool is_client_ready = file_size <= config->max_file_size;
         if(not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
             printf("[Failed to send is_client_ready: %d] [errno: %d] [strerror: %s]\n", is_client_ready, errno, strerror(errno));
         }
         if(not is_client_ready) {
-            printf("[Server file size is too large: %u]\n", file_size);
-            return;
+            printf("[Server file size is too large: %lu]\n", file_size);
+            return false;
         }
     }
     // while(true) {}
@@ -160,7 +315,11 @@ static void main_logic(const ClientConfig *const config, const int sock) {
             if(not checked_write(sock, &is_client_ready, sizeof(is_client_ready), NULL)) {
                 printf("[Failed to send is_client_ready: %d] [errno: %d] [strerror: %s]\n", is_client_ready, errno, strerror(errno));
             } else {
-                receive_file(sock, file_size, pipefd[0], pipefd[1], file_fd);
+                if(config->operation == RequestOperation_GET_SPARSE) {
+                    receive_sparse_file(sock, file_size, pipefd[0], pipefd[1], file_fd);
+                } else {
+                    receive_file(sock, file_size, pipefd[0], pipefd[1], file_fd);
+                }
                 uint8_t signal_end_byte;
                 checked_write(sock, &signal_end_byte, sizeof(signal_end_byte), NULL);
             }
@@ -175,16 +334,43 @@ static void main_logic(const ClientConfig *const config, const int sock) {
             printf("[Failed to close pipe 1] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
         }
     }
+    return false;
+}
+
+// Equal jitter: the wait doubles with every BUSY answer starting from the server's hint, half of
+// it is always waited and the other half is random, so clients shed together come back spread out.
+static void backoff_sleep(const uint32_t retry_after_ms, const uint32_t attempt) {
+    uint64_t delay_ms = (uint64_t)retry_after_ms << (attempt < MAX_BACKOFF_SHIFT ? attempt : MAX_BACKOFF_SHIFT);
+    if(delay_ms > MAX_BACKOFF_MS) {
+        delay_ms = MAX_BACKOFF_MS;
+    }
+    const uint64_t sleep_ms = delay_ms / 2 + (uint64_t)random() % (delay_ms / 2 + 1);
+    printf("[Retrying] [attempt: %u] [sleep_ms: %lu]\n", attempt + 1, sleep_ms);
+    const struct timespec duration = { .tv_sec = (time_t)(sleep_ms / 1000), .tv_nsec = (long)(sleep_ms % 1000) * 1000000 };
+    nanosleep(&duration, NULL);
 }
 
 int main(const int argc, char *argv[]) {
     const ClientConfig config = handle_cmd_args(argc, argv);
+    srandom((unsigned)getpid() ^ (unsigned)time(NULL));
 
-    const int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("Socket creation failed");
-    } else {
-        main_logic(&config, sock);
+    for(uint32_t attempt = 0; ; ++attempt) {
+        const int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == -1) {
+            perror("Socket creation failed");
+            break;
+        }
+        uint32_t retry_after_ms = 0;
+        const bool is_busy = main_logic(&config, sock, &retry_after_ms);
+        checked_close(sock);
+        if(not is_busy) {
+            break;
+        }
+        if(attempt == config.max_retries) {
+            printf("[Server still busy, giving up] [attempts: %u]\n", attempt + 1);
+            return EXIT_FAILURE;
+        }
+        backoff_sleep(retry_after_ms, attempt);
     }
     return EXIT_SUCCESS;
 }
@@ -78,5 +78,26 @@ static bool checked_close(const int fd) {
     return true;
 }
 
-static const uint8_t PROTOCOL_VERSION = 17;
+static const uint8_t PROTOCOL_VERSION = 20;
 static const uint16_t CHUNK_SIZE = 100;
+
+typedef enum {
+    RequestOperation_GET = 0,
+    RequestOperation_PUT = 1,
+    RequestOperation_GET_SPARSE = 2,
+} RequestOperation;
+
+// The server's answer to the protocol version byte. BUSY is followed by a big-endian uint32
+// retry-after hint in milliseconds, then the server closes the connection.
+typedef enum {
+    ProtocolStatus_MISMATCH = 0,
+    ProtocolStatus_OK = 1,
+    ProtocolStatus_BUSY = 2,
+} ProtocolStatus;
+
+// Precedes every data extent of a sparse transfer, both fields are big-endian.
+// A zero length terminates the transfer.
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} ExtentHeader;
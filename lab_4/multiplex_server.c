@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -8,31 +9,58 @@
 #include <signal.h>
 #include <dirent.h>
 #include <errno.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <sys/resource.h>
+#include <sched.h>
 #include <sys/sendfile.h>
+#include <sys/statvfs.h>
 
 #include "client_utils.h"
+#include "trace.h"
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+static const char UPLOAD_TEMP_PREFIX[] = ".upload.";
+enum { UPLOAD_TEMP_NAME_SIZE = 16 };
+
+typedef struct {
+    char temp_name[UPLOAD_TEMP_NAME_SIZE];
+    char filename[NAME_MAX + 1];
+} UploadNames;
+
 typedef enum {
     ClientStateTag_INVALID,
     ClientStateTag_RECEIVE_PROTOCOL_VERSION,
     ClientStateTag_SEND_MATCH_PROTOCOL_VERSION,
+    ClientStateTag_RECEIVE_OPERATION,
     ClientStateTag_RECEIVE_FILE_NAME,
     ClientStateTag_SEND_FILE_OPERATION_POSSIBILITY,
     ClientStateTag_SEND_FILE_SIZE,
     ClientStateTag_RECEIVE_CLIENT_READY,
     ClientStateTag_SEND_CHUNK,
     ClientStateTag_RECEIVE_FINISH,
+    ClientStateTag_RECEIVE_UPLOAD_SIZE,
+    ClientStateTag_SEND_UPLOAD_POSSIBILITY,
+    ClientStateTag_RECEIVE_UPLOAD_CHUNK,
+    ClientStateTag_SEND_UPLOAD_COMMIT,
 } ClientStateTag;
 
+// Trace phases are the states, the INVALID slot stands for the accept.
+static const char *const CLIENT_STATE_TAG_TRACE_NAMES[] = {
+    "accepted", "receive_protocol_version", "send_match_protocol_version", "receive_operation", "receive_file_name",
+    "send_file_operation_possibility", "send_file_size", "receive_client_ready", "send_chunk", "receive_finish",
+    "receive_upload_size", "send_upload_possibility", "receive_upload_chunk", "send_upload_commit",
+};
+_Static_assert(ARRAY_SIZE(CLIENT_STATE_TAG_TRACE_NAMES) == ClientStateTag_SEND_UPLOAD_COMMIT + 1, "every state needs a trace name");
+
 typedef struct {
     ClientStateTag tag;
     union {
@@ -43,32 +71,64 @@ typedef struct {
             int32_t client_fd;
             uint8_t client_protocol_version;
         } send_match_protocol_version;
+        struct ClientState_ReceiveOperation {
+            int32_t client_fd;
+        } receive_operation;
         struct ClientState_ReceiveFilename {
             int32_t client_fd;
+            uint8_t operation;
         } receive_filename;
         struct ClientState_SendFileOperationPossibility {
             int32_t client_fd;
             int32_t fd;
+            bool is_sparse;
         } send_file_operation_possibility;
         struct ClientState_SendChunkAndFileSize {
             int32_t client_fd;
             int32_t fd;
             off_t file_size;
+            bool is_sparse;
         } send_file_size;
         struct ClientState_ReceiveClientReady {
             int32_t client_fd;
             int32_t fd;
             off_t file_size;
+            bool is_sparse;
         } receive_client_ready;
         struct ClientState_SendChunk {
             int32_t client_fd;
             int32_t fd;
             off_t file_size;
             off_t file_offset;
+            off_t extent_end;
+            bool is_sparse;
         } send_chunk;
         struct ClientState_ReceiveFinish {
             int32_t client_fd;
         } receive_finish;
+        struct ClientState_ReceiveUploadSize {
+            int32_t client_fd;
+            char filename[NAME_MAX + 1];
+        } receive_upload_size;
+        struct ClientState_SendUploadPossibility {
+            int32_t client_fd;
+            int32_t fd;
+            off_t file_size;
+            UploadNames names;
+        } send_upload_possibility;
+        struct ClientState_ReceiveUploadChunk {
+            int32_t client_fd;
+            int32_t fd;
+            int32_t pipe_in;
+            int32_t pipe_out;
+            off_t file_size;
+            off_t file_offset;
+            UploadNames names;
+        } receive_upload_chunk;
+        struct ClientState_SendUploadCommit {
+            int32_t client_fd;
+            bool is_committed;
+        } send_upload_commit;
     } value;
 } ClientState;
 
@@ -87,13 +147,118 @@ static ClientState construct_drop_connection(
     return state;
 }
 
+static bool is_upload_temp_name(const char *const filename) {
+    return strncmp(filename, UPLOAD_TEMP_PREFIX, strlen(UPLOAD_TEMP_PREFIX)) == 0;
+}
+
+// Enforces the quota and reserves the space before any payload moves, returns -1 if the upload is refused.
+static int32_t upload_open_temp(
+    const int32_t client_fd,
+    char* const filepath_buffer,
+    const size_t filepath_buffer_offset,
+    const char *const filename,
+    const off_t file_size,
+    const uint64_t max_upload_size,
+    char *const temp_name
+) {
+    if(filename[0] == '\0' or strchr(filename, '/') != NULL or is_upload_temp_name(filename)) {
+        printf("[client_fd: %d] [upload filename not allowed: %s]\n", client_fd, filename);
+        return -1;
+    }
+    if((uint64_t)file_size > max_upload_size) {
+        printf("[client_fd: %d] [upload exceeds quota] [file_size: %ld] [max_upload_size: %lu]\n", client_fd, file_size, max_upload_size);
+        return -1;
+    }
+    filepath_buffer[filepath_buffer_offset] = '\0';
+    struct statvfs stv;
+    if(statvfs(filepath_buffer, &stv) == -1 or (uint64_t)stv.f_bavail * stv.f_frsize < (uint64_t)file_size) {
+        printf("[client_fd: %d] [not enough space for upload] [file_size: %ld]\n", client_fd, file_size);
+        return -1;
+    }
+    snprintf(filepath_buffer + filepath_buffer_offset, NAME_MAX, "%sXXXXXX", UPLOAD_TEMP_PREFIX);
+    const int32_t fd = mkostemp(filepath_buffer, O_CLOEXEC);
+    if(fd == -1) {
+        printf("[client_fd: %d] [failed to create upload file] [errno: %d] [strerror: %s]\n", client_fd, errno, strerror(errno));
+        return -1;
+    }
+    strncpy(temp_name, filepath_buffer + filepath_buffer_offset, UPLOAD_TEMP_NAME_SIZE);
+    if(fchmod(fd, 0644) == -1 or (file_size > 0 and fallocate(fd, 0, 0, file_size) == -1 and errno != EOPNOTSUPP)) {
+        printf("[client_fd: %d] [failed to preallocate upload file] [errno: %d] [strerror: %s]\n", client_fd, errno, strerror(errno));
+        checked_close(fd);
+        unlink(filepath_buffer);
+        return -1;
+    }
+    return fd;
+}
+
+static void upload_discard(
+    char* const filepath_buffer,
+    const size_t filepath_buffer_offset,
+    const int32_t fd,
+    const UploadNames *const names
+) {
+    checked_close(fd);
+    strcpy(filepath_buffer + filepath_buffer_offset, names->temp_name);
+    unlink(filepath_buffer);
+}
+
+// The temp file is renamed over the target only once complete,
+// so concurrent readers see either the old or the new version.
+static bool upload_publish(
+    char* const filepath_buffer,
+    const size_t filepath_buffer_offset,
+    const int32_t fd,
+    const UploadNames *const names
+) {
+    checked_close(fd);
+    char temp_path[PATH_MAX];
+    memcpy(temp_path, filepath_buffer, filepath_buffer_offset);
+    strcpy(temp_path + filepath_buffer_offset, names->temp_name);
+    strcpy(filepath_buffer + filepath_buffer_offset, names->filename);
+    if(rename(temp_path, filepath_buffer) == -1) {
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+}
+
+// Sends the header of the next data extent at or after file_offset, holes are skipped entirely.
+// Once no data is left the terminating header carries the apparent size and the transfer
+// finishes like a plain one.
+static bool ClientState_SendChunk_next_extent(struct ClientState_SendChunk *const cur_state) {
+    ExtentHeader header;
+    off_t data = lseek(cur_state->fd, cur_state->file_offset, SEEK_DATA);
+    if(data == -1 and errno != ENXIO) {
+        return false;
+    }
+    if(data == -1 or data >= cur_state->file_size) {
+        header.offset = htobe64((uint64_t)cur_state->file_size);
+        header.length = 0;
+        cur_state->is_sparse = false;
+        cur_state->file_offset = cur_state->file_size;
+        cur_state->extent_end = cur_state->file_size;
+    } else {
+        const off_t hole = lseek(cur_state->fd, data, SEEK_HOLE);
+        if(hole == -1) {
+            return false;
+        }
+        cur_state->file_offset = data;
+        cur_state->extent_end = MIN(hole, cur_state->file_size);
+        header.offset = htobe64((uint64_t)data);
+        header.length = htobe64((uint64_t)(cur_state->extent_end - data));
+    }
+    return checked_write(cur_state->client_fd, &header, sizeof(header), NULL);
+}
+
 static ClientState ClientState_transition(
     clients_count_t *const clients_count,
     const ClientState* const state,
     const fd_set* const readfds,
     const fd_set* const writefds,
     char* const filepath_buffer,
-    const size_t filepath_buffer_offset
+    const size_t filepath_buffer_offset,
+    const uint64_t max_upload_size,
+    TraceRecord *const trace
 ) {
     switch (state->tag) {
         case ClientStateTag_INVALID: {
@@ -127,15 +292,36 @@ static ClientState ClientState_transition(
             printf("[client_fd: %d] [ClientStateTag_SEND_MATCH_PROTOCOL_VERSION]\n", cur_state->client_fd);
             
             const bool is_protocol_match = cur_state->client_protocol_version == PROTOCOL_VERSION;
-            if(not checked_write(cur_state->client_fd, &is_protocol_match, sizeof(is_protocol_match), NULL)) {
+            const uint8_t status = is_protocol_match ? ProtocolStatus_OK : ProtocolStatus_MISMATCH;
+            if(not checked_write(cur_state->client_fd, &status, sizeof(status), NULL)) {
                 return construct_drop_connection(clients_count, cur_state->client_fd);
             }
             if(not is_protocol_match) {
                 return construct_drop_connection(clients_count, cur_state->client_fd);
             }
             ClientState new_state;
+            new_state.tag = ClientStateTag_RECEIVE_OPERATION;
+            new_state.value.receive_operation.client_fd = cur_state->client_fd;
+            return new_state;
+        }
+        case ClientStateTag_RECEIVE_OPERATION: {
+            const struct ClientState_ReceiveOperation* const cur_state = &state->value.receive_operation;
+            if(!FD_ISSET(cur_state->client_fd, readfds)) {
+                return *state;
+            }
+            printf("[client_fd: %d] [ClientStateTag_RECEIVE_OPERATION]\n", cur_state->client_fd);
+
+            uint8_t operation;
+            if(not checked_read(cur_state->client_fd, &operation, sizeof(operation), NULL)) {
+                return construct_drop_connection(clients_count, cur_state->client_fd);
+            }
+            if(operation != RequestOperation_GET and operation != RequestOperation_PUT and operation != RequestOperation_GET_SPARSE) {
+                return construct_drop_connection(clients_count, cur_state->client_fd);
+            }
+            ClientState new_state;
             new_state.tag = ClientStateTag_RECEIVE_FILE_NAME;
             new_state.value.receive_filename.client_fd = cur_state->client_fd;
+            new_state.value.receive_filename.operation = operation;
             return new_state;
         }
         case ClientStateTag_RECEIVE_FILE_NAME: {
@@ -150,11 +336,21 @@ static ClientState ClientState_transition(
             }
             filepath_buffer[filepath_buffer_offset + NAME_MAX] = '\0';
             printf("[client_fd: %d] [filepath_buffer: %s]\n", cur_state->client_fd, filepath_buffer);
+            trace->operation = cur_state->operation;
+            trace->filename_hash = trace_hash_filename(filepath_buffer + filepath_buffer_offset);
             
             ClientState new_state;
+            if(cur_state->operation == RequestOperation_PUT) {
+                new_state.tag = ClientStateTag_RECEIVE_UPLOAD_SIZE;
+                new_state.value.receive_upload_size.client_fd = cur_state->client_fd;
+                strcpy(new_state.value.receive_upload_size.filename, filepath_buffer + filepath_buffer_offset);
+                return new_state;
+            }
             new_state.tag = ClientStateTag_SEND_FILE_OPERATION_POSSIBILITY;
             new_state.value.send_file_operation_possibility.client_fd = cur_state->client_fd;
-            new_state.value.send_file_operation_possibility.fd = open(filepath_buffer, O_RDONLY);
+            new_state.value.send_file_operation_possibility.fd = is_upload_temp_name(filepath_buffer + filepath_buffer_offset)
+                ? -1 : open(filepath_buffer, O_RDONLY);
+            new_state.value.send_file_operation_possibility.is_sparse = cur_state->operation == RequestOperation_GET_SPARSE;
             return new_state;
         }
         case ClientStateTag_SEND_FILE_OPERATION_POSSIBILITY: {
@@ -185,6 +381,7 @@ static ClientState ClientState_transition(
             new_state.value.send_file_size.client_fd = cur_state->client_fd;
             new_state.value.send_file_size.fd = cur_state->fd;
             new_state.value.send_file_size.file_size = st.st_size;
+            new_state.value.send_file_size.is_sparse = cur_state->is_sparse;
             return new_state;
         }
         case ClientStateTag_SEND_FILE_SIZE: {
@@ -195,7 +392,7 @@ static ClientState ClientState_transition(
             printf("[client_fd: %d] [ClientStateTag_SEND_FILE_SIZE]\n", cur_state->client_fd);
 
             printf("[client_fd: %d] [cur_state->file_size: %ld]\n", cur_state->client_fd, cur_state->file_size);
-            const uint32_t network_file_size = htonl((uint32_t)cur_state->file_size);
+            const uint64_t network_file_size = htobe64((uint64_t)cur_state->file_size);
             checked_write(cur_state->client_fd, &network_file_size, sizeof(network_file_size), NULL);
 
             ClientState new_state;
@@ -203,6 +400,7 @@ static ClientState ClientState_transition(
             new_state.value.receive_client_ready.client_fd = cur_state->client_fd;
             new_state.value.receive_client_ready.fd = cur_state->fd;
             new_state.value.receive_client_ready.file_size = cur_state->file_size;
+            new_state.value.receive_client_ready.is_sparse = cur_state->is_sparse;
             return new_state;
         }
         case ClientStateTag_RECEIVE_CLIENT_READY: {
@@ -228,6 +426,8 @@ static ClientState ClientState_transition(
             new_state.value.send_chunk.fd = cur_state->fd;
             new_state.value.send_chunk.file_size = cur_state->file_size;
             new_state.value.send_chunk.file_offset = 0;
+            new_state.value.send_chunk.extent_end = cur_state->is_sparse ? 0 : cur_state->file_size;
+            new_state.value.send_chunk.is_sparse = cur_state->is_sparse;
             return new_state;
         }
         case ClientStateTag_SEND_CHUNK: {
@@ -237,10 +437,17 @@ static ClientState ClientState_transition(
                 return new_generic_state;
             }
             printf("[client_fd: %d] [ClientStateTag_SEND_CHUNK]\n", new_cur_state->client_fd);
-            const off_t end_offset = MIN(new_cur_state->file_size, new_cur_state->file_offset + CHUNK_SIZE);
+            if(new_cur_state->is_sparse and new_cur_state->file_offset >= new_cur_state->extent_end) {
+                if(not ClientState_SendChunk_next_extent(new_cur_state)) {
+                    printf("[client_fd: %d] [Failed to send extent] [errno: %d] [strerror: %s]\n", new_cur_state->client_fd, errno, strerror(errno));
+                    checked_close(new_cur_state->fd);
+                    return construct_drop_connection(clients_count, new_cur_state->client_fd);
+                }
+            }
+            const off_t end_offset = MIN(new_cur_state->extent_end, new_cur_state->file_offset + CHUNK_SIZE);
 
             while(true) {
-                if(new_cur_state->file_size <= new_cur_state->file_offset) {
+                if(not new_cur_state->is_sparse and new_cur_state->file_size <= new_cur_state->file_offset) {
                     checked_close(new_cur_state->fd);
                     new_generic_state.tag = ClientStateTag_RECEIVE_FINISH;
                     new_generic_state.value.receive_finish.client_fd = state->value.send_chunk.client_fd;
@@ -253,6 +460,12 @@ static ClientState ClientState_transition(
                 // printf("[client_fd: %d] [pre new_cur_state->file_offset: %ld]\n", new_cur_state->client_fd, new_cur_state->file_offset);
 
                 const ssize_t nsendfile = sendfile(new_cur_state->client_fd, new_cur_state->fd, &new_cur_state->file_offset, (size_t)(local_diff));
+                ++trace->sendfile_calls;
+                if(nsendfile > 0) {
+                    trace->bytes_sent += (uint64_t)nsendfile;
+                } else if(nsendfile == -1 and errno == EAGAIN) {
+                    ++trace->eagain_count;
+                }
                 if(nsendfile == -1) {
                     printf("[Failed to sendfile] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
                     break;
@@ -276,15 +489,307 @@ static ClientState ClientState_transition(
 
             return construct_drop_connection(clients_count, cur_state->client_fd);
         }
+        case ClientStateTag_RECEIVE_UPLOAD_SIZE: {
+            const struct ClientState_ReceiveUploadSize *const cur_state = &state->value.receive_upload_size;
+            if(!FD_ISSET(cur_state->client_fd, readfds)) {
+                return *state;
+            }
+            printf("[client_fd: %d] [ClientStateTag_RECEIVE_UPLOAD_SIZE]\n", cur_state->client_fd);
+
+            uint64_t network_file_size;
+            if(not checked_read(cur_state->client_fd, &network_file_size, sizeof(network_file_size), NULL)) {
+                return construct_drop_connection(clients_count, cur_state->client_fd);
+            }
+            ClientState new_state;
+            new_state.tag = ClientStateTag_SEND_UPLOAD_POSSIBILITY;
+            struct ClientState_SendUploadPossibility *const new_cur_state = &new_state.value.send_upload_possibility;
+            new_cur_state->client_fd = cur_state->client_fd;
+            new_cur_state->file_size = (off_t)be64toh(network_file_size);
+            strcpy(new_cur_state->names.filename, cur_state->filename);
+            new_cur_state->fd = upload_open_temp(
+                cur_state->client_fd, filepath_buffer, filepath_buffer_offset, cur_state->filename,
+                new_cur_state->file_size, max_upload_size, new_cur_state->names.temp_name
+            );
+            return new_state;
+        }
+        case ClientStateTag_SEND_UPLOAD_POSSIBILITY: {
+            const struct ClientState_SendUploadPossibility *const cur_state = &state->value.send_upload_possibility;
+            if(!FD_ISSET(cur_state->client_fd, writefds)) {
+                return *state;
+            }
+            printf("[client_fd: %d] [ClientStateTag_SEND_UPLOAD_POSSIBILITY]\n", cur_state->client_fd);
+
+            int pipefd[2] = { -1, -1 };
+            bool is_possible = cur_state->fd != -1;
+            if(is_possible and pipe(pipefd) == -1) {
+                upload_discard(filepath_buffer, filepath_buffer_offset, cur_state->fd, &cur_state->names);
+                is_possible = false;
+            }
+            if(not checked_write(cur_state->client_fd, &is_possible, sizeof(is_possible), NULL) or not is_possible) {
+                if(is_possible) {
+                    checked_close(pipefd[0]);
+                    checked_close(pipefd[1]);
+                    upload_discard(filepath_buffer, filepath_buffer_offset, cur_state->fd, &cur_state->names);
+                }
+                return construct_drop_connection(clients_count, cur_state->client_fd);
+            }
+            ClientState new_state;
+            new_state.tag = ClientStateTag_RECEIVE_UPLOAD_CHUNK;
+            struct ClientState_ReceiveUploadChunk *const new_cur_state = &new_state.value.receive_upload_chunk;
+            new_cur_state->client_fd = cur_state->client_fd;
+            new_cur_state->fd = cur_state->fd;
+            new_cur_state->pipe_in = pipefd[0];
+            new_cur_state->pipe_out = pipefd[1];
+            new_cur_state->file_size = cur_state->file_size;
+            new_cur_state->file_offset = 0;
+            new_cur_state->names = cur_state->names;
+            return new_state;
+        }
+        case ClientStateTag_RECEIVE_UPLOAD_CHUNK: {
+            ClientState new_generic_state = *state;
+            struct ClientState_ReceiveUploadChunk *const new_cur_state = &new_generic_state.value.receive_upload_chunk;
+            if(new_cur_state->file_offset < new_cur_state->file_size) {
+                if(!FD_ISSET(new_cur_state->client_fd, readfds)) {
+                    return new_generic_state;
+                }
+                printf("[client_fd: %d] [ClientStateTag_RECEIVE_UPLOAD_CHUNK]\n", new_cur_state->client_fd);
+
+                const size_t chunk = (size_t)MIN(new_cur_state->file_size - new_cur_state->file_offset, CHUNK_SIZE);
+                ssize_t pending = splice(new_cur_state->client_fd, NULL, new_cur_state->pipe_out, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if(pending == -1 and (errno == EAGAIN or errno == EINTR)) {
+                    if(errno == EAGAIN) {
+                        ++trace->eagain_count;
+                    }
+                    return new_generic_state;
+                }
+                trace->bytes_received += pending > 0 ? (uint64_t)pending : 0;
+                // 0 is a client gone before the whole body arrived, select keeps reporting its
+                // socket readable, so it is dropped like a failed splice.
+                const bool is_peer_gone = pending == 0;
+                while(pending > 0) {
+                    const ssize_t nsplice = splice(new_cur_state->pipe_in, NULL, new_cur_state->fd, &new_cur_state->file_offset, (size_t)pending, SPLICE_F_MOVE);
+                    if(nsplice <= 0) {
+                        break;
+                    }
+                    pending -= nsplice;
+                }
+                if(is_peer_gone or pending != 0) {
+                    printf("[client_fd: %d] [upload interrupted] [errno: %d] [strerror: %s]\n", new_cur_state->client_fd, errno, strerror(errno));
+                    checked_close(new_cur_state->pipe_in);
+                    checked_close(new_cur_state->pipe_out);
+                    upload_discard(filepath_buffer, filepath_buffer_offset, new_cur_state->fd, &new_cur_state->names);
+                    return construct_drop_connection(clients_count, new_cur_state->client_fd);
+                }
+                if(new_cur_state->file_offset < new_cur_state->file_size) {
+                    return new_generic_state;
+                }
+            }
+            checked_close(new_cur_state->pipe_in);
+            checked_close(new_cur_state->pipe_out);
+            const bool is_committed = upload_publish(filepath_buffer, filepath_buffer_offset, new_cur_state->fd, &new_cur_state->names);
+            printf("[client_fd: %d] [upload published: %d]\n", new_cur_state->client_fd, is_committed);
+
+            ClientState new_state;
+            new_state.tag = ClientStateTag_SEND_UPLOAD_COMMIT;
+            new_state.value.send_upload_commit.client_fd = new_cur_state->client_fd;
+            new_state.value.send_upload_commit.is_committed = is_committed;
+            return new_state;
+        }
+        case ClientStateTag_SEND_UPLOAD_COMMIT: {
+            const struct ClientState_SendUploadCommit *const cur_state = &state->value.send_upload_commit;
+            if(!FD_ISSET(cur_state->client_fd, writefds)) {
+                return *state;
+            }
+            printf("[client_fd: %d] [ClientStateTag_SEND_UPLOAD_COMMIT]\n", cur_state->client_fd);
+
+            checked_write(cur_state->client_fd, &cur_state->is_committed, sizeof(cur_state->is_committed), NULL);
+            return construct_drop_connection(clients_count, cur_state->client_fd);
+        }
         default: {
             __builtin_unreachable();
         }
     }
 }
 
+// Admission control. A new connection is answered with BUSY right away when the server
+// already holds busy_clients connections, or when the share of the last sampling window in
+// which runnable tasks waited for a CPU (cpu) or tasks stalled on reads that missed the page
+// cache (io) crosses its limit. Both shares come from the PSI "some" totals, which are
+// cumulative stall microseconds, so the window is ours and not the kernel's 10 s average.
+enum {
+    PRESSURE_SAMPLE_INTERVAL_MS = 250,
+    DEFAULT_CPU_LIMIT_PERCENT = 90,
+    DEFAULT_IO_LIMIT_PERCENT = 60,
+    DEFAULT_RETRY_AFTER_MS = 250,
+    MAX_RETRY_AFTER_MS = 10000
+};
+
+typedef struct {
+    int fd;
+    uint64_t last_total_us;
+    double percent;
+} PressureSource;
+
+typedef struct {
+    clients_count_t busy_clients;
+    uint32_t cpu_limit_percent;
+    uint32_t io_limit_percent;
+    uint32_t retry_after_ms;
+    PressureSource cpu;
+    PressureSource io;
+    struct timespec last_sample;
+    uint64_t shed_count;
+} OverloadMonitor;
+
+static void PressureSource_open(PressureSource *const source, const char *const path, const uint32_t limit_percent) {
+    source->fd = -1;
+    source->last_total_us = 0;
+    source->percent = 0;
+    if(limit_percent == 0) {
+        return;
+    }
+    source->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(source->fd == -1) {
+        printf("[Pressure stall information unavailable: %s] [errno: %d] [strerror: %s]\n", path, errno, strerror(errno));
+    }
+}
+
+static bool PressureSource_read_total(const PressureSource *const source, uint64_t *const total_us) {
+    char buffer[256];
+    const ssize_t nread = pread(source->fd, buffer, sizeof(buffer) - 1, 0);
+    if(nread <= 0) {
+        return false;
+    }
+    buffer[nread] = '\0';
+    // First line: "some avg10=0.00 avg60=0.00 avg300=0.00 total=12345"
+    const char *const total = strstr(buffer, "total=");
+    if(total == NULL) {
+        return false;
+    }
+    *total_us = strtoull(total + strlen("total="), NULL, 10);
+    return true;
+}
+
+static void PressureSource_sample(PressureSource *const source, const uint64_t elapsed_us) {
+    uint64_t total_us;
+    if(source->fd == -1 or not PressureSource_read_total(source, &total_us)) {
+        return;
+    }
+    if(source->last_total_us != 0 and elapsed_us != 0) {
+        source->percent = 100.0 * (double)(total_us - source->last_total_us) / (double)elapsed_us;
+    }
+    source->last_total_us = total_us;
+}
+
+static void OverloadMonitor_sample(OverloadMonitor *const monitor) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t elapsed_us = (now.tv_sec - monitor->last_sample.tv_sec) * 1000000 + (now.tv_nsec - monitor->last_sample.tv_nsec) / 1000;
+    if(elapsed_us < PRESSURE_SAMPLE_INTERVAL_MS * 1000) {
+        return;
+    }
+    PressureSource_sample(&monitor->cpu, (uint64_t)elapsed_us);
+    PressureSource_sample(&monitor->io, (uint64_t)elapsed_us);
+    monitor->last_sample = now;
+}
+
+// Returns why a new connection has to be turned away, or NULL if it can be admitted.
+static const char *OverloadMonitor_check(OverloadMonitor *const monitor, const clients_count_t clients_count, const clients_count_t max_clients_count) {
+    if(clients_count >= max_clients_count or (monitor->busy_clients != 0 and clients_count >= monitor->busy_clients)) {
+        return "connections";
+    }
+    OverloadMonitor_sample(monitor);
+    if(monitor->cpu.fd != -1 and monitor->cpu.percent >= monitor->cpu_limit_percent) {
+        return "cpu pressure";
+    }
+    if(monitor->io.fd != -1 and monitor->io.percent >= monitor->io_limit_percent) {
+        return "io pressure";
+    }
+    return NULL;
+}
+
+// The version byte is already here thanks to TCP_DEFER_ACCEPT, it is consumed before the close
+// so the kernel does not answer unread data with a reset that could overtake the reply.
+static void send_busy(OverloadMonitor *const monitor, const int client_fd, const char *const reason) {
+    uint8_t discard[16];
+    while(recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    ++monitor->shed_count;
+    struct {
+        uint8_t status;
+        uint32_t retry_after_ms;
+    } __attribute__((packed)) reply = { .status = ProtocolStatus_BUSY, .retry_after_ms = htonl(monitor->retry_after_ms) };
+    if(send(client_fd, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(reply)) {
+        printf("[client_fd: %d] [failed to send busy] [errno: %d] [strerror: %s]\n", client_fd, errno, strerror(errno));
+    }
+    printf("[client_fd: %d] [busy: %s] [retry_after_ms: %u] [shed: %lu]\n", client_fd, reason, monitor->retry_after_ms, monitor->shed_count);
+    shutdown(client_fd, SHUT_WR);
+    checked_close(client_fd);
+}
+
 static volatile sig_atomic_t keep_running = 1;
 static void handle_sigint(const int value __attribute_maybe_unused__) { keep_running = 0; }
 
+// Low-latency mode. Before sleeping in select the loop keeps polling with a zero timeout for
+// spin_us, yielding in between, so an event arriving within the budget is handled without a
+// wakeup, and client sockets get SO_BUSY_POLL so the kernel polls the NIC queue for them as
+// well. Both trade a core for latency, the CPU time printed on shutdown says how much of one.
+typedef struct {
+    uint32_t spin_us;
+    uint64_t spin_hits;
+    uint64_t sleeps;
+    struct timespec started_at;
+} BusyPoll;
+
+static int64_t BusyPoll_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int BusyPoll_select(BusyPoll *const busy_poll, const int nfds, fd_set *const readfds, fd_set *const writefds) {
+    if(busy_poll->spin_us != 0) {
+        const fd_set read_interest = *readfds;
+        const fd_set write_interest = *writefds;
+        const int64_t deadline_ns = BusyPoll_now_ns() + (int64_t)busy_poll->spin_us * 1000;
+        do {
+            struct timeval no_wait = { .tv_sec = 0, .tv_usec = 0 };
+            const int ready = select(nfds, readfds, writefds, NULL, &no_wait);
+            if(ready != 0) {
+                busy_poll->spin_hits += ready > 0;
+                return ready;
+            }
+            *readfds = read_interest;
+            *writefds = write_interest;
+            sched_yield();
+        } while(keep_running and BusyPoll_now_ns() < deadline_ns);
+    }
+    ++busy_poll->sleeps;
+    return select(nfds, readfds, writefds, NULL, NULL);
+}
+
+static void BusyPoll_set_socket(const BusyPoll *const busy_poll, const int client_fd) {
+    static bool is_failure_logged = false;
+    const int value = (int)busy_poll->spin_us;
+    if(busy_poll->spin_us != 0 and setsockopt(client_fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) == -1 and not is_failure_logged) {
+        printf("[Failed to set SO_BUSY_POLL] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        is_failure_logged = true;
+    }
+}
+
+static void BusyPoll_print(const BusyPoll *const busy_poll) {
+    if(busy_poll->spin_us == 0) {
+        return;
+    }
+    struct rusage usage;
+    ASSERT_POSIX(getrusage(RUSAGE_SELF, &usage));
+    const double cpu_seconds = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    const double wall_seconds = (double)(BusyPoll_now_ns() - (busy_poll->started_at.tv_sec * 1000000000 + busy_poll->started_at.tv_nsec)) / 1e9;
+    printf("[Busy poll] [budget_us: %u] [spin_hits: %lu] [sleeps: %lu] [cpu_seconds: %.2f] [wall_seconds: %.2f] [cpu: %.0f%%]\n",
+        busy_poll->spin_us, busy_poll->spin_hits, busy_poll->sleeps, cpu_seconds, wall_seconds, 100 * cpu_seconds / wall_seconds);
+}
+
 static in_addr_t parse_address(const char *const value) {
     const in_addr_t address = inet_addr(value);
     ASSERT_POSIX(address);
@@ -297,6 +802,27 @@ static in_port_t parse_port(const char *const value) {
     assert(port == (uint64_t)((in_port_t)port));
     return htons((in_port_t)port);
 }
+static uint64_t parse_max_upload_size(const char *const value) {
+    errno = 0;
+    const uint64_t max_upload_size = strtoull(value, NULL, 10);
+    assert(errno == 0);
+    return max_upload_size;
+}
+static uint32_t parse_percent(const char *const value) {
+    const uint64_t percent = strtoul(value, NULL, 10);
+    assert(percent <= 100);
+    return (uint32_t)percent;
+}
+static uint32_t parse_retry_after(const char *const value) {
+    const uint64_t retry_after_ms = strtoul(value, NULL, 10);
+    assert(retry_after_ms > 0 and retry_after_ms <= MAX_RETRY_AFTER_MS);
+    return (uint32_t)retry_after_ms;
+}
+static int parse_backlog(const char *const value) {
+    const int backlog = atoi(value);
+    assert(backlog > 0);
+    return backlog;
+}
 static uint16_t parse_max_clients_count(const char *const value) {
     const uint64_t max_clients_count = strtoul(value, NULL, 10);
     assert(errno == 0);
@@ -315,6 +841,9 @@ static int32_t ClientState_client_fd(const ClientState *const state) {
         case ClientStateTag_SEND_MATCH_PROTOCOL_VERSION: {
             return state->value.send_match_protocol_version.client_fd;
         }
+        case ClientStateTag_RECEIVE_OPERATION: {
+            return state->value.receive_operation.client_fd;
+        }
         case ClientStateTag_RECEIVE_FILE_NAME: {
             return state->value.receive_filename.client_fd;
         }
@@ -333,6 +862,18 @@ static int32_t ClientState_client_fd(const ClientState *const state) {
         case ClientStateTag_RECEIVE_FINISH: {
             return state->value.receive_finish.client_fd;
         }
+        case ClientStateTag_RECEIVE_UPLOAD_SIZE: {
+            return state->value.receive_upload_size.client_fd;
+        }
+        case ClientStateTag_SEND_UPLOAD_POSSIBILITY: {
+            return state->value.send_upload_possibility.client_fd;
+        }
+        case ClientStateTag_RECEIVE_UPLOAD_CHUNK: {
+            return state->value.receive_upload_chunk.client_fd;
+        }
+        case ClientStateTag_SEND_UPLOAD_COMMIT: {
+            return state->value.send_upload_commit.client_fd;
+        }
         default: {
             __builtin_unreachable();
         }
@@ -366,7 +907,7 @@ static int init_file_descriptors(
 
 int main(
     const int argc,
-    const char* const argv[]
+    char* argv[]
 ) {
     {
         struct sigaction sa;
@@ -375,70 +916,154 @@ int main(
         sa.sa_flags = 0;
         ASSERT_POSIX(sigaction(SIGINT, &sa, NULL));
     }
-    assert(argc == 5);
+    uint64_t max_upload_size = 0;
+    int backlog = SOMAXCONN;
+    OverloadMonitor monitor = {
+        .busy_clients = 0,
+        .cpu_limit_percent = DEFAULT_CPU_LIMIT_PERCENT,
+        .io_limit_percent = DEFAULT_IO_LIMIT_PERCENT,
+        .retry_after_ms = DEFAULT_RETRY_AFTER_MS,
+    };
+    bool is_shedding = true;
+    BusyPoll busy_poll = { .spin_us = 0 };
+    const char *trace_path = NULL;
+    uint64_t trace_records = TRACE_DEFAULT_RECORDS;
+    {
+        int opt;
+        while((opt = getopt(argc, argv, "q:b:B:c:i:r:Np:T:n:")) != -1) {
+            switch(opt) {
+                case 'q': max_upload_size = parse_max_upload_size(optarg); break;
+                case 'b': backlog = parse_backlog(optarg); break;
+                case 'B': monitor.busy_clients = parse_max_clients_count(optarg); break;
+                case 'c': monitor.cpu_limit_percent = parse_percent(optarg); break;
+                case 'i': monitor.io_limit_percent = parse_percent(optarg); break;
+                case 'r': monitor.retry_after_ms = parse_retry_after(optarg); break;
+                case 'N': is_shedding = false; break;
+                case 'p': busy_poll.spin_us = (uint32_t)strtoul(optarg, NULL, 10); break;
+                case 'T': trace_path = optarg; break;
+                case 'n': trace_records = strtoull(optarg, NULL, 10); break;
+                default: {
+                    fprintf(stderr, "Usage: %s [-q <max_upload_size>] [-b <backlog>] [-B <busy_clients>] [-c <cpu_pressure_percent>] [-i <io_pressure_percent>] [-r <retry_after_ms>] [-N] [-p <busy_poll_us>] [-T <trace_file> [-n <trace_records>]] <server_address> <server_port> <directory_path> <max_clients>\n"
+                        "  -B  answer BUSY once this many clients are connected, defaults to max_clients\n"
+                        "  -c  answer BUSY while tasks wait for a CPU this share of the time, 0 disables\n"
+                        "  -i  answer BUSY while tasks stall on IO this share of the time, 0 disables\n"
+                        "  -N  never answer BUSY, leave excess connections in the accept queue\n"
+                        "  -p  poll for this many microseconds before sleeping in select\n"
+                        "  -T  record every connection into this trace ring file, trace_reader prints it\n"
+                        "  -n  records the trace ring holds\n", argv[0]);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    assert(argc - optind == 4);
+    const char *const *const args = (const char *const *)argv + optind;
     
-    const int listenfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    const int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
     ASSERT_POSIX(listenfd);
+    {
+        // A restarted server can bind again while old connections sit in TIME_WAIT.
+        static const int IS_REUSE_ADDRESS = 1;
+        ASSERT_POSIX(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &IS_REUSE_ADDRESS, sizeof(IS_REUSE_ADDRESS)));
+    }
     {
         struct sockaddr_in srv_sin4 = {
             .sin_family  = AF_INET,
-            .sin_addr.s_addr = parse_address(argv[1]),
-            .sin_port = parse_port(argv[2]),
+            .sin_addr.s_addr = parse_address(args[0]),
+            .sin_port = parse_port(args[1]),
         };
         ASSERT_POSIX(bind(listenfd, (struct sockaddr *)&srv_sin4, sizeof(srv_sin4)));
-        static const uint8_t MAX_BACKLOG = 10;
-        ASSERT_POSIX(listen(listenfd, MAX_BACKLOG));
+        ASSERT_POSIX(listen(listenfd, backlog));
+        // Connections are only queued once the version byte arrived, and returning
+        // clients may carry it in the SYN. Both are optional.
+        static const int DEFER_ACCEPT_SECONDS = 5;
+        if(setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &DEFER_ACCEPT_SECONDS, sizeof(DEFER_ACCEPT_SECONDS)) == -1) {
+            printf("[Failed to set TCP_DEFER_ACCEPT] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        }
+        static const int FASTOPEN_QUEUE_LENGTH = 256;
+        if(setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &FASTOPEN_QUEUE_LENGTH, sizeof(FASTOPEN_QUEUE_LENGTH)) == -1) {
+            printf("[Failed to set TCP_FASTOPEN] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        }
     }
     char filepath_buffer[PATH_MAX];
     uint16_t filepath_buffer_offset;
     {
         static const uint8_t slash_character_addition = 1;
-        const size_t len_with_slash = strlen(argv[3]) + slash_character_addition;
+        const size_t len_with_slash = strlen(args[2]) + slash_character_addition;
         assert((len_with_slash + NAME_MAX) <= PATH_MAX);
         filepath_buffer_offset = (uint16_t)len_with_slash;
-        strcpy(filepath_buffer, argv[3]);
+        strcpy(filepath_buffer, args[2]);
         strcat(filepath_buffer, "/");
     }
 
-    const uint16_t max_clients_count = parse_max_clients_count(argv[4]);
+    const uint16_t max_clients_count = parse_max_clients_count(args[3]);
+    if(monitor.busy_clients == 0 or monitor.busy_clients > max_clients_count) {
+        monitor.busy_clients = max_clients_count;
+    }
+    if(is_shedding) {
+        PressureSource_open(&monitor.cpu, "/proc/pressure/cpu", monitor.cpu_limit_percent);
+        PressureSource_open(&monitor.io, "/proc/pressure/io", monitor.io_limit_percent);
+    }
+
+    TraceRing trace = { .header = NULL, .slots = NULL };
+    if(trace_path != NULL and (trace_records == 0
+        or not trace_ring_create(&trace, trace_path, trace_records, CLIENT_STATE_TAG_TRACE_NAMES, ARRAY_SIZE(CLIENT_STATE_TAG_TRACE_NAMES)))) {
+        return EXIT_FAILURE;
+    }
 
     fd_set readfds, writefds;
     ClientState *const client_state_array = calloc(max_clients_count, sizeof(ClientState));
+    // Records are only written to the ring with tracing on, the counters are kept regardless.
+    TraceRecord *const trace_array = calloc(max_clients_count, sizeof(TraceRecord));
     clients_count_t client_state_array_count = 0;
     for(size_t i = 0; i < max_clients_count; ++i) {
         client_state_array[i].tag = ClientStateTag_INVALID;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &busy_poll.started_at);
     while(keep_running) {
         // printf("[main cycle start]\n");
         const int max_fd = init_file_descriptors(
             &readfds, &writefds, listenfd, client_state_array, max_clients_count
         );
         // printf("[pre select] [max_fd: %d]\n", max_fd);
-        if(select(max_fd + 1, &readfds, &writefds, NULL, NULL) == -1) {
+        if(BusyPoll_select(&busy_poll, max_fd + 1, &readfds, &writefds) == -1) {
             // printf("[select] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
             continue;
         }
         // printf("[post select] [max_fd: %d]\n", max_fd);
-        if(FD_ISSET(listenfd, &readfds) && client_state_array_count < max_clients_count) {
+        // Drain the whole accept queue per wakeup, the listener is non-blocking so the loop
+        // ends on EAGAIN. Client sockets stay blocking, the states read whole messages.
+        // With shedding on the queue is drained even at capacity, the excess is told BUSY.
+        while(FD_ISSET(listenfd, &readfds) && (is_shedding || client_state_array_count < max_clients_count)) {
             struct sockaddr_in address;
             socklen_t addr_len = sizeof(address);
-            // printf("[pre accept]\n");
-            const int client_fd = accept(listenfd, (struct sockaddr *)&address, &addr_len);
-            // printf("[post accept]\n");
+            const int client_fd = accept4(listenfd, (struct sockaddr *)&address, &addr_len, SOCK_CLOEXEC);
             if(client_fd == -1) {
                 // printf("[accept] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
-                continue;
+                break;
             }
             printf("[New connection] [client_fd: %d] [IP: %s] [port: %d]\n",
                 client_fd, inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+            if(is_shedding) {
+                const char *const reason = OverloadMonitor_check(&monitor, client_state_array_count, max_clients_count);
+                if(reason != NULL) {
+                    send_busy(&monitor, client_fd, reason);
+                    continue;
+                }
+            }
             
+            BusyPoll_set_socket(&busy_poll, client_fd);
             for(size_t i = 0; i < max_clients_count; ++i) {
                 ClientState* state = &client_state_array[i];
                 if(state->tag == ClientStateTag_INVALID) {
                     state->tag = ClientStateTag_RECEIVE_PROTOCOL_VERSION;
                     state->value.receive_protocol_version.client_fd = client_fd;
                     ++client_state_array_count;
+                    if(trace.header != NULL) {
+                        trace_record_begin(&trace, &trace_array[i]);
+                        trace_record_phase(&trace_array[i], ClientStateTag_RECEIVE_PROTOCOL_VERSION);
+                    }
                     break;
                 }
             }
@@ -446,11 +1071,22 @@ int main(
 
         for(size_t i = 0; i < max_clients_count; ++i) {
             ClientState* state = &client_state_array[i];
-            *state = ClientState_transition(&client_state_array_count, state, &readfds, &writefds, filepath_buffer, filepath_buffer_offset);
+            const ClientStateTag tag = state->tag;
+            *state = ClientState_transition(&client_state_array_count, state, &readfds, &writefds, filepath_buffer, filepath_buffer_offset, max_upload_size, &trace_array[i]);
+            if(trace.header != NULL and state->tag != tag) {
+                if(state->tag == ClientStateTag_INVALID) {
+                    trace_ring_write(&trace, &trace_array[i]);
+                } else {
+                    trace_record_phase(&trace_array[i], state->tag);
+                }
+            }
         }
         // printf("[main cycle end]\n");
     }
 
+    printf("[Shed connections: %lu]\n", monitor.shed_count);
+    BusyPoll_print(&busy_poll);
+    free(trace_array);
     free(client_state_array);
     assert(checked_close(listenfd));
     return EXIT_SUCCESS;
@@ -0,0 +1,261 @@
+// The server's main is renamed, the bench drives its state machine on its own.
+#define main multiplex_server_main
+int multiplex_server_main(const int argc, char *argv[]);
+#include "multiplex_server.c"
+#undef main
+
+#include <stddef.h>
+
+#include "syscall_count.h"
+
+// System calls and time per small-file request of ClientState_transition. Each connection is
+// stepped the way the main loop steps a lone client: select on its socket for reading and
+// writing, then one transition, until the connection is dropped. Accepting and admission
+// control are left out. Server logging goes to a buffer big enough for the whole run.
+//
+// The client sends its whole side of a request up front, which the protocol allows, so every
+// state finds its input waiting and the count does not depend on how the two processes are
+// scheduled. Exits with failure when a request needs more system calls than its budget. A
+// change that saves some should lower the budget with it.
+
+enum {
+    BENCH_REQUESTS = 50,
+    BENCH_FILE_SIZE = 4096,
+    BENCH_LOG_BUFFER_SIZE = 64 << 20
+};
+
+static const char BENCH_FILENAME[] = "small.bin";
+
+typedef enum {
+    BenchTransport_SOCKETPAIR,
+    BenchTransport_TCP,
+} BenchTransport;
+
+typedef struct {
+    const char *name;
+    BenchTransport transport;
+    RequestOperation operation;
+    uint64_t budget;
+} BenchVariant;
+
+static const BenchVariant BENCH_VARIANTS[] = {
+    { .name = "get over socketpair", .transport = BenchTransport_SOCKETPAIR, .operation = RequestOperation_GET, .budget = 102 },
+    { .name = "get over tcp", .transport = BenchTransport_TCP, .operation = RequestOperation_GET, .budget = 102 },
+    { .name = "put over socketpair", .transport = BenchTransport_SOCKETPAIR, .operation = RequestOperation_PUT, .budget = 148 },
+};
+
+typedef struct {
+    const int *socks;
+    char *filepath_buffer;
+    size_t filepath_buffer_offset;
+} BenchServer;
+
+static bool bench_pairs_create(const BenchTransport transport, int server_socks[], int client_socks[]) {
+    int listen_fd = -1;
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK), .sin_port = 0 };
+    socklen_t address_len = sizeof(address);
+    if(transport == BenchTransport_TCP) {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(listen_fd == -1 or bind(listen_fd, (const struct sockaddr *)&address, sizeof(address)) == -1
+            or listen(listen_fd, 1) == -1 or getsockname(listen_fd, (struct sockaddr *)&address, &address_len) == -1) {
+            return false;
+        }
+    }
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        if(transport == BenchTransport_SOCKETPAIR) {
+            int pair[2];
+            if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+                return false;
+            }
+            server_socks[i] = pair[0];
+            client_socks[i] = pair[1];
+            continue;
+        }
+        client_socks[i] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(client_socks[i] == -1 or connect(client_socks[i], (const struct sockaddr *)&address, address_len) == -1) {
+            return false;
+        }
+        server_socks[i] = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(server_socks[i] == -1) {
+            return false;
+        }
+    }
+    if(listen_fd != -1) {
+        checked_close(listen_fd);
+    }
+    return true;
+}
+
+// One request as client.c sends it, the messages in the order it sends them.
+typedef struct __attribute__((packed)) {
+    uint8_t protocol_version;
+    uint8_t operation;
+    char filename[NAME_MAX];
+    union {
+        struct __attribute__((packed)) {
+            bool is_client_ready;
+            uint8_t signal_end_byte;
+        } get;
+        struct __attribute__((packed)) {
+            uint64_t file_size;
+            uint8_t body[BENCH_FILE_SIZE];
+        } put;
+    } tail;
+} BenchRequest;
+
+// The client half of one request.
+static bool bench_request(const int sock, const RequestOperation operation) {
+    BenchRequest request;
+    memset(&request, 0, sizeof(request));
+    request.protocol_version = PROTOCOL_VERSION;
+    request.operation = (uint8_t)operation;
+    strcpy(request.filename, BENCH_FILENAME);
+    size_t request_size = offsetof(BenchRequest, tail);
+    if(operation == RequestOperation_PUT) {
+        request.tail.put.file_size = htobe64(BENCH_FILE_SIZE);
+        memset(request.tail.put.body, 'x', sizeof(request.tail.put.body));
+        request_size += sizeof(request.tail.put);
+    } else {
+        request.tail.get.is_client_ready = true;
+        request_size += sizeof(request.tail.get);
+    }
+    uint8_t status;
+    bool is_ok;
+    if(not checked_write(sock, &request, request_size, NULL) or not checked_read(sock, &status, sizeof(status), NULL)
+        or status != ProtocolStatus_OK or not checked_read(sock, &is_ok, sizeof(is_ok), NULL) or not is_ok) {
+        return false;
+    }
+    if(operation == RequestOperation_PUT) {
+        return checked_read(sock, &is_ok, sizeof(is_ok), NULL) and is_ok;
+    }
+    uint64_t size;
+    uint8_t body[BENCH_FILE_SIZE];
+    return checked_read(sock, &size, sizeof(size), NULL) and be64toh(size) == BENCH_FILE_SIZE
+        and checked_read(sock, body, sizeof(body), NULL);
+}
+
+static pid_t bench_client_spawn(const BenchVariant *const variant, const int server_socks[], const int client_socks[]) {
+    fflush(NULL);
+    const pid_t pid = fork();
+    if(pid != 0) {
+        return pid;
+    }
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        checked_close(server_socks[i]);
+    }
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        if(not bench_request(client_socks[i], variant->operation)) {
+            _exit(EXIT_FAILURE);
+        }
+        checked_close(client_socks[i]);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+static void bench_serve(void *const arg) {
+    const BenchServer *const server = arg;
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        clients_count_t clients_count = 1;
+        ClientState state = { .tag = ClientStateTag_RECEIVE_PROTOCOL_VERSION };
+        state.value.receive_protocol_version.client_fd = server->socks[i];
+        TraceRecord trace;
+        memset(&trace, 0, sizeof(trace));
+        while(state.tag != ClientStateTag_INVALID) {
+            const int client_fd = ClientState_client_fd(&state);
+            fd_set readfds, writefds;
+            FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
+            FD_SET(client_fd, &readfds);
+            FD_SET(client_fd, &writefds);
+            if(select(client_fd + 1, &readfds, &writefds, NULL, NULL) == -1) {
+                return;
+            }
+            state = ClientState_transition(&clients_count, &state, &readfds, &writefds,
+                server->filepath_buffer, server->filepath_buffer_offset, BENCH_FILE_SIZE, &trace);
+        }
+    }
+}
+
+// Serves BENCH_REQUESTS requests, counting system calls when count is given and timing them
+// otherwise. Returns the nanoseconds per request or -1.
+static int64_t bench_run(const BenchVariant *const variant, BenchServer *const server, SyscallCount *const count) {
+    int server_socks[BENCH_REQUESTS];
+    int client_socks[BENCH_REQUESTS];
+    if(not bench_pairs_create(variant->transport, server_socks, client_socks)) {
+        return -1;
+    }
+    const pid_t client = bench_client_spawn(variant, server_socks, client_socks);
+    for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+        checked_close(client_socks[i]);
+    }
+    server->socks = server_socks;
+    const int64_t started_at = BusyPoll_now_ns();
+    bool is_ok = true;
+    if(count != NULL) {
+        is_ok = syscall_count_run(bench_serve, server, count);
+        // The traced child closed its copies, these are the parent's.
+        for(size_t i = 0; i < BENCH_REQUESTS; ++i) {
+            checked_close(server_socks[i]);
+        }
+    } else {
+        bench_serve(server);
+    }
+    const int64_t elapsed = BusyPoll_now_ns() - started_at;
+    int status;
+    is_ok = waitpid(client, &status, 0) != -1 and WIFEXITED(status) and WEXITSTATUS(status) == 0 and is_ok;
+    return is_ok ? elapsed / BENCH_REQUESTS : -1;
+}
+
+int main(void) {
+    // The report keeps the real stdout, the server's logging goes to /dev/null through a buffer
+    // that holds all of it.
+    FILE *const report = fdopen(dup(STDOUT_FILENO), "w");
+    static char log_buffer[BENCH_LOG_BUFFER_SIZE];
+    if(report == NULL or freopen("/dev/null", "w", stdout) == NULL or setvbuf(stdout, log_buffer, _IOFBF, sizeof(log_buffer)) != 0) {
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    char dir_path[] = "/tmp/syscall_bench.XXXXXX";
+    if(mkdtemp(dir_path) == NULL) {
+        fprintf(report, "[Failed to create directory] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    char file_path[PATH_MAX];
+    snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, BENCH_FILENAME);
+    const int file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint8_t data[BENCH_FILE_SIZE];
+    memset(data, 'x', sizeof(data));
+    if(file_fd == -1 or not checked_write(file_fd, data, sizeof(data), NULL) or not checked_close(file_fd)) {
+        fprintf(report, "[Failed to create %s] [errno: %d] [strerror: %s]\n", file_path, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    char filepath_buffer[PATH_MAX];
+    snprintf(filepath_buffer, sizeof(filepath_buffer), "%s/", dir_path);
+    BenchServer server = { .socks = NULL, .filepath_buffer = filepath_buffer, .filepath_buffer_offset = strlen(filepath_buffer) };
+
+    bool is_within_budget = true;
+    for(size_t i = 0; i < ARRAY_SIZE(BENCH_VARIANTS); ++i) {
+        const BenchVariant *const variant = &BENCH_VARIANTS[i];
+        SyscallCount count;
+        // The timed run goes first and warms the page cache and the allocator for the counted one.
+        const int64_t ns = bench_run(variant, &server, NULL);
+        if(ns == -1 or bench_run(variant, &server, &count) == -1) {
+            fprintf(report, "[%s] [Failed to run] [errno: %d] [strerror: %s]\n", variant->name, errno, strerror(errno));
+            is_within_budget = false;
+            continue;
+        }
+        const double per_request = (double)count.total / BENCH_REQUESTS;
+        fprintf(report, "[%s] [syscalls per request: %.2f] [budget: %lu] [ns per request: %ld]\n\t", variant->name, per_request, variant->budget, ns);
+        syscall_count_print(report, &count, BENCH_REQUESTS);
+        if(per_request > (double)variant->budget) {
+            fprintf(report, "[FAILED: %s needs more system calls than its budget]\n", variant->name);
+            is_within_budget = false;
+        } else if(per_request + 1 <= (double)variant->budget) {
+            fprintf(report, "[Budget of %s can be lowered to %lu]\n", variant->name, (count.total + BENCH_REQUESTS - 1) / BENCH_REQUESTS);
+        }
+    }
+    unlink(file_path);
+    rmdir(dir_path);
+    fclose(report);
+    return is_within_budget ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,168 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "client_utils.h"
+
+// Per-request trace ring for offline analysis of single slow requests, the aggregate counters
+// only say that some were slow. A request is first traced into a private TraceRecord: the
+// time each phase was first entered, byte counts and how often sendfile was called and ran
+// into EAGAIN. Once the request is done the record is copied into the next slot of a ring in
+// a memory-mapped file, which outlives the server and is read by trace_reader.
+//
+// Writers never wait for each other: the slot comes from one fetch-and-add on the shared
+// head, and the slot's sequence is cleared before and set after the copy, so a reader racing a
+// writer skips the slot rather than returning a torn record. A writer that stalls for a whole
+// lap of the ring can still be overwritten halfway, which a ring large enough to hold a few
+// seconds of traffic makes academic. The ring header names the phases, so the reader works
+// for any server.
+
+static const char TRACE_MAGIC[8] = "TRACERNG";
+
+enum {
+    TRACE_VERSION = 1,
+    TRACE_MAX_PHASES = 16,
+    TRACE_PHASE_NAME_SIZE = 32,
+    TRACE_HEADER_SIZE = 4096,
+    TRACE_DEFAULT_RECORDS = 1 << 16
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t capacity;
+    uint32_t phase_count;
+    uint32_t reserved;
+    char phase_names[TRACE_MAX_PHASES][TRACE_PHASE_NAME_SIZE];
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t next_connection_id;
+} TraceRingHeader;
+
+// phase_ns holds CLOCK_MONOTONIC nanoseconds, 0 for phases the request never reached. Phase 0
+// is the start of the request.
+typedef struct {
+    uint64_t connection_id;
+    uint64_t filename_hash;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t finished_ns;
+    uint32_t sendfile_calls;
+    uint32_t eagain_count;
+    int32_t pid;
+    uint8_t operation;
+    uint8_t reserved[3];
+    uint64_t phase_ns[TRACE_MAX_PHASES];
+} TraceRecord;
+
+// sequence is the record's position in the ring plus one once complete, 0 while written.
+typedef struct {
+    atomic_uint_fast64_t sequence;
+    TraceRecord record;
+} TraceSlot;
+
+_Static_assert(sizeof(TraceRingHeader) <= TRACE_HEADER_SIZE, "the ring header must fit its page");
+_Static_assert(sizeof(TraceSlot) == 192, "slots are kept a whole number of cache lines");
+
+// header is NULL while tracing is off.
+typedef struct {
+    TraceRingHeader *header;
+    TraceSlot *slots;
+} TraceRing;
+
+static uint64_t trace_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// FNV-1a, the reader groups requests by it without the names ever leaving the server.
+static uint64_t trace_hash_filename(const char *const filename) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(const char *c = filename; *c != '\0'; ++c) {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static size_t trace_ring_size(const uint64_t capacity) {
+    return TRACE_HEADER_SIZE + capacity * sizeof(TraceSlot);
+}
+
+// Creates the ring file, capacity is rounded up to a power of two. The mapping is shared, so
+// it is created before the first fork and every worker writes into the same ring.
+static bool trace_ring_create(TraceRing *const ring, const char *const path, const uint64_t records,
+    const char *const *const phase_names, const size_t phase_count) {
+    uint64_t capacity = 1;
+    while(capacity < records) {
+        capacity <<= 1;
+    }
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1 or ftruncate(fd, (off_t)trace_ring_size(capacity)) == -1) {
+        printf("[Failed to create trace ring: %s] [errno: %d] [strerror: %s]\n", path, errno, strerror(errno));
+        if(fd != -1) {
+            checked_close(fd);
+        }
+        return false;
+    }
+    void *const memory = mmap(NULL, trace_ring_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    checked_close(fd);
+    if(memory == MAP_FAILED) {
+        printf("[Failed to map trace ring: %s] [errno: %d] [strerror: %s]\n", path, errno, strerror(errno));
+        return false;
+    }
+    ring->header = memory;
+    ring->slots = (TraceSlot *)(void *)((uint8_t *)memory + TRACE_HEADER_SIZE);
+    ring->header->version = TRACE_VERSION;
+    ring->header->slot_size = sizeof(TraceSlot);
+    ring->header->capacity = capacity;
+    ring->header->phase_count = (uint32_t)(phase_count < TRACE_MAX_PHASES ? phase_count : TRACE_MAX_PHASES);
+    for(uint32_t i = 0; i < ring->header->phase_count; ++i) {
+        strncpy(ring->header->phase_names[i], phase_names[i], TRACE_PHASE_NAME_SIZE - 1);
+    }
+    // The magic goes last, a reader never sees a half-written header as valid.
+    atomic_thread_fence(memory_order_release);
+    memcpy(ring->header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    return true;
+}
+
+static void trace_record_begin(const TraceRing *const ring, TraceRecord *const record) {
+    memset(record, 0, sizeof(*record));
+    record->connection_id = atomic_fetch_add_explicit(&ring->header->next_connection_id, 1, memory_order_relaxed);
+    record->pid = getpid();
+    record->phase_ns[0] = trace_now_ns();
+}
+
+// Only the first entry counts, states a request passes through repeatedly keep their start.
+static void trace_record_phase(TraceRecord *const record, const size_t phase) {
+    if(record->phase_ns[phase] == 0) {
+        record->phase_ns[phase] = trace_now_ns();
+    }
+}
+
+static void trace_ring_write(const TraceRing *const ring, TraceRecord *const record) {
+    record->finished_ns = trace_now_ns();
+    const uint64_t position = atomic_fetch_add_explicit(&ring->header->head, 1, memory_order_relaxed);
+    TraceSlot *const slot = &ring->slots[position & (ring->header->capacity - 1)];
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&slot->record, record, sizeof(*record));
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
+
+// Copies the record at position, false if it was overwritten or is being written.
+static bool trace_ring_read(const TraceRing *const ring, const uint64_t position, TraceRecord *const record) {
+    const TraceSlot *const slot = &ring->slots[position & (ring->header->capacity - 1)];
+    const uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    memcpy(record, &slot->record, sizeof(*record));
+    atomic_thread_fence(memory_order_acquire);
+    return sequence == position + 1 and atomic_load_explicit(&slot->sequence, memory_order_relaxed) == sequence;
+}
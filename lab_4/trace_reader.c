@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+// Reads a trace ring written by a server started with -T: per-phase time spent over all
+// requests, then the slowest requests with their own breakdown. Reading a ring the server is
+// still writing is fine, records being written are skipped.
+
+enum { TRACE_READER_DEFAULT_SLOWEST = 10 };
+
+static uint64_t record_total_ns(const TraceRecord *const record) {
+    return record->finished_ns - record->phase_ns[0];
+}
+
+// A phase lasts until the next one reached, by time rather than by number, as not every
+// request goes through the phases in the same order. The last one lasts until the end.
+static uint64_t record_phase_ns(const TraceRecord *const record, const uint32_t phase_count, const uint32_t phase) {
+    uint64_t until = record->finished_ns;
+    for(uint32_t other = 0; other < phase_count; ++other) {
+        const uint64_t at = record->phase_ns[other];
+        if(other != phase and at != 0 and (at > record->phase_ns[phase] or (at == record->phase_ns[phase] and other > phase)) and at < until) {
+            until = at;
+        }
+    }
+    return until - record->phase_ns[phase];
+}
+
+static int compare_u64(const void *const a, const void *const b) {
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static const TraceRecord *sort_records;
+
+static int compare_slowest(const void *const a, const void *const b) {
+    const uint64_t x = record_total_ns(&sort_records[*(const size_t *)a]);
+    const uint64_t y = record_total_ns(&sort_records[*(const size_t *)b]);
+    return (x < y) - (x > y);
+}
+
+static void print_stats_row(const char *const name, uint64_t *const values, const size_t count) {
+    if(count == 0) {
+        return;
+    }
+    qsort(values, count, sizeof(*values), compare_u64);
+    double sum = 0;
+    for(size_t i = 0; i < count; ++i) {
+        sum += (double)values[i];
+    }
+    printf("%31s %8zu %12.1f %12.1f %12.1f %12.1f\n", name, count, sum / (double)count / 1e3,
+        (double)values[count / 2] / 1e3, (double)values[count * 99 / 100] / 1e3, (double)values[count - 1] / 1e3);
+}
+
+int main(const int argc, char *argv[]) {
+    size_t slowest = TRACE_READER_DEFAULT_SLOWEST;
+    int opt;
+    while((opt = getopt(argc, argv, "n:")) != -1) {
+        if(opt != 'n') {
+            fprintf(stderr, "Usage: %s [-n <slowest_requests>] <trace_file>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        slowest = strtoul(optarg, NULL, 10);
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-n <slowest_requests>] <trace_file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if(fd == -1 or fstat(fd, &st) == -1 or (size_t)st.st_size < TRACE_HEADER_SIZE) {
+        printf("[Failed to open trace ring: %s] [errno: %d] [strerror: %s]\n", argv[optind], errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    void *const memory = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    checked_close(fd);
+    if(memory == MAP_FAILED) {
+        printf("[Failed to map trace ring] [errno: %d] [strerror: %s]\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    const TraceRing ring = { .header = memory, .slots = (TraceSlot *)(void *)((uint8_t *)memory + TRACE_HEADER_SIZE) };
+    const TraceRingHeader *const header = ring.header;
+    if(memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 or header->version != TRACE_VERSION
+        or header->slot_size != sizeof(TraceSlot) or header->phase_count > TRACE_MAX_PHASES
+        or trace_ring_size(header->capacity) > (size_t)st.st_size) {
+        printf("[Not a trace ring of version %d: %s]\n", TRACE_VERSION, argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+    const uint64_t first = head > header->capacity ? head - header->capacity : 0;
+    TraceRecord *const records = malloc((head - first + 1) * sizeof(*records));
+    size_t count = 0;
+    for(uint64_t position = first; position < head; ++position) {
+        if(trace_ring_read(&ring, position, &records[count])) {
+            ++count;
+        }
+    }
+    printf("[Requests: %lu] [In ring: %zu] [Overwritten: %lu] [Being written: %lu]\n", head, count, first, head - first - count);
+    if(count == 0) {
+        free(records);
+        return EXIT_SUCCESS;
+    }
+
+    // Microseconds spent in each phase, by the requests that reached it.
+    uint64_t *const values = malloc(count * sizeof(*values));
+    printf("\n%31s %8s %12s %12s %12s %12s\n", "phase, us", "requests", "mean", "p50", "p99", "max");
+    for(uint32_t phase = 0; phase < header->phase_count; ++phase) {
+        size_t reached = 0;
+        for(size_t i = 0; i < count; ++i) {
+            if(records[i].phase_ns[phase] != 0) {
+                values[reached++] = record_phase_ns(&records[i], header->phase_count, phase);
+            }
+        }
+        print_stats_row(header->phase_names[phase], values, reached);
+    }
+    for(size_t i = 0; i < count; ++i) {
+        values[i] = record_total_ns(&records[i]);
+    }
+    print_stats_row("total", values, count);
+    free(values);
+
+    size_t *const order = malloc(count * sizeof(*order));
+    for(size_t i = 0; i < count; ++i) {
+        order[i] = i;
+    }
+    sort_records = records;
+    qsort(order, count, sizeof(*order), compare_slowest);
+    printf("\n%8s %8s %3s %16s %12s %12s %8s %6s %12s  phases, us\n",
+        "conn", "pid", "op", "filename_hash", "sent", "received", "sendfile", "eagain", "total, us");
+    for(size_t i = 0; i < count and i < slowest; ++i) {
+        const TraceRecord *const record = &records[order[i]];
+        const uint64_t total_ns = record_total_ns(record);
+        printf("%8lu %8d %3u %016lx %12lu %12lu %8u %6u %12.1f ", record->connection_id, record->pid, record->operation,
+            record->filename_hash, record->bytes_sent, record->bytes_received, record->sendfile_calls, record->eagain_count,
+            (double)total_ns / 1e3);
+        for(uint32_t phase = 0; phase < header->phase_count; ++phase) {
+            if(record->phase_ns[phase] != 0) {
+                const uint64_t phase_ns = record_phase_ns(record, header->phase_count, phase);
+                printf(" %s=%.1f", header->phase_names[phase], (double)phase_ns / 1e3);
+            }
+        }
+        printf("\n");
+    }
+    free(order);
+    free(records);
+    munmap(memory, (size_t)st.st_size);
+    return EXIT_SUCCESS;
+}